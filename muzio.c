@@ -1,24 +1,536 @@
+#define G_LOG_DOMAIN "muzio"
+
 #include <gtk/gtk.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fnmatch.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gst/gst.h>
 #include <time.h>
+#include <math.h>
 
 #define CONFIG_FILE "config.txt"
 #define PLAYLISTS_DIR "playlists"
-
-typedef struct Node {
-    char *song_name;
-    struct Node *next;
-    struct Node *prev;
-} Node;
-
-typedef struct CircularDoublyLinkedList {
-    Node *head;
-} CircularDoublyLinkedList;
+#define LIBRARY_INDEX_FILE "library.idx"
+#define LIBRARY_INDEX_MAGIC "MUZIDX02"
+#define LIBRARY_INDEX_NO_PARENT G_MAXUINT32
+#define LIBRARY_SCAN_BUFFER (64 * 1024)
+#define LIBRARY_WATCH_BATCH_MS 250
+#define LIBRARY_BATCH_SIZE 512
+#define DOWNLOAD_RETRY_BASE_MS 2000
+#define TAG_CACHE_FILE "tags.cache"
+#define DEDUPE_CACHE_FILE "hashes.cache"
+#define DEDUPE_READ_CHUNK (1024 * 1024)
+#define DOWNLOAD_ARCHIVE_FILE "downloads.archive"
+#define CONTENT_HASH_PRIME1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define CONTENT_HASH_PRIME2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define CONTENT_HASH_PRIME3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+#define CONTENT_HASH_PRIME4 G_GUINT64_CONSTANT(0x85EBCA77C2B2AE63)
+#define CONTENT_HASH_PRIME5 G_GUINT64_CONSTANT(0x27D4EB2F165667C5)
+#define SEARCH_MAX_RESULTS 100
+#define SEARCH_COMPACT_MIN 65536
+#define PLAYLIST_MAGIC "MUZPL001"
+#define CONTROL_SOCKET_NAME "muzio.sock"
+#define CONTROL_MAX_LINE 65536
+#define TRACE_RING_SIZE 4096
+#define TRACE_HISTOGRAM_BUCKETS 32
+#define TRACE_MAX_ERRORS 16
+#define PREFETCH_CHECK_BYTES (4 * 1024 * 1024)
+#define PREFETCH_READ_CHUNK (1024 * 1024)
+#define SEEK_WATCHDOG_MS 2000
+#define UI_CHANNEL_INTERVAL_MS 16
+#define LOUDNESS_CACHE_FILE "loudness.cache"
+#define LOUDNESS_RATE 48000
+#define LOUDNESS_SUBBLOCK_FRAMES (LOUDNESS_RATE / 10)
+#define LOUDNESS_ABSOLUTE_GATE -70.0
+#define LOUDNESS_RELATIVE_GATE -10.0
+#define LOUDNESS_SAVE_EVERY 64
+#define WAVEFORM_CACHE_FILE "waveforms.cache"
+#define WAVEFORM_CACHE_MAGIC "MUZWF001"
+#define WAVEFORM_BUCKETS 256
+#define WAVEFORM_CHUNK_FRAMES 1024
+#define SESSION_FILE "session.bin"
+#define SESSION_MAGIC "MUZSES02"
+#define SESSION_SAVE_DELAY_MS 1000
+#define SESSION_SAVE_INTERVAL_MS 15000
+#define DEDUPE_SAVE_DELAY_MS 2000
+#define SESSION_FLAG_LOOP (1u << 0)
+#define SESSION_FLAG_SHUFFLE (1u << 1)
+#define SESSION_FLAG_PAUSED (1u << 2)
+#define SMART_PLAYLIST_GROUP "Smart Playlist"
+#define PLAY_COUNT_FILE "plays.cache"
+#define PLAY_COUNT_SAVE_DELAY_MS 5000
+
+/* playbin's GstPlayFlags are not in a public header. */
+#define PLAY_FLAG_SOFT_VOLUME (1 << 4)
+#define PLAY_FLAG_NATIVE_AUDIO (1 << 5)
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define AUDIO_DECODE_FORMAT "F32LE"
+#else
+#define AUDIO_DECODE_FORMAT "F32BE"
+#endif
+
+typedef guint32 TrackId;
+
+#define TRACK_ID_NONE G_MAXUINT32
+#define QUEUE_NO_POSITION G_MAXUINT32
+#define SHUFFLE_HISTORY_MAX 1024
+#define SHUFFLE_HEAD_MAX 1024
+#define TRACK_NAME_CHUNK (256 * 1024)
+#define TRACK_PAGE_BITS 16
+#define TRACK_PAGE_SIZE (1u << TRACK_PAGE_BITS)
+#define TRACK_MAX_PAGES (1u << (32 - TRACK_PAGE_BITS))
+
+/* A stretch of a shuffled order: the tracks at insertion indices [start, start + length)
+ * take the play positions with the same range. The first head_length positions play the
+ * head, indices relative to start that were already played when the segment last changed
+ * length; the rest follow the permutation keyed by key with the head left out. ranks
+ * holds the head's ranks in that permutation, sorted. */
+typedef struct ShuffleSegment {
+    guint32 start;
+    guint32 length;
+    guint64 key;
+    guint32 head_length;
+    guint32 *head;
+    guint32 *ranks;
+} ShuffleSegment;
+
+/* Play queue: tracks holds TrackIds in insertion order. Play positions map to indices
+ * into tracks either directly or, when shuffled, through a permutation keyed by
+ * shuffle_key that is computed on demand, so shuffling never touches the tracks. Once
+ * songs are added or removed while shuffled, segments keep the played part of the order
+ * in place; without segments the whole queue is one segment keyed by shuffle_key. */
+typedef struct PlayQueue {
+    TrackId *tracks;
+    gboolean shuffled;
+    guint64 shuffle_key;
+    guint32 length;
+    guint32 capacity;
+    guint32 position;
+    ShuffleSegment *segments;
+    guint32 segment_count;
+} PlayQueue;
+
+/* On-disk layout of LIBRARY_INDEX_FILE: header, dir table, entry table, string blob.
+ * Entries of a directory are contiguous and hold track names; all offsets point into the
+ * string blob. A directory's parent is its position in the dir table, always before it,
+ * or LIBRARY_INDEX_NO_PARENT for a root. */
+typedef struct LibraryIndexHeader {
+    char magic[8];
+    guint32 dir_count;
+    guint32 entry_count;
+    guint32 strings_size;
+    guint32 reserved;
+} LibraryIndexHeader;
+
+typedef struct LibraryIndexDir {
+    gint64 mtime_sec;
+    gint64 mtime_nsec;
+    guint32 path_offset;
+    guint32 first_entry;
+    guint32 entry_count;
+    guint32 parent;
+} LibraryIndexDir;
+
+typedef struct LibraryIndexEntry {
+    guint32 name_offset;
+} LibraryIndexEntry;
+
+typedef struct TrackTags {
+    char *title;
+    char *artist;
+    char *album;
+    guint32 duration_ms;
+    gint64 size;
+    gint64 mtime;
+} TrackTags;
+
+typedef struct TagScanJob {
+    TrackId id;
+    char *path;
+    TrackTags *tags;
+    gboolean missing;
+} TagScanJob;
+
+/* Streaming XXH64 state: four lanes and a partial 32-byte stripe. */
+typedef struct ContentHash {
+    guint64 lanes[4];
+    guint64 total;
+    guint8 buffer[32];
+    gsize buffered;
+} ContentHash;
+
+typedef struct ContentHashInfo {
+    gint64 size;
+    gint64 mtime;
+    guint64 hash;
+} ContentHashInfo;
+
+/* One hash cache line as copied for the writer thread; path is a GRefString shared
+ * with the cache. */
+typedef struct DedupeCacheEntry {
+    char *path;
+    ContentHashInfo info;
+} DedupeCacheEntry;
+
+typedef struct DedupeJob {
+    TrackId id;
+    char *path;
+    ContentHashInfo *info;
+    guint64 hash;
+    guint64 hashed_bytes;
+    gboolean missing;
+    guint generation;
+} DedupeJob;
+
+/* A playlist journal is PLAYLIST_MAGIC followed by records, each a PlaylistRecord and
+ * `length` bytes of song name. Replaying the records rebuilds the playlist. */
+typedef enum PlaylistOp {
+    PLAYLIST_OP_APPEND = 'A',
+    PLAYLIST_OP_REMOVE = 'D',
+    PLAYLIST_OP_MOVE = 'M'
+} PlaylistOp;
+
+typedef struct PlaylistRecord {
+    guint8 op;
+    guint8 reserved[3];
+    guint32 a;
+    guint32 b;
+    guint32 length;
+} PlaylistRecord;
+
+/* The rule of a smart playlist. Unset bounds are 0 and G_MAXUINT32. positions maps a
+ * TrackId to its index in the playlist's entries plus one, 0 for non-members. */
+typedef struct SmartRule {
+    gchar *name_pattern;
+    gchar *directory;
+    gint64 added_after;
+    guint32 min_duration_ms;
+    guint32 max_duration_ms;
+    guint32 min_plays;
+    guint32 max_plays;
+    guint32 *positions;
+    guint32 positions_size;
+} SmartRule;
+
+/* A smart playlist has a rule, no journal (fd -1) and entries kept up to date by
+ * smart_playlists_update. */
+typedef struct Playlist {
+    char *name;
+    char *path;
+    int fd;
+    GPtrArray *entries;
+    GHashTable *members;
+    guint32 records;
+    goffset journal_size;
+    SmartRule *rule;
+} Playlist;
+
+/* One connection to the daemon's control socket. Commands are newline-terminated and
+ * answered in order with one "OK ..." or "ERR ..." line each, so a client may send
+ * several before reading. "enqueue N" consumes the next N lines as song names. */
+typedef struct ControlClient {
+    int fd;
+    GIOChannel *channel;
+    guint read_watch;
+    guint write_watch;
+    GString *input;
+    GString *output;
+    guint enqueue_remaining;
+    guint enqueue_added;
+} ControlClient;
+
+/* Spans recorded by trace_span. The TRACE_SWITCH_* spans all start at the click (or
+ * whatever asked for the track) and end at the named stage. */
+typedef enum TraceKind {
+    TRACE_SWITCH_PLAY_SONG,
+    TRACE_SWITCH_PLAYING,
+    TRACE_SWITCH_FIRST_BUFFER,
+    TRACE_PLAY_SONG,
+    TRACE_SEEK,
+    TRACE_LIBRARY_SCAN,
+    TRACE_TAG_SCAN,
+    TRACE_DOWNLOAD,
+    TRACE_DOWNLOAD_POSTPROCESS,
+    TRACE_PREFETCH,
+    TRACE_ANALYSIS,
+    TRACE_DEDUPE,
+    TRACE_SESSION_SAVE,
+    TRACE_KIND_COUNT
+} TraceKind;
+
+typedef struct TraceEvent {
+    guint64 seq;
+    gint64 start_us;
+    gint64 duration_us;
+    guint32 kind;
+    guint32 arg;
+} TraceEvent;
+
+/* Written only by its own thread; readers use seq to skip slots being overwritten. */
+typedef struct TraceRing {
+    guint id;
+    guint64 head;
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+typedef struct TraceHistogram {
+    guint64 count;
+    guint64 sum_us;
+    guint64 max_us;
+    guint64 buckets[TRACE_HISTOGRAM_BUCKETS];
+} TraceHistogram;
+
+typedef struct TraceError {
+    gint64 at_us;
+    gchar *message;
+} TraceError;
+
+/* Updates posted to the main loop by background threads. Only the newest event per
+ * kind and slot survives a drain; slot tells apart independent targets of one kind. */
+typedef enum UiEventKind {
+    UI_EVENT_STATUS,
+    UI_EVENT_TAG_SCAN,
+    UI_EVENT_WAVEFORM,
+    UI_EVENT_LOUDNESS_FLUSH,
+    UI_EVENT_DEDUPE,
+    UI_EVENT_BENCH
+} UiEventKind;
+
+typedef struct UiEvent {
+    struct UiEvent *next;
+    UiEventKind kind;
+    guint slot;
+    gint64 value;
+    gchar *text;
+} UiEvent;
+
+/* One upcoming file for the prefetcher, in queue order until sorted by disk position. */
+typedef struct PrefetchFile {
+    gchar *path;
+    int fd;
+    goffset size;
+    guint64 physical;
+} PrefetchFile;
+
+/* GCC vector types for the analysis kernels. */
+typedef gdouble DoubleX2 __attribute__((vector_size(2 * sizeof(gdouble))));
+typedef gdouble DoubleX4 __attribute__((vector_size(4 * sizeof(gdouble))));
+typedef gint64 Int64X4 __attribute__((vector_size(4 * sizeof(gint64))));
+typedef gfloat FloatX4 __attribute__((vector_size(4 * sizeof(gfloat))));
+typedef gint32 Int32X4 __attribute__((vector_size(4 * sizeof(gint32))));
+
+/* Receives decoded audio as interleaved stereo float frames. Called on the decoder's
+ * streaming thread; the samples are only valid during the call. */
+typedef void (*AudioDecodeFunc)(const gfloat *samples, gsize frames, gpointer data);
+
+typedef struct AudioDecodeTarget {
+    AudioDecodeFunc func;
+    gpointer data;
+} AudioDecodeTarget;
+
+/* Cached result for one file. lufs is NAN for silence, undecodable files and tracks
+ * shorter than one gating block. */
+typedef struct LoudnessInfo {
+    gint64 size;
+    gint64 mtime;
+    gdouble lufs;
+    gdouble peak;
+} LoudnessInfo;
+
+/* Running state of one BS.1770 measurement: the two K-weighting biquads with both
+ * channels in one vector, the current 100 ms sub-block and the mean square of every
+ * finished one. */
+typedef struct LoudnessAnalysis {
+    DoubleX2 shelf[2];
+    DoubleX2 highpass[2];
+    DoubleX2 block_sum;
+    guint block_frames;
+    gfloat peak;
+    guint64 frames;
+    GArray *subblocks;
+} LoudnessAnalysis;
+
+/* Minimum and maximum of every WAVEFORM_CHUNK_FRAMES frames seen so far, as pairs. */
+typedef struct WaveformAnalysis {
+    GArray *chunks;
+    gfloat low;
+    gfloat high;
+    guint chunk_frames;
+    guint64 frames;
+} WaveformAnalysis;
+
+/* What one decoding pass feeds; either part is NULL when its cache is current. */
+typedef struct TrackAnalysis {
+    LoudnessAnalysis *loudness;
+    WaveformAnalysis *waveform;
+} TrackAnalysis;
+
+/* WAVEFORM_CACHE_FILE is WAVEFORM_CACHE_MAGIC followed by records, each a WaveformRecord,
+ * `path_length` bytes of path and `bucket_count` min/max pairs of gint8. Records are only
+ * appended; the last one for a path wins. */
+typedef struct WaveformRecord {
+    gint64 size;
+    gint64 mtime;
+    guint32 path_length;
+    guint32 bucket_count;
+} WaveformRecord;
+
+/* peaks points into the mapped cache file or at owned; NULL for undecodable files. */
+typedef struct WaveformEntry {
+    gint64 size;
+    gint64 mtime;
+    const gint8 *peaks;
+    gint8 *owned;
+} WaveformEntry;
+
+typedef struct DownloadJob {
+    char *url;
+    char *output_path;
+    GPid pid;
+    guint attempt;
+    guint stdout_watch;
+    guint retry_source;
+    gint progress;
+    gint exit_status;
+    gboolean stdout_closed;
+    gboolean exited;
+    gboolean cancelled;
+    gint64 started_at;
+    gint64 postprocess_at;
+} DownloadJob;
+
+typedef enum LibraryChange {
+    LIBRARY_CHANGE_ADD = 1,
+    LIBRARY_CHANGE_REMOVE
+} LibraryChange;
+
+/* prefix is what the directory's songs are named under: "" for the music directory,
+ * "Album/" below it, the full path and a slash under the other roots. */
+typedef struct LibraryDir {
+    char *path;
+    char *prefix;
+    struct stat st;
+    GPtrArray *names;
+    guint32 slot;
+    guint32 parent;
+} LibraryDir;
+
+/* Receives the library a slice at a time while load_library runs. The names are only
+ * valid during the call, and calls never overlap. */
+typedef void (*LibraryBatchFunc)(const char *const *names, guint count, gpointer data);
+
+typedef struct LibraryDirent {
+    guint64 d_ino;
+    gint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LibraryDirent;
+
+typedef struct LibraryScan LibraryScan;
+
+typedef struct LibraryScanWorker {
+    LibraryScan *scan;
+    guint index;
+    GMutex mutex;
+    GQueue dirs;
+    GPtrArray *owned_names;
+    guint8 *buffer;
+    GThread *thread;
+} LibraryScanWorker;
+
+/* One load_library walk. The index fields point into the mapped LIBRARY_INDEX_FILE;
+ * index_first_child and index_next_sibling chain each indexed dir's subdirectories. */
+struct LibraryScan {
+    GPtrArray *dirs;
+    GHashTable *indexed;
+    const LibraryIndexDir *index_dirs;
+    const LibraryIndexEntry *index_entries;
+    const char *index_strings;
+    guint32 *index_first_child;
+    guint32 *index_next_sibling;
+    LibraryScanWorker *workers;
+    guint worker_count;
+    GMutex mutex;
+    GCond cond;
+    guint idle;
+    gint pending;
+    gint queued;
+    gint rescanned;
+    GMutex emit_mutex;
+    LibraryBatchFunc emit;
+    gpointer data;
+};
+
+/* Counted by output_stats_probe on an audio sink's pad. expected is where the next
+ * buffer should start if the stream is continuous; late marks an ongoing underrun. */
+typedef struct OutputStats {
+    GstElement *sink;
+    GstSegment segment;
+    GstClockTime expected;
+    GstClockTime slack;
+    gboolean late;
+    gint underruns;
+    gint discontinuities;
+} OutputStats;
+
+/* SESSION_FILE is a SessionHeader, segment_count SessionSegments with head_count head
+ * entries after them, track_count offsets into the string block in queue insertion
+ * order, then the string block of NUL-terminated names. The play order follows from
+ * shuffle_key and the segments, so it is not stored. position is the play position. */
+typedef struct SessionHeader {
+    char magic[8];
+    guint32 track_count;
+    guint32 position;
+    guint64 shuffle_key;
+    gint64 position_ns;
+    gdouble volume;
+    guint32 flags;
+    guint32 strings_size;
+    guint32 segment_count;
+    guint32 head_count;
+} SessionHeader;
+
+typedef struct SessionSegment {
+    guint64 key;
+    guint32 start;
+    guint32 length;
+    guint32 head_length;
+    guint32 reserved;
+} SessionSegment;
+
+/* A session taken on the main thread, for the writer to lay out and save at path. */
+typedef struct SessionSnapshot {
+    SessionHeader header;
+    SessionSegment *segments;
+    guint32 *heads;
+    TrackId *tracks;
+    gchar *path;
+} SessionSnapshot;
 
 GtkWidget *url_entry;
 GtkWidget *main_window;
@@ -36,24 +548,317 @@ GtkWidget *total_time_label;
 GstElement *pipeline;
 GtkComboBoxText *playlist_combo_box;
 GtkWidget *add_to_playlist_button;
-CircularDoublyLinkedList song_list;
-GMutex list_mutex;
-GThread *download_thread = NULL;
-Node *current_song = NULL;
+PlayQueue play_queue;
+GMutex queue_mutex;
+GPtrArray *track_name_chunks = NULL;
+char *track_name_free = NULL;
+gsize track_name_left = 0;
+const char **track_name_pages[TRACK_MAX_PAGES];
+guint32 track_total = 0;
+guint32 *track_slots = NULL;
+guint32 track_slot_mask = 0;
+GRand *shuffle_rand = NULL;
+TrackId *shuffle_recent = NULL;
+guint32 shuffle_recent_size = 0;
+guint32 shuffle_recent_count = 0;
+GPtrArray *track_tags = NULL;
+GHashTable *tag_cache = NULL;
+GMutex tag_cache_mutex;
+gboolean tag_cache_dirty = FALSE;
+GThreadPool *tag_pool = NULL;
+GPtrArray *tag_scan_results = NULL;
+guint tag_scan_total = 0;
+guint tag_scan_done = 0;
+guint tag_scan_parsed = 0;
+gint64 tag_scan_started = 0;
+GThreadPool *dedupe_pool = NULL;
+GHashTable *dedupe_cache = NULL;
+GMutex dedupe_mutex;
+gboolean dedupe_cache_dirty = FALSE;
+GThreadPool *dedupe_save_pool = NULL;
+guint dedupe_save_source = 0;
+GPtrArray *dedupe_results = NULL;
+guint dedupe_total = 0;
+guint dedupe_done = 0;
+guint dedupe_hashed = 0;
+guint64 dedupe_hashed_bytes = 0;
+gint64 dedupe_started = 0;
+GArray *track_hashes = NULL;
+GHashTable *dedupe_owners = NULL;
+GHashTable *dedupe_hidden = NULL;
+GHashTable *dedupe_copies = NULL;
+GHashTable *dedupe_downloads = NULL;
+guint dedupe_generation = 0;
+static GPrivate dedupe_buffer = G_PRIVATE_INIT(g_free);
+GHashTable *search_postings = NULL;
+GPtrArray *search_texts = NULL;
+guint64 search_entries = 0;
+guint64 search_dead = 0;
+GtkWidget *search_entry;
+GtkListStore *search_results_store;
+const char *playlists_dir = PLAYLISTS_DIR;
+const char *library_index_path = LIBRARY_INDEX_FILE;
+gchar **library_roots = NULL;
+guint library_scan_workers = 4;
+GPtrArray *library_dir_paths = NULL;
+guint8 *library_tracks = NULL;
+guint32 library_tracks_size = 0;
+GHashTable *open_playlists = NULL;
+GPtrArray *smart_playlists = NULL;
+GHashTable *play_counts = NULL;
+GMutex play_count_mutex;
+gboolean play_counts_loaded = FALSE;
+gboolean play_counts_dirty = FALSE;
+GThreadPool *play_counts_save_pool = NULL;
+guint play_counts_save_source = 0;
+GtkWidget *remove_from_playlist_button;
+gint64 startup_started_at = 0;
+gboolean startup_first_audio_pending = TRUE;
+GThread *library_loader_thread = NULL;
+GMutex library_loader_mutex;
+GQueue library_loader_batches = G_QUEUE_INIT;
+GPtrArray *library_loader_playlists = NULL;
+GPtrArray *library_loader_dir_paths = NULL;
+gboolean library_loader_finished = FALSE;
+guint library_loader_source = 0;
+gboolean library_loader_startup = FALSE;
+gboolean library_loader_autoplay = FALSE;
+gboolean library_loader_resync = FALSE;
+guint8 *library_resync_unseen = NULL;
+guint32 library_resync_size = 0;
+guint library_resync_added = 0;
+gint64 library_loader_started_at = 0;
+int control_listen_fd = -1;
+guint control_listen_watch = 0;
+gchar *control_socket_path = NULL;
+GList *control_clients = NULL;
+GMainLoop *daemon_loop = NULL;
+gint64 startup_ready_us = 0;
+int remote_fd = -1;
+guint remote_watch = 0;
+guint remote_poll_source = 0;
+GString *remote_input = NULL;
+gchar *remote_track = NULL;
+static __thread TraceRing *trace_local_ring = NULL;
+GPtrArray *trace_rings = NULL;
+GMutex trace_rings_mutex;
+guint trace_next_ring_id = 0;
+TraceHistogram trace_histograms[TRACE_KIND_COUNT];
+TraceError trace_errors[TRACE_MAX_ERRORS];
+guint trace_error_count = 0;
+GMutex trace_errors_mutex;
+gint64 trace_switch_started_us = 0;
+gint64 trace_switch_playing_from = 0;
+gint64 trace_switch_buffer_from = 0;
+static const char *const trace_kind_names[TRACE_KIND_COUNT] = {
+    "switch:play_song", "switch:playing", "switch:first_buffer", "play_song",
+    "seek", "library_scan", "tag_scan", "download", "download_postprocess", "prefetch", "analysis", "dedupe", "session_save"
+};
+GThreadPool *prefetch_pool = NULL;
+guint32 prefetch_batch_position = QUEUE_NO_POSITION;
+guint32 prefetch_horizon = 0;
+gint prefetch_hits = 0;
+gint prefetch_misses = 0;
+UiEvent *ui_channel_head = NULL;
+gint ui_channel_scheduled = 0;
+GHashTable *ui_channel_slots = NULL;
+guint64 ui_channel_received = 0;
+guint64 ui_channel_applied = 0;
+guint ui_channel_drains = 0;
+gint64 ui_channel_max_drain_us = 0;
+GMainLoop *bench_ui_loop = NULL;
+gint64 *bench_ui_last = NULL;
+guint bench_ui_producers = 0;
+gint64 bench_ui_events = 0;
+guint64 bench_ui_expected = 0;
+gboolean bench_ui_ordered = TRUE;
+gboolean seek_dragging = FALSE;
+gboolean seek_in_flight = FALSE;
+gboolean seek_in_flight_accurate = FALSE;
+gint64 seek_pending_target = -1;
+gboolean seek_pending_accurate = FALSE;
+gint64 seek_started_us = 0;
+guint seek_watchdog_source = 0;
+guint seek_issued = 0;
+guint seek_coalesced = 0;
+GThreadPool *analysis_pool = NULL;
+GMutex analysis_mutex;
+GHashTable *loudness_cache = NULL;
+GMutex loudness_mutex;
+GQueue analysis_urgent = G_QUEUE_INIT;
+GQueue analysis_background = G_QUEUE_INIT;
+gboolean loudness_cache_dirty = FALSE;
+guint loudness_analyzed = 0;
+gint analysis_outstanding = 0;
+gint analysis_cancelled = 0;
+gdouble loudness_track_gain = 1.0;
+gdouble volume_level = 1.0;
+GHashTable *waveform_cache = NULL;
+GMutex waveform_mutex;
+GMappedFile *waveform_map = NULL;
+int waveform_fd = -1;
+gint8 waveform_current[WAVEFORM_BUCKETS * 2];
+gboolean waveform_current_valid = FALSE;
+gchar *waveform_current_path = NULL;
+GQueue download_queue = G_QUEUE_INIT;
+GList *active_downloads = NULL;
+GList *waiting_downloads = NULL;
 GstElement *pipeline = NULL;
 gint64 current_position = 0;
 gboolean is_loop_enabled = FALSE;
 gboolean is_shuffle_enabled = FALSE;
 char *music_dir = NULL;
 gboolean pipeline_is_playing = FALSE;
-
-void init_list(CircularDoublyLinkedList *list);
-int is_empty(CircularDoublyLinkedList *list);
-void add_song(CircularDoublyLinkedList *list, const char *song_name);
-void *download_song_thread(void *data);
+gboolean main_window_iconified = FALSE;
+guint position_clock_source = 0;
+gint64 position_clock_duration = -1;
+gint position_clock_shown_second = -1;
+guint position_clock_wakeups = 0;
+gint64 position_clock_window_start = 0;
+GHashTable *settings = NULL;
+gboolean gapless_enabled = TRUE;
+guint32 gapless_pending_position = QUEUE_NO_POSITION;
+GMutex gap_mutex;
+gint64 gap_sink_idle_at = 0;
+gint64 gap_eos_at = 0;
+gboolean gap_awaiting_first_buffer = FALSE;
+guint output_buffer_ms = 200;
+guint output_latency_ms = 10;
+gint output_realtime_priority = 10;
+gint output_realtime_threads = 0;
+gint output_realtime_failed = 0;
+GstElement *output_volume = NULL;
+OutputStats output_stats;
+GThreadPool *session_pool = NULL;
+guint session_save_source = 0;
+gboolean session_save_periodic = FALSE;
+gint64 session_resume_at = -1;
+gboolean session_resume_paused = FALSE;
+gboolean session_resume_seeked = FALSE;
+guint8 *session_tracks = NULL;
+guint32 session_tracks_size = 0;
+int library_watch_fd = -1;
+guint library_watch_source = 0;
+guint library_watch_flush_source = 0;
+GHashTable *library_pending_changes = NULL;
+GHashTable *library_watch_dirs = NULL;
+gboolean library_pending_resync = FALSE;
+
+static const char *track_name_store(const char *name, gsize length);
+static guint track_name_hash(const char *name, gsize length);
+static guint32 track_slot_find(const char *name, gsize length, guint hash);
+static void track_slots_grow();
+TrackId track_intern_length(const char *song_name, gsize length);
+TrackId track_intern(const char *song_name);
+TrackId track_lookup(const char *song_name);
+const char *track_name(TrackId id);
+guint32 track_count();
+void free_tracks();
+void init_queue(PlayQueue *queue);
+int is_empty(PlayQueue *queue);
+void add_song(PlayQueue *queue, const char *song_name);
+static guint32 shuffle_round(guint64 key, guint round, guint32 half);
+static guint shuffle_half_bits(guint32 length);
+static guint32 shuffle_permute(guint64 key, guint32 length, guint32 position);
+static guint32 shuffle_unpermute(guint64 key, guint32 length, guint32 index);
+static guint32 shuffle_segment_order(const ShuffleSegment *segment, guint32 position);
+static guint32 shuffle_segment_position(const ShuffleSegment *segment, guint32 index);
+static void shuffle_segment_rank(ShuffleSegment *segment);
+static ShuffleSegment *queue_segment(PlayQueue *queue, guint32 position);
+static void queue_segments_init(PlayQueue *queue);
+static void queue_segments_free(PlayQueue *queue);
+static gboolean queue_freeze_played(PlayQueue *queue, guint32 position);
+guint64 shuffle_new_key();
+void shuffle_note_played(TrackId id);
+static gboolean shuffle_recently_played(TrackId id, guint32 window);
+guint32 queue_order(PlayQueue *queue, guint32 position);
+guint32 queue_position_of(PlayQueue *queue, guint32 index);
+TrackId queue_current(PlayQueue *queue);
+guint32 queue_next_position(PlayQueue *queue);
+TrackId queue_step(PlayQueue *queue, int direction);
+void queue_jump(PlayQueue *queue, guint32 position);
+guint32 queue_find(PlayQueue *queue, TrackId id);
+void queue_mark_present(PlayQueue *queue, guint8 *present, guint32 present_size);
+void queue_set_shuffle(PlayQueue *queue, gboolean shuffled, guint64 key);
+void remove_songs(PlayQueue *queue, const guint8 *removed, guint32 removed_size);
+void register_song_file(const char *path);
+static void download_child_setup(gpointer data);
+static void update_download_status();
+static void download_job_free(DownloadJob *job);
+static void download_job_finish(DownloadJob *job);
+static gboolean download_job_readable(GIOChannel *channel, GIOCondition condition, gpointer data);
+static void download_job_exited(GPid pid, gint status, gpointer data);
+static gboolean download_job_retry(gpointer data);
+static void download_job_start(DownloadJob *job);
+void download_manager_pump();
+void download_manager_cancel_all();
 void download_song_button(GtkWidget *widget, gpointer data);
+void cancel_downloads_button(GtkWidget *widget, gpointer data);
+static TraceRing *trace_ring();
+void trace_span(TraceKind kind, gint64 start_us, gint64 end_us, guint32 arg);
+void trace_error(const char *format, ...) G_GNUC_PRINTF(1, 2);
+void trace_switch_begin();
+static guint64 trace_histogram_percentile(const TraceHistogram *histogram, gdouble fraction);
+gchar *trace_stats_text();
+gboolean trace_write_chrome(const char *path);
+void trace_dump();
+static gboolean on_trace_signal(gpointer data);
+void ui_post(UiEventKind kind, guint slot, gint64 value, const char *text);
+static void ui_event_free(UiEvent *event);
+static void ui_event_apply(const UiEvent *event);
+static gboolean ui_channel_drain(gpointer data);
+void ui_channel_stop();
+static guint64 prefetch_physical_offset(int fd, const struct stat *st);
+static gboolean prefetch_is_resident(int fd, goffset size, goffset limit);
+static int prefetch_compare_physical(gconstpointer a, gconstpointer b);
+static void prefetch_worker(gpointer data, gpointer user_data);
+void prefetch_note_track_start(const char *path);
+void prefetch_invalidate();
+void prefetch_update();
+void prefetch_start();
+void prefetch_stop();
+static void audio_decode_handoff(GstElement *sink, GstBuffer *buffer, GstPad *pad, gpointer data);
+gboolean audio_decode_file(const char *path, guint rate, AudioDecodeFunc func, gpointer data, const gint *cancel);
+void loudness_analysis_init(LoudnessAnalysis *analysis);
+void loudness_analysis_clear(LoudnessAnalysis *analysis);
+static gfloat loudness_peak(const gfloat *samples, gsize count, gfloat peak);
+void loudness_feed(LoudnessAnalysis *analysis, const gfloat *samples, gsize frames);
+static gdouble loudness_gated_mean(const gdouble *blocks, guint count, gdouble threshold, guint *kept);
+gdouble loudness_integrated(const LoudnessAnalysis *analysis);
+static void waveform_range(const gfloat *samples, gsize count, gfloat *low, gfloat *high);
+void waveform_analysis_init(WaveformAnalysis *analysis);
+void waveform_analysis_clear(WaveformAnalysis *analysis);
+static void waveform_close_chunk(WaveformAnalysis *analysis);
+void waveform_feed(WaveformAnalysis *analysis, const gfloat *samples, gsize frames);
+gboolean waveform_finish(WaveformAnalysis *analysis, gint8 *peaks);
+static void analysis_decoded(const gfloat *samples, gsize frames, gpointer data);
+gboolean analysis_decode_file(const char *path, LoudnessAnalysis *loudness, WaveformAnalysis *waveform);
+static gboolean loudness_is_current(const char *path, const struct stat *st);
+static gboolean loudness_store(const char *path, const struct stat *st, gdouble lufs, gdouble peak);
+static void waveform_entry_free(gpointer data);
+static gboolean waveform_is_current(const char *path, const struct stat *st);
+static void waveform_store(const char *path, const struct stat *st, const gint8 *peaks);
+gboolean waveform_show(const char *path);
+void load_waveform_cache();
+static void waveform_draw_columns(cairo_t *cr, const GdkRectangle *area, gint from, gint to);
+static gboolean on_seek_scale_draw(GtkWidget *widget, cairo_t *cr, gpointer data);
+static void analysis_worker(gpointer data, gpointer user_data);
+void analysis_request(gchar *path, gboolean urgent);
+static gboolean analysis_is_current(const char *path);
+gdouble loudness_lookup_gain(const char *path);
+void analysis_track_started(const char *song_name);
+void load_loudness_cache();
+void save_loudness_cache();
+void analysis_start();
+void analysis_stop();
+void apply_volume();
 void stop_current_song();
+gchar *song_uri(const char *song_name);
 void play_song(const char *song_name);
+static void on_about_to_finish(GstElement *playbin, gpointer data);
+static void commit_gapless_transition();
+static GstPadProbeReturn audio_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+void update_window_title(TrackId id);
 void pause_song();
 void resume_song();
 void play_pause_button_toggled(GtkWidget *widget, gpointer data);
@@ -62,17 +867,63 @@ void next_song_button(GtkWidget *widget, gpointer data);
 void play_previous_song();
 void previous_song_button(GtkWidget *widget, gpointer data);
 void toggle_loop(GtkWidget *widget, gpointer data);
-void shuffle_playlist(CircularDoublyLinkedList *list);
+void shuffle_playlist(PlayQueue *queue);
 void toggle_shuffle(GtkWidget *widget, gpointer data);
 void on_volume_changed(GtkRange *range, gpointer data);
-static void update_seek_bar_position_thread();
-static void start_seek_bar_update_thread();
-void on_seek_changed(GtkRange *range, gpointer data);
+static void set_time_label(GtkWidget *label, gint64 time_ns);
+static gboolean position_clock_tick(gpointer data);
+void position_clock_update();
+void position_clock_reset_track();
+static void on_main_window_visibility(GtkWidget *widget, gpointer data);
+static gboolean on_main_window_state(GtkWidget *widget, GdkEventWindowState *event, gpointer data);
+static gboolean seek_issue();
+gboolean seek_request(gint64 target, gboolean accurate);
+static void seek_complete();
+static gboolean seek_watchdog(gpointer data);
+void seek_reset();
+static gboolean on_seek_change_value(GtkRange *range, GtkScrollType scroll, gdouble value, gpointer data);
+static gboolean on_seek_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data);
+static gboolean on_seek_button_release(GtkWidget *widget, GdkEventButton *event, gpointer data);
+static void remote_seek(gdouble seconds);
 void reset_seek_scale();
+void set_play_pause_icon(gboolean playing);
+static gchar *playlist_file_path(const char *playlist_name, const char *extension);
+static void playlist_free(Playlist *playlist);
+static gboolean playlist_write_record(Playlist *playlist, PlaylistOp op, guint32 a, guint32 b, const char *song_name);
+static void playlist_apply_append(Playlist *playlist, const char *song_name, gsize length);
+static gboolean playlist_replay(Playlist *playlist, const char *data, gsize length);
+static gboolean playlist_import_txt(Playlist *playlist, const char *txt_path);
+gboolean playlist_compact(Playlist *playlist);
+static void playlist_maybe_compact(Playlist *playlist);
+gboolean playlist_exists(const char *playlist_name);
+Playlist *playlist_open(const char *playlist_name, gboolean create);
+gboolean playlist_append(Playlist *playlist, const char *song_name);
+gboolean playlist_remove(Playlist *playlist, guint index);
+gboolean playlist_move(Playlist *playlist, guint from, guint to);
+gint playlist_index_of(Playlist *playlist, const char *song_name);
+void playlist_close_all();
+void smart_rule_free(SmartRule *rule);
+static gboolean smart_rule_get_bound(GKeyFile *file, const char *key, guint32 unit, guint32 *bound, GError **error);
+SmartRule *smart_rule_load(const char *path, GError **error);
+gboolean smart_rule_matches(const SmartRule *rule, TrackId id);
+Playlist *smart_playlist_new(const char *playlist_name, const char *path, SmartRule *rule);
+static void smart_playlist_update(Playlist *playlist, TrackId id, gboolean present);
+void smart_playlists_update(TrackId id, gboolean present);
+void smart_playlists_clear();
+void smart_playlists_start();
+void smart_playlists_stop();
+guint32 play_count_get(const char *song_name);
+void play_count_note(TrackId id);
+void load_play_counts();
+static void play_counts_write(gpointer data, gpointer user_data);
+static gboolean play_counts_save_due(gpointer data);
 void create_playlist(const char *playlist_name);
 void add_song_to_playlist(const char *song_name, const char *playlist_name);
+GPtrArray *list_playlists();
+void add_playlist_names(GPtrArray *names);
 void load_playlists();
 void on_add_to_playlist_button_clicked(GtkWidget *widget, gpointer data);
+void on_remove_from_playlist_button_clicked(GtkWidget *widget, gpointer data);
 void on_create_playlist_button_clicked(GtkWidget *widget, gpointer data);
 void on_play_playlist_button_clicked(GtkWidget *widget, gpointer data);
 static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data);
@@ -81,7 +932,178 @@ void free_music_directory();
 void cleanup_resources();
 void save_music_directory(const char *dir);
 char *load_music_directory();
+void load_settings();
+const char *get_setting(const char *key, const char *fallback);
+gint get_setting_int(const char *key, gint fallback);
+static void set_status_text(const char *text);
+static gboolean has_audio_suffix(const char *name);
+static gboolean has_audio_magic(const guint8 *head);
+static gboolean is_song_file_at(int dir_fd, const char *name);
+gchar *library_name_for_path(const char *path);
+gchar **library_root_paths(const char *dir_path);
+static guint emit_library_names(LibraryScan *scan, LibraryDir *dir, guint first);
+static LibraryDir *library_scan_add_dir(LibraryScan *scan, char *path, char *prefix, const struct stat *st,
+                                        guint32 parent);
+static void library_scan_push(LibraryScanWorker *worker, LibraryDir *dir);
+static void library_scan_wake(LibraryScan *scan);
+static LibraryDir *library_scan_take(LibraryScanWorker *worker);
+static void library_scan_indexed(LibraryScanWorker *worker, LibraryDir *dir, guint32 position);
+static gboolean scan_library_dir(LibraryScanWorker *worker, LibraryDir *dir);
+static void library_scan_process(LibraryScanWorker *worker, LibraryDir *dir);
+static gpointer library_scan_run(gpointer data);
+static gboolean load_library_index(GMappedFile *index, LibraryScan *scan);
+static void save_library_index(const char *index_path, LibraryScan *scan);
+guint load_library(const char *index_path, const char *const *root_paths, guint root_count,
+                   LibraryBatchFunc emit, gpointer data, GPtrArray *dir_paths_out);
+void library_add_to_queue(const char *const *names, guint count, gpointer data);
+static void library_loader_emit(const char *const *names, guint count, gpointer data);
+static gpointer library_loader_run(gpointer data);
+static gboolean library_loader_deliver(gpointer data);
+void library_loader_start(const char *dir_path, gboolean startup);
+void library_resync_start();
+static void library_resync_finish();
+gboolean library_loader_busy();
+void library_loader_stop();
+static gboolean on_first_frame(GtkWidget *widget, cairo_t *cr, gpointer data);
+glong read_rss_kb();
+gchar *control_default_socket_path();
+const char *current_song_name();
+static void output_configure_sink(GstElement *element);
+static void output_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data);
+GstElement *output_bin_new(const char *sink_name, GstElement **volume, GstElement **sink);
+static GstBusSyncReply output_sync_handler(GstBus *bus, GstMessage *msg, gpointer data);
+static GstPadProbeReturn output_stats_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+void output_stats_attach(OutputStats *stats, GstElement *sink, guint latency_ms);
+void create_pipeline();
+void destroy_pipeline();
+static void control_client_free(ControlClient *client);
+static gboolean control_client_writable(GIOChannel *channel, GIOCondition condition, gpointer data);
+static void control_client_flush(ControlClient *client);
+static void control_play(ControlClient *client, const char *argument);
+static void control_execute(ControlClient *client, char *line);
+static gboolean control_client_readable(GIOChannel *channel, GIOCondition condition, gpointer data);
+static gboolean control_accept(GIOChannel *channel, GIOCondition condition, gpointer data);
+gboolean control_server_start(const char *path);
+void control_server_stop();
+static gboolean daemon_quit(gpointer data);
+int run_daemon(const char *socket_path);
+void remote_send(const char *commands);
+static void remote_handle_line(const char *line);
+static gboolean remote_readable(GIOChannel *channel, GIOCondition condition, gpointer data);
+static gboolean remote_poll(gpointer data);
+gboolean remote_connect(const char *path);
+void remote_disconnect();
 void load_songs_from_directory();
+static gboolean library_watch_readable(GIOChannel *channel, GIOCondition condition, gpointer data);
+static gboolean library_watch_flush(gpointer data);
+void library_watch_start();
+static void library_watch_close();
+void library_watch_stop();
+void read_track_tags(const char *path, goffset file_size, TrackTags *tags);
+void track_tags_free(TrackTags *tags);
+static gchar *song_path(const char *song_name);
+const TrackTags *track_tags_get(TrackId id);
+static void tag_scan_worker(gpointer data, gpointer user_data);
+void tag_scan_track(TrackId id);
+static guint tag_scan_publish();
+static void tag_scan_drain();
+void load_tag_cache();
+void save_tag_cache();
+void tag_scanner_start();
+void tag_scanner_stop();
+static guint64 content_hash_round(guint64 acc, guint64 input);
+static guint64 content_hash_merge(guint64 hash, guint64 lane);
+static guint64 content_hash_read64(const guint8 *data);
+void content_hash_init(ContentHash *state);
+void content_hash_update(ContentHash *state, const guint8 *data, gsize length);
+guint64 content_hash_finish(const ContentHash *state);
+static goffset content_payload_bounds(int fd, goffset size, goffset *end);
+gboolean content_hash_file(const char *path, guint8 *buffer, guint64 *hash, guint64 *hashed_bytes);
+static guint8 *dedupe_thread_buffer();
+static void dedupe_worker(gpointer data, gpointer user_data);
+void dedupe_track(TrackId id);
+void dedupe_note_download(const char *path);
+gboolean dedupe_is_hidden(TrackId id);
+static GPtrArray *dedupe_publish();
+static void dedupe_set_owner(guint64 hash, TrackId id);
+static void dedupe_hide(TrackId id, guint64 hash);
+static void dedupe_unhide(TrackId id, guint64 hash);
+static gboolean dedupe_owner_present(TrackId id);
+static void dedupe_promote(guint64 hash);
+static void dedupe_restore(TrackId id, guint64 hash);
+static void dedupe_drain();
+void dedupe_track_removed(TrackId id);
+void dedupe_reset();
+gchar *dedupe_report_text(guint max_groups);
+void load_dedupe_cache();
+static GArray *dedupe_cache_snapshot();
+static void dedupe_cache_write(gpointer data, gpointer user_data);
+static gboolean dedupe_save_due(gpointer data);
+void dedupe_start();
+void dedupe_stop();
+SessionSnapshot *session_snapshot_take(const char *path);
+void session_snapshot_free(SessionSnapshot *snapshot);
+gboolean session_snapshot_write(SessionSnapshot *snapshot, gsize *size_out);
+static void session_write(gpointer data, gpointer user_data);
+static gboolean session_save_due(gpointer data);
+void session_mark_dirty();
+void session_start();
+void session_stop();
+gboolean session_restore(const char *path);
+static void session_resume_track(const char *song_name, gint64 position, gboolean paused);
+static void session_resume_continue();
+static gboolean session_claim(const char *song_name);
+static void session_drop_missing();
+void library_track_added(TrackId id);
+void library_track_removed(TrackId id);
+gboolean library_has_track(TrackId id);
+void library_clear();
+gchar *search_normalize(const char *text);
+static guint64 search_trigram(const gchar *text);
+static GArray *search_trigram_set(const gchar *text);
+static void search_posting_add(guint64 key, TrackId id);
+static void search_compact();
+void search_index_track(TrackId id);
+void search_remove_track(TrackId id);
+guint search_tracks(const char *query, TrackId *results, guint max_results);
+static void on_search_changed(GtkEditable *editable, gpointer data);
+static gboolean on_search_match_selected(GtkEntryCompletion *completion, GtkTreeModel *model, GtkTreeIter *iter, gpointer data);
+static gboolean search_match_all(GtkEntryCompletion *completion, const gchar *key, GtkTreeIter *iter, gpointer data);
+int run_library_benchmark(const char *dir, guint count);
+int run_playlist_benchmark(guint count);
+static guint64 bench_now_ns();
+static void bench_reset_peak_rss();
+static glong bench_peak_rss_kb();
+static int bench_compare_u64(gconstpointer a, gconstpointer b);
+static void bench_report(const char *name, guint size, guint64 *samples_ns, guint count);
+static gboolean bench_make_library(const char *dir, guint size);
+static void bench_fill_queue(guint size);
+static void bench_queue_paths(guint size);
+static void bench_library_paths(const char *dir, guint size);
+static void bench_playlist_paths(const char *dir, guint size);
+int run_bench_suite(const char *base_dir, const char *sizes);
+static gdouble bench_cpu_seconds(clockid_t clock);
+int run_analysis_benchmark(int count, char *paths[]);
+void bench_ui_event(guint slot, gint64 value);
+static gpointer bench_ui_producer(gpointer data);
+int run_ui_channel_benchmark(guint producers, guint events);
+static void bench_dedupe_worker(gpointer data, gpointer user_data);
+static void bench_collect_files(const char *dir_path, GPtrArray *jobs);
+int run_dedupe_benchmark(const char *dir_path, guint workers);
+int run_track_names_benchmark(guint count);
+static void bench_count_names(const char *const *names, guint count, gpointer data);
+static void bench_scan_readdir(const char *dir_path, guint *dirs, guint *files);
+static gboolean bench_drop_dentries();
+static gboolean bench_make_tree(const char *dir, guint artists);
+static void bench_scan_report(const char *mode, guint workers, gboolean cold, guint dirs, guint files, gint64 us);
+int run_scan_benchmark(const char *dir_path, guint workers);
+static gboolean bench_write_tone(const char *path, guint seconds);
+int run_output_benchmark(guint streams, guint seconds, const char *file);
+int run_session_benchmark(guint count);
+static gboolean bench_run_ffmpeg(const char *const *argv, gdouble *wall_ms, gdouble *cpu_ms);
+int run_postprocess_benchmark(const char *file, guint runs);
+int run_smart_playlist_benchmark(guint count);
+int run_benchmark(int argc, char *argv[]);
 void ask_for_music_directory();
 void change_music_directory_button(GtkWidget *widget, gpointer data);
 void update_directory_label();
@@ -91,703 +1113,8125 @@ void create_ui();
 void add_css_style();
 int main(int argc, char *argv[]);
 
-void init_list(CircularDoublyLinkedList *list) {
-    list->head = NULL;
+/* Copies a name into the newest arena chunk, starting a new chunk when it does not fit.
+ * Chunks are never moved or freed before exit, so stored names stay put. Names are whole
+ * paths below the music directory and the directory part is stored again for every
+ * track: track_name hands out NUL-terminated strings, which rules out front-coding. */
+static const char *track_name_store(const char *name, gsize length) {
+    if (length + 1 > track_name_left) {
+        gsize size = MAX(TRACK_NAME_CHUNK, length + 1);
+        if (!track_name_chunks) track_name_chunks = g_ptr_array_new_with_free_func(g_free);
+        track_name_free = g_malloc(size);
+        track_name_left = size;
+        g_ptr_array_add(track_name_chunks, track_name_free);
+    }
+
+    char *stored = track_name_free;
+    memcpy(stored, name, length);
+    stored[length] = '\0';
+    track_name_free += length + 1;
+    track_name_left -= length + 1;
+    return stored;
 }
 
-int is_empty(CircularDoublyLinkedList *list) {
-    return list->head == NULL;
+static guint track_name_hash(const char *name, gsize length) {
+    guint hash = 5381;
+    for (gsize i = 0; i < length; i++) {
+        hash = hash * 33 + (guchar)name[i];
+    }
+    return hash;
 }
 
-void add_song(CircularDoublyLinkedList *list, const char *song_name) {
-    Node *new_node = (Node *)malloc(sizeof(Node));
-    new_node->song_name = strdup(song_name);
+/* The slot holding name in track_slots, or the empty slot where it belongs. */
+static guint32 track_slot_find(const char *name, gsize length, guint hash) {
+    guint32 slot = hash & track_slot_mask;
+    while (track_slots[slot]) {
+        const char *candidate = track_name(track_slots[slot] - 1);
+        if (strncmp(candidate, name, length) == 0 && candidate[length] == '\0') break;
+        slot = (slot + 1) & track_slot_mask;
+    }
+    return slot;
+}
 
-    g_mutex_lock(&list_mutex); 
+/* Doubles the id table, which is kept at most half full. */
+static void track_slots_grow() {
+    guint32 size = track_slots ? (track_slot_mask + 1) * 2 : 1024;
+    g_free(track_slots);
+    track_slots = g_new0(guint32, size);
+    track_slot_mask = size - 1;
+    for (TrackId id = 0; id < track_total; id++) {
+        const char *name = track_name(id);
+        gsize length = strlen(name);
+        track_slots[track_slot_find(name, length, track_name_hash(name, length))] = id + 1;
+    }
+}
 
-    if (is_empty(list)) {
-        new_node->next = new_node;
-        new_node->prev = new_node;
-        list->head = new_node;
-    } else {
-        Node *tail = list->head->prev;
-        tail->next = new_node;
-        new_node->prev = tail;
-        new_node->next = list->head;
-        list->head->prev = new_node;
+/* Names are stored once, back to back in arena chunks, and found through an open
+ * addressing table of 32-bit ids. The queue, library and playlists all hold these ids or
+ * the pointers track_name returns. Interning happens on the main thread; other threads
+ * may read any id below track_total, whose page is filled in before the count grows. */
+TrackId track_intern_length(const char *song_name, gsize length) {
+    if (!track_slots || (track_total + 1) * 2 > track_slot_mask + 1) {
+        track_slots_grow();
     }
+    guint32 slot = track_slot_find(song_name, length, track_name_hash(song_name, length));
+    if (track_slots[slot]) return track_slots[slot] - 1;
 
-    g_mutex_unlock(&list_mutex); 
+    TrackId id = track_total;
+    const char **page = track_name_pages[id >> TRACK_PAGE_BITS];
+    if (!page) {
+        page = track_name_pages[id >> TRACK_PAGE_BITS] = g_new(const char *, TRACK_PAGE_SIZE);
+    }
+    page[id & (TRACK_PAGE_SIZE - 1)] = track_name_store(song_name, length);
+    track_slots[slot] = id + 1;
+    __atomic_store_n(&track_total, id + 1, __ATOMIC_RELEASE);
+    return id;
 }
 
-void *download_song_thread(void *data) {
-    const char *url = (const char *)data;
-    char command[512];
-    snprintf(command, sizeof(command), "yt-dlp -x --audio-format mp3 -f bestaudio --embed-thumbnail --no-warnings --no-check-certificate --hls-prefer-native \"%s\" -o \"%s/%(title)s.%%(ext)s\"", url, music_dir);
-    system(command);
-
-    gtk_label_set_text(GTK_LABEL(status_label), "Download Complete");
-    char *song_name = strrchr(url, '/') + 1;
-    add_song(&song_list, song_name);
+TrackId track_intern(const char *song_name) {
+    return track_intern_length(song_name, strlen(song_name));
+}
 
-    free((void *)data); 
-    return NULL;
+TrackId track_lookup(const char *song_name) {
+    if (!track_slots) return TRACK_ID_NONE;
+    gsize length = strlen(song_name);
+    guint32 slot = track_slot_find(song_name, length, track_name_hash(song_name, length));
+    return track_slots[slot] ? track_slots[slot] - 1 : TRACK_ID_NONE;
 }
 
-void download_song_button(GtkWidget *widget, gpointer data) {
-    const char *url = gtk_entry_get_text(GTK_ENTRY(url_entry));
-    if (strlen(url) == 0) {
-        gtk_label_set_text(GTK_LABEL(status_label), "No URL provided.");
-        return;
-    }
+const char *track_name(TrackId id) {
+    if (id >= __atomic_load_n(&track_total, __ATOMIC_ACQUIRE)) return NULL;
+    return track_name_pages[id >> TRACK_PAGE_BITS][id & (TRACK_PAGE_SIZE - 1)];
+}
 
-    char *url_copy = g_strdup(url); 
-    download_thread = g_thread_new("download_thread", download_song_thread, url_copy);
-    gtk_entry_set_text(GTK_ENTRY(url_entry), "");
-    gtk_label_set_text(GTK_LABEL(status_label), "Downloading...");
+guint32 track_count() {
+    return track_total;
 }
 
-void stop_current_song() {
-    if (pipeline) {
-        gst_element_set_state(pipeline, GST_STATE_NULL);
+void free_tracks() {
+    for (guint32 page = 0; page < TRACK_MAX_PAGES && track_name_pages[page]; page++) {
+        g_free(track_name_pages[page]);
+        track_name_pages[page] = NULL;
     }
+    if (track_name_chunks) g_ptr_array_unref(track_name_chunks);
+    g_free(track_slots);
+    track_name_chunks = NULL;
+    track_name_free = NULL;
+    track_name_left = 0;
+    track_total = 0;
+    track_slots = NULL;
+    track_slot_mask = 0;
 }
 
-void play_song(const char *song_name) {
-    start_seek_bar_update_thread();
-    reset_seek_scale();
-    stop_current_song();
-
-    gchar *file_path = g_strdup_printf("file://%s/%s", music_dir, song_name);
-    g_object_set(G_OBJECT(pipeline), "uri", file_path, NULL);
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
-    gtk_label_set_text(GTK_LABEL(status_label), "Playing Song...");
-
-    GtkWidget *pause_icon = gtk_image_new_from_icon_name("media-playback-pause", GTK_ICON_SIZE_BUTTON);
-    gtk_button_set_image(GTK_BUTTON(play_pause_button), pause_icon);
+/* Round function of the shuffle permutation: a 64-bit finalizer over the key, the
+ * round number and the half block. */
+static guint32 shuffle_round(guint64 key, guint round, guint32 half) {
+    guint64 x = key ^ ((guint64)round << 32 | half);
+    x ^= x >> 33;
+    x *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return (guint32)x;
+}
 
-    current_position = 0;
-    pipeline_is_playing = TRUE; 
-    g_free(file_path);
+/* Bits per Feistel half: the smallest even-width block that holds every index below
+ * length, so the block is less than four times the queue and cycle-walking takes
+ * fewer than four rounds on average. */
+static guint shuffle_half_bits(guint32 length) {
+    return (g_bit_storage(length - 1) + 1) / 2;
 }
 
-void pause_song() {
-    if (pipeline) {
-        gst_element_query_position(pipeline, GST_FORMAT_TIME, &current_position);
-        gst_element_set_state(pipeline, GST_STATE_PAUSED);
+/* Maps a play position to an insertion index: a four-round Feistel network over the
+ * block, applied again while the result falls outside the queue. Feistel networks are
+ * bijective for any round function, and so is this cycle-walk restricted to the queue. */
+static guint32 shuffle_permute(guint64 key, guint32 length, guint32 position) {
+    if (length <= 1) return position;
+    guint half = shuffle_half_bits(length);
+    guint32 mask = (1u << half) - 1;
+    guint32 value = position;
+    do {
+        guint32 left = value >> half, right = value & mask;
+        for (guint round = 0; round < 4; round++) {
+            guint32 next = left ^ (shuffle_round(key, round, right) & mask);
+            left = right;
+            right = next;
+        }
+        value = left << half | right;
+    } while (value >= length);
+    return value;
+}
 
-        GtkWidget *play_icon = gtk_image_new_from_icon_name("media-playback-start", GTK_ICON_SIZE_BUTTON);
-        gtk_button_set_image(GTK_BUTTON(play_pause_button), play_icon);
-        gtk_label_set_text(GTK_LABEL(status_label), "Song Paused");
-    }
+/* Inverse of shuffle_permute: the rounds in reverse, walked the same way. */
+static guint32 shuffle_unpermute(guint64 key, guint32 length, guint32 index) {
+    if (length <= 1) return index;
+    guint half = shuffle_half_bits(length);
+    guint32 mask = (1u << half) - 1;
+    guint32 value = index;
+    do {
+        guint32 left = value >> half, right = value & mask;
+        for (guint round = 4; round-- > 0;) {
+            guint32 previous = right ^ (shuffle_round(key, round, left) & mask);
+            right = left;
+            left = previous;
+        }
+        value = left << half | right;
+    } while (value >= length);
+    return value;
 }
 
-void resume_song() {
-    if (pipeline) {
-        gst_element_seek(pipeline, 1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, GST_SEEK_TYPE_SET, current_position, GST_SEEK_TYPE_NONE, 0);
-        gst_element_set_state(pipeline, GST_STATE_PLAYING);
-        
-        GtkWidget *pause_icon = gtk_image_new_from_icon_name("media-playback-pause", GTK_ICON_SIZE_BUTTON);
-        gtk_button_set_image(GTK_BUTTON(play_pause_button), pause_icon);
-        gtk_label_set_text(GTK_LABEL(status_label), "Resuming Song...");
-    }
+static int shuffle_compare_u32(gconstpointer a, gconstpointer b) {
+    guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+    return x < y ? -1 : x > y;
 }
 
-void play_pause_button_toggled(GtkWidget *widget, gpointer data) {
-    GstState current_state;
-    gst_element_get_state(pipeline, &current_state, NULL, GST_CLOCK_TIME_NONE);
+/* Index, relative to the segment, of the song at a position relative to it. Past the
+ * head, the wanted rank is the position-th one the head does not hold, found by
+ * stepping over the sorted head ranks at or below it. */
+static guint32 shuffle_segment_order(const ShuffleSegment *segment, guint32 position) {
+    if (position < segment->head_length) return segment->head[position];
 
-    if (current_state == GST_STATE_PLAYING) {
-        pause_song(); 
-    } else {
-        resume_song(); 
+    guint32 rank = position - segment->head_length;
+    for (guint32 i = 0; i < segment->head_length && segment->ranks[i] <= rank; i++) {
+        rank++;
     }
+    return shuffle_permute(segment->key, segment->length, rank);
 }
 
-void play_next_song() {
-    if (current_song && current_song->next) {
-        current_song = current_song->next;
-        play_song(current_song->song_name);
-        gtk_label_set_text(GTK_LABEL(status_label), "Playing Next Song...");
-    } else if (current_song) {
-        current_song = song_list.head;
-        play_song(current_song->song_name);
-        gtk_label_set_text(GTK_LABEL(status_label), "Playing First Song (Looping)...");
-    } else {
-        gtk_label_set_text(GTK_LABEL(status_label), "No next song to play.");
+/* Inverse of shuffle_segment_order. */
+static guint32 shuffle_segment_position(const ShuffleSegment *segment, guint32 index) {
+    for (guint32 i = 0; i < segment->head_length; i++) {
+        if (segment->head[i] == index) return i;
     }
-}
 
-void next_song_button(GtkWidget *widget, gpointer data) {
-    play_next_song();
+    guint32 rank = shuffle_unpermute(segment->key, segment->length, index);
+    guint32 below = 0;
+    while (below < segment->head_length && segment->ranks[below] < rank) below++;
+    return segment->head_length + rank - below;
 }
 
-void play_previous_song() {
-    if (current_song && current_song->prev) {
-        current_song = current_song->prev;
-        play_song(current_song->song_name);
-        gtk_label_set_text(GTK_LABEL(status_label), "Playing Previous Song...");
-    } else {
-        gtk_label_set_text(GTK_LABEL(status_label), "No previous song to play.");
+/* Recomputes the head's ranks after the segment changed length. */
+static void shuffle_segment_rank(ShuffleSegment *segment) {
+    segment->ranks = g_renew(guint32, segment->ranks, MAX(segment->head_length, 1));
+    for (guint32 i = 0; i < segment->head_length; i++) {
+        segment->ranks[i] = shuffle_unpermute(segment->key, segment->length, segment->head[i]);
     }
+    qsort(segment->ranks, segment->head_length, sizeof(guint32), shuffle_compare_u32);
 }
 
-void previous_song_button(GtkWidget *widget, gpointer data) {
-    play_previous_song();
+/* A fresh shuffle key. With the shuffle_seed setting the sequence of keys, and so of
+ * orders, is the same on every run. */
+guint64 shuffle_new_key() {
+    guint64 high = g_rand_int(shuffle_rand);
+    return high << 32 | g_rand_int(shuffle_rand);
 }
 
-void toggle_loop(GtkWidget *widget, gpointer data) {
-    is_loop_enabled = !is_loop_enabled; 
+/* Remembers a started track in a ring of the last shuffle_history tracks. */
+void shuffle_note_played(TrackId id) {
+    if (id == TRACK_ID_NONE) return;
 
-    GtkWidget *loop_icon;
-    if (is_loop_enabled) {
-        loop_icon = gtk_image_new_from_icon_name("media-playlist-repeat-symbolic", GTK_ICON_SIZE_BUTTON);
-        gtk_label_set_text(GTK_LABEL(status_label), "Looping current song.");
-    } else {
-        loop_icon = gtk_image_new_from_icon_name("media-playlist-repeat", GTK_ICON_SIZE_BUTTON);
-        gtk_label_set_text(GTK_LABEL(status_label), "Looping disabled.");
+    g_mutex_lock(&queue_mutex);
+    if (!shuffle_recent) {
+        shuffle_recent_size = CLAMP(get_setting_int("shuffle_history", 50), 1, SHUFFLE_HISTORY_MAX);
+        shuffle_recent = g_new(TrackId, shuffle_recent_size);
     }
+    shuffle_recent[shuffle_recent_count++ % shuffle_recent_size] = id;
+    g_mutex_unlock(&queue_mutex);
+}
 
+/* Whether id is among the last window tracks started. */
+static gboolean shuffle_recently_played(TrackId id, guint32 window) {
+    for (guint32 i = 1; i <= window; i++) {
+        if (shuffle_recent[(shuffle_recent_count - i) % shuffle_recent_size] == id) return TRUE;
+    }
+    return FALSE;
 }
 
-void shuffle_playlist(CircularDoublyLinkedList *list) {
-    if (is_empty(list)) return;
+void init_queue(PlayQueue *queue) {
+    queue->tracks = NULL;
+    queue->shuffled = FALSE;
+    queue->shuffle_key = 0;
+    queue->length = 0;
+    queue->capacity = 0;
+    queue->position = QUEUE_NO_POSITION;
+    queue->segments = NULL;
+    queue->segment_count = 0;
+}
 
-    g_mutex_lock(&list_mutex);
-    Node *nodes[1000];
-    int count = 0;
+/* The segment holding a play position, which is also the one holding that index. */
+static ShuffleSegment *queue_segment(PlayQueue *queue, guint32 position) {
+    guint32 low = 0, high = queue->segment_count - 1;
+    while (low < high) {
+        guint32 middle = (low + high + 1) / 2;
+        if (queue->segments[middle].start <= position) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return &queue->segments[low];
+}
 
-    Node *temp = list->head;
-    do {
-        nodes[count++] = temp;
-        temp = temp->next;
-    } while (temp != list->head);
+/* Turns the implicit single segment into an explicit one before the first change. */
+static void queue_segments_init(PlayQueue *queue) {
+    if (queue->segments) return;
 
-    srand(time(NULL));
+    queue->segments = g_new0(ShuffleSegment, 1);
+    queue->segment_count = 1;
+    queue->segments[0].length = queue->length;
+    queue->segments[0].key = queue->shuffle_key;
+}
 
-    for (int i = count - 1; i > 0; --i) {
-        int j = rand() % (i + 1);
-        Node *temp_node = nodes[i];
-        nodes[i] = nodes[j];
-        nodes[j] = temp_node;
+static void queue_segments_free(PlayQueue *queue) {
+    for (guint32 i = 0; i < queue->segment_count; i++) {
+        g_free(queue->segments[i].head);
+        g_free(queue->segments[i].ranks);
     }
+    g_clear_pointer(&queue->segments, g_free);
+    queue->segment_count = 0;
+}
 
-    for (int i = 0; i < count; ++i) {
-        nodes[i]->next = nodes[(i + 1) % count];
-        nodes[i]->prev = nodes[(i - 1 + count) % count];
+/* Appends the positions played so far this cycle in the segment holding position, up to
+ * and including position, to its head, so the segment can change length without moving
+ * them. Returns FALSE, leaving the head alone, when that would take it past
+ * SHUFFLE_HEAD_MAX. */
+static gboolean queue_freeze_played(PlayQueue *queue, guint32 position) {
+    if (position >= queue->length) return TRUE;
+
+    ShuffleSegment *segment = queue_segment(queue, position);
+    guint32 played = position - segment->start + 1;
+    if (played <= segment->head_length) return TRUE;
+    if (played > SHUFFLE_HEAD_MAX) return FALSE;
+
+    guint32 *head = g_new(guint32, played);
+    for (guint32 i = 0; i < played; i++) {
+        head[i] = shuffle_segment_order(segment, i);
     }
+    g_free(segment->head);
+    segment->head = head;
+    segment->head_length = played;
+    return TRUE;
+}
 
-    list->head = nodes[0];
-    g_mutex_unlock(&list_mutex);
-
-    current_song = list->head;
-    play_song(current_song->song_name);
-    gtk_label_set_text(GTK_LABEL(status_label), "Shuffle enabled. Playing first song.");
+int is_empty(PlayQueue *queue) {
+    return queue->length == 0;
 }
 
-void toggle_shuffle(GtkWidget *widget, gpointer data) {
-    is_shuffle_enabled = !is_shuffle_enabled;
+void add_song(PlayQueue *queue, const char *song_name) {
+    g_mutex_lock(&queue_mutex);
 
-    GtkWidget *shuffle_icon;
-    if (is_shuffle_enabled) {
-        shuffle_playlist(&song_list);
-        shuffle_icon = gtk_image_new_from_icon_name("media-playlist-shuffle-symbolic", GTK_ICON_SIZE_BUTTON);
-        gtk_label_set_text(GTK_LABEL(status_label), "Shuffling playlist.");
-    } else {
-        shuffle_icon = gtk_image_new_from_icon_name("media-playlist-shuffle", GTK_ICON_SIZE_BUTTON);
-        gtk_label_set_text(GTK_LABEL(status_label), "Shuffle disabled.");
+    TrackId id = track_intern(song_name);
+    if (queue->length == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 256;
+        queue->tracks = g_renew(TrackId, queue->tracks, queue->capacity);
     }
-}
-
-void on_volume_changed(GtkRange *range, gpointer data) {
-    if (pipeline) {
-        gdouble value = gtk_range_get_value(range);
-        gdouble volume = value / 100.0;
-        g_object_set(pipeline, "volume", volume, NULL);
 
+    /* A shuffled add joins the last segment, so it is shuffled into the part of the
+     * order not played yet. When the played part is too long to pin, the segment is
+     * closed as it stands and new songs start one that plays after it. */
+    if (queue->shuffled) {
+        queue_segments_init(queue);
+        ShuffleSegment *open = &queue->segments[queue->segment_count - 1];
+        if (queue->position >= open->start && !queue_freeze_played(queue, queue->position)) {
+            queue->segments = g_renew(ShuffleSegment, queue->segments, queue->segment_count + 1);
+            open = &queue->segments[queue->segment_count++];
+            memset(open, 0, sizeof(ShuffleSegment));
+            open->start = queue->length;
+            open->key = shuffle_round(queue->shuffle_key, queue->segment_count, queue->length) |
+                        (guint64)shuffle_round(queue->shuffle_key, queue->segment_count + 4, queue->length) << 32;
+        }
+        open->length++;
+        shuffle_segment_rank(open);
     }
+    queue->tracks[queue->length] = id;
+    queue->length++;
+
+    g_mutex_unlock(&queue_mutex);
+    session_mark_dirty();
 }
 
-static void update_seek_bar_position_thread() {
-    while (pipeline_is_playing) {
-        if (pipeline) {
-            GstFormat format = GST_FORMAT_TIME;
-            gint64 current_position = 0;
-            gint64 duration = 0;
+/* Index into tracks of the song at a play position. */
+guint32 queue_order(PlayQueue *queue, guint32 position) {
+    if (!queue->shuffled) return position;
+    if (!queue->segments) return shuffle_permute(queue->shuffle_key, queue->length, position);
 
-            if (gst_element_query_position(pipeline, format, &current_position) &&
-                gst_element_query_duration(pipeline, format, &duration)) {
+    const ShuffleSegment *segment = queue_segment(queue, position);
+    return segment->start + shuffle_segment_order(segment, position - segment->start);
+}
 
-                gdouble current_position_sec = (gdouble)current_position / GST_SECOND;
-                gdouble duration_sec = (gdouble)duration / GST_SECOND;
+/* Play position of the song at an index into tracks. */
+guint32 queue_position_of(PlayQueue *queue, guint32 index) {
+    if (!queue->shuffled) return index;
+    if (!queue->segments) return shuffle_unpermute(queue->shuffle_key, queue->length, index);
 
-                gtk_range_set_value(GTK_RANGE(seek_scale), current_position_sec);
-                gtk_range_set_range(GTK_RANGE(seek_scale), 0.0, duration_sec);
+    const ShuffleSegment *segment = queue_segment(queue, index);
+    return segment->start + shuffle_segment_position(segment, index - segment->start);
+}
 
-                int current_minutes = (int)(current_position_sec / 60);
-                int current_seconds = (int)(current_position_sec) % 60;
-                gchar *current_time_text = g_strdup_printf("%02d:%02d", current_minutes, current_seconds);
-                gtk_label_set_text(GTK_LABEL(current_time_label), current_time_text);
-                g_free(current_time_text);
+TrackId queue_current(PlayQueue *queue) {
+    if (queue->position >= queue->length) return TRACK_ID_NONE;
+    return queue->tracks[queue_order(queue, queue->position)];
+}
 
-                int total_minutes = (int)(duration_sec / 60);
-                int total_seconds = (int)(duration_sec) % 60;
-                gchar *total_time_text = g_strdup_printf("%02d:%02d", total_minutes, total_seconds);
-                gtk_label_set_text(GTK_LABEL(total_time_label), total_time_text);
-                g_free(total_time_text);
-            }
+/* The position played after the current one. A new order (toggling shuffle, a new key)
+ * can put tracks heard a moment ago right ahead, so in shuffle mode tracks among the
+ * last plays are skipped. The window is at most half the queue,
+ * which guarantees a track outside it within window + 1 steps. */
+guint32 queue_next_position(PlayQueue *queue) {
+    if (is_empty(queue)) return QUEUE_NO_POSITION;
+    if (queue->position >= queue->length) return 0;
+
+    guint32 window = 0;
+    if (queue->shuffled && shuffle_recent) {
+        window = MIN(MIN(shuffle_recent_count, shuffle_recent_size), queue->length / 2);
+    }
+    guint32 position = queue->position;
+    for (guint32 skipped = 0;; skipped++) {
+        position = position + 1 == queue->length ? 0 : position + 1;
+        if (skipped == window || !shuffle_recently_played(queue->tracks[queue_order(queue, position)], window)) {
+            return position;
         }
-        g_usleep(1000000); 
     }
 }
 
-static void start_seek_bar_update_thread() {
-    g_thread_new("seek-bar-update", (GThreadFunc)update_seek_bar_position_thread, NULL);
-}
+/* Moves one position forward or backward in play order, wrapping around at both ends. */
+TrackId queue_step(PlayQueue *queue, int direction) {
+    if (is_empty(queue)) return TRACK_ID_NONE;
 
-void on_seek_changed(GtkRange *range, gpointer data) {
-    if (pipeline) {
-        gdouble seek_position_sec = gtk_range_get_value(GTK_RANGE(seek_scale)); 
-        gint64 seek_position_ns = seek_position_sec * 1000000000.0; 
-        gst_element_seek(pipeline, 1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
-                         GST_SEEK_TYPE_SET, seek_position_ns, GST_SEEK_TYPE_NONE, 0);
+    if (queue->position >= queue->length) {
+        queue->position = direction > 0 ? 0 : queue->length - 1;
+    } else if (direction > 0) {
+        queue->position = queue_next_position(queue);
+    } else {
+        queue->position = queue->position == 0 ? queue->length - 1 : queue->position - 1;
     }
-}   
+    return queue_current(queue);
+}
 
-void reset_seek_scale() {
-    gtk_range_set_value(GTK_RANGE(seek_scale), 0.0);  
+void queue_jump(PlayQueue *queue, guint32 position) {
+    queue->position = position < queue->length ? position : QUEUE_NO_POSITION;
 }
 
-void create_playlist(const char *playlist_name) {
-    if (playlist_name == NULL || playlist_name[0] == '\0') {
-        gtk_label_set_text(GTK_LABEL(status_label), "Error: Invalid playlist name.");
-        return;
+guint32 queue_find(PlayQueue *queue, TrackId id) {
+    for (guint32 index = 0; index < queue->length; index++) {
+        if (queue->tracks[index] == id) return queue_position_of(queue, index);
     }
+    return QUEUE_NO_POSITION;
+}
 
-    char playlist_file[512];
-    snprintf(playlist_file, sizeof(playlist_file), "%s/%s.txt", PLAYLISTS_DIR, playlist_name);
+void queue_mark_present(PlayQueue *queue, guint8 *present, guint32 present_size) {
+    for (guint32 i = 0; i < queue->length; i++) {
+        if (queue->tracks[i] < present_size) present[queue->tracks[i]] = 1;
+    }
+}
 
-    FILE *file = fopen(playlist_file, "w");
-    if (file) {
-        fclose(file);
+/* Switches between insertion order and the order given by key in O(1), keeping the
+ * current track current. Switching back restores insertion order exactly. */
+void queue_set_shuffle(PlayQueue *queue, gboolean shuffled, guint64 key) {
+    g_mutex_lock(&queue_mutex);
+    guint32 current = queue->position < queue->length ? queue_order(queue, queue->position) : QUEUE_NO_POSITION;
+    queue_segments_free(queue);
+    queue->shuffled = shuffled;
+    queue->shuffle_key = key;
+    if (current != QUEUE_NO_POSITION) {
+        queue->position = queue_position_of(queue, current);
+    }
+    g_mutex_unlock(&queue_mutex);
+    session_mark_dirty();
+}
 
-        if (playlist_combo_box != NULL) {
-            gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(playlist_combo_box), playlist_name);
-        } else {
-            gtk_label_set_text(GTK_LABEL(status_label), "Error: Playlist combo box not initialized.");
+/* Drops every track whose removed[] flag is set in one compaction pass. A removed
+ * current track falls back to the closest earlier kept one in play order, so "next"
+ * continues from there. When shuffled, the segment holding that track keeps the order
+ * played so far, unless it is longer than SHUFFLE_HEAD_MAX. Other segments keep their
+ * songs, played or not, but may change order among them. */
+void remove_songs(PlayQueue *queue, const guint8 *removed, guint32 removed_size) {
+    g_mutex_lock(&queue_mutex);
+
+    guint32 current = QUEUE_NO_POSITION;
+    guint32 current_position = QUEUE_NO_POSITION;
+    gboolean fallback_to_last = FALSE;
+    if (queue->position < queue->length) {
+        for (guint32 position = queue->position + 1; position-- > 0;) {
+            guint32 index = queue_order(queue, position);
+            TrackId id = queue->tracks[index];
+            if (id >= removed_size || !removed[id]) {
+                current = index;
+                current_position = position;
+                break;
+            }
         }
-
-        char message[256];
-        snprintf(message, sizeof(message), "Playlist '%s' created successfully.", playlist_name);
-        gtk_label_set_text(GTK_LABEL(status_label), message);
-    } else {
-        char message[256];
-        snprintf(message, sizeof(message), "Error creating playlist file for: %s", playlist_name);
-        gtk_label_set_text(GTK_LABEL(status_label), message);
+        fallback_to_last = current == QUEUE_NO_POSITION;
     }
-}
 
-void add_song_to_playlist(const char *song_name, const char *playlist_name) {
-    char playlist_file[512];
-    snprintf(playlist_file, sizeof(playlist_file), "%s/%s.txt", PLAYLISTS_DIR, playlist_name);
-    
-    FILE *file = fopen(playlist_file, "a");
-    if (file) {
-        fprintf(file, "%s\n", song_name); 
-        fclose(file);
-        gtk_label_set_text(GTK_LABEL(status_label), "Song added to playlist.");
-    } else {
-        gtk_label_set_text(GTK_LABEL(status_label), "Error adding song to playlist.");
+    guint32 *moved = NULL;
+    if (queue->shuffled && current != QUEUE_NO_POSITION) {
+        queue_segments_init(queue);
+        queue_freeze_played(queue, current_position);
+    }
+    if (queue->segments) {
+        moved = g_new(guint32, MAX(queue->length, 1));
     }
-}
 
-void load_playlists() {
-    DIR *dir = opendir(PLAYLISTS_DIR);
-    if (dir == NULL) {
-        gtk_label_set_text(GTK_LABEL(status_label), "Failed to open playlists directory.");
-        return;
+    guint32 kept = 0;
+    for (guint32 i = 0; i < queue->length; i++) {
+        TrackId id = queue->tracks[i];
+        if (moved) moved[i] = QUEUE_NO_POSITION;
+        if (id >= removed_size || !removed[id]) {
+            if (i == current) current = kept;
+            if (moved) moved[i] = kept;
+            queue->tracks[kept++] = id;
+        }
     }
 
-    struct dirent *entry;
-    gboolean first_playlist_set = FALSE;
+    if (moved && kept < queue->length) {
+        guint32 segments = 0;
+        for (guint32 s = 0; s < queue->segment_count; s++) {
+            ShuffleSegment segment = queue->segments[s];
+            guint32 start = queue->length;
+            guint32 length = 0;
+            for (guint32 i = segment.start; i < segment.start + segment.length; i++) {
+                if (moved[i] == QUEUE_NO_POSITION) continue;
+                if (length++ == 0) start = moved[i];
+            }
+            if (length == 0 && s + 1 < queue->segment_count) {
+                g_free(segment.head);
+                g_free(segment.ranks);
+                continue;
+            }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".txt") != NULL) {
-            char playlist_name[256];
-            strncpy(playlist_name, entry->d_name, sizeof(playlist_name));
-            playlist_name[strlen(playlist_name) - 4] = '\0';
-            gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(playlist_combo_box), playlist_name);
-            if (!first_playlist_set) {
-                gtk_combo_box_set_active(GTK_COMBO_BOX(playlist_combo_box), 0);
-                first_playlist_set = TRUE;
+            guint32 head_length = 0;
+            for (guint32 i = 0; i < segment.head_length; i++) {
+                guint32 index = moved[segment.start + segment.head[i]];
+                if (index != QUEUE_NO_POSITION) segment.head[head_length++] = index - start;
             }
+            segment.start = length > 0 ? start : kept;
+            segment.length = length;
+            segment.head_length = head_length;
+            shuffle_segment_rank(&segment);
+            queue->segments[segments++] = segment;
         }
+        queue->segment_count = segments;
     }
-    closedir(dir);
-}
-
-void on_add_to_playlist_button_clicked(GtkWidget *widget, gpointer data) {
-    const char *song_name = current_song->song_name;  
-    const char *playlist_name = gtk_combo_box_text_get_active_text(playlist_combo_box);  
+    g_free(moved);
 
-    if (song_name && playlist_name) {
-        add_song_to_playlist(song_name, playlist_name);
-    } else {
-        gtk_label_set_text(GTK_LABEL(status_label), "No song or playlist selected.");
+    if (kept < queue->length) {
+        queue->length = kept;
+        if (current != QUEUE_NO_POSITION) {
+            queue->position = queue_position_of(queue, current);
+        } else {
+            queue->position = fallback_to_last && kept > 0 ? kept - 1 : QUEUE_NO_POSITION;
+        }
     }
+
+    g_mutex_unlock(&queue_mutex);
+    session_mark_dirty();
 }
 
-void on_create_playlist_button_clicked(GtkWidget *widget, gpointer data) {
-    GtkWidget *dialog = gtk_dialog_new_with_buttons("Create Playlist", GTK_WINDOW(main_window),
-                                                   GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
-                                                   "Create", GTK_RESPONSE_ACCEPT,
-                                                   "Cancel", GTK_RESPONSE_REJECT,
-                                                   NULL);
-    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+/* Adds a file that appeared in a library root to the queue unless it is there already. */
+void register_song_file(const char *path) {
+    gchar *name = library_name_for_path(path);
 
-    GtkWidget *entry = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter Playlist Name");
-    gtk_box_pack_start(GTK_BOX(content_area), entry, TRUE, TRUE, 0);
-    
-    gtk_widget_show_all(dialog);
-    
-    gint result = gtk_dialog_run(GTK_DIALOG(dialog));
-    
-    if (result == GTK_RESPONSE_ACCEPT) {
-        const char *playlist_name = gtk_entry_get_text(GTK_ENTRY(entry));
-        create_playlist(playlist_name);
+    if (name && is_song_file_at(AT_FDCWD, path)) {
+        TrackId id = track_lookup(name);
+        if (id == TRACK_ID_NONE || queue_find(&play_queue, id) == QUEUE_NO_POSITION) {
+            add_song(&play_queue, name);
+        }
+        library_track_added(track_lookup(name));
     }
-    
-    gtk_widget_destroy(dialog); 
+
+    g_free(name);
 }
 
-void on_play_playlist_button_clicked(GtkWidget *widget, gpointer data) {
-    const char *playlist_name = gtk_combo_box_text_get_active_text(playlist_combo_box); 
-    if (playlist_name == NULL) {
-        gtk_label_set_text(GTK_LABEL(status_label), "No playlist selected.");
-        return;
-    }
+/* Puts the downloader in its own process group so cancelling also stops its ffmpeg children. */
+static void download_child_setup(gpointer data) {
+    setpgid(0, 0);
+}
 
-    char playlist_file[512];
-    snprintf(playlist_file, sizeof(playlist_file), "%s/%s.txt", PLAYLISTS_DIR, playlist_name);
+static void update_download_status() {
+    guint running = g_list_length(active_downloads);
+    if (running == 0) return;
 
-    FILE *file = fopen(playlist_file, "r");
-    if (!file) {
-        gtk_label_set_text(GTK_LABEL(status_label), "Error opening playlist file.");
-        return;
-    }
+    DownloadJob *job = active_downloads->data;
+    gchar *text = g_strdup_printf("Downloading %d%% (%u running, %u queued)", MAX(job->progress, 0), running,
+                                  download_queue.length + g_list_length(waiting_downloads));
+    set_status_text(text);
+    g_free(text);
+}
 
-    free_song_list();
+static void download_job_free(DownloadJob *job) {
+    g_free(job->url);
+    g_free(job->output_path);
+    g_free(job);
+}
 
-    char song_path[512];
-    while (fgets(song_path, sizeof(song_path), file)) {
-        song_path[strcspn(song_path, "\n")] = '\0'; 
-        if (strlen(song_path) > 0) {
-            add_song(&song_list, song_path);
-        }
+/* Runs once both the child has exited and its output is drained. */
+static void download_job_finish(DownloadJob *job) {
+    active_downloads = g_list_remove(active_downloads, job);
+    job->pid = 0;
+    if (!job->cancelled) {
+        trace_span(TRACE_DOWNLOAD, job->started_at, g_get_monotonic_time(), job->exit_status == 0);
+    }
+    if (!job->cancelled && job->exit_status == 0 && job->postprocess_at) {
+        trace_span(TRACE_DOWNLOAD_POSTPROCESS, job->postprocess_at, g_get_monotonic_time(), 0);
+        g_debug("Post-processing of %s took %.1f ms", job->url, (g_get_monotonic_time() - job->postprocess_at) / 1000.0);
     }
-    fclose(file);
 
-    if (!is_empty(&song_list)) {
-        current_song = song_list.head;
-        play_song(current_song->song_name);
+    if (job->cancelled) {
+        download_job_free(job);
+    } else if (job->exit_status == 0) {
+        /* --print silences the archive notice, so a success that printed no file is
+         * the downloader skipping a video the archive already has. */
+        if (job->output_path) {
+            dedupe_note_download(job->output_path);
+            register_song_file(job->output_path);
+            set_status_text("Download Complete");
+        } else {
+            gchar *text = g_strdup_printf("Already downloaded: %s", job->url);
+            set_status_text(text);
+            g_free(text);
+        }
+        download_job_free(job);
+    } else if (job->attempt < (guint)get_setting_int("download_retries", 3)) {
+        guint delay = DOWNLOAD_RETRY_BASE_MS << (job->attempt - 1);
+        g_debug("Download of %s failed (status %d), retrying in %u ms", job->url, job->exit_status, delay);
+        job->retry_source = g_timeout_add(delay, download_job_retry, job);
+        waiting_downloads = g_list_append(waiting_downloads, job);
     } else {
-        gtk_label_set_text(GTK_LABEL(status_label), "Playlist is empty.");
+        trace_error("Download of %s failed after %u attempts (status %d)", job->url, job->attempt, job->exit_status);
+        gchar *text = g_strdup_printf("Download failed: %s", job->url);
+        set_status_text(text);
+        g_free(text);
+        download_job_free(job);
     }
+
+    download_manager_pump();
 }
 
-static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data) {
-    switch (GST_MESSAGE_TYPE(msg)) {
-        case GST_MESSAGE_EOS:
-            if (is_loop_enabled && current_song) {
-                play_song(current_song->song_name);
-            } else {
-                play_next_song();
+/* Reads the downloader's line-oriented output: "[download]  42.0% ..." progress lines,
+ * the start of audio extraction, and the final file path printed by --print
+ * after_move:filepath. --print
+ * silences yt-dlp's other messages, so extraction is marked by the postprocess progress
+ * template rather than its "[ExtractAudio]" line. */
+static gboolean download_job_readable(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    DownloadJob *job = data;
+    gchar *line = NULL;
+    gsize terminator = 0;
+    GIOStatus status;
+
+    while ((status = g_io_channel_read_line(channel, &line, NULL, &terminator, NULL)) == G_IO_STATUS_NORMAL) {
+        line[terminator] = '\0';
+        char *percent = strchr(line, '%');
+        if (strcmp(line, "[postprocess] ExtractAudio started") == 0) {
+            if (!job->postprocess_at) job->postprocess_at = g_get_monotonic_time();
+        } else if (g_str_has_prefix(line, "[download]") && percent) {
+            char *number = percent;
+            while (number > line && (g_ascii_isdigit(number[-1]) || number[-1] == '.')) number--;
+            gint progress = (gint)g_ascii_strtod(number, NULL);
+            if (progress != job->progress) {
+                job->progress = progress;
+                update_download_status();
             }
-            break;
-        case GST_MESSAGE_ERROR: {
-            GError *err;
-            gchar *debug;
-            gst_message_parse_error(msg, &err, &debug);
-            g_free(debug);
-            g_error_free(err);
-            gtk_label_set_text(GTK_LABEL(status_label), "Error occurred while playing song.");
-            break;
+        } else if (g_path_is_absolute(line)) {
+            g_free(job->output_path);
+            job->output_path = g_strdup(line);
         }
-        default:
-            break;
+        g_free(line);
     }
-    return TRUE;
-}
 
-void free_song_list() {
-    if (!is_empty(&song_list)) {
-        Node *temp = song_list.head;
-        do {
-            Node *next = temp->next;
-            free(temp->song_name); 
-            free(temp);           
-            temp = next;
-        } while (temp != song_list.head);
-        init_list(&song_list);     
-    }
+    if (status == G_IO_STATUS_AGAIN) return G_SOURCE_CONTINUE;
+
+    job->stdout_watch = 0;
+    job->stdout_closed = TRUE;
+    if (job->exited) download_job_finish(job);
+    return G_SOURCE_REMOVE;
 }
 
-void free_music_directory() {   
-    if (music_dir) {
-        g_free(music_dir); 
-        music_dir = NULL;
-    }
+static void download_job_exited(GPid pid, gint status, gpointer data) {
+    DownloadJob *job = data;
+    g_spawn_close_pid(pid);
+    job->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    job->exited = TRUE;
+    if (job->stdout_closed) download_job_finish(job);
 }
 
-void cleanup_resources() {   
-    free_song_list();         
-    free_music_directory();   
-    g_mutex_clear(&list_mutex); 
+static gboolean download_job_retry(gpointer data) {
+    DownloadJob *job = data;
+    job->retry_source = 0;
+    waiting_downloads = g_list_remove(waiting_downloads, job);
+    g_queue_push_head(&download_queue, job);
+    download_manager_pump();
+    return G_SOURCE_REMOVE;
 }
 
-void save_music_directory(const char *dir) {
-    FILE *file = fopen(CONFIG_FILE, "w");
-    if (file) {
-        fprintf(file, "%s\n", dir);
-        fclose(file);
+/* The download archive makes the downloader skip videos it has fetched before, by
+ * extractor and video id, so a repeated URL costs no download or transcode. An empty
+ * download_archive setting ends argv early and turns it off.
+ *
+ * download_profile=native extracts the best audio stream as it is: Opus is remuxed into
+ * .opus and AAC into .m4a, with no decoding or encoding. download_profile=mp3 transcodes
+ * every download to MP3 as before. */
+static void download_job_start(DownloadJob *job) {
+    gchar *output_template = g_build_filename(music_dir, "%(title)s.%(ext)s", NULL);
+    const char *archive = get_setting("download_archive", DOWNLOAD_ARCHIVE_FILE);
+    const char *audio_format = g_strcmp0(get_setting("download_profile", "native"), "mp3") == 0 ? "mp3" : "best";
+    const gchar *argv[] = {
+        get_setting("downloader", "yt-dlp"), "--newline", "--progress", "--print", "after_move:filepath",
+        "--progress-template", "postprocess:[postprocess] %(progress.postprocessor)s %(progress.status)s",
+        "-x", "--audio-format", audio_format, "-f", "bestaudio", "--embed-thumbnail", "--no-warnings",
+        "--no-check-certificate", "--hls-prefer-native", "-o", output_template, job->url,
+        archive[0] ? "--download-archive" : NULL, archive, NULL
+    };
+    gint stdout_fd = -1;
+    GError *error = NULL;
+
+    job->attempt++;
+    job->started_at = g_get_monotonic_time();
+    job->progress = -1;
+    job->stdout_closed = FALSE;
+    job->exited = FALSE;
+    job->postprocess_at = 0;
+    g_free(job->output_path);
+    job->output_path = NULL;
+
+    if (!g_spawn_async_with_pipes(NULL, (gchar **)argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD |
+                                  G_SPAWN_STDERR_TO_DEV_NULL, download_child_setup, NULL, &job->pid,
+                                  NULL, &stdout_fd, NULL, &error)) {
+        gchar *text = g_strdup_printf("Cannot start %s: %s", argv[0], error->message);
+        set_status_text(text);
+        g_free(text);
+        g_error_free(error);
+        g_free(output_template);
+        download_job_free(job);
+        return;
     }
+
+    GIOChannel *channel = g_io_channel_unix_new(stdout_fd);
+    g_io_channel_set_close_on_unref(channel, TRUE);
+    g_io_channel_set_encoding(channel, NULL, NULL);
+    g_io_channel_set_flags(channel, G_IO_FLAG_NONBLOCK, NULL);
+    job->stdout_watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, download_job_readable, job);
+    g_io_channel_unref(channel);
+    g_child_watch_add(job->pid, download_job_exited, job);
+
+    active_downloads = g_list_append(active_downloads, job);
+    g_free(output_template);
 }
 
-char *load_music_directory() {
-    FILE *file = fopen(CONFIG_FILE, "r");
-    if (!file) return NULL;
+/* Starts queued downloads until the configured number of workers is busy. */
+void download_manager_pump() {
+    guint workers = MAX(get_setting_int("download_workers", 2), 1);
 
-    char *dir = (char *)malloc(256);
-    if (fgets(dir, 256, file)) {
-        dir[strcspn(dir, "\n")] = '\0';
+    while (g_list_length(active_downloads) < workers && !g_queue_is_empty(&download_queue)) {
+        download_job_start(g_queue_pop_head(&download_queue));
     }
-    fclose(file);
-    return dir;
+    update_download_status();
 }
-    
-void load_songs_from_directory() {
-    if (!music_dir) {
-        gtk_label_set_text(GTK_LABEL(status_label), "No music directory selected.");
-        return;
-    }
 
-    struct dirent *entry;
-    DIR *dir = opendir(music_dir);
-    if (dir == NULL) {
-        gtk_label_set_text(GTK_LABEL(status_label), "Failed to open directory.");
-        return;
+void download_manager_cancel_all() {
+    DownloadJob *job;
+    while ((job = g_queue_pop_head(&download_queue)) != NULL) {
+        download_job_free(job);
     }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".mp3") != NULL) {
-            add_song(&song_list, entry->d_name);
-        }
+    for (GList *l = waiting_downloads; l != NULL; l = l->next) {
+        job = l->data;
+        g_source_remove(job->retry_source);
+        download_job_free(job);
     }
+    g_list_free(waiting_downloads);
+    waiting_downloads = NULL;
 
-    closedir(dir);
+    for (GList *l = active_downloads; l != NULL; l = l->next) {
+        job = l->data;
+        job->cancelled = TRUE;
+        if (job->pid > 0) kill(-job->pid, SIGTERM);
+    }
 }
 
-void ask_for_music_directory() {
-    GtkWidget *dialog = gtk_file_chooser_dialog_new("Select Music Directory", GTK_WINDOW(main_window),
-                                                    GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
-                                                    "Cancel", GTK_RESPONSE_CANCEL,
-                                                    "Select", GTK_RESPONSE_ACCEPT, NULL);
-
-    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+void download_song_button(GtkWidget *widget, gpointer data) {
+    const char *url = gtk_entry_get_text(GTK_ENTRY(url_entry));
+    if (strlen(url) == 0) {
+        set_status_text("No URL provided.");
+        return;
+    }
+    if (!music_dir) {
+        set_status_text("No music directory selected.");
+        return;
+    }
+
+    DownloadJob *job = g_new0(DownloadJob, 1);
+    job->url = g_strdup(url);
+    g_queue_push_tail(&download_queue, job);
+    gtk_entry_set_text(GTK_ENTRY(url_entry), "");
+    set_status_text("Downloading...");
+    download_manager_pump();
+}
+
+void cancel_downloads_button(GtkWidget *widget, gpointer data) {
+    download_manager_cancel_all();
+    set_status_text("Downloads cancelled.");
+}
+
+/* The calling thread's ring, created and registered on first use. */
+static TraceRing *trace_ring() {
+    if (!trace_local_ring) {
+        trace_local_ring = g_new0(TraceRing, 1);
+        g_mutex_lock(&trace_rings_mutex);
+        if (!trace_rings) trace_rings = g_ptr_array_new();
+        trace_local_ring->id = trace_next_ring_id++;
+        g_ptr_array_add(trace_rings, trace_local_ring);
+        g_mutex_unlock(&trace_rings_mutex);
+    }
+    return trace_local_ring;
+}
+
+/* Lock-free on every thread: one slot of the thread's own ring plus atomic histogram
+ * updates in power-of-two microsecond buckets. */
+void trace_span(TraceKind kind, gint64 start_us, gint64 end_us, guint32 arg) {
+    TraceRing *ring = trace_ring();
+    guint64 seq = ring->head + 1;
+    TraceEvent *event = &ring->events[ring->head % TRACE_RING_SIZE];
+    guint64 duration = (guint64)MAX(end_us - start_us, 0);
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->start_us = start_us;
+    event->duration_us = duration;
+    event->kind = kind;
+    event->arg = arg;
+    __atomic_store_n(&event->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+
+    TraceHistogram *histogram = &trace_histograms[kind];
+    guint bucket = duration ? MIN(g_bit_storage(duration), TRACE_HISTOGRAM_BUCKETS - 1) : 0;
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum_us, duration, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    guint64 max = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    while (duration > max && !__atomic_compare_exchange_n(&histogram->max_us, &max, duration, FALSE,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* Errors are rare, so they keep their text in a small mutex-protected ring. */
+void trace_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    gchar *message = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    g_debug("Error: %s", message);
+    g_mutex_lock(&trace_errors_mutex);
+    TraceError *slot = &trace_errors[trace_error_count % TRACE_MAX_ERRORS];
+    g_free(slot->message);
+    slot->message = message;
+    slot->at_us = g_get_monotonic_time();
+    trace_error_count++;
+    g_mutex_unlock(&trace_errors_mutex);
+}
+
+/* Marks the moment a new track was asked for; the stages of the switch are measured
+ * from here. */
+void trace_switch_begin() {
+    gint64 now = g_get_monotonic_time();
+    trace_switch_started_us = now;
+    trace_switch_playing_from = now;
+    __atomic_store_n(&trace_switch_buffer_from, now, __ATOMIC_RELEASE);
+}
+
+/* Upper bound of the bucket holding the given fraction of samples. */
+static guint64 trace_histogram_percentile(const TraceHistogram *histogram, gdouble fraction) {
+    guint64 count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    guint64 target = (guint64)(count * fraction);
+    guint64 seen = 0;
+
+    for (guint b = 0; b < TRACE_HISTOGRAM_BUCKETS; b++) {
+        seen += __atomic_load_n(&histogram->buckets[b], __ATOMIC_RELAXED);
+        if (seen > target) return b ? (G_GUINT64_CONSTANT(1) << b) - 1 : 0;
+    }
+    return __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+}
+
+gchar *trace_stats_text() {
+    GString *text = g_string_new("muzio stats (times in ms)\n");
+    gint64 now = g_get_monotonic_time();
+
+    for (guint kind = 0; kind < TRACE_KIND_COUNT; kind++) {
+        const TraceHistogram *histogram = &trace_histograms[kind];
+        guint64 count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        if (count == 0) continue;
+
+        g_string_append_printf(text, "  %-20s n=%-6" G_GUINT64_FORMAT " mean=%.1f p50<=%.1f p90<=%.1f p99<=%.1f max=%.1f\n    ",
+                               trace_kind_names[kind], count,
+                               __atomic_load_n(&histogram->sum_us, __ATOMIC_RELAXED) / 1000.0 / count,
+                               trace_histogram_percentile(histogram, 0.5) / 1000.0,
+                               trace_histogram_percentile(histogram, 0.9) / 1000.0,
+                               trace_histogram_percentile(histogram, 0.99) / 1000.0,
+                               __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED) / 1000.0);
+        for (guint b = 0; b < TRACE_HISTOGRAM_BUCKETS; b++) {
+            guint64 hits = __atomic_load_n(&histogram->buckets[b], __ATOMIC_RELAXED);
+            if (hits) g_string_append_printf(text, " <%.3g:%" G_GUINT64_FORMAT, (G_GUINT64_CONSTANT(1) << b) / 1000.0, hits);
+        }
+        g_string_append_c(text, '\n');
+    }
+
+    gint hits = g_atomic_int_get(&prefetch_hits), misses = g_atomic_int_get(&prefetch_misses);
+    if (hits + misses > 0) {
+        g_string_append_printf(text, "  prefetch: %d hits, %d misses (%.0f%% of track starts cached)\n",
+                               hits, misses, 100.0 * hits / (hits + misses));
+    }
+
+    if (seek_issued + seek_coalesced > 0) {
+        g_string_append_printf(text, "  seeks: %u issued, %u coalesced away while another was in flight\n",
+                               seek_issued, seek_coalesced);
+    }
+
+    if (pipeline) {
+        g_string_append_printf(text, "  audio output: %s, %d underruns, %d discontinuities, %d realtime threads\n",
+                               output_volume ? "custom" : "auto", g_atomic_int_get(&output_stats.underruns),
+                               g_atomic_int_get(&output_stats.discontinuities),
+                               g_atomic_int_get(&output_realtime_threads));
+    }
+
+    if (ui_channel_drains > 0) {
+        g_string_append_printf(text, "  ui channel: %" G_GUINT64_FORMAT " events, %" G_GUINT64_FORMAT
+                               " applied in %u drains, longest drain %" G_GINT64_FORMAT " us\n",
+                               ui_channel_received, ui_channel_applied, ui_channel_drains, ui_channel_max_drain_us);
+    }
+
+    gchar *duplicates = dedupe_report_text(20);
+    g_string_append(text, duplicates);
+    g_free(duplicates);
+
+    g_mutex_lock(&trace_errors_mutex);
+    guint shown = MIN(trace_error_count, TRACE_MAX_ERRORS);
+    g_string_append_printf(text, "recent errors (%u total)\n", trace_error_count);
+    for (guint i = 0; i < shown; i++) {
+        const TraceError *error = &trace_errors[(trace_error_count - shown + i) % TRACE_MAX_ERRORS];
+        g_string_append_printf(text, "  %.1f s ago: %s\n", (now - error->at_us) / (gdouble)G_USEC_PER_SEC, error->message);
+    }
+    g_mutex_unlock(&trace_errors_mutex);
+
+    return g_string_free(text, FALSE);
+}
+
+/* Writes every span still in the rings in Chrome's trace event format, viewable in
+ * chrome://tracing or Perfetto. */
+gboolean trace_write_chrome(const char *path) {
+    GString *json = g_string_new("{\"traceEvents\":[\n");
+    gboolean first = TRUE;
+
+    g_mutex_lock(&trace_rings_mutex);
+    for (guint r = 0; trace_rings && r < trace_rings->len; r++) {
+        TraceRing *ring = g_ptr_array_index(trace_rings, r);
+        guint64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        guint64 oldest = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE + 1 : 1;
+
+        for (guint64 seq = oldest; seq <= head; seq++) {
+            TraceEvent *slot = &ring->events[(seq - 1) % TRACE_RING_SIZE];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) continue;
+            TraceEvent event = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || event.kind >= TRACE_KIND_COUNT) continue;
+
+            g_string_append_printf(json, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                                   "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ",\"args\":{\"arg\":%u}}",
+                                   first ? "" : ",\n", trace_kind_names[event.kind], ring->id,
+                                   event.start_us, event.duration_us, event.arg);
+            first = FALSE;
+        }
+    }
+    g_mutex_unlock(&trace_rings_mutex);
+    g_string_append(json, "\n]}\n");
+
+    GError *error = NULL;
+    gboolean written = g_file_set_contents(path, json->str, json->len, &error);
+    if (!written) {
+        g_warning("Cannot write trace %s: %s", path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(json, TRUE);
+    return written;
+}
+
+/* Prints the stats to stderr and, with the trace_file setting, writes the Chrome trace. */
+void trace_dump() {
+    gchar *text = trace_stats_text();
+    g_printerr("%s", text);
+    g_free(text);
+
+    const char *trace_file = get_setting("trace_file", NULL);
+    if (trace_file && trace_file[0] != '\0' && trace_write_chrome(trace_file)) {
+        g_printerr("Trace written to %s\n", trace_file);
+    }
+}
+
+static gboolean on_trace_signal(gpointer data) {
+    trace_dump();
+    return G_SOURCE_CONTINUE;
+}
+
+/* Producer side, safe from any thread: pushes onto a Treiber stack and makes sure one
+ * drain is scheduled. Consumers never pop single events, only take the whole stack, so
+ * there is no ABA problem. */
+void ui_post(UiEventKind kind, guint slot, gint64 value, const char *text) {
+    UiEvent *event = g_new(UiEvent, 1);
+    event->kind = kind;
+    event->slot = slot;
+    event->value = value;
+    event->text = g_strdup(text);
+
+    UiEvent *head = __atomic_load_n(&ui_channel_head, __ATOMIC_RELAXED);
+    do {
+        event->next = head;
+    } while (!__atomic_compare_exchange_n(&ui_channel_head, &head, event, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (g_atomic_int_compare_and_exchange(&ui_channel_scheduled, 0, 1)) {
+        g_timeout_add(UI_CHANNEL_INTERVAL_MS, ui_channel_drain, NULL);
+    }
+}
+
+static void ui_event_free(UiEvent *event) {
+    g_free(event->text);
+    g_free(event);
+}
+
+static void ui_event_apply(const UiEvent *event) {
+    switch (event->kind) {
+        case UI_EVENT_STATUS:
+            if (status_label) gtk_label_set_text(GTK_LABEL(status_label), event->text);
+            break;
+        case UI_EVENT_TAG_SCAN:
+            tag_scan_drain();
+            break;
+        case UI_EVENT_WAVEFORM:
+            if (waveform_current_path && !waveform_current_valid) waveform_show(waveform_current_path);
+            break;
+        case UI_EVENT_LOUDNESS_FLUSH:
+            if (loudness_cache_dirty) save_loudness_cache();
+            break;
+        case UI_EVENT_DEDUPE:
+            dedupe_drain();
+            break;
+        case UI_EVENT_BENCH:
+            bench_ui_event(event->slot, event->value);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Main-loop side: takes everything posted since the last drain, keeps only the newest
+ * event per (kind, slot) and applies those, so a burst of updates costs one redraw. */
+static gboolean ui_channel_drain(gpointer data) {
+    gint64 started = g_get_monotonic_time();
+    g_atomic_int_set(&ui_channel_scheduled, 0);
+    UiEvent *stack = __atomic_exchange_n(&ui_channel_head, NULL, __ATOMIC_ACQUIRE);
+
+    UiEvent *events = NULL;
+    while (stack) {
+        UiEvent *next = stack->next;
+        stack->next = events;
+        events = stack;
+        stack = next;
+    }
+
+    if (!ui_channel_slots) {
+        ui_channel_slots = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    GPtrArray *latest = g_ptr_array_new();
+    for (UiEvent *event = events, *next; event; event = next) {
+        next = event->next;
+        ui_channel_received++;
+
+        gpointer key = GUINT_TO_POINTER(((guint)event->kind << 24 | event->slot) + 1);
+        gpointer index = g_hash_table_lookup(ui_channel_slots, key);
+        if (index) {
+            ui_event_free(g_ptr_array_index(latest, GPOINTER_TO_UINT(index) - 1));
+            g_ptr_array_index(latest, GPOINTER_TO_UINT(index) - 1) = event;
+        } else {
+            g_ptr_array_add(latest, event);
+            g_hash_table_insert(ui_channel_slots, key, GUINT_TO_POINTER(latest->len));
+        }
+    }
+    g_hash_table_remove_all(ui_channel_slots);
+
+    for (guint i = 0; i < latest->len; i++) {
+        UiEvent *event = g_ptr_array_index(latest, i);
+        ui_event_apply(event);
+        ui_event_free(event);
+    }
+    ui_channel_applied += latest->len;
+    ui_channel_drains++;
+    g_ptr_array_unref(latest);
+
+    gint64 elapsed = g_get_monotonic_time() - started;
+    ui_channel_max_drain_us = MAX(ui_channel_max_drain_us, elapsed);
+    return G_SOURCE_REMOVE;
+}
+
+/* Drops whatever was posted after the producers stopped. */
+void ui_channel_stop() {
+    UiEvent *event = __atomic_exchange_n(&ui_channel_head, NULL, __ATOMIC_ACQUIRE);
+    while (event) {
+        UiEvent *next = event->next;
+        ui_event_free(event);
+        event = next;
+    }
+    g_clear_pointer(&ui_channel_slots, g_hash_table_unref);
+}
+
+/* Where the file starts on disk: the first FIEMAP extent, or the inode number, which
+ * roughly follows allocation order, when the filesystem cannot say. */
+static guint64 prefetch_physical_offset(int fd, const struct stat *st) {
+    union {
+        struct fiemap map;
+        char space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } request;
+
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0) {
+        return request.map.fm_extents[0].fe_physical;
+    }
+    return (guint64)st->st_ino;
+}
+
+/* TRUE when the first `limit` bytes of the file are all in the page cache. */
+static gboolean prefetch_is_resident(int fd, goffset size, goffset limit) {
+    gsize length = (gsize)MIN(size, limit);
+    if (length == 0) return TRUE;
+
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return FALSE;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    gsize pages = (length + page_size - 1) / page_size;
+    unsigned char *vector = g_malloc(pages);
+    gboolean resident = mincore(map, length, vector) == 0;
+    for (gsize i = 0; resident && i < pages; i++) {
+        resident = (vector[i] & 1) != 0;
+    }
+
+    g_free(vector);
+    munmap(map, length);
+    return resident;
+}
+
+static int prefetch_compare_physical(gconstpointer a, gconstpointer b) {
+    const PrefetchFile *x = a, *y = b;
+    return x->physical < y->physical ? -1 : x->physical > y->physical;
+}
+
+/* Worker: keeps the nearest upcoming files that fit the budget, then reads the ones not
+ * yet cached in physical order, so the disk makes one sweep and can spin down again. */
+static void prefetch_worker(gpointer data, gpointer user_data) {
+    GPtrArray *paths = data;
+    guint64 budget = (guint64)MAX(get_setting_int("prefetch_budget_mb", 256), 0) * 1024 * 1024;
+    GArray *files = g_array_new(FALSE, FALSE, sizeof(PrefetchFile));
+    guint64 planned = 0;
+    gint64 started = g_get_monotonic_time();
+
+    for (guint i = 0; i < paths->len; i++) {
+        PrefetchFile file = { g_ptr_array_index(paths, i), -1, 0, 0 };
+        struct stat st;
+
+        file.fd = open(file.path, O_RDONLY | O_CLOEXEC);
+        if (file.fd < 0) continue;
+        if (fstat(file.fd, &st) != 0) {
+            close(file.fd);
+            continue;
+        }
+        if (planned + st.st_size > budget) {
+            close(file.fd);
+            break;
+        }
+        planned += st.st_size;
+        if (prefetch_is_resident(file.fd, st.st_size, st.st_size)) {
+            close(file.fd);
+            continue;
+        }
+        file.size = st.st_size;
+        file.physical = prefetch_physical_offset(file.fd, &st);
+        g_array_append_val(files, file);
+    }
+    g_array_sort(files, prefetch_compare_physical);
+
+    guint64 read_bytes = 0;
+    char *buffer = g_malloc(PREFETCH_READ_CHUNK);
+    for (guint i = 0; i < files->len; i++) {
+        PrefetchFile *file = &g_array_index(files, PrefetchFile, i);
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ssize_t length;
+        goffset offset = 0;
+        while ((length = pread(file->fd, buffer, PREFETCH_READ_CHUNK, offset)) > 0) {
+            offset += length;
+        }
+        read_bytes += offset;
+        close(file->fd);
+    }
+    g_free(buffer);
+
+    if (files->len > 0) {
+        gint64 finished = g_get_monotonic_time();
+        trace_span(TRACE_PREFETCH, started, finished, files->len);
+        g_debug("Prefetch: read %u of %u upcoming files (%.1f MB) in %.0f ms", files->len, paths->len,
+                read_bytes / 1048576.0, (finished - started) / 1000.0);
+    }
+    g_array_unref(files);
+    g_ptr_array_unref(paths);
+}
+
+/* Counts whether the start of a track was already cached when playback needed it. */
+void prefetch_note_track_start(const char *path) {
+    if (!prefetch_pool) return;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        if (prefetch_is_resident(fd, st.st_size, PREFETCH_CHECK_BYTES)) {
+            g_atomic_int_inc(&prefetch_hits);
+        } else {
+            g_atomic_int_inc(&prefetch_misses);
+        }
+    }
+    close(fd);
+}
+
+/* Forgets the last batch, e.g. after the play order changed. */
+void prefetch_invalidate() {
+    prefetch_batch_position = QUEUE_NO_POSITION;
+}
+
+/* Called whenever a track starts. A new batch covering the next prefetch_ahead entries
+ * of the play order is queued only after a jump or once half of the previous one has
+ * been played, so disk reads come in bursts instead of one per track. */
+void prefetch_update() {
+    guint ahead = (guint)MAX(get_setting_int("prefetch_ahead", 5), 0);
+    guint32 position = play_queue.position;
+    guint32 length = play_queue.length;
+    if (!prefetch_pool || ahead == 0 || position >= length || length < 2) return;
+
+    ahead = MIN(ahead, length - 1);
+    if (prefetch_batch_position < length) {
+        guint32 played = (position + length - prefetch_batch_position) % length;
+        if (played <= prefetch_horizon && prefetch_horizon - played > ahead / 2) return;
+    }
+
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 1; i <= ahead; i++) {
+        guint32 next = (position + i) % length;
+        g_ptr_array_add(paths, song_path(track_name(play_queue.tracks[queue_order(&play_queue, next)])));
+    }
+    prefetch_batch_position = position;
+    prefetch_horizon = ahead;
+    g_thread_pool_push(prefetch_pool, paths, NULL);
+}
+
+void prefetch_start() {
+    if (get_setting_int("prefetch_ahead", 5) <= 0) return;
+    prefetch_pool = g_thread_pool_new(prefetch_worker, NULL, 1, FALSE, NULL);
+}
+
+void prefetch_stop() {
+    if (!prefetch_pool) return;
+
+    g_thread_pool_free(prefetch_pool, TRUE, TRUE);
+    prefetch_pool = NULL;
+    if (prefetch_hits + prefetch_misses > 0) {
+        g_debug("Prefetch: %d hits, %d misses", prefetch_hits, prefetch_misses);
+    }
+}
+
+static void audio_decode_handoff(GstElement *sink, GstBuffer *buffer, GstPad *pad, gpointer data) {
+    AudioDecodeTarget *target = data;
+    GstMapInfo map;
+
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) return;
+    target->func((const gfloat *)map.data, map.size / (2 * sizeof(gfloat)), target->data);
+    gst_buffer_unmap(buffer, &map);
+}
+
+/* Decodes a whole file as fast as the CPU allows through a private pipeline, converted
+ * to stereo float at `rate`. Returns FALSE on a decoding error or once *cancel is set. */
+gboolean audio_decode_file(const char *path, guint rate, AudioDecodeFunc func, gpointer data, const gint *cancel) {
+    gchar *description = g_strdup_printf(
+        "uridecodebin name=source ! audioconvert ! audioresample ! "
+        "audio/x-raw,format=" AUDIO_DECODE_FORMAT ",layout=interleaved,channels=2,rate=%u ! "
+        "fakesink name=sink sync=false signal-handoffs=true", rate);
+    GError *error = NULL;
+    GstElement *decoder = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!decoder) {
+        trace_error("Cannot build decoder: %s", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return FALSE;
+    }
+    g_clear_error(&error);
+
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    GstElement *source = gst_bin_get_by_name(GST_BIN(decoder), "source");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(decoder), "sink");
+    AudioDecodeTarget target = { func, data };
+    g_object_set(source, "uri", uri, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(audio_decode_handoff), &target);
+    gst_object_unref(source);
+    gst_object_unref(sink);
+    g_free(uri);
+
+    gboolean decoded = FALSE;
+    gboolean done = FALSE;
+    GstBus *bus = gst_element_get_bus(decoder);
+    if (gst_element_set_state(decoder, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+        while (!done && !(cancel && g_atomic_int_get(cancel))) {
+            GstMessage *msg = gst_bus_timed_pop_filtered(bus, 100 * GST_MSECOND,
+                                                         GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+            if (!msg) continue;
+
+            if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+                gst_message_parse_error(msg, &error, NULL);
+                trace_error("Cannot decode %s: %s", path, error->message);
+                g_clear_error(&error);
+            } else {
+                decoded = TRUE;
+            }
+            gst_message_unref(msg);
+            done = TRUE;
+        }
+    }
+    gst_element_set_state(decoder, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(decoder);
+    return decoded;
+}
+
+void loudness_analysis_init(LoudnessAnalysis *analysis) {
+    memset(analysis, 0, sizeof(*analysis));
+    analysis->subblocks = g_array_new(FALSE, FALSE, sizeof(gdouble));
+}
+
+void loudness_analysis_clear(LoudnessAnalysis *analysis) {
+    g_array_unref(analysis->subblocks);
+    analysis->subblocks = NULL;
+}
+
+/* Largest absolute sample value, four samples per step. */
+static gfloat loudness_peak(const gfloat *samples, gsize count, gfloat peak) {
+    const Int32X4 magnitude = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+    FloatX4 highest = { peak, peak, peak, peak };
+    gsize i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        FloatX4 value;
+        memcpy(&value, samples + i, sizeof(value));
+        value = (FloatX4)((Int32X4)value & magnitude);
+        Int32X4 greater = (Int32X4)(value > highest);
+        highest = (FloatX4)(((Int32X4)value & greater) | ((Int32X4)highest & ~greater));
+    }
+    for (guint lane = 0; lane < 4; lane++) peak = MAX(peak, highest[lane]);
+    for (; i < count; i++) peak = MAX(peak, fabsf(samples[i]));
+    return peak;
+}
+
+/* K-weights interleaved stereo frames (ITU-R BS.1770 coefficients for 48 kHz: a high
+ * shelf for the head, then the RLB high-pass), both channels per vector operation, and
+ * closes a sub-block every 100 ms. */
+void loudness_feed(LoudnessAnalysis *analysis, const gfloat *samples, gsize frames) {
+    const DoubleX2 shelf_b0 = { 1.53512485958697, 1.53512485958697 };
+    const DoubleX2 shelf_b1 = { -2.69169618940638, -2.69169618940638 };
+    const DoubleX2 shelf_b2 = { 1.19839281085285, 1.19839281085285 };
+    const DoubleX2 shelf_a1 = { -1.69065929318241, -1.69065929318241 };
+    const DoubleX2 shelf_a2 = { 0.73248077421585, 0.73248077421585 };
+    const DoubleX2 highpass_a1 = { -1.99004745483398, -1.99004745483398 };
+    const DoubleX2 highpass_a2 = { 0.99007225036621, 0.99007225036621 };
+    DoubleX2 s1 = analysis->shelf[0], s2 = analysis->shelf[1];
+    DoubleX2 h1 = analysis->highpass[0], h2 = analysis->highpass[1];
+    DoubleX2 sum = analysis->block_sum;
+    guint block_frames = analysis->block_frames;
+
+    analysis->peak = loudness_peak(samples, frames * 2, analysis->peak);
+    for (gsize i = 0; i < frames; i++) {
+        DoubleX2 x = { samples[2 * i], samples[2 * i + 1] };
+        DoubleX2 y = shelf_b0 * x + s1;
+        s1 = shelf_b1 * x - shelf_a1 * y + s2;
+        s2 = shelf_b2 * x - shelf_a2 * y;
+
+        DoubleX2 z = y + h1;
+        h1 = -2.0 * y - highpass_a1 * z + h2;
+        h2 = y - highpass_a2 * z;
+
+        sum += z * z;
+        if (++block_frames == LOUDNESS_SUBBLOCK_FRAMES) {
+            gdouble mean_square = (sum[0] + sum[1]) / LOUDNESS_SUBBLOCK_FRAMES;
+            g_array_append_val(analysis->subblocks, mean_square);
+            sum = (DoubleX2){ 0.0, 0.0 };
+            block_frames = 0;
+        }
+    }
+
+    analysis->shelf[0] = s1;
+    analysis->shelf[1] = s2;
+    analysis->highpass[0] = h1;
+    analysis->highpass[1] = h2;
+    analysis->block_sum = sum;
+    analysis->block_frames = block_frames;
+    analysis->frames += frames;
+}
+
+/* Mean of the block energies above `threshold`, four blocks per step. */
+static gdouble loudness_gated_mean(const gdouble *blocks, guint count, gdouble threshold, guint *kept) {
+    const DoubleX4 limit = { threshold, threshold, threshold, threshold };
+    DoubleX4 sum = { 0.0, 0.0, 0.0, 0.0 };
+    Int64X4 hits = { 0, 0, 0, 0 };
+    guint i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        DoubleX4 energy;
+        memcpy(&energy, blocks + i, sizeof(energy));
+        Int64X4 above = (Int64X4)(energy > limit);
+        sum += (DoubleX4)((Int64X4)energy & above);
+        hits -= above;
+    }
+
+    gdouble total = sum[0] + sum[1] + sum[2] + sum[3];
+    guint n = (guint)(hits[0] + hits[1] + hits[2] + hits[3]);
+    for (; i < count; i++) {
+        if (blocks[i] > threshold) {
+            total += blocks[i];
+            n++;
+        }
+    }
+    *kept = n;
+    return n > 0 ? total / n : 0.0;
+}
+
+/* Integrated loudness in LUFS over 400 ms blocks overlapping by 75%, gated at -70 LUFS
+ * and then 10 LU below the loudness of the blocks that passed. */
+gdouble loudness_integrated(const LoudnessAnalysis *analysis) {
+    guint subblock_count = analysis->subblocks->len;
+    if (subblock_count < 4) return NAN;
+
+    const gdouble *subblocks = (const gdouble *)analysis->subblocks->data;
+    guint count = subblock_count - 3;
+    gdouble *blocks = g_new(gdouble, count);
+    for (guint i = 0; i < count; i++) {
+        blocks[i] = (subblocks[i] + subblocks[i + 1] + subblocks[i + 2] + subblocks[i + 3]) / 4.0;
+    }
+
+    guint kept = 0;
+    gdouble absolute = pow(10.0, (LOUDNESS_ABSOLUTE_GATE + 0.691) / 10.0);
+    gdouble mean = loudness_gated_mean(blocks, count, absolute, &kept);
+    if (kept > 0) {
+        gdouble relative = mean * pow(10.0, LOUDNESS_RELATIVE_GATE / 10.0);
+        mean = loudness_gated_mean(blocks, count, MAX(absolute, relative), &kept);
+    }
+    g_free(blocks);
+    return kept > 0 ? -0.691 + 10.0 * log10(mean) : NAN;
+}
+
+/* Smallest and largest sample value, four samples per step. */
+static void waveform_range(const gfloat *samples, gsize count, gfloat *low, gfloat *high) {
+    FloatX4 lowest = { *low, *low, *low, *low };
+    FloatX4 highest = { *high, *high, *high, *high };
+    gsize i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        FloatX4 value;
+        memcpy(&value, samples + i, sizeof(value));
+        Int32X4 below = (Int32X4)(value < lowest);
+        Int32X4 above = (Int32X4)(value > highest);
+        lowest = (FloatX4)(((Int32X4)value & below) | ((Int32X4)lowest & ~below));
+        highest = (FloatX4)(((Int32X4)value & above) | ((Int32X4)highest & ~above));
+    }
+    for (guint lane = 0; lane < 4; lane++) {
+        *low = MIN(*low, lowest[lane]);
+        *high = MAX(*high, highest[lane]);
+    }
+    for (; i < count; i++) {
+        *low = MIN(*low, samples[i]);
+        *high = MAX(*high, samples[i]);
+    }
+}
+
+void waveform_analysis_init(WaveformAnalysis *analysis) {
+    memset(analysis, 0, sizeof(*analysis));
+    analysis->chunks = g_array_new(FALSE, FALSE, sizeof(gfloat));
+    analysis->low = G_MAXFLOAT;
+    analysis->high = -G_MAXFLOAT;
+}
+
+void waveform_analysis_clear(WaveformAnalysis *analysis) {
+    g_array_unref(analysis->chunks);
+    analysis->chunks = NULL;
+}
+
+static void waveform_close_chunk(WaveformAnalysis *analysis) {
+    g_array_append_val(analysis->chunks, analysis->low);
+    g_array_append_val(analysis->chunks, analysis->high);
+    analysis->low = G_MAXFLOAT;
+    analysis->high = -G_MAXFLOAT;
+    analysis->chunk_frames = 0;
+}
+
+/* Keeps the minimum and maximum of every WAVEFORM_CHUNK_FRAMES frames, both channels
+ * together. The length of the track is not known until the end, so the chunks are only
+ * folded into buckets by waveform_finish. */
+void waveform_feed(WaveformAnalysis *analysis, const gfloat *samples, gsize frames) {
+    analysis->frames += frames;
+    while (frames > 0) {
+        gsize take = MIN(frames, WAVEFORM_CHUNK_FRAMES - analysis->chunk_frames);
+        waveform_range(samples, take * 2, &analysis->low, &analysis->high);
+        samples += take * 2;
+        frames -= take;
+        analysis->chunk_frames += take;
+        if (analysis->chunk_frames == WAVEFORM_CHUNK_FRAMES) {
+            waveform_close_chunk(analysis);
+        }
+    }
+}
+
+/* Folds the chunks into WAVEFORM_BUCKETS min/max pairs, scaled so the largest peak is
+ * 127. FALSE when there was no audio at all. */
+gboolean waveform_finish(WaveformAnalysis *analysis, gint8 *peaks) {
+    if (analysis->chunk_frames > 0) {
+        waveform_close_chunk(analysis);
+    }
+    guint count = analysis->chunks->len / 2;
+    if (count == 0) return FALSE;
+
+    const gfloat *chunks = (const gfloat *)analysis->chunks->data;
+    gfloat largest = 0.0f;
+    for (guint i = 0; i < count * 2; i++) largest = MAX(largest, fabsf(chunks[i]));
+    gfloat scale = largest > 0.0f ? 127.0f / largest : 0.0f;
+
+    for (guint bucket = 0; bucket < WAVEFORM_BUCKETS; bucket++) {
+        guint first = (guint)((guint64)bucket * count / WAVEFORM_BUCKETS);
+        guint last = MAX((guint)((guint64)(bucket + 1) * count / WAVEFORM_BUCKETS), first + 1);
+        gfloat low = G_MAXFLOAT, high = -G_MAXFLOAT;
+        for (guint chunk = first; chunk < last; chunk++) {
+            low = MIN(low, chunks[chunk * 2]);
+            high = MAX(high, chunks[chunk * 2 + 1]);
+        }
+        peaks[bucket * 2] = (gint8)CLAMP(lrintf(low * scale), -127, 127);
+        peaks[bucket * 2 + 1] = (gint8)CLAMP(lrintf(high * scale), -127, 127);
+    }
+    return TRUE;
+}
+
+static void analysis_decoded(const gfloat *samples, gsize frames, gpointer data) {
+    TrackAnalysis *analysis = data;
+    if (analysis->loudness) loudness_feed(analysis->loudness, samples, frames);
+    if (analysis->waveform) waveform_feed(analysis->waveform, samples, frames);
+}
+
+/* Decodes the file once and feeds whichever analyses are given. */
+gboolean analysis_decode_file(const char *path, LoudnessAnalysis *loudness, WaveformAnalysis *waveform) {
+    TrackAnalysis analysis = { loudness, waveform };
+    return audio_decode_file(path, LOUDNESS_RATE, analysis_decoded, &analysis, &analysis_cancelled);
+}
+
+static gboolean loudness_is_current(const char *path, const struct stat *st) {
+    g_mutex_lock(&loudness_mutex);
+    LoudnessInfo *info = g_hash_table_lookup(loudness_cache, path);
+    gboolean current = info && info->size == st->st_size && info->mtime == st->st_mtim.tv_sec;
+    g_mutex_unlock(&loudness_mutex);
+    return current;
+}
+
+/* Records a measurement; TRUE when it is time to write the cache out. */
+static gboolean loudness_store(const char *path, const struct stat *st, gdouble lufs, gdouble peak) {
+    LoudnessInfo *info = g_new0(LoudnessInfo, 1);
+    info->size = st->st_size;
+    info->mtime = st->st_mtim.tv_sec;
+    info->lufs = lufs;
+    info->peak = peak;
+    g_debug("Loudness: %.1f LUFS, peak %.3f for %s", lufs, peak, path);
+
+    g_mutex_lock(&loudness_mutex);
+    g_hash_table_replace(loudness_cache, g_strdup(path), info);
+    loudness_cache_dirty = TRUE;
+    gboolean flush = ++loudness_analyzed % LOUDNESS_SAVE_EVERY == 0;
+    g_mutex_unlock(&loudness_mutex);
+    return flush;
+}
+
+static void waveform_entry_free(gpointer data) {
+    WaveformEntry *entry = data;
+    g_free(entry->owned);
+    g_free(entry);
+}
+
+static gboolean waveform_is_current(const char *path, const struct stat *st) {
+    g_mutex_lock(&waveform_mutex);
+    WaveformEntry *entry = g_hash_table_lookup(waveform_cache, path);
+    gboolean current = entry && entry->size == st->st_size && entry->mtime == st->st_mtim.tv_sec;
+    g_mutex_unlock(&waveform_mutex);
+    return current;
+}
+
+/* Appends one record to the cache file and publishes the overview. peaks is NULL for
+ * files that could not be decoded, so they are not tried again until they change. */
+static void waveform_store(const char *path, const struct stat *st, const gint8 *peaks) {
+    WaveformRecord record = { st->st_size, st->st_mtim.tv_sec, (guint32)strlen(path), peaks ? WAVEFORM_BUCKETS : 0 };
+    WaveformEntry *entry = g_new0(WaveformEntry, 1);
+    entry->size = record.size;
+    entry->mtime = record.mtime;
+    if (peaks) {
+        entry->owned = g_malloc(WAVEFORM_BUCKETS * 2);
+        memcpy(entry->owned, peaks, WAVEFORM_BUCKETS * 2);
+        entry->peaks = entry->owned;
+    }
+
+    g_mutex_lock(&waveform_mutex);
+    if (waveform_fd < 0) {
+        struct stat cache_st;
+        waveform_fd = open(WAVEFORM_CACHE_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (waveform_fd >= 0 && fstat(waveform_fd, &cache_st) == 0 && cache_st.st_size == 0 &&
+            write(waveform_fd, WAVEFORM_CACHE_MAGIC, strlen(WAVEFORM_CACHE_MAGIC)) < 0) {
+            trace_error("Cannot write %s: %s", WAVEFORM_CACHE_FILE, g_strerror(errno));
+        }
+    }
+    if (waveform_fd >= 0) {
+        struct iovec parts[3] = {
+            { &record, sizeof(record) },
+            { (void *)path, record.path_length },
+            { (void *)peaks, peaks ? WAVEFORM_BUCKETS * 2 : 0 }
+        };
+        if (writev(waveform_fd, parts, G_N_ELEMENTS(parts)) < 0) {
+            trace_error("Cannot write %s: %s", WAVEFORM_CACHE_FILE, g_strerror(errno));
+        }
+    }
+    g_hash_table_replace(waveform_cache, g_strdup(path), entry);
+    g_mutex_unlock(&waveform_mutex);
+}
+
+/* Copies the overview of `path` into waveform_current for the seek bar. FALSE when the
+ * file has not been analyzed since it last changed. */
+gboolean waveform_show(const char *path) {
+    struct stat st;
+    gboolean current = FALSE;
+
+    waveform_current_valid = FALSE;
+    if (waveform_cache && stat(path, &st) == 0) {
+        g_mutex_lock(&waveform_mutex);
+        WaveformEntry *entry = g_hash_table_lookup(waveform_cache, path);
+        current = entry && entry->size == st.st_size && entry->mtime == st.st_mtim.tv_sec;
+        if (current && entry->peaks) {
+            memcpy(waveform_current, entry->peaks, sizeof(waveform_current));
+            waveform_current_valid = TRUE;
+        }
+        g_mutex_unlock(&waveform_mutex);
+    }
+    if (seek_scale) gtk_widget_queue_draw(seek_scale);
+    return current;
+}
+
+/* WAVEFORM_CACHE_FILE is mapped, and entries point straight into the mapping. A torn
+ * record at the end, left by a crash, is cut off; a file holding more than twice as
+ * many records as files is rewritten without the stale ones. */
+void load_waveform_cache() {
+    GMappedFile *map = g_mapped_file_new(WAVEFORM_CACHE_FILE, FALSE, NULL);
+    if (!map) return;
+
+    const gchar *data = g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    gsize offset = strlen(WAVEFORM_CACHE_MAGIC);
+    if (length < offset || memcmp(data, WAVEFORM_CACHE_MAGIC, offset) != 0) {
+        g_mapped_file_unref(map);
+        g_unlink(WAVEFORM_CACHE_FILE);
+        return;
+    }
+
+    guint records = 0;
+    g_mutex_lock(&waveform_mutex);
+    while (length - offset >= sizeof(WaveformRecord)) {
+        WaveformRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        gsize body = (gsize)record.path_length + (gsize)record.bucket_count * 2;
+        if (record.path_length == 0 || body > length - offset - sizeof(record)) break;
+
+        if (record.bucket_count == 0 || record.bucket_count == WAVEFORM_BUCKETS) {
+            const gchar *path = data + offset + sizeof(record);
+            WaveformEntry *entry = g_new0(WaveformEntry, 1);
+            entry->size = record.size;
+            entry->mtime = record.mtime;
+            entry->peaks = record.bucket_count ? (const gint8 *)(path + record.path_length) : NULL;
+            g_hash_table_replace(waveform_cache, g_strndup(path, record.path_length), entry);
+        }
+        offset += sizeof(record) + body;
+        records++;
+    }
+    waveform_map = map;
+
+    if (records > 2 * g_hash_table_size(waveform_cache) + 64) {
+        GString *contents = g_string_new(WAVEFORM_CACHE_MAGIC);
+        GHashTableIter iter;
+        gpointer path, value;
+        g_hash_table_iter_init(&iter, waveform_cache);
+        while (g_hash_table_iter_next(&iter, &path, &value)) {
+            const WaveformEntry *entry = value;
+            WaveformRecord record = { entry->size, entry->mtime, (guint32)strlen(path), entry->peaks ? WAVEFORM_BUCKETS : 0 };
+            g_string_append_len(contents, (const gchar *)&record, sizeof(record));
+            g_string_append_len(contents, path, record.path_length);
+            if (entry->peaks) g_string_append_len(contents, (const gchar *)entry->peaks, WAVEFORM_BUCKETS * 2);
+        }
+        g_file_set_contents(WAVEFORM_CACHE_FILE, contents->str, contents->len, NULL);
+        g_string_free(contents, TRUE);
+    } else if (offset < length) {
+        if (truncate(WAVEFORM_CACHE_FILE, offset) != 0) {
+            trace_error("Cannot truncate %s: %s", WAVEFORM_CACHE_FILE, g_strerror(errno));
+        }
+    }
+    g_mutex_unlock(&waveform_mutex);
+}
+
+/* Worker: takes the oldest urgent path, else the oldest background one, and decodes it
+ * once for whichever of loudness and waveform are out of date. Runs at a lower
+ * priority, which an unprivileged thread cannot undo; analysis_pool is exclusive so
+ * these threads never go on to run another pool's work. */
+static void analysis_worker(gpointer data, gpointer user_data) {
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    g_mutex_lock(&analysis_mutex);
+    gchar *path = g_queue_pop_head(&analysis_urgent);
+    if (!path) path = g_queue_pop_head(&analysis_background);
+    g_mutex_unlock(&analysis_mutex);
+
+    gboolean flush = FALSE;
+    struct stat st;
+    if (path && !g_atomic_int_get(&analysis_cancelled) && stat(path, &st) == 0) {
+        gboolean need_loudness = loudness_cache && !loudness_is_current(path, &st);
+        gboolean need_waveform = waveform_cache && !waveform_is_current(path, &st);
+        LoudnessAnalysis loudness;
+        WaveformAnalysis waveform;
+
+        if (need_loudness) loudness_analysis_init(&loudness);
+        if (need_waveform) waveform_analysis_init(&waveform);
+        if (need_loudness || need_waveform) {
+            gint64 started = g_get_monotonic_time();
+            gboolean decoded = analysis_decode_file(path, need_loudness ? &loudness : NULL,
+                                                    need_waveform ? &waveform : NULL);
+            gint64 finished = g_get_monotonic_time();
+
+            if (!g_atomic_int_get(&analysis_cancelled)) {
+                guint64 frames = need_loudness ? loudness.frames : waveform.frames;
+                gdouble seconds = frames / (gdouble)LOUDNESS_RATE;
+                trace_span(TRACE_ANALYSIS, started, finished, (guint32)(seconds * 1000));
+                g_debug("Analysis: %.1f s of audio at %.0fx realtime for %s", seconds,
+                        finished > started ? seconds * G_USEC_PER_SEC / (finished - started) : 0.0, path);
+
+                if (need_loudness) {
+                    flush = loudness_store(path, &st, decoded ? loudness_integrated(&loudness) : NAN, loudness.peak);
+                }
+                if (need_waveform) {
+                    gint8 peaks[WAVEFORM_BUCKETS * 2];
+                    waveform_store(path, &st, decoded && waveform_finish(&waveform, peaks) ? peaks : NULL);
+                    ui_post(UI_EVENT_WAVEFORM, 0, 0, NULL);
+                }
+            }
+        }
+        if (need_loudness) loudness_analysis_clear(&loudness);
+        if (need_waveform) waveform_analysis_clear(&waveform);
+    }
+    g_free(path);
+
+    if (g_atomic_int_dec_and_test(&analysis_outstanding) || flush) {
+        ui_post(UI_EVENT_LOUDNESS_FLUSH, 0, 0, NULL);
+    }
+}
+
+/* Queues a path (taking ownership) for analysis. Urgent paths, the playing and next
+ * track, go ahead of the library backlog. */
+void analysis_request(gchar *path, gboolean urgent) {
+    if (!analysis_pool) {
+        g_free(path);
+        return;
+    }
+
+    g_mutex_lock(&analysis_mutex);
+    g_queue_push_tail(urgent ? &analysis_urgent : &analysis_background, path);
+    g_mutex_unlock(&analysis_mutex);
+
+    g_atomic_int_inc(&analysis_outstanding);
+    g_thread_pool_push(analysis_pool, GINT_TO_POINTER(1), NULL);
+}
+
+/* TRUE when every enabled analysis of the file matches its current size and mtime. */
+static gboolean analysis_is_current(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return TRUE;
+    return (!loudness_cache || loudness_is_current(path, &st)) && (!waveform_cache || waveform_is_current(path, &st));
+}
+
+/* Linear gain that brings the file to loudness_target LUFS without pushing its peak past
+ * full scale, or 1.0 when the file has not been measured since it last changed. */
+gdouble loudness_lookup_gain(const char *path) {
+    struct stat st;
+    gdouble gain = 1.0;
+    if (!loudness_cache || stat(path, &st) != 0) return gain;
+
+    g_mutex_lock(&loudness_mutex);
+    LoudnessInfo *info = g_hash_table_lookup(loudness_cache, path);
+    if (info && info->size == st.st_size && info->mtime == st.st_mtim.tv_sec && !isnan(info->lufs)) {
+        gdouble gain_db = get_setting_int("loudness_target", -18) - info->lufs;
+        if (info->peak > 0.0) gain_db = MIN(gain_db, -20.0 * log10(info->peak));
+        gain = pow(10.0, gain_db / 20.0);
+    }
+    g_mutex_unlock(&loudness_mutex);
+    return gain;
+}
+
+/* Called when a track becomes audible: applies its loudness gain and shows its waveform,
+ * and makes sure it and the track after it are analyzed next if either is missing. The
+ * gain is only changed at track starts, never in the middle of a song; a waveform that
+ * arrives later is drawn as soon as it is ready. */
+void analysis_track_started(const char *song_name) {
+    gchar *path = song_path(song_name);
+    loudness_track_gain = loudness_lookup_gain(path);
+    waveform_show(path);
+    g_free(waveform_current_path);
+    waveform_current_path = g_strdup(path);
+    if (analysis_pool && !analysis_is_current(path)) {
+        analysis_request(g_strdup(path), TRUE);
+    }
+    g_free(path);
+
+    if (analysis_pool && play_queue.position < play_queue.length && play_queue.length > 1) {
+        guint32 next = queue_next_position(&play_queue);
+        gchar *next_path = song_path(track_name(play_queue.tracks[queue_order(&play_queue, next)]));
+        if (analysis_is_current(next_path)) {
+            g_free(next_path);
+        } else {
+            analysis_request(next_path, TRUE);
+        }
+    }
+    apply_volume();
+}
+
+/* One line per file: size, mtime, integrated loudness in LUFS, sample peak, path. */
+void load_loudness_cache() {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(LOUDNESS_CACHE_FILE, &contents, NULL, NULL)) return;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_mutex_lock(&loudness_mutex);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        gchar **fields = g_strsplit(lines[i], "\t", 5);
+        if (g_strv_length(fields) == 5 && fields[4][0] != '\0') {
+            LoudnessInfo *info = g_new0(LoudnessInfo, 1);
+            info->size = g_ascii_strtoll(fields[0], NULL, 10);
+            info->mtime = g_ascii_strtoll(fields[1], NULL, 10);
+            info->lufs = g_ascii_strtod(fields[2], NULL);
+            info->peak = g_ascii_strtod(fields[3], NULL);
+            g_hash_table_replace(loudness_cache, g_strdup(fields[4]), info);
+        }
+        g_strfreev(fields);
+    }
+    g_mutex_unlock(&loudness_mutex);
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+void save_loudness_cache() {
+    GString *contents = g_string_new(NULL);
+    GHashTableIter iter;
+    gpointer path, value;
+
+    g_mutex_lock(&loudness_mutex);
+    g_hash_table_iter_init(&iter, loudness_cache);
+    while (g_hash_table_iter_next(&iter, &path, &value)) {
+        const LoudnessInfo *info = value;
+        gchar lufs[G_ASCII_DTOSTR_BUF_SIZE], peak[G_ASCII_DTOSTR_BUF_SIZE];
+        g_ascii_formatd(lufs, sizeof(lufs), "%.2f", info->lufs);
+        g_ascii_formatd(peak, sizeof(peak), "%.6f", info->peak);
+        g_string_append_printf(contents, "%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%s\t%s\t%s\n",
+                               info->size, info->mtime, lufs, peak, (const char *)path);
+    }
+    loudness_cache_dirty = FALSE;
+    g_mutex_unlock(&loudness_mutex);
+
+    g_file_set_contents(LOUDNESS_CACHE_FILE, contents->str, contents->len, NULL);
+    g_string_free(contents, TRUE);
+}
+
+/* The caches themselves are read by the library loader at startup. */
+void analysis_start() {
+    gboolean loudness = get_setting_int("loudness", 1) != 0;
+    gboolean waveform = get_setting_int("waveform", 1) != 0;
+    if (!loudness && !waveform) return;
+
+    if (loudness) {
+        loudness_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    if (waveform) {
+        waveform_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, waveform_entry_free);
+    }
+    gint workers = get_setting_int("analysis_workers", MAX((gint)g_get_num_processors() / 2, 1));
+    analysis_pool = g_thread_pool_new(analysis_worker, NULL, MAX(workers, 1), TRUE, NULL);
+}
+
+void analysis_stop() {
+    if (!analysis_pool) return;
+
+    g_atomic_int_set(&analysis_cancelled, 1);
+    g_thread_pool_free(analysis_pool, TRUE, TRUE);
+    analysis_pool = NULL;
+    g_queue_clear_full(&analysis_urgent, g_free);
+    g_queue_clear_full(&analysis_background, g_free);
+    if (loudness_cache_dirty) {
+        save_loudness_cache();
+    }
+    if (waveform_fd >= 0) {
+        close(waveform_fd);
+        waveform_fd = -1;
+    }
+}
+
+/* The slider sets volume_level; the playing track's loudness gain scales it. */
+void apply_volume() {
+    if (output_volume) {
+        g_object_set(output_volume, "volume", volume_level * loudness_track_gain, NULL);
+    } else if (pipeline) {
+        g_object_set(pipeline, "volume", volume_level * loudness_track_gain, NULL);
+    }
+}
+
+void stop_current_song() {
+    if (pipeline) {
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+    }
+}
+
+gchar *song_uri(const char *song_name) {
+    gchar *path = song_path(song_name);
+    gchar *uri = g_filename_to_uri(path, NULL, NULL);
+    g_free(path);
+    return uri;
+}
+
+void play_song(const char *song_name) {
+    gint64 started = g_get_monotonic_time();
+    if (trace_switch_started_us) {
+        trace_span(TRACE_SWITCH_PLAY_SONG, trace_switch_started_us, started, 0);
+    } else {
+        trace_switch_begin();
+    }
+
+    position_clock_reset_track();
+    reset_seek_scale();
+    stop_current_song();
+    seek_reset();
+    session_resume_at = -1;
+
+    g_mutex_lock(&queue_mutex);
+    gapless_pending_position = QUEUE_NO_POSITION;
+    g_mutex_unlock(&queue_mutex);
+
+    g_mutex_lock(&gap_mutex);
+    gap_sink_idle_at = gap_eos_at;
+    gap_eos_at = 0;
+    gap_awaiting_first_buffer = FALSE;
+    g_mutex_unlock(&gap_mutex);
+
+    gchar *local_path = song_path(song_name);
+    prefetch_note_track_start(local_path);
+    g_free(local_path);
+
+    gchar *file_path = song_uri(song_name);
+    g_object_set(G_OBJECT(pipeline), "uri", file_path, NULL);
+    shuffle_note_played(track_lookup(song_name));
+    play_count_note(track_lookup(song_name));
+    analysis_track_started(song_name);
+    update_window_title(track_lookup(song_name));
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    set_status_text("Playing Song...");
+
+    set_play_pause_icon(TRUE);
+
+    current_position = 0;
+    pipeline_is_playing = TRUE; 
+    position_clock_update();
+    g_free(file_path);
+
+    trace_span(TRACE_PLAY_SONG, started, g_get_monotonic_time(), track_lookup(song_name));
+    trace_switch_started_us = 0;
+    prefetch_update();
+    session_mark_dirty();
+}
+
+/* Runs on the streaming thread shortly before the current track ends: hands playbin the
+ * next URI so the decoder chain carries straight on into it. */
+static void on_about_to_finish(GstElement *playbin, gpointer data) {
+    gchar *next_path = NULL;
+
+    g_mutex_lock(&queue_mutex);
+    if (play_queue.position < play_queue.length) {
+        guint32 position = is_loop_enabled ? play_queue.position : queue_next_position(&play_queue);
+        const char *next_name = track_name(play_queue.tracks[queue_order(&play_queue, position)]);
+        next_path = song_path(next_name);
+
+        gchar *uri = song_uri(next_name);
+        g_object_set(playbin, "uri", uri, NULL);
+        g_free(uri);
+        gapless_pending_position = position;
+    }
+    g_mutex_unlock(&queue_mutex);
+
+    if (next_path) {
+        prefetch_note_track_start(next_path);
+        g_free(next_path);
+    }
+}
+
+/* Called on STREAM_START: the track queued by on_about_to_finish is now audible. */
+static void commit_gapless_transition() {
+    g_mutex_lock(&queue_mutex);
+    guint32 position = gapless_pending_position;
+    gapless_pending_position = QUEUE_NO_POSITION;
+    if (position < play_queue.length) {
+        play_queue.position = position;
+    }
+    g_mutex_unlock(&queue_mutex);
+
+    if (position == QUEUE_NO_POSITION) return;
+
+    position_clock_reset_track();
+    reset_seek_scale();
+    shuffle_note_played(queue_current(&play_queue));
+    play_count_note(queue_current(&play_queue));
+    analysis_track_started(track_name(queue_current(&play_queue)));
+    update_window_title(queue_current(&play_queue));
+    current_position = 0;
+    set_status_text(is_loop_enabled ? "Looping current song." : "Playing Next Song...");
+    prefetch_update();
+    session_mark_dirty();
+}
+
+/* Measures the silence between tracks at the audio sink: the time from the moment the
+ * previous track ran out (last buffer end, or EOS when the pipeline is rebuilt) to the
+ * first buffer of the next one. */
+static GstPadProbeReturn audio_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    gint64 now = g_get_monotonic_time();
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+        gint64 switch_started = __atomic_exchange_n(&trace_switch_buffer_from, 0, __ATOMIC_ACQ_REL);
+        if (switch_started) trace_span(TRACE_SWITCH_FIRST_BUFFER, switch_started, now, 0);
+    }
+
+    g_mutex_lock(&gap_mutex);
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        GstClockTime duration = GST_BUFFER_DURATION(buffer);
+
+        if (startup_first_audio_pending) {
+            startup_first_audio_pending = FALSE;
+            g_debug("Time to first audio: %.1f ms", (now - startup_started_at) / 1000.0);
+        }
+        if (gap_awaiting_first_buffer && gap_sink_idle_at > 0) {
+            g_debug("Track gap (%s): %.1f ms", gapless_enabled ? "gapless" : "pipeline restart",
+                    MAX(now - gap_sink_idle_at, 0) / 1000.0);
+        }
+        gap_awaiting_first_buffer = FALSE;
+        gap_sink_idle_at = now + (GST_CLOCK_TIME_IS_VALID(duration) ? (gint64)(duration / GST_USECOND) : 0);
+    } else if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_STREAM_START) {
+        gap_awaiting_first_buffer = TRUE;
+    }
+    g_mutex_unlock(&gap_mutex);
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Shows "Title - Artist" from the tag scanner once it knows the track. */
+void update_window_title(TrackId id) {
+    const TrackTags *tags = track_tags_get(id);
+    if (!main_window) return;
+
+    if (tags && tags->title) {
+        gchar *title = tags->artist ? g_strdup_printf("%s - %s", tags->title, tags->artist) : g_strdup(tags->title);
+        gtk_window_set_title(GTK_WINDOW(main_window), title);
+        g_free(title);
+    } else {
+        gtk_window_set_title(GTK_WINDOW(main_window), "Muzio");
+    }
+}
+
+void pause_song() {
+    if (pipeline) {
+        gst_element_query_position(pipeline, GST_FORMAT_TIME, &current_position);
+        gst_element_set_state(pipeline, GST_STATE_PAUSED);
+        pipeline_is_playing = FALSE;
+        position_clock_update();
+
+        set_play_pause_icon(FALSE);
+        set_status_text("Song Paused");
+        session_resume_paused = TRUE;
+        session_mark_dirty();
+    }
+}
+
+void resume_song() {
+    if (pipeline) {
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+        pipeline_is_playing = TRUE;
+        position_clock_update();
+
+        set_play_pause_icon(TRUE);
+        set_status_text("Resuming Song...");
+        session_resume_paused = FALSE;
+        session_mark_dirty();
+    }
+}
+
+void play_pause_button_toggled(GtkWidget *widget, gpointer data) {
+    if (remote_fd >= 0) {
+        remote_send("toggle\n");
+        return;
+    }
+
+    GstState current_state;
+    gst_element_get_state(pipeline, &current_state, NULL, GST_CLOCK_TIME_NONE);
+
+    if (current_state == GST_STATE_PLAYING) {
+        pause_song(); 
+    } else {
+        resume_song(); 
+    }
+}
+
+void play_next_song() {
+    if (is_empty(&play_queue)) {
+        set_status_text("No next song to play.");
+        return;
+    }
+
+    gboolean wraps = play_queue.position == play_queue.length - 1;
+    play_song(track_name(queue_step(&play_queue, 1)));
+    if (wraps) {
+        set_status_text("Playing First Song (Looping)...");
+    } else {
+        set_status_text("Playing Next Song...");
+    }
+}
+
+void next_song_button(GtkWidget *widget, gpointer data) {
+    if (remote_fd >= 0) {
+        remote_send("next\n");
+        return;
+    }
+    trace_switch_begin();
+    play_next_song();
+}
+
+void play_previous_song() {
+    if (!is_empty(&play_queue)) {
+        play_song(track_name(queue_step(&play_queue, -1)));
+        set_status_text("Playing Previous Song...");
+    } else {
+        set_status_text("No previous song to play.");
+    }
+}
+
+void previous_song_button(GtkWidget *widget, gpointer data) {
+    if (remote_fd >= 0) {
+        remote_send("prev\n");
+        return;
+    }
+    trace_switch_begin();
+    play_previous_song();
+}
+
+void toggle_loop(GtkWidget *widget, gpointer data) {
+    is_loop_enabled = !is_loop_enabled; 
+
+    GtkWidget *loop_icon;
+    if (is_loop_enabled) {
+        loop_icon = gtk_image_new_from_icon_name("media-playlist-repeat-symbolic", GTK_ICON_SIZE_BUTTON);
+        set_status_text("Looping current song.");
+    } else {
+        loop_icon = gtk_image_new_from_icon_name("media-playlist-repeat", GTK_ICON_SIZE_BUTTON);
+        set_status_text("Looping disabled.");
+    }
+    session_mark_dirty();
+}
+
+/* Switches the queue to a new random order. Nothing is reordered or restarted: the
+ * current song keeps playing and "next" continues in the new order. */
+void shuffle_playlist(PlayQueue *queue) {
+    queue_set_shuffle(queue, TRUE, shuffle_new_key());
+    if (is_empty(queue)) return;
+
+    prefetch_invalidate();
+    prefetch_update();
+}
+
+void toggle_shuffle(GtkWidget *widget, gpointer data) {
+    is_shuffle_enabled = !is_shuffle_enabled;
+
+    GtkWidget *shuffle_icon;
+    if (is_shuffle_enabled) {
+        shuffle_playlist(&play_queue);
+        shuffle_icon = gtk_image_new_from_icon_name("media-playlist-shuffle-symbolic", GTK_ICON_SIZE_BUTTON);
+        set_status_text("Shuffling playlist.");
+    } else {
+        queue_set_shuffle(&play_queue, FALSE, 0);
+        prefetch_invalidate();
+        prefetch_update();
+        shuffle_icon = gtk_image_new_from_icon_name("media-playlist-shuffle", GTK_ICON_SIZE_BUTTON);
+        set_status_text("Shuffle disabled.");
+    }
+}
+
+void on_volume_changed(GtkRange *range, gpointer data) {
+    volume_level = gtk_range_get_value(range) / 100.0;
+    apply_volume();
+    session_mark_dirty();
+}
+
+static void set_time_label(GtkWidget *label, gint64 time_ns) {
+    char text[16];
+    gint seconds = (gint)(time_ns / GST_SECOND);
+    g_snprintf(text, sizeof(text), "%02d:%02d", seconds / 60, seconds % 60);
+    gtk_label_set_text(GTK_LABEL(label), text);
+}
+
+/* Main-loop clock behind the seek bar and time labels. Each tick re-arms itself just
+ * after the next whole second of stream time, so it wakes about once per displayed
+ * change and not at all while paused or hidden. */
+static gboolean position_clock_tick(gpointer data) {
+    gint64 now = g_get_monotonic_time();
+    gint64 position = 0;
+    guint delay_ms = 1000;
+
+    position_clock_source = 0;
+    position_clock_wakeups++;
+    if (now - position_clock_window_start >= 60 * G_USEC_PER_SEC) {
+        g_debug("Position clock: %u wakeups in the last minute", position_clock_wakeups);
+        position_clock_wakeups = 0;
+        position_clock_window_start = now;
+    }
+
+    if (pipeline && gst_element_query_position(pipeline, GST_FORMAT_TIME, &position)) {
+        if (position_clock_duration < 0 &&
+            gst_element_query_duration(pipeline, GST_FORMAT_TIME, &position_clock_duration)) {
+            gtk_range_set_range(GTK_RANGE(seek_scale), 0.0, (gdouble)position_clock_duration / GST_SECOND);
+            set_time_label(total_time_label, position_clock_duration);
+        }
+
+        gint second = (gint)(position / GST_SECOND);
+        if (second != position_clock_shown_second && !seek_dragging && !seek_in_flight) {
+            position_clock_shown_second = second;
+            gtk_range_set_value(GTK_RANGE(seek_scale), (gdouble)position / GST_SECOND);
+            set_time_label(current_time_label, position);
+        }
+        delay_ms = (guint)((GST_SECOND - position % GST_SECOND) / GST_MSECOND) + 5;
+    }
+
+    position_clock_source = g_timeout_add(delay_ms, position_clock_tick, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/* Starts the clock while a song plays in a visible window and stops it otherwise. */
+void position_clock_update() {
+    gboolean visible = main_window && gtk_widget_get_mapped(main_window) && !main_window_iconified;
+
+    if (pipeline_is_playing && visible) {
+        if (!position_clock_source) {
+            if (position_clock_window_start == 0) {
+                position_clock_window_start = g_get_monotonic_time();
+            }
+            position_clock_source = g_timeout_add(0, position_clock_tick, NULL);
+        }
+    } else if (position_clock_source) {
+        g_source_remove(position_clock_source);
+        position_clock_source = 0;
+    }
+}
+
+void position_clock_reset_track() {
+    position_clock_duration = -1;
+    position_clock_shown_second = -1;
+}
+
+static void on_main_window_visibility(GtkWidget *widget, gpointer data) {
+    position_clock_update();
+}
+
+static gboolean on_main_window_state(GtkWidget *widget, GdkEventWindowState *event, gpointer data) {
+    main_window_iconified = (event->new_window_state & GDK_WINDOW_STATE_ICONIFIED) != 0;
+    position_clock_update();
+    return FALSE;
+}
+
+/* Issues the pending target as one flushing seek: keyframe-snapped while the user drags,
+ * sample-accurate otherwise. The next one waits for ASYNC_DONE. */
+static gboolean seek_issue() {
+    gint64 target = seek_pending_target;
+    gboolean accurate = seek_pending_accurate;
+    GstSeekFlags flags = GST_SEEK_FLAG_FLUSH |
+                         (accurate ? GST_SEEK_FLAG_ACCURATE : GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_NEAREST);
+
+    seek_pending_target = -1;
+    if (!pipeline || !gst_element_seek_simple(pipeline, GST_FORMAT_TIME, flags, target)) {
+        trace_error("Seek to %.3f s failed", (gdouble)target / GST_SECOND);
+        return FALSE;
+    }
+
+    seek_in_flight = TRUE;
+    seek_in_flight_accurate = accurate;
+    seek_started_us = g_get_monotonic_time();
+    seek_issued++;
+    current_position = target;
+    seek_watchdog_source = g_timeout_add(SEEK_WATCHDOG_MS, seek_watchdog, NULL);
+    session_mark_dirty();
+    return TRUE;
+}
+
+/* Asks for a seek. With one already in flight the target only replaces the pending
+ * one, so a drag produces at most one seek per round trip and ends on the last target. */
+gboolean seek_request(gint64 target, gboolean accurate) {
+    if (!pipeline || target < 0) return FALSE;
+
+    if (seek_pending_target >= 0) seek_coalesced++;
+    seek_pending_target = target;
+    seek_pending_accurate = accurate;
+    return seek_in_flight || seek_issue();
+}
+
+/* ASYNC_DONE: the seek in flight has prerolled at its target. */
+static void seek_complete() {
+    if (!seek_in_flight) return;
+
+    trace_span(TRACE_SEEK, seek_started_us, g_get_monotonic_time(), seek_in_flight_accurate);
+    seek_in_flight = FALSE;
+    if (seek_watchdog_source) {
+        g_source_remove(seek_watchdog_source);
+        seek_watchdog_source = 0;
+    }
+    if (seek_pending_target >= 0) {
+        seek_issue();
+    } else if (!seek_dragging) {
+        position_clock_shown_second = -1;
+        position_clock_update();
+    }
+}
+
+/* A seek whose ASYNC_DONE never came (e.g. the pipeline errored) must not block the
+ * next ones forever. */
+static gboolean seek_watchdog(gpointer data) {
+    seek_watchdog_source = 0;
+    trace_error("Seek to %.3f s did not complete within %d ms", (gdouble)current_position / GST_SECOND,
+                SEEK_WATCHDOG_MS);
+    seek_complete();
+    return G_SOURCE_REMOVE;
+}
+
+/* Drops seek state when the pipeline is restarted for another track. */
+void seek_reset() {
+    seek_in_flight = FALSE;
+    seek_pending_target = -1;
+    if (seek_watchdog_source) {
+        g_source_remove(seek_watchdog_source);
+        seek_watchdog_source = 0;
+    }
+}
+
+/* "change-value" is only emitted for user input, so the position clock moving the
+ * slider never seeks. */
+static gboolean on_seek_change_value(GtkRange *range, GtkScrollType scroll, gdouble value, gpointer data) {
+    GtkAdjustment *adjustment = gtk_range_get_adjustment(range);
+    value = CLAMP(value, gtk_adjustment_get_lower(adjustment), gtk_adjustment_get_upper(adjustment));
+
+    if (remote_fd >= 0) {
+        if (!seek_dragging) remote_seek(value);
+    } else {
+        seek_request((gint64)(value * GST_SECOND), !seek_dragging);
+    }
+    return FALSE;
+}
+
+static gboolean on_seek_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+    seek_dragging = TRUE;
+    return FALSE;
+}
+
+/* Ends a drag with one accurate seek to where the slider was let go. */
+static gboolean on_seek_button_release(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+    if (!seek_dragging) return FALSE;
+
+    seek_dragging = FALSE;
+    gdouble value = gtk_range_get_value(GTK_RANGE(widget));
+    if (remote_fd >= 0) {
+        remote_seek(value);
+    } else {
+        seek_request((gint64)(value * GST_SECOND), TRUE);
+    }
+    return FALSE;
+}
+
+static void remote_seek(gdouble seconds) {
+    gchar seconds_text[G_ASCII_DTOSTR_BUF_SIZE];
+    g_ascii_formatd(seconds_text, sizeof(seconds_text), "%.3f", seconds);
+    gchar *command = g_strdup_printf("seek %s\n", seconds_text);
+    remote_send(command);
+    g_free(command);
+}
+
+/* Strokes one vertical line per pixel column in [from, to), each spanning the min/max of
+ * the buckets under it. */
+static void waveform_draw_columns(cairo_t *cr, const GdkRectangle *area, gint from, gint to) {
+    gdouble middle = area->y + area->height / 2.0;
+    gdouble half = area->height / 2.0;
+
+    for (gint x = from; x < to; x++) {
+        guint first = (guint)((gint64)x * WAVEFORM_BUCKETS / area->width);
+        guint last = MAX((guint)((gint64)(x + 1) * WAVEFORM_BUCKETS / area->width), first + 1);
+        gint low = 127, high = -127;
+        for (guint bucket = first; bucket < last; bucket++) {
+            low = MIN(low, waveform_current[bucket * 2]);
+            high = MAX(high, waveform_current[bucket * 2 + 1]);
+        }
+        cairo_move_to(cr, area->x + x + 0.5, middle - high * half / 127.0);
+        cairo_line_to(cr, area->x + x + 0.5, middle - low * half / 127.0 + 1.0);
+    }
+    cairo_stroke(cr);
+}
+
+/* Runs before the scale's own drawing, so the trough and slider stay on top. The part
+ * already played is drawn stronger than the rest. */
+static gboolean on_seek_scale_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    GdkRectangle area;
+    if (!waveform_current_valid) return FALSE;
+
+    gtk_range_get_range_rect(GTK_RANGE(widget), &area);
+    if (area.width <= 0 || area.height <= 0) return FALSE;
+
+    GtkAdjustment *adjustment = gtk_range_get_adjustment(GTK_RANGE(widget));
+    gdouble span = gtk_adjustment_get_upper(adjustment) - gtk_adjustment_get_lower(adjustment);
+    gdouble played = span > 0 ? (gtk_adjustment_get_value(adjustment) - gtk_adjustment_get_lower(adjustment)) / span : 0.0;
+    gint split = CLAMP((gint)(played * area.width), 0, area.width);
+
+    GdkRGBA color;
+    gtk_style_context_get_color(gtk_widget_get_style_context(widget), gtk_widget_get_state_flags(widget), &color);
+    cairo_set_line_width(cr, 1.0);
+    cairo_set_source_rgba(cr, color.red, color.green, color.blue, 0.6);
+    waveform_draw_columns(cr, &area, 0, split);
+    cairo_set_source_rgba(cr, color.red, color.green, color.blue, 0.25);
+    waveform_draw_columns(cr, &area, split, area.width);
+    return FALSE;
+}
+
+void reset_seek_scale() {
+    if (seek_scale) {
+        gtk_range_set_value(GTK_RANGE(seek_scale), 0.0);
+    }
+}
+
+void set_play_pause_icon(gboolean playing) {
+    if (!play_pause_button) return;
+
+    GtkWidget *icon = gtk_image_new_from_icon_name(playing ? "media-playback-pause" : "media-playback-start",
+                                                   GTK_ICON_SIZE_BUTTON);
+    gtk_button_set_image(GTK_BUTTON(play_pause_button), icon);
+}
+
+static gchar *playlist_file_path(const char *playlist_name, const char *extension) {
+    gchar *file_name = g_strconcat(playlist_name, extension, NULL);
+    gchar *path = g_build_filename(playlists_dir, file_name, NULL);
+    g_free(file_name);
+    return path;
+}
+
+static void playlist_free(Playlist *playlist) {
+    if (playlist->fd >= 0) close(playlist->fd);
+    if (playlist->rule) smart_rule_free(playlist->rule);
+    g_hash_table_unref(playlist->members);
+    g_ptr_array_unref(playlist->entries);
+    g_free(playlist->name);
+    g_free(playlist->path);
+    g_free(playlist);
+}
+
+/* Appends one record with a single O_APPEND write and syncs it, so a crash leaves at
+ * most a torn last record, which playlist_replay cuts off. */
+static gboolean playlist_write_record(Playlist *playlist, PlaylistOp op, guint32 a, guint32 b, const char *song_name) {
+    PlaylistRecord record;
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.a = a;
+    record.b = b;
+    record.length = song_name ? strlen(song_name) : 0;
+
+    struct iovec iov[2] = {
+        { &record, sizeof(record) },
+        { (void *)song_name, record.length }
+    };
+    ssize_t expected = sizeof(record) + record.length;
+    if (writev(playlist->fd, iov, song_name ? 2 : 1) != expected || fdatasync(playlist->fd) != 0) {
+        if (ftruncate(playlist->fd, playlist->journal_size) != 0) {
+            g_warning("Cannot roll back playlist journal %s", playlist->path);
+        }
+        return FALSE;
+    }
+
+    playlist->journal_size += expected;
+    playlist->records++;
+    return TRUE;
+}
+
+/* Entries are the interned track names, so a song in several playlists and the queue is
+ * stored once. */
+static void playlist_apply_append(Playlist *playlist, const char *song_name, gsize length) {
+    const char *name = track_name(track_intern_length(song_name, length));
+    g_ptr_array_add(playlist->entries, (gpointer)name);
+    g_hash_table_add(playlist->members, (gpointer)name);
+}
+
+/* Rebuilds entries from a mapped journal. Stops at the first torn or inconsistent
+ * record and reports how much of the file is valid in journal_size. */
+static gboolean playlist_replay(Playlist *playlist, const char *data, gsize length) {
+    if (length < strlen(PLAYLIST_MAGIC) || memcmp(data, PLAYLIST_MAGIC, strlen(PLAYLIST_MAGIC)) != 0) return FALSE;
+
+    gsize pos = strlen(PLAYLIST_MAGIC);
+    while (pos + sizeof(PlaylistRecord) <= length) {
+        PlaylistRecord record;
+        memcpy(&record, data + pos, sizeof(record));
+        if (record.length > length - pos - sizeof(record)) break;
+
+        const char *song_name = data + pos + sizeof(record);
+        GPtrArray *entries = playlist->entries;
+        if (record.op == PLAYLIST_OP_APPEND && record.length > 0) {
+            playlist_apply_append(playlist, song_name, record.length);
+        } else if (record.op == PLAYLIST_OP_REMOVE && record.a < entries->len) {
+            g_hash_table_remove(playlist->members, g_ptr_array_index(entries, record.a));
+            g_ptr_array_remove_index(entries, record.a);
+        } else if (record.op == PLAYLIST_OP_MOVE && record.a < entries->len && record.b < entries->len) {
+            gpointer moved = g_ptr_array_steal_index(entries, record.a);
+            g_ptr_array_insert(entries, record.b, moved);
+        } else {
+            break;
+        }
+
+        pos += sizeof(record) + record.length;
+        playlist->records++;
+    }
+
+    playlist->journal_size = pos;
+    return TRUE;
+}
+
+/* Reads a legacy one-song-per-line playlist without any line length limit, dropping
+ * duplicates, and writes it out as a compacted journal. */
+static gboolean playlist_import_txt(Playlist *playlist, const char *txt_path) {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(txt_path, &contents, NULL, NULL)) return FALSE;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_strchomp(lines[i]);
+        if (lines[i][0] != '\0' && !g_hash_table_contains(playlist->members, lines[i])) {
+            playlist_apply_append(playlist, lines[i], strlen(lines[i]));
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    g_debug("Imported %u songs from %s", playlist->entries->len, txt_path);
+    return playlist_compact(playlist);
+}
+
+/* Rewrites the journal as one append record per entry and swaps it in atomically. */
+gboolean playlist_compact(Playlist *playlist) {
+    GByteArray *journal = g_byte_array_new();
+    g_byte_array_append(journal, (const guint8 *)PLAYLIST_MAGIC, strlen(PLAYLIST_MAGIC));
+
+    for (guint i = 0; i < playlist->entries->len; i++) {
+        const char *song_name = g_ptr_array_index(playlist->entries, i);
+        PlaylistRecord record;
+        memset(&record, 0, sizeof(record));
+        record.op = PLAYLIST_OP_APPEND;
+        record.length = strlen(song_name);
+        g_byte_array_append(journal, (const guint8 *)&record, sizeof(record));
+        g_byte_array_append(journal, (const guint8 *)song_name, record.length);
+    }
+
+    GError *error = NULL;
+    gboolean written = g_file_set_contents(playlist->path, (const gchar *)journal->data, journal->len, &error);
+    if (written) {
+        if (playlist->fd >= 0) close(playlist->fd);
+        playlist->fd = open(playlist->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        playlist->records = playlist->entries->len;
+        playlist->journal_size = journal->len;
+    } else {
+        g_warning("Cannot compact playlist %s: %s", playlist->path, error->message);
+        g_error_free(error);
+    }
+
+    g_byte_array_unref(journal);
+    return written && playlist->fd >= 0;
+}
+
+static void playlist_maybe_compact(Playlist *playlist) {
+    if (playlist->records > playlist->entries->len * 2 + 64) {
+        playlist_compact(playlist);
+    }
+}
+
+gboolean playlist_exists(const char *playlist_name) {
+    gchar *journal_path = playlist_file_path(playlist_name, ".journal");
+    gchar *txt_path = playlist_file_path(playlist_name, ".txt");
+    gchar *smart_path = playlist_file_path(playlist_name, ".smart");
+    gboolean exists = g_file_test(journal_path, G_FILE_TEST_EXISTS) || g_file_test(txt_path, G_FILE_TEST_EXISTS) ||
+                      g_file_test(smart_path, G_FILE_TEST_EXISTS);
+    g_free(journal_path);
+    g_free(txt_path);
+    g_free(smart_path);
+    return exists;
+}
+
+/* Returns the cached playlist, or loads it from its journal, importing the legacy .txt
+ * file the first time. With create set, a missing playlist starts out empty. Smart
+ * playlists are always cached, already materialized. */
+Playlist *playlist_open(const char *playlist_name, gboolean create) {
+    if (!open_playlists) {
+        open_playlists = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)playlist_free);
+    }
+
+    Playlist *playlist = g_hash_table_lookup(open_playlists, playlist_name);
+    if (playlist) return playlist;
+
+    playlist = g_new0(Playlist, 1);
+    playlist->name = g_strdup(playlist_name);
+    playlist->path = playlist_file_path(playlist_name, ".journal");
+    playlist->fd = -1;
+    playlist->entries = g_ptr_array_new();
+    playlist->members = g_hash_table_new(g_str_hash, g_str_equal);
+
+    gboolean ok;
+    GMappedFile *journal = g_mapped_file_new(playlist->path, FALSE, NULL);
+    gchar *txt_path = playlist_file_path(playlist_name, ".txt");
+
+    if (journal) {
+        ok = playlist_replay(playlist, g_mapped_file_get_contents(journal), g_mapped_file_get_length(journal));
+        gboolean torn = ok && (gsize)playlist->journal_size < g_mapped_file_get_length(journal);
+        g_mapped_file_unref(journal);
+        if (ok) {
+            playlist->fd = open(playlist->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (torn && playlist->fd >= 0 && ftruncate(playlist->fd, playlist->journal_size) != 0) {
+                ok = FALSE;
+            }
+            ok = ok && playlist->fd >= 0;
+        }
+    } else if (g_file_test(txt_path, G_FILE_TEST_EXISTS)) {
+        ok = playlist_import_txt(playlist, txt_path);
+    } else if (create) {
+        ok = playlist_compact(playlist);
+    } else {
+        ok = FALSE;
+    }
+    g_free(txt_path);
+
+    if (!ok) {
+        playlist_free(playlist);
+        return NULL;
+    }
+
+    playlist_maybe_compact(playlist);
+    g_hash_table_insert(open_playlists, playlist->name, playlist);
+    return playlist;
+}
+
+/* O(1): one journal record plus an array append. Returns FALSE for duplicates. */
+gboolean playlist_append(Playlist *playlist, const char *song_name) {
+    if (g_hash_table_contains(playlist->members, song_name)) return FALSE;
+    if (!playlist_write_record(playlist, PLAYLIST_OP_APPEND, 0, 0, song_name)) return FALSE;
+
+    playlist_apply_append(playlist, song_name, strlen(song_name));
+    return TRUE;
+}
+
+gboolean playlist_remove(Playlist *playlist, guint index) {
+    if (index >= playlist->entries->len) return FALSE;
+    if (!playlist_write_record(playlist, PLAYLIST_OP_REMOVE, index, 0, NULL)) return FALSE;
+
+    g_hash_table_remove(playlist->members, g_ptr_array_index(playlist->entries, index));
+    g_ptr_array_remove_index(playlist->entries, index);
+    playlist_maybe_compact(playlist);
+    return TRUE;
+}
+
+gboolean playlist_move(Playlist *playlist, guint from, guint to) {
+    if (from >= playlist->entries->len || to >= playlist->entries->len) return FALSE;
+    if (!playlist_write_record(playlist, PLAYLIST_OP_MOVE, from, to, NULL)) return FALSE;
+
+    gpointer moved = g_ptr_array_steal_index(playlist->entries, from);
+    g_ptr_array_insert(playlist->entries, to, moved);
+    playlist_maybe_compact(playlist);
+    return TRUE;
+}
+
+gint playlist_index_of(Playlist *playlist, const char *song_name) {
+    if (!g_hash_table_contains(playlist->members, song_name)) return -1;
+    for (guint i = 0; i < playlist->entries->len; i++) {
+        if (strcmp(g_ptr_array_index(playlist->entries, i), song_name) == 0) return i;
+    }
+    return -1;
+}
+
+void playlist_close_all() {
+    if (open_playlists) {
+        g_hash_table_unref(open_playlists);
+        open_playlists = NULL;
+    }
+}
+
+void smart_rule_free(SmartRule *rule) {
+    g_free(rule->name_pattern);
+    g_free(rule->directory);
+    g_free(rule->positions);
+    g_free(rule);
+}
+
+/* A whole number of UNIT (1000 for seconds in ms) or the default when the key is not set. */
+static gboolean smart_rule_get_bound(GKeyFile *file, const char *key, guint32 unit, guint32 *bound, GError **error) {
+    if (!g_key_file_has_key(file, SMART_PLAYLIST_GROUP, key, NULL)) return TRUE;
+
+    GError *parse_error = NULL;
+    gint value = g_key_file_get_integer(file, SMART_PLAYLIST_GROUP, key, &parse_error);
+    if (parse_error || value < 0 || (guint)value > G_MAXUINT32 / unit) {
+        g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE, "%s must be a whole number", key);
+        g_clear_error(&parse_error);
+        return FALSE;
+    }
+    *bound = (guint32)value * unit;
+    return TRUE;
+}
+
+/* Reads a .smart key file. Every key is optional and an absent one does not constrain:
+ *   [Smart Playlist]
+ *   name=*live*             glob on the file name, case-insensitive
+ *   directory=Jazz          library directory, relative or absolute
+ *   added_after=2024-01-31  file modified on or after that day
+ *   min_duration=120        seconds, as are max_duration
+ *   min_plays=1             as are max_plays */
+SmartRule *smart_rule_load(const char *path, GError **error) {
+    GKeyFile *file = g_key_file_new();
+    if (!g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, error)) {
+        g_key_file_free(file);
+        return NULL;
+    }
+
+    SmartRule *rule = g_new0(SmartRule, 1);
+    rule->max_duration_ms = G_MAXUINT32;
+    rule->max_plays = G_MAXUINT32;
+    gboolean ok = smart_rule_get_bound(file, "min_duration", 1000, &rule->min_duration_ms, error) &&
+                  smart_rule_get_bound(file, "max_duration", 1000, &rule->max_duration_ms, error) &&
+                  smart_rule_get_bound(file, "min_plays", 1, &rule->min_plays, error) &&
+                  smart_rule_get_bound(file, "max_plays", 1, &rule->max_plays, error);
+
+    gchar *value = ok ? g_key_file_get_string(file, SMART_PLAYLIST_GROUP, "name", NULL) : NULL;
+    if (value) {
+        rule->name_pattern = g_utf8_casefold(value, -1);
+        g_free(value);
+    }
+
+    value = ok ? g_key_file_get_string(file, SMART_PLAYLIST_GROUP, "directory", NULL) : NULL;
+    if (value) {
+        gsize length = strlen(value);
+        while (length > 1 && value[length - 1] == '/') value[--length] = '\0';
+        if (!g_path_is_absolute(value)) {
+            rule->directory = g_strdup(value);
+        } else if (g_strcmp0(value, music_dir) != 0) {
+            gchar *probe = g_build_filename(value, "-", NULL);
+            gchar *name = library_name_for_path(probe);
+            if (name) {
+                rule->directory = g_path_get_dirname(name);
+            } else {
+                g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE, "%s is not in the library", value);
+                ok = FALSE;
+            }
+            g_free(name);
+            g_free(probe);
+        }
+        g_free(value);
+    }
+
+    value = ok ? g_key_file_get_string(file, SMART_PLAYLIST_GROUP, "added_after", NULL) : NULL;
+    if (value) {
+        gint year, month, day;
+        if (sscanf(value, "%d-%d-%d", &year, &month, &day) == 3 && g_date_valid_dmy(day, month, year)) {
+            GDateTime *date = g_date_time_new_local(year, month, day, 0, 0, 0);
+            rule->added_after = g_date_time_to_unix(date);
+            g_date_time_unref(date);
+        } else {
+            g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE, "added_after must be YYYY-MM-DD");
+            ok = FALSE;
+        }
+        g_free(value);
+    }
+
+    g_key_file_free(file);
+    if (!ok) {
+        smart_rule_free(rule);
+        return NULL;
+    }
+    return rule;
+}
+
+/* Whether the track satisfies every condition of the rule. Conditions on tags fail
+ * until the tag scanner has published the track. */
+gboolean smart_rule_matches(const SmartRule *rule, TrackId id) {
+    const char *song_name = track_name(id);
+    if (!song_name) return FALSE;
+
+    if (rule->directory) {
+        gsize length = strlen(rule->directory);
+        if (strncmp(song_name, rule->directory, length) != 0 || song_name[length] != '/') return FALSE;
+    }
+    if (rule->name_pattern) {
+        const char *base = strrchr(song_name, '/');
+        gchar *folded = g_utf8_casefold(base ? base + 1 : song_name, -1);
+        gboolean matched = fnmatch(rule->name_pattern, folded, 0) == 0;
+        g_free(folded);
+        if (!matched) return FALSE;
+    }
+    if (rule->added_after != 0 || rule->min_duration_ms != 0 || rule->max_duration_ms != G_MAXUINT32) {
+        const TrackTags *tags = track_tags_get(id);
+        if (!tags || tags->mtime < rule->added_after || tags->duration_ms < rule->min_duration_ms ||
+            tags->duration_ms > rule->max_duration_ms) {
+            return FALSE;
+        }
+    }
+    if (rule->min_plays != 0 || rule->max_plays != G_MAXUINT32) {
+        guint32 plays = play_count_get(song_name);
+        if (plays < rule->min_plays || plays > rule->max_plays) return FALSE;
+    }
+    return TRUE;
+}
+
+/* An empty playlist in open_playlists that follows RULE; takes ownership of it. */
+Playlist *smart_playlist_new(const char *playlist_name, const char *path, SmartRule *rule) {
+    if (!open_playlists) {
+        open_playlists = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)playlist_free);
+    }
+    if (!smart_playlists) {
+        smart_playlists = g_ptr_array_new();
+    }
+
+    Playlist *playlist = g_new0(Playlist, 1);
+    playlist->name = g_strdup(playlist_name);
+    playlist->path = g_strdup(path);
+    playlist->fd = -1;
+    playlist->entries = g_ptr_array_new();
+    playlist->members = g_hash_table_new(g_str_hash, g_str_equal);
+    playlist->rule = rule;
+    g_hash_table_replace(open_playlists, playlist->name, playlist);
+    g_ptr_array_add(smart_playlists, playlist);
+    return playlist;
+}
+
+/* Brings one track's membership up to date: an append, or a removal that moves the
+ * last entry into the gap, so the cost does not depend on the playlist's length. */
+static void smart_playlist_update(Playlist *playlist, TrackId id, gboolean present) {
+    SmartRule *rule = playlist->rule;
+    gboolean member = id < rule->positions_size && rule->positions[id] != 0;
+    gboolean matches = present && smart_rule_matches(rule, id);
+    if (matches == member) return;
+
+    const char *song_name = track_name(id);
+    if (matches) {
+        if (id >= rule->positions_size) {
+            guint32 size = MAX(id + 1, rule->positions_size * 2);
+            rule->positions = g_renew(guint32, rule->positions, size);
+            memset(rule->positions + rule->positions_size, 0, (size - rule->positions_size) * sizeof(guint32));
+            rule->positions_size = size;
+        }
+        g_ptr_array_add(playlist->entries, (gpointer)song_name);
+        g_hash_table_add(playlist->members, (gpointer)song_name);
+        rule->positions[id] = playlist->entries->len;
+        return;
+    }
+
+    guint index = rule->positions[id] - 1;
+    rule->positions[id] = 0;
+    g_hash_table_remove(playlist->members, song_name);
+    g_ptr_array_remove_index_fast(playlist->entries, index);
+    if (index < playlist->entries->len) {
+        rule->positions[track_lookup(g_ptr_array_index(playlist->entries, index))] = index + 1;
+    }
+}
+
+/* Re-evaluates every smart playlist for one track that was added, changed (tags, play
+ * count) or, with present unset, removed from the library. Hidden duplicates count as
+ * removed. */
+void smart_playlists_update(TrackId id, gboolean present) {
+    if (!smart_playlists || id == TRACK_ID_NONE) return;
+    present = present && !dedupe_is_hidden(id);
+
+    for (guint i = 0; i < smart_playlists->len; i++) {
+        smart_playlist_update(g_ptr_array_index(smart_playlists, i), id, present);
+    }
+}
+
+/* Empties every smart playlist when another music directory replaces the library. */
+void smart_playlists_clear() {
+    if (!smart_playlists) return;
+
+    for (guint i = 0; i < smart_playlists->len; i++) {
+        Playlist *playlist = g_ptr_array_index(smart_playlists, i);
+        g_ptr_array_set_size(playlist->entries, 0);
+        g_hash_table_remove_all(playlist->members);
+        g_clear_pointer(&playlist->rule->positions, g_free);
+        playlist->rule->positions_size = 0;
+    }
+}
+
+/* Loads the .smart files in the playlists directory as empty smart playlists, before
+ * the library loader runs; library_track_added fills them as tracks arrive. */
+void smart_playlists_start() {
+    play_counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    play_counts_save_pool = g_thread_pool_new(play_counts_write, NULL, 1, FALSE, NULL);
+
+    DIR *dir = opendir(playlists_dir);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *extension = strrchr(entry->d_name, '.');
+        if (!extension || strcmp(extension, ".smart") != 0) continue;
+
+        gchar *playlist_name = g_strndup(entry->d_name, extension - entry->d_name);
+        gchar *path = g_build_filename(playlists_dir, entry->d_name, NULL);
+        GError *error = NULL;
+        SmartRule *rule = smart_rule_load(path, &error);
+        if (rule) {
+            smart_playlist_new(playlist_name, path, rule);
+        } else {
+            trace_error("Cannot load smart playlist %s: %s", path, error->message);
+            g_error_free(error);
+        }
+        g_free(path);
+        g_free(playlist_name);
+    }
+    closedir(dir);
+    g_debug("Smart playlists: %u rules", smart_playlists ? smart_playlists->len : 0);
+}
+
+/* The playlists themselves go with open_playlists. */
+void smart_playlists_stop() {
+    if (!play_counts) return;
+
+    /* Writes what is still pending and waits for the writer. */
+    if (play_counts_save_source) {
+        g_source_remove(play_counts_save_source);
+        play_counts_save_source = 0;
+    }
+    if (play_counts_dirty) {
+        g_thread_pool_push(play_counts_save_pool, play_counts, NULL);
+    }
+    g_thread_pool_free(play_counts_save_pool, FALSE, TRUE);
+    play_counts_save_pool = NULL;
+    g_clear_pointer(&smart_playlists, g_ptr_array_unref);
+    g_clear_pointer(&play_counts, g_hash_table_unref);
+    play_counts_loaded = FALSE;
+}
+
+guint32 play_count_get(const char *song_name) {
+    if (!play_counts) return 0;
+
+    g_mutex_lock(&play_count_mutex);
+    guint32 count = GPOINTER_TO_UINT(g_hash_table_lookup(play_counts, song_name));
+    g_mutex_unlock(&play_count_mutex);
+    return count;
+}
+
+/* Counts a play when the track starts and moves it in or out of the smart playlists
+ * whose bounds it crosses. The count is written PLAY_COUNT_SAVE_DELAY_MS later, off the
+ * main thread. */
+void play_count_note(TrackId id) {
+    if (!play_counts || id == TRACK_ID_NONE) return;
+
+    const char *song_name = track_name(id);
+    g_mutex_lock(&play_count_mutex);
+    guint32 count = GPOINTER_TO_UINT(g_hash_table_lookup(play_counts, song_name)) + 1;
+    g_hash_table_replace(play_counts, g_strdup(song_name), GUINT_TO_POINTER(count));
+    play_counts_dirty = TRUE;
+    g_mutex_unlock(&play_count_mutex);
+
+    smart_playlists_update(id, TRUE);
+    if (play_counts_save_pool && !play_counts_save_source) {
+        play_counts_save_source = g_timeout_add(PLAY_COUNT_SAVE_DELAY_MS, play_counts_save_due, NULL);
+    }
+}
+
+/* One line per track played: count, name. Adds to the plays counted before the load. */
+void load_play_counts() {
+    gchar *contents = NULL;
+    if (g_file_get_contents(PLAY_COUNT_FILE, &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        g_mutex_lock(&play_count_mutex);
+        for (guint i = 0; lines[i] != NULL; i++) {
+            gchar **fields = g_strsplit(lines[i], "\t", 2);
+            if (g_strv_length(fields) == 2 && fields[1][0] != '\0') {
+                guint32 count = GPOINTER_TO_UINT(g_hash_table_lookup(play_counts, fields[1]));
+                count += (guint32)g_ascii_strtoull(fields[0], NULL, 10);
+                g_hash_table_replace(play_counts, g_strdup(fields[1]), GUINT_TO_POINTER(count));
+            }
+            g_strfreev(fields);
+        }
+        g_mutex_unlock(&play_count_mutex);
+        g_strfreev(lines);
+        g_free(contents);
+    }
+
+    g_mutex_lock(&play_count_mutex);
+    play_counts_loaded = TRUE;
+    g_mutex_unlock(&play_count_mutex);
+}
+
+/* The single play-count writer thread. play_count_mutex already guards the counts
+ * against the library loader, so the writer formats them itself and the main thread
+ * only waits for the lock. Not before load_play_counts, which would otherwise find the
+ * file cut down to this run's plays. */
+static void play_counts_write(gpointer data, gpointer user_data) {
+    GHashTable *counts = data;
+    GString *contents = g_string_new(NULL);
+    GHashTableIter iter;
+    gpointer name, value;
+
+    g_mutex_lock(&play_count_mutex);
+    gboolean loaded = play_counts_loaded;
+    g_hash_table_iter_init(&iter, counts);
+    while (loaded && g_hash_table_iter_next(&iter, &name, &value)) {
+        g_string_append_printf(contents, "%u\t%s\n", GPOINTER_TO_UINT(value), (const char *)name);
+    }
+    if (loaded) play_counts_dirty = FALSE;
+    g_mutex_unlock(&play_count_mutex);
+
+    GError *error = NULL;
+    if (loaded && !g_file_set_contents(PLAY_COUNT_FILE, contents->str, contents->len, &error)) {
+        g_warning("Cannot save %s: %s", PLAY_COUNT_FILE, error->message);
+        g_error_free(error);
+    }
+    g_string_free(contents, TRUE);
+}
+
+/* One write covers a run of plays. Until the library loader has read the old counts
+ * the timer waits for it. */
+static gboolean play_counts_save_due(gpointer data) {
+    g_mutex_lock(&play_count_mutex);
+    gboolean loaded = play_counts_loaded;
+    g_mutex_unlock(&play_count_mutex);
+    if (!loaded) return G_SOURCE_CONTINUE;
+
+    play_counts_save_source = 0;
+    g_thread_pool_push(play_counts_save_pool, play_counts, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+void create_playlist(const char *playlist_name) {
+    if (playlist_name == NULL || playlist_name[0] == '\0' || strchr(playlist_name, '/') != NULL) {
+        set_status_text("Error: Invalid playlist name.");
+        return;
+    }
+
+    char message[256];
+    if (playlist_exists(playlist_name)) {
+        snprintf(message, sizeof(message), "Playlist '%s' already exists.", playlist_name);
+        set_status_text(message);
+        return;
+    }
+
+    if (playlist_open(playlist_name, TRUE)) {
+        if (playlist_combo_box != NULL) {
+            gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(playlist_combo_box), playlist_name);
+        } else {
+            set_status_text("Error: Playlist combo box not initialized.");
+        }
+
+        snprintf(message, sizeof(message), "Playlist '%s' created successfully.", playlist_name);
+        set_status_text(message);
+    } else {
+        snprintf(message, sizeof(message), "Error creating playlist file for: %s", playlist_name);
+        set_status_text(message);
+    }
+}
+
+void add_song_to_playlist(const char *song_name, const char *playlist_name) {
+    Playlist *playlist = playlist_open(playlist_name, FALSE);
+
+    if (!playlist) {
+        set_status_text("Error adding song to playlist.");
+    } else if (playlist->rule) {
+        set_status_text("Smart playlists follow their rules.");
+    } else if (playlist_index_of(playlist, song_name) >= 0) {
+        set_status_text("Song is already in the playlist.");
+    } else if (playlist_append(playlist, song_name)) {
+        set_status_text("Song added to playlist.");
+    } else {
+        set_status_text("Error adding song to playlist.");
+    }
+}
+
+/* Names journals, not yet imported .txt playlists and the smart playlists that were
+ * loaded once each. Safe to call off the main thread; returns NULL when the directory
+ * cannot be read. */
+GPtrArray *list_playlists() {
+    DIR *dir = opendir(playlists_dir);
+    if (dir == NULL) return NULL;
+
+    struct dirent *entry;
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+
+    while ((entry = readdir(dir)) != NULL) {
+        const char *extension = strrchr(entry->d_name, '.');
+        if (extension == NULL || (strcmp(extension, ".txt") != 0 && strcmp(extension, ".journal") != 0 &&
+                                  (strcmp(extension, ".smart") != 0 || !smart_playlists))) {
+            continue;
+        }
+
+        char *playlist_name = g_strndup(entry->d_name, extension - entry->d_name);
+        if (g_hash_table_contains(seen, playlist_name)) {
+            g_free(playlist_name);
+            continue;
+        }
+        g_hash_table_add(seen, playlist_name);
+        g_ptr_array_add(names, playlist_name);
+    }
+    g_hash_table_unref(seen);
+    closedir(dir);
+    return names;
+}
+
+void add_playlist_names(GPtrArray *names) {
+    for (guint i = 0; i < names->len; i++) {
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(playlist_combo_box), g_ptr_array_index(names, i));
+    }
+    if (names->len > 0 && gtk_combo_box_get_active(GTK_COMBO_BOX(playlist_combo_box)) < 0) {
+        gtk_combo_box_set_active(GTK_COMBO_BOX(playlist_combo_box), 0);
+    }
+}
+
+void load_playlists() {
+    GPtrArray *names = list_playlists();
+    if (names == NULL) {
+        set_status_text("Failed to open playlists directory.");
+        return;
+    }
+    add_playlist_names(names);
+    g_ptr_array_unref(names);
+}
+
+void on_add_to_playlist_button_clicked(GtkWidget *widget, gpointer data) {
+    const char *song_name = current_song_name();
+    const char *playlist_name = gtk_combo_box_text_get_active_text(playlist_combo_box);  
+
+    if (song_name && playlist_name) {
+        add_song_to_playlist(song_name, playlist_name);
+    } else {
+        set_status_text("No song or playlist selected.");
+    }
+}
+
+void on_remove_from_playlist_button_clicked(GtkWidget *widget, gpointer data) {
+    const char *song_name = current_song_name();
+    gchar *playlist_name = gtk_combo_box_text_get_active_text(playlist_combo_box);
+    Playlist *playlist = playlist_name ? playlist_open(playlist_name, FALSE) : NULL;
+    g_free(playlist_name);
+
+    if (!song_name || !playlist) {
+        set_status_text("No song or playlist selected.");
+        return;
+    }
+    if (playlist->rule) {
+        set_status_text("Smart playlists follow their rules.");
+        return;
+    }
+
+    gint index = playlist_index_of(playlist, song_name);
+    if (index < 0) {
+        set_status_text("Song is not in the playlist.");
+    } else if (playlist_remove(playlist, index)) {
+        set_status_text("Song removed from playlist.");
+    } else {
+        set_status_text("Error removing song from playlist.");
+    }
+}
+
+void on_create_playlist_button_clicked(GtkWidget *widget, gpointer data) {
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("Create Playlist", GTK_WINDOW(main_window),
+                                                   GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                   "Create", GTK_RESPONSE_ACCEPT,
+                                                   "Cancel", GTK_RESPONSE_REJECT,
+                                                   NULL);
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Enter Playlist Name");
+    gtk_box_pack_start(GTK_BOX(content_area), entry, TRUE, TRUE, 0);
+    
+    gtk_widget_show_all(dialog);
+    
+    gint result = gtk_dialog_run(GTK_DIALOG(dialog));
+    
+    if (result == GTK_RESPONSE_ACCEPT) {
+        const char *playlist_name = gtk_entry_get_text(GTK_ENTRY(entry));
+        create_playlist(playlist_name);
+    }
+    
+    gtk_widget_destroy(dialog); 
+}
+
+void on_play_playlist_button_clicked(GtkWidget *widget, gpointer data) {
+    const char *playlist_name = gtk_combo_box_text_get_active_text(playlist_combo_box); 
+    if (playlist_name == NULL) {
+        set_status_text("No playlist selected.");
+        return;
+    }
+
+    Playlist *playlist = playlist_open(playlist_name, FALSE);
+    if (!playlist) {
+        set_status_text("Error opening playlist file.");
+        return;
+    }
+
+    if (remote_fd >= 0) {
+        GString *commands = g_string_new("clear\n");
+        g_string_append_printf(commands, "enqueue %u\n", playlist->entries->len);
+        for (guint i = 0; i < playlist->entries->len; i++) {
+            g_string_append_printf(commands, "%s\n", (const char *)g_ptr_array_index(playlist->entries, i));
+        }
+        g_string_append(commands, "play 0\n");
+        remote_send(commands->str);
+        g_string_free(commands, TRUE);
+        return;
+    }
+
+    trace_switch_begin();
+    free_song_list();
+
+    for (guint i = 0; i < playlist->entries->len; i++) {
+        const char *song_name = g_ptr_array_index(playlist->entries, i);
+        if (!dedupe_is_hidden(track_intern(song_name))) {
+            add_song(&play_queue, song_name);
+        }
+    }
+
+    if (!is_empty(&play_queue)) {
+        queue_jump(&play_queue, 0);
+        play_song(track_name(queue_current(&play_queue)));
+    } else {
+        set_status_text("Playlist is empty.");
+    }
+}
+
+static gboolean bus_call(GstBus *bus, GstMessage *msg, gpointer data) {
+    switch (GST_MESSAGE_TYPE(msg)) {
+        case GST_MESSAGE_DURATION_CHANGED:
+            position_clock_reset_track();
+            break;
+        case GST_MESSAGE_STREAM_START:
+            commit_gapless_transition();
+            break;
+        case GST_MESSAGE_STATE_CHANGED:
+            if (GST_MESSAGE_SRC(msg) == GST_OBJECT(pipeline) && trace_switch_playing_from) {
+                GstState new_state;
+                gst_message_parse_state_changed(msg, NULL, &new_state, NULL);
+                if (new_state == GST_STATE_PLAYING) {
+                    trace_span(TRACE_SWITCH_PLAYING, trace_switch_playing_from, g_get_monotonic_time(), 0);
+                    trace_switch_playing_from = 0;
+                }
+            }
+            break;
+        case GST_MESSAGE_ASYNC_DONE:
+            seek_complete();
+            session_resume_continue();
+            break;
+        case GST_MESSAGE_EOS:
+            trace_switch_begin();
+            g_mutex_lock(&gap_mutex);
+            gap_eos_at = g_get_monotonic_time();
+            g_mutex_unlock(&gap_mutex);
+            if (is_loop_enabled && queue_current(&play_queue) != TRACK_ID_NONE) {
+                play_song(track_name(queue_current(&play_queue)));
+            } else {
+                play_next_song();
+            }
+            break;
+        case GST_MESSAGE_ERROR: {
+            GError *err;
+            gchar *debug;
+            gst_message_parse_error(msg, &err, &debug);
+            trace_error("Playback of %s: %s (%s)", current_song_name() ? current_song_name() : "?",
+                        err->message, debug ? debug : "no details");
+            gchar *text = g_strdup_printf("Error occurred while playing song: %s", err->message);
+            set_status_text(text);
+            g_free(text);
+            g_free(debug);
+            g_error_free(err);
+            break;
+        }
+        default:
+            break;
+    }
+    return TRUE;
+}
+
+/* Empties the queue. Shuffle mode and its key survive, so a new queue plays shuffled too. */
+void free_song_list() {
+    g_mutex_lock(&queue_mutex);
+    gboolean shuffled = play_queue.shuffled;
+    guint64 shuffle_key = play_queue.shuffle_key;
+    g_free(play_queue.tracks);
+    queue_segments_free(&play_queue);
+    init_queue(&play_queue);
+    play_queue.shuffled = shuffled;
+    play_queue.shuffle_key = shuffle_key;
+    g_mutex_unlock(&queue_mutex);
+    session_mark_dirty();
+}
+
+void free_music_directory() {   
+    if (music_dir) {
+        g_free(music_dir); 
+        music_dir = NULL;
+    }
+}
+
+void cleanup_resources() {   
+    const char *trace_file = get_setting("trace_file", NULL);
+    if (trace_file && trace_file[0] != '\0') {
+        trace_write_chrome(trace_file);
+    }
+    session_stop();
+    download_manager_cancel_all();
+    library_loader_stop();
+    prefetch_stop();
+    analysis_stop();
+    smart_playlists_stop();
+    playlist_close_all();
+    tag_scanner_stop();
+    dedupe_stop();
+    library_watch_stop();
+    ui_channel_stop();
+    free_song_list();         
+    free_tracks();
+    free_music_directory();   
+    g_rand_free(shuffle_rand);
+    g_clear_pointer(&shuffle_recent, g_free);
+    g_mutex_clear(&queue_mutex); 
+}
+
+void save_music_directory(const char *dir) {
+    FILE *file = fopen(CONFIG_FILE, "w");
+    if (file) {
+        fprintf(file, "%s\n", dir);
+        if (settings) {
+            GHashTableIter iter;
+            gpointer key, value;
+            g_hash_table_iter_init(&iter, settings);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                fprintf(file, "%s=%s\n", (const char *)key, (const char *)value);
+            }
+        }
+        fclose(file);
+    }
+}
+
+char *load_music_directory() {
+    FILE *file = fopen(CONFIG_FILE, "r");
+    if (!file) return NULL;
+
+    char *dir = (char *)malloc(256);
+    if (fgets(dir, 256, file)) {
+        dir[strcspn(dir, "\n")] = '\0';
+    }
+    fclose(file);
+    return dir;
+}
+
+/* Settings are optional "key=value" lines following the music directory in CONFIG_FILE. */
+void load_settings() {
+    if (!settings) {
+        settings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+
+    gchar *contents = NULL;
+    if (!g_file_get_contents(CONFIG_FILE, &contents, NULL, NULL)) return;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 1; lines[i] != NULL; i++) {
+        char *separator = strchr(lines[i], '=');
+        if (separator == NULL) continue;
+        *separator = '\0';
+        g_hash_table_insert(settings, g_strdup(g_strstrip(lines[i])), g_strdup(g_strstrip(separator + 1)));
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    const char *seed = get_setting("shuffle_seed", NULL);
+    if (seed && shuffle_rand) {
+        g_rand_set_seed(shuffle_rand, (guint32)g_ascii_strtoull(seed, NULL, 10));
+    }
+
+    /* Extra library roots, separated by ':' like PATH. */
+    GPtrArray *roots = g_ptr_array_new();
+    gchar **paths = g_strsplit(get_setting("library_roots", ""), ":", -1);
+    for (guint i = 0; paths[i] != NULL; i++) {
+        if (paths[i][0] != '\0') g_ptr_array_add(roots, g_canonicalize_filename(paths[i], NULL));
+    }
+    g_strfreev(paths);
+    g_ptr_array_add(roots, NULL);
+    g_strfreev(library_roots);
+    library_roots = (gchar **)g_ptr_array_free(roots, FALSE);
+    library_scan_workers = CLAMP(get_setting_int("library_scan_workers", 4), 1, 64);
+
+    output_buffer_ms = CLAMP(get_setting_int("audio_buffer_ms", 200), 20, 2000);
+    output_latency_ms = CLAMP(get_setting_int("audio_latency_ms", 10), 1, output_buffer_ms / 2);
+    output_realtime_priority = CLAMP(get_setting_int("audio_realtime_priority", 10), 0, 99);
+}
+
+const char *get_setting(const char *key, const char *fallback) {
+    const char *value = settings ? g_hash_table_lookup(settings, key) : NULL;
+    return value ? value : fallback;
+}
+
+gint get_setting_int(const char *key, gint fallback) {
+    const char *value = get_setting(key, NULL);
+    return value ? atoi(value) : fallback;
+}
+    
+/* Goes through the UI channel so that download progress, which can arrive many times per
+ * frame, costs one label update per drain and never overtakes a later message. Without a
+ * window (daemon mode) status messages go to the debug log instead. */
+static void set_status_text(const char *text) {
+    if (status_label) {
+        ui_post(UI_EVENT_STATUS, 0, 0, text);
+    } else {
+        g_debug("Status: %s", text);
+    }
+}
+
+/* Audio files are recognized by suffix without being opened. Files with no suffix at all
+ * are sniffed by their first bytes instead; any other suffix, such as a partial
+ * ".mp3.part" download or "cover.jpg", is not a song. */
+static gboolean has_audio_suffix(const char *name) {
+    static const char *const suffixes[] = { ".mp3", ".flac", ".ogg", ".oga", ".opus", ".m4a", ".aac", ".wav", ".wv" };
+    const char *dot = strrchr(name, '.');
+    if (!dot) return FALSE;
+
+    for (guint i = 0; i < G_N_ELEMENTS(suffixes); i++) {
+        if (g_ascii_strcasecmp(dot, suffixes[i]) == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+/* The containers read_track_tags and playbin understand, from a file's first 12 bytes.
+ * A bare MPEG or ADTS frame sync counts too: raw MP3 and AAC streams have no header. */
+static gboolean has_audio_magic(const guint8 *head) {
+    return memcmp(head, "ID3", 3) == 0 || memcmp(head, "fLaC", 4) == 0 || memcmp(head, "OggS", 4) == 0 ||
+           memcmp(head + 4, "ftyp", 4) == 0 || memcmp(head, "wvpk", 4) == 0 ||
+           (memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0) ||
+           (head[0] == 0xFF && (head[1] & 0xE0) == 0xE0);
+}
+
+/* name is relative to dir_fd, or a full path with AT_FDCWD. Hidden files never count. */
+static gboolean is_song_file_at(int dir_fd, const char *name) {
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (base[0] == '.') return FALSE;
+    if (strchr(base, '.')) return has_audio_suffix(base);
+
+    guint8 head[12];
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    gboolean audio = pread(fd, head, sizeof(head), 0) == sizeof(head) && has_audio_magic(head);
+    close(fd);
+    return audio;
+}
+
+/* Track names are paths relative to music_dir, or absolute paths for files under the
+ * other library roots. Returns NULL for a path outside every root. */
+gchar *library_name_for_path(const char *path) {
+    gsize length = music_dir ? strlen(music_dir) : 0;
+    if (length > 0 && strncmp(path, music_dir, length) == 0 && path[length] == '/') {
+        return g_strdup(path + length + 1);
+    }
+    for (guint i = 0; library_roots && library_roots[i]; i++) {
+        length = strlen(library_roots[i]);
+        if (strncmp(path, library_roots[i], length) == 0 && path[length] == '/') return g_strdup(path);
+    }
+    return NULL;
+}
+
+/* dir_path first, then the library_roots setting; empty without dir_path, since the
+ * first root decides how names are relative. */
+gchar **library_root_paths(const char *dir_path) {
+    if (!dir_path) return g_new0(gchar *, 1);
+
+    GPtrArray *roots = g_ptr_array_new();
+    g_ptr_array_add(roots, g_strdup(dir_path));
+    for (guint i = 0; library_roots && library_roots[i]; i++) {
+        g_ptr_array_add(roots, g_strdup(library_roots[i]));
+    }
+    g_ptr_array_add(roots, NULL);
+    return (gchar **)g_ptr_array_free(roots, FALSE);
+}
+
+/* Hands dir->names from index first onwards to emit in LIBRARY_BATCH_SIZE slices, one
+ * worker at a time. */
+static guint emit_library_names(LibraryScan *scan, LibraryDir *dir, guint first) {
+    g_mutex_lock(&scan->emit_mutex);
+    while (first < dir->names->len) {
+        guint count = MIN(dir->names->len - first, LIBRARY_BATCH_SIZE);
+        scan->emit((const char *const *)dir->names->pdata + first, count, scan->data);
+        first += count;
+    }
+    g_mutex_unlock(&scan->emit_mutex);
+    return first;
+}
+
+/* Records a directory in index order; its position is what children store as parent. */
+static LibraryDir *library_scan_add_dir(LibraryScan *scan, char *path, char *prefix, const struct stat *st,
+                                        guint32 parent) {
+    LibraryDir *dir = g_new0(LibraryDir, 1);
+    dir->path = path;
+    dir->prefix = prefix;
+    dir->st = *st;
+    dir->names = g_ptr_array_new();
+    dir->parent = parent;
+
+    g_mutex_lock(&scan->mutex);
+    dir->slot = scan->dirs->len;
+    g_ptr_array_add(scan->dirs, dir);
+    g_mutex_unlock(&scan->mutex);
+    return dir;
+}
+
+static void library_scan_push(LibraryScanWorker *worker, LibraryDir *dir) {
+    g_atomic_int_inc(&worker->scan->pending);
+    g_mutex_lock(&worker->mutex);
+    g_queue_push_tail(&worker->dirs, dir);
+    g_mutex_unlock(&worker->mutex);
+    g_atomic_int_inc(&worker->scan->queued);
+}
+
+/* Wakes idle workers after a directory's subdirectories were pushed. */
+static void library_scan_wake(LibraryScan *scan) {
+    g_mutex_lock(&scan->mutex);
+    if (scan->idle > 0) g_cond_broadcast(&scan->cond);
+    g_mutex_unlock(&scan->mutex);
+}
+
+/* Own deque from the tail, so a worker goes depth first and its directories stay in the
+ * dentry cache; other deques from the head, where the oldest and usually largest
+ * subtrees wait. */
+static LibraryDir *library_scan_take(LibraryScanWorker *worker) {
+    LibraryScan *scan = worker->scan;
+    LibraryDir *dir = NULL;
+
+    g_mutex_lock(&worker->mutex);
+    dir = g_queue_pop_tail(&worker->dirs);
+    g_mutex_unlock(&worker->mutex);
+
+    for (guint i = 1; !dir && i < scan->worker_count; i++) {
+        LibraryScanWorker *victim = &scan->workers[(worker->index + i) % scan->worker_count];
+        g_mutex_lock(&victim->mutex);
+        dir = g_queue_pop_head(&victim->dirs);
+        g_mutex_unlock(&victim->mutex);
+    }
+
+    if (dir) g_atomic_int_add(&scan->queued, -1);
+    return dir;
+}
+
+/* An unchanged directory: its songs come from the mapped index and its subdirectories
+ * from the index's parent links, each still checked against its own mtime. */
+static void library_scan_indexed(LibraryScanWorker *worker, LibraryDir *dir, guint32 position) {
+    LibraryScan *scan = worker->scan;
+    const LibraryIndexDir *index_dir = &scan->index_dirs[position];
+
+    for (guint e = 0; e < index_dir->entry_count; e++) {
+        guint32 offset = scan->index_entries[index_dir->first_entry + e].name_offset;
+        g_ptr_array_add(dir->names, (gpointer)(scan->index_strings + offset));
+    }
+    emit_library_names(scan, dir, 0);
+
+    for (guint32 child = scan->index_first_child[position]; child != LIBRARY_INDEX_NO_PARENT;
+         child = scan->index_next_sibling[child]) {
+        const char *path = scan->index_strings + scan->index_dirs[child].path_offset;
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+
+        gchar *base = g_path_get_basename(path);
+        gchar *prefix = g_strconcat(dir->prefix, base, "/", NULL);
+        g_free(base);
+        library_scan_push(worker, library_scan_add_dir(scan, g_strdup(path), prefix, &st, dir->slot));
+    }
+}
+
+/* A new or changed directory, read with getdents64 into the worker's buffer. Songs are
+ * emitted every LIBRARY_BATCH_SIZE names; subdirectories go on the worker's deque.
+ * Symlinks to files are followed, symlinks to directories are not, so a link cannot
+ * make the walk loop. */
+static gboolean scan_library_dir(LibraryScanWorker *worker, LibraryDir *dir) {
+    LibraryScan *scan = worker->scan;
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    guint emitted = 0;
+    long length;
+    while ((length = syscall(SYS_getdents64, fd, worker->buffer, LIBRARY_SCAN_BUFFER)) > 0) {
+        for (long offset = 0; offset < length; ) {
+            const LibraryDirent *entry = (const LibraryDirent *)(worker->buffer + offset);
+            offset += entry->d_reclen;
+            if (entry->d_name[0] == '.') continue;
+
+            unsigned char type = entry->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN || type == DT_DIR) {
+                if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_LNK) {
+                type = fstatat(fd, entry->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                gchar *path = g_build_filename(dir->path, entry->d_name, NULL);
+                gchar *prefix = g_strconcat(dir->prefix, entry->d_name, "/", NULL);
+                library_scan_push(worker, library_scan_add_dir(scan, path, prefix, &st, dir->slot));
+            } else if (type == DT_REG && is_song_file_at(fd, entry->d_name)) {
+                char *name = g_strconcat(dir->prefix, entry->d_name, NULL);
+                g_ptr_array_add(worker->owned_names, name);
+                g_ptr_array_add(dir->names, name);
+                if (dir->names->len - emitted == LIBRARY_BATCH_SIZE) {
+                    emitted = emit_library_names(scan, dir, emitted);
+                }
+            }
+        }
+    }
+    emit_library_names(scan, dir, emitted);
+
+    close(fd);
+    return TRUE;
+}
+
+static void library_scan_process(LibraryScanWorker *worker, LibraryDir *dir) {
+    LibraryScan *scan = worker->scan;
+    gpointer found;
+
+    if (g_hash_table_lookup_extended(scan->indexed, dir->path, NULL, &found)) {
+        const LibraryIndexDir *index_dir = &scan->index_dirs[GPOINTER_TO_UINT(found)];
+        if (index_dir->mtime_sec == dir->st.st_mtim.tv_sec && index_dir->mtime_nsec == dir->st.st_mtim.tv_nsec) {
+            library_scan_indexed(worker, dir, GPOINTER_TO_UINT(found));
+            library_scan_wake(scan);
+            return;
+        }
+    }
+
+    scan_library_dir(worker, dir);
+    g_atomic_int_inc(&scan->rescanned);
+    library_scan_wake(scan);
+}
+
+/* Worker loop. pending counts directories found but not finished, queued those still
+ * waiting in a deque; the walk is over when pending drops to zero. Pushes bump queued
+ * before library_scan_wake takes the mutex, so checking it under the mutex cannot miss
+ * a wakeup. */
+static gpointer library_scan_run(gpointer data) {
+    LibraryScanWorker *worker = data;
+    LibraryScan *scan = worker->scan;
+
+    while (TRUE) {
+        LibraryDir *dir = library_scan_take(worker);
+        if (dir) {
+            library_scan_process(worker, dir);
+            if (g_atomic_int_dec_and_test(&scan->pending)) {
+                g_mutex_lock(&scan->mutex);
+                g_cond_broadcast(&scan->cond);
+                g_mutex_unlock(&scan->mutex);
+            }
+            continue;
+        }
+
+        g_mutex_lock(&scan->mutex);
+        while (g_atomic_int_get(&scan->queued) == 0 && g_atomic_int_get(&scan->pending) > 0) {
+            scan->idle++;
+            g_cond_wait(&scan->cond, &scan->mutex);
+            scan->idle--;
+        }
+        gboolean done = g_atomic_int_get(&scan->pending) == 0;
+        g_mutex_unlock(&scan->mutex);
+        if (done) break;
+    }
+    return NULL;
+}
+
+/* Checks the whole mapping up front, so workers can read it without bounds checks, and
+ * fills scan->indexed and the child lists. Returns FALSE when the file is not a
+ * well-formed index. */
+static gboolean load_library_index(GMappedFile *index, LibraryScan *scan) {
+    const char *data = g_mapped_file_get_contents(index);
+    gsize length = g_mapped_file_get_length(index);
+    if (length < sizeof(LibraryIndexHeader)) return FALSE;
+
+    const LibraryIndexHeader *header = (const LibraryIndexHeader *)data;
+    if (memcmp(header->magic, LIBRARY_INDEX_MAGIC, sizeof(header->magic)) != 0) return FALSE;
+
+    gsize expected = sizeof(LibraryIndexHeader)
+                   + (gsize)header->dir_count * sizeof(LibraryIndexDir)
+                   + (gsize)header->entry_count * sizeof(LibraryIndexEntry)
+                   + header->strings_size;
+    if (length != expected || header->strings_size == 0) return FALSE;
+
+    const LibraryIndexDir *index_dirs = (const LibraryIndexDir *)(data + sizeof(LibraryIndexHeader));
+    const LibraryIndexEntry *entries = (const LibraryIndexEntry *)(index_dirs + header->dir_count);
+    const char *strings = (const char *)(entries + header->entry_count);
+    if (strings[header->strings_size - 1] != '\0') return FALSE;
+
+    for (guint i = 0; i < header->entry_count; i++) {
+        if (entries[i].name_offset >= header->strings_size) return FALSE;
+    }
+    for (guint i = 0; i < header->dir_count; i++) {
+        const LibraryIndexDir *index_dir = &index_dirs[i];
+        if (index_dir->path_offset >= header->strings_size ||
+            index_dir->first_entry > header->entry_count ||
+            index_dir->entry_count > header->entry_count - index_dir->first_entry ||
+            (index_dir->parent != LIBRARY_INDEX_NO_PARENT && index_dir->parent >= i)) {
+            return FALSE;
+        }
+    }
+
+    scan->index_dirs = index_dirs;
+    scan->index_entries = entries;
+    scan->index_strings = strings;
+    scan->index_first_child = g_new(guint32, header->dir_count);
+    scan->index_next_sibling = g_new(guint32, header->dir_count);
+    for (guint i = 0; i < header->dir_count; i++) {
+        scan->index_first_child[i] = LIBRARY_INDEX_NO_PARENT;
+        scan->index_next_sibling[i] = LIBRARY_INDEX_NO_PARENT;
+    }
+    for (guint i = header->dir_count; i-- > 0; ) {
+        guint32 parent = index_dirs[i].parent;
+        if (parent != LIBRARY_INDEX_NO_PARENT) {
+            scan->index_next_sibling[i] = scan->index_first_child[parent];
+            scan->index_first_child[parent] = i;
+        }
+        g_hash_table_insert(scan->indexed, (gpointer)(strings + index_dirs[i].path_offset), GUINT_TO_POINTER(i));
+    }
+    return TRUE;
+}
+
+static void save_library_index(const char *index_path, LibraryScan *scan) {
+    LibraryIndexHeader header;
+    GByteArray *tables = g_byte_array_new();
+    GByteArray *entries = g_byte_array_new();
+    GString *strings = g_string_new(NULL);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LIBRARY_INDEX_MAGIC, sizeof(header.magic));
+
+    for (guint d = 0; d < scan->dirs->len; d++) {
+        const LibraryDir *dir = g_ptr_array_index(scan->dirs, d);
+        LibraryIndexDir index_dir;
+        memset(&index_dir, 0, sizeof(index_dir));
+        index_dir.mtime_sec = dir->st.st_mtim.tv_sec;
+        index_dir.mtime_nsec = dir->st.st_mtim.tv_nsec;
+        index_dir.path_offset = strings->len;
+        index_dir.first_entry = header.entry_count;
+        index_dir.entry_count = dir->names->len;
+        index_dir.parent = dir->parent;
+        g_string_append_len(strings, dir->path, strlen(dir->path) + 1);
+
+        for (guint i = 0; i < dir->names->len; i++) {
+            const char *name = g_ptr_array_index(dir->names, i);
+            LibraryIndexEntry entry = { strings->len };
+            g_byte_array_append(entries, (const guint8 *)&entry, sizeof(entry));
+            g_string_append_len(strings, name, strlen(name) + 1);
+        }
+
+        g_byte_array_append(tables, (const guint8 *)&index_dir, sizeof(index_dir));
+        header.dir_count++;
+        header.entry_count += index_dir.entry_count;
+    }
+    header.strings_size = strings->len;
+
+    GByteArray *file = g_byte_array_sized_new(sizeof(header) + tables->len + entries->len + strings->len);
+    g_byte_array_append(file, (const guint8 *)&header, sizeof(header));
+    g_byte_array_append(file, tables->data, tables->len);
+    g_byte_array_append(file, entries->data, entries->len);
+    g_byte_array_append(file, (const guint8 *)strings->str, strings->len);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(index_path, (const gchar *)file->data, file->len, &error)) {
+        g_warning("Could not write library index %s: %s", index_path, error->message);
+        g_error_free(error);
+    }
+
+    g_byte_array_unref(file);
+    g_byte_array_unref(tables);
+    g_byte_array_unref(entries);
+    g_string_free(strings, TRUE);
+}
+
+/* Walks every root recursively with library_scan_workers threads (the caller being one
+ * of them) and passes the songs to emit as they become known. Directories whose mtime
+ * matches the memory-mapped index are not read; their songs and subdirectories come
+ * from the index. Names under the first root are relative to it, names under the
+ * others absolute. When dir_paths_out is given, it receives the path of every
+ * directory found. */
+guint load_library(const char *index_path, const char *const *root_paths, guint root_count,
+                   LibraryBatchFunc emit, gpointer data, GPtrArray *dir_paths_out) {
+    gint64 start = g_get_monotonic_time();
+    LibraryScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.dirs = g_ptr_array_new();
+    scan.indexed = g_hash_table_new(g_str_hash, g_str_equal);
+    scan.emit = emit;
+    scan.data = data;
+    g_mutex_init(&scan.mutex);
+    g_cond_init(&scan.cond);
+    g_mutex_init(&scan.emit_mutex);
+
+    GMappedFile *index = g_mapped_file_new(index_path, FALSE, NULL);
+    gboolean index_valid = index && load_library_index(index, &scan);
+    if (index && !index_valid) {
+        g_debug("Ignoring malformed library index %s", index_path);
+        g_hash_table_remove_all(scan.indexed);
+    }
+
+    scan.worker_count = MAX(library_scan_workers, 1);
+    scan.workers = g_new0(LibraryScanWorker, scan.worker_count);
+    for (guint w = 0; w < scan.worker_count; w++) {
+        LibraryScanWorker *worker = &scan.workers[w];
+        worker->scan = &scan;
+        worker->index = w;
+        worker->owned_names = g_ptr_array_new_with_free_func(g_free);
+        worker->buffer = g_malloc(LIBRARY_SCAN_BUFFER);
+        g_mutex_init(&worker->mutex);
+        g_queue_init(&worker->dirs);
+    }
+
+    for (guint r = 0; r < root_count; r++) {
+        struct stat st;
+        if (stat(root_paths[r], &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        gchar *prefix = r == 0 ? g_strdup("") : g_strconcat(root_paths[r], "/", NULL);
+        LibraryDir *dir = library_scan_add_dir(&scan, g_strdup(root_paths[r]), prefix, &st, LIBRARY_INDEX_NO_PARENT);
+        library_scan_push(&scan.workers[r % scan.worker_count], dir);
+    }
+
+    for (guint w = 1; w < scan.worker_count; w++) {
+        scan.workers[w].thread = g_thread_new("library-scan", library_scan_run, &scan.workers[w]);
+    }
+    library_scan_run(&scan.workers[0]);
+    for (guint w = 1; w < scan.worker_count; w++) {
+        g_thread_join(scan.workers[w].thread);
+    }
+
+    guint total = 0;
+    for (guint d = 0; d < scan.dirs->len; d++) {
+        total += ((LibraryDir *)g_ptr_array_index(scan.dirs, d))->names->len;
+    }
+    guint rescanned = g_atomic_int_get(&scan.rescanned);
+    if (rescanned > 0 || !index_valid) {
+        save_library_index(index_path, &scan);
+    }
+
+    for (guint d = 0; d < scan.dirs->len; d++) {
+        LibraryDir *dir = g_ptr_array_index(scan.dirs, d);
+        if (dir_paths_out) {
+            g_ptr_array_add(dir_paths_out, dir->path);
+        } else {
+            g_free(dir->path);
+        }
+        g_free(dir->prefix);
+        g_ptr_array_unref(dir->names);
+        g_free(dir);
+    }
+    for (guint w = 0; w < scan.worker_count; w++) {
+        g_ptr_array_unref(scan.workers[w].owned_names);
+        g_free(scan.workers[w].buffer);
+        g_mutex_clear(&scan.workers[w].mutex);
+    }
+    guint dir_count = scan.dirs->len;
+    g_ptr_array_unref(scan.dirs);
+    g_hash_table_unref(scan.indexed);
+    g_free(scan.index_first_child);
+    g_free(scan.index_next_sibling);
+    g_free(scan.workers);
+    g_mutex_clear(&scan.mutex);
+    g_cond_clear(&scan.cond);
+    g_mutex_clear(&scan.emit_mutex);
+    if (index) g_mapped_file_unref(index);
+
+    trace_span(TRACE_LIBRARY_SCAN, start, g_get_monotonic_time(), total);
+    g_debug("Library: %u tracks, %u of %u dirs rescanned by %u workers, loaded in %.1f ms",
+            total, rescanned, dir_count, scan.worker_count, (g_get_monotonic_time() - start) / 1000.0);
+    return total;
+}
+
+void library_add_to_queue(const char *const *names, guint count, gpointer data) {
+    for (guint i = 0; i < count; i++) {
+        add_song(data, names[i]);
+    }
+}
+
+void load_songs_from_directory() {
+    if (!music_dir) {
+        set_status_text("No music directory selected.");
+        return;
+    }
+
+    struct stat st;
+    if (stat(music_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        set_status_text("Failed to open directory.");
+        return;
+    }
+
+    gchar **roots = library_root_paths(music_dir);
+    GPtrArray *dir_paths = g_ptr_array_new_with_free_func(g_free);
+    load_library(library_index_path, (const char *const *)roots, g_strv_length(roots), library_add_to_queue,
+                 &play_queue, dir_paths);
+    g_strfreev(roots);
+    if (library_dir_paths) g_ptr_array_unref(library_dir_paths);
+    library_dir_paths = dir_paths;
+    for (guint32 i = 0; i < play_queue.length; i++) {
+        library_track_added(play_queue.tracks[i]);
+    }
+}
+
+/* Worker side of the progressive load: copies each slice and queues it for
+ * library_loader_deliver, arming one idle at a time so batches arrive in order. */
+static void library_loader_emit(const char *const *names, guint count, gpointer data) {
+    GPtrArray *batch = g_ptr_array_new_full(count, g_free);
+    for (guint i = 0; i < count; i++) {
+        g_ptr_array_add(batch, g_strdup(names[i]));
+    }
+
+    g_mutex_lock(&library_loader_mutex);
+    g_queue_push_tail(&library_loader_batches, batch);
+    if (!library_loader_source) {
+        library_loader_source = g_idle_add(library_loader_deliver, NULL);
+    }
+    g_mutex_unlock(&library_loader_mutex);
+}
+
+/* Everything slow at startup runs here: the tag cache, the library and the playlist
+ * directory. Only the first two touch the disk for every track. */
+static gpointer library_loader_run(gpointer data) {
+    gchar **roots = data;
+    gboolean startup = library_loader_startup;
+
+    if (startup && tag_cache) {
+        load_tag_cache();
+    }
+    if (startup && dedupe_cache) {
+        load_dedupe_cache();
+    }
+    if (startup && loudness_cache) {
+        load_loudness_cache();
+    }
+    if (startup && waveform_cache) {
+        load_waveform_cache();
+    }
+    if (startup && play_counts) {
+        load_play_counts();
+    }
+
+    GPtrArray *dir_paths = g_ptr_array_new_with_free_func(g_free);
+    struct stat st;
+    if (roots[0] && stat(roots[0], &st) == 0 && S_ISDIR(st.st_mode)) {
+        load_library(library_index_path, (const char *const *)roots, g_strv_length(roots), library_loader_emit, NULL,
+                     dir_paths);
+    }
+    GPtrArray *playlists = startup ? list_playlists() : NULL;
+
+    g_mutex_lock(&library_loader_mutex);
+    library_loader_playlists = playlists;
+    library_loader_dir_paths = dir_paths;
+    library_loader_finished = TRUE;
+    if (!library_loader_source) {
+        library_loader_source = g_idle_add(library_loader_deliver, NULL);
+    }
+    g_mutex_unlock(&library_loader_mutex);
+
+    g_strfreev(roots);
+    return NULL;
+}
+
+/* Main-loop side: queues and indexes every batch that has arrived, starts playback on
+ * the first one at startup, and finishes the load once the worker is done. */
+static gboolean library_loader_deliver(gpointer data) {
+    GQueue batches = G_QUEUE_INIT;
+
+    g_mutex_lock(&library_loader_mutex);
+    batches = library_loader_batches;
+    g_queue_init(&library_loader_batches);
+    gboolean finished = library_loader_finished;
+    GPtrArray *playlists = library_loader_playlists;
+    library_loader_playlists = NULL;
+    GPtrArray *dir_paths = library_loader_dir_paths;
+    library_loader_dir_paths = NULL;
+    library_loader_source = 0;
+    g_mutex_unlock(&library_loader_mutex);
+
+    GPtrArray *batch;
+    while ((batch = g_queue_pop_head(&batches)) != NULL) {
+        for (guint i = 0; i < batch->len; i++) {
+            const char *song_name = g_ptr_array_index(batch, i);
+            if (library_loader_resync) {
+                TrackId id = track_lookup(song_name);
+                if (library_has_track(id)) {
+                    if (id < library_resync_size) library_resync_unseen[id] = 0;
+                    continue;
+                }
+                library_resync_added++;
+            }
+            if (!session_claim(song_name)) add_song(&play_queue, song_name);
+            library_track_added(track_lookup(song_name));
+        }
+        g_ptr_array_unref(batch);
+
+        if (library_loader_autoplay) {
+            library_loader_autoplay = FALSE;
+            g_debug("First %u tracks after %.1f ms", play_queue.length,
+                    (g_get_monotonic_time() - startup_started_at) / 1000.0);
+            queue_jump(&play_queue, 0);
+            play_song(track_name(queue_current(&play_queue)));
+        }
+    }
+
+    if (!finished) {
+        if (library_loader_resync) return G_SOURCE_REMOVE;
+        gchar *text = g_strdup_printf("Loading library... %u songs", play_queue.length);
+        set_status_text(text);
+        g_free(text);
+        return G_SOURCE_REMOVE;
+    }
+
+    g_thread_join(library_loader_thread);
+    library_loader_thread = NULL;
+    library_loader_finished = FALSE;
+    library_loader_autoplay = FALSE;
+
+    if (playlists) {
+        if (playlist_combo_box) add_playlist_names(playlists);
+        g_ptr_array_unref(playlists);
+    }
+    if (dir_paths) {
+        if (library_dir_paths) g_ptr_array_unref(library_dir_paths);
+        library_dir_paths = dir_paths;
+    }
+    if (library_loader_resync) {
+        library_resync_finish();
+        return G_SOURCE_REMOVE;
+    }
+
+    g_debug("Library loaded in background: %u tracks in %.1f ms", play_queue.length,
+            (g_get_monotonic_time() - library_loader_started_at) / 1000.0);
+
+    if (!music_dir) {
+        ask_for_music_directory();
+        return G_SOURCE_REMOVE;
+    }
+    session_drop_missing();
+    if (queue_current(&play_queue) == TRACK_ID_NONE && !is_empty(&play_queue)) {
+        queue_jump(&play_queue, 0);
+    }
+    set_status_text(is_empty(&play_queue) ? "No songs found in the music directory." : "Library loaded.");
+    library_watch_start();
+    prefetch_invalidate();
+    prefetch_update();
+    return G_SOURCE_REMOVE;
+}
+
+/* Replaces the queue with the library in dir_path, loaded on a worker thread. The
+ * startup load also reads the tag cache and playlists and plays the first batch, unless
+ * a restored session is already playing. */
+void library_loader_start(const char *dir_path, gboolean startup) {
+    if (library_loader_thread) return;
+
+    library_watch_stop();
+    if (!startup) {
+        library_clear();
+    }
+    library_loader_startup = startup;
+    library_loader_autoplay = startup && queue_current(&play_queue) == TRACK_ID_NONE;
+    library_loader_started_at = g_get_monotonic_time();
+    set_status_text("Loading library...");
+    library_loader_thread = g_thread_new("library-loader", library_loader_run, library_root_paths(dir_path));
+}
+
+/* Rescans the current library on the loader thread without touching the queue; the
+ * index spares the directories whose mtime did not change. Tracks the scan finds that
+ * the library lacks are added as their batch arrives, and library_resync_finish removes
+ * the ones it no longer found. */
+void library_resync_start() {
+    if (library_loader_thread || !music_dir) return;
+
+    library_loader_startup = FALSE;
+    library_loader_autoplay = FALSE;
+    library_loader_resync = TRUE;
+    library_resync_added = 0;
+    library_resync_size = library_tracks_size;
+    library_resync_unseen = g_new(guint8, MAX(library_tracks_size, 1));
+    if (library_tracks_size > 0) memcpy(library_resync_unseen, library_tracks, library_tracks_size);
+    library_loader_started_at = g_get_monotonic_time();
+    library_loader_thread = g_thread_new("library-loader", library_loader_run, library_root_paths(music_dir));
+}
+
+static void library_resync_finish() {
+    guint32 mask_size = track_count();
+    guint8 *mask = g_new0(guint8, mask_size);
+    guint removed = 0;
+    for (TrackId id = 0; id < library_resync_size; id++) {
+        if (library_resync_unseen[id] && library_has_track(id)) {
+            mask[id] = 1;
+            removed++;
+            library_track_removed(id);
+        }
+    }
+    if (removed > 0) remove_songs(&play_queue, mask, mask_size);
+    if (queue_current(&play_queue) == TRACK_ID_NONE && !is_empty(&play_queue)) {
+        queue_jump(&play_queue, 0);
+    }
+    g_free(mask);
+    g_clear_pointer(&library_resync_unseen, g_free);
+    library_resync_size = 0;
+    library_loader_resync = FALSE;
+
+    g_debug("Library resync: %u added, %u removed in %.1f ms", library_resync_added, removed,
+            (g_get_monotonic_time() - library_loader_started_at) / 1000.0);
+    gchar *text = g_strdup_printf("Library updated: %u added, %u removed", library_resync_added, removed);
+    set_status_text(text);
+    g_free(text);
+
+    /* Directories may have come or gone; changes seen during the rescan stay pending. */
+    library_watch_start();
+    prefetch_invalidate();
+    prefetch_update();
+}
+
+gboolean library_loader_busy() {
+    return library_loader_thread != NULL;
+}
+
+/* Waits for the worker and throws away whatever it had not delivered yet. */
+void library_loader_stop() {
+    if (!library_loader_thread) return;
+
+    g_thread_join(library_loader_thread);
+    library_loader_thread = NULL;
+    library_loader_finished = FALSE;
+    if (library_loader_source) {
+        g_source_remove(library_loader_source);
+        library_loader_source = 0;
+    }
+    g_queue_clear_full(&library_loader_batches, (GDestroyNotify)g_ptr_array_unref);
+    if (library_loader_playlists) {
+        g_ptr_array_unref(library_loader_playlists);
+        library_loader_playlists = NULL;
+    }
+    if (library_loader_dir_paths) {
+        g_ptr_array_unref(library_loader_dir_paths);
+        library_loader_dir_paths = NULL;
+    }
+    g_clear_pointer(&library_resync_unseen, g_free);
+    library_resync_size = 0;
+    library_loader_resync = FALSE;
+}
+
+/* Drains the inotify queue into library_pending_changes, where the latest event per
+ * file wins, and arms a single flush so a burst of events becomes one batch. A directory
+ * appearing or going away anywhere in the tree, or a lost event, triggers a resync
+ * instead (see library_resync_start). */
+static gboolean library_watch_readable(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(library_watch_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF) ||
+                ((event->mask & IN_ISDIR) && event->len > 0 && event->name[0] != '.')) {
+                library_pending_resync = TRUE;
+                continue;
+            }
+            const char *dir_path = g_hash_table_lookup(library_watch_dirs, GINT_TO_POINTER(event->wd));
+            if (event->len == 0 || (event->mask & IN_CREATE) || !dir_path) continue;
+
+            gchar *path = g_build_filename(dir_path, event->name, NULL);
+            gchar *name = library_name_for_path(path);
+            LibraryChange change = (event->mask & (IN_DELETE | IN_MOVED_FROM)) ? LIBRARY_CHANGE_REMOVE : LIBRARY_CHANGE_ADD;
+            if (name && (change == LIBRARY_CHANGE_REMOVE || is_song_file_at(AT_FDCWD, path))) {
+                g_hash_table_insert(library_pending_changes, name, GINT_TO_POINTER(change));
+            } else {
+                g_free(name);
+            }
+            g_free(path);
+        }
+    }
+
+    if (!library_watch_flush_source && (library_pending_resync || g_hash_table_size(library_pending_changes) > 0)) {
+        library_watch_flush_source = g_timeout_add(LIBRARY_WATCH_BATCH_MS, library_watch_flush, NULL);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean library_watch_flush(gpointer data) {
+    library_watch_flush_source = 0;
+
+    /* A rescan in progress would race the changes; they wait until it has finished. */
+    if (library_loader_busy()) {
+        library_watch_flush_source = g_timeout_add(LIBRARY_WATCH_BATCH_MS, library_watch_flush, NULL);
+        return G_SOURCE_REMOVE;
+    }
+    if (library_pending_resync) {
+        library_pending_resync = FALSE;
+        g_hash_table_remove_all(library_pending_changes);
+        library_resync_start();
+        return G_SOURCE_REMOVE;
+    }
+
+    guint32 mask_size = track_count();
+    guint8 *mask = g_new0(guint8, mask_size);
+    GPtrArray *added = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer name, change;
+    guint removed_count = 0;
+
+    g_hash_table_iter_init(&iter, library_pending_changes);
+    while (g_hash_table_iter_next(&iter, &name, &change)) {
+        if (GPOINTER_TO_INT(change) == LIBRARY_CHANGE_REMOVE) {
+            TrackId id = track_lookup(name);
+            if (id != TRACK_ID_NONE) {
+                mask[id] = 1;
+                removed_count++;
+                library_track_removed(id);
+            }
+        } else {
+            g_ptr_array_add(added, name);
+        }
+    }
+
+    guint32 old_length = play_queue.length;
+    if (removed_count > 0) {
+        remove_songs(&play_queue, mask, mask_size);
+        memset(mask, 0, mask_size);
+    }
+    queue_mark_present(&play_queue, mask, mask_size);
+
+    guint32 first_added = play_queue.length;
+    for (guint i = 0; i < added->len; i++) {
+        TrackId id = track_lookup(g_ptr_array_index(added, i));
+        if (id == TRACK_ID_NONE || id >= mask_size || !mask[id]) {
+            add_song(&play_queue, g_ptr_array_index(added, i));
+        }
+        library_track_added(track_lookup(g_ptr_array_index(added, i)));
+    }
+    if (queue_current(&play_queue) == TRACK_ID_NONE && !is_empty(&play_queue)) {
+        queue_jump(&play_queue, 0);
+    }
+
+    g_debug("Library watch: %u added, %u removed", play_queue.length - first_added, old_length - first_added);
+
+    g_free(mask);
+    g_ptr_array_unref(added);
+    g_hash_table_remove_all(library_pending_changes);
+    return G_SOURCE_REMOVE;
+}
+
+/* Watches every directory the last library load found. IN_CREATE is only wanted for
+ * new subdirectories; a new file is picked up once it is closed or moved in. Changes
+ * still pending from an earlier watch are kept and flushed. */
+void library_watch_start() {
+    library_watch_close();
+    if (!library_dir_paths || library_dir_paths->len == 0) return;
+
+    library_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (library_watch_fd < 0) {
+        g_warning("inotify is unavailable, library changes will not be picked up");
+        return;
+    }
+
+    if (!library_pending_changes) {
+        library_pending_changes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    if (!library_watch_dirs) {
+        library_watch_dirs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    for (guint i = 0; i < library_dir_paths->len; i++) {
+        const char *dir_path = g_ptr_array_index(library_dir_paths, i);
+        int wd = inotify_add_watch(library_watch_fd, dir_path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                   IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0) {
+            g_warning("Cannot watch %s for changes: %s", dir_path, g_strerror(errno));
+            if (errno == ENOSPC) break;
+            continue;
+        }
+        g_hash_table_insert(library_watch_dirs, GINT_TO_POINTER(wd), (gpointer)dir_path);
+    }
+
+    GIOChannel *channel = g_io_channel_unix_new(library_watch_fd);
+    library_watch_source = g_io_add_watch(channel, G_IO_IN, library_watch_readable, NULL);
+    g_io_channel_unref(channel);
+
+    if (library_pending_resync || g_hash_table_size(library_pending_changes) > 0) {
+        library_watch_flush_source = g_timeout_add(LIBRARY_WATCH_BATCH_MS, library_watch_flush, NULL);
+    }
+}
+
+static void library_watch_close() {
+    if (library_watch_source) {
+        g_source_remove(library_watch_source);
+        library_watch_source = 0;
+    }
+    if (library_watch_flush_source) {
+        g_source_remove(library_watch_flush_source);
+        library_watch_flush_source = 0;
+    }
+    if (library_watch_fd >= 0) {
+        close(library_watch_fd);
+        library_watch_fd = -1;
+    }
+    if (library_watch_dirs) {
+        g_hash_table_remove_all(library_watch_dirs);
+    }
+}
+
+/* Stops watching and forgets pending changes, before another library replaces this one. */
+void library_watch_stop() {
+    library_watch_close();
+    if (library_pending_changes) {
+        g_hash_table_remove_all(library_pending_changes);
+    }
+    library_pending_resync = FALSE;
+}
+
+static guint32 read_be32(const guint8 *p) {
+    return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) | ((guint32)p[2] << 8) | p[3];
+}
+
+static guint32 read_le32(const guint8 *p) {
+    return ((guint32)p[3] << 24) | ((guint32)p[2] << 16) | ((guint32)p[1] << 8) | p[0];
+}
+
+static guint64 read_le64(const guint8 *p) {
+    return ((guint64)read_le32(p + 4) << 32) | read_le32(p);
+}
+
+static guint32 read_syncsafe32(const guint8 *p) {
+    return ((guint32)(p[0] & 0x7f) << 21) | ((guint32)(p[1] & 0x7f) << 14) | ((guint32)(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/* Stores the first value seen for a field, replacing invalid UTF-8. */
+static void set_tag_text(char **field, const char *text, gssize length) {
+    if (*field || length == 0) return;
+    if (length < 0) length = strlen(text);
+    while (length > 0 && (text[length - 1] == '\0' || text[length - 1] == ' ')) length--;
+    if (length == 0) return;
+
+    *field = g_utf8_make_valid(text, length);
+    g_strdelimit(*field, "\t\n\r", ' ');
+}
+
+static void parse_vorbis_comment(const guint8 *data, gsize length, TrackTags *tags) {
+    if (length < 8) return;
+
+    gsize pos = 4 + (gsize)read_le32(data);
+    if (pos + 4 > length) return;
+    guint32 count = read_le32(data + pos);
+    pos += 4;
+
+    for (guint32 i = 0; i < count && pos + 4 <= length; i++) {
+        gsize size = read_le32(data + pos);
+        pos += 4;
+        if (size > length - pos) break;
+
+        const char *comment = (const char *)data + pos;
+        if (size > 6 && g_ascii_strncasecmp(comment, "TITLE=", 6) == 0) {
+            set_tag_text(&tags->title, comment + 6, size - 6);
+        } else if (size > 7 && g_ascii_strncasecmp(comment, "ARTIST=", 7) == 0) {
+            set_tag_text(&tags->artist, comment + 7, size - 7);
+        } else if (size > 6 && g_ascii_strncasecmp(comment, "ALBUM=", 6) == 0) {
+            set_tag_text(&tags->album, comment + 6, size - 6);
+        }
+        pos += size;
+    }
+}
+
+static void set_id3_text(char **field, const guint8 *data, gsize length) {
+    if (*field || length < 2) return;
+
+    const char *charset = NULL;
+    switch (data[0]) {
+        case 0: charset = "ISO-8859-1"; break;
+        case 1: charset = "UTF-16"; break;
+        case 2: charset = "UTF-16BE"; break;
+        default: break;
+    }
+
+    if (charset == NULL) {
+        set_tag_text(field, (const char *)data + 1, length - 1);
+        return;
+    }
+
+    gsize converted_length = 0;
+    gchar *converted = g_convert((const gchar *)data + 1, length - 1, "UTF-8", charset, NULL, &converted_length, NULL);
+    if (converted) {
+        set_tag_text(field, converted, strlen(converted));
+        g_free(converted);
+    }
+}
+
+/* Reads the text frames we care about from an ID3v2.2/2.3/2.4 tag, seeking past the
+ * others (cover art can make the tag several hundred kilobytes). Returns the offset of
+ * the first byte after the tag. */
+static goffset read_id3v2(FILE *file, TrackTags *tags) {
+    guint8 header[10];
+    if (fread(header, 1, 10, file) != 10 || memcmp(header, "ID3", 3) != 0) return 0;
+
+    guint version = header[3];
+    goffset end = 10 + (goffset)read_syncsafe32(header + 6) + ((header[5] & 0x10) ? 10 : 0);
+    goffset pos = 10;
+
+    if (header[5] & 0x40) {
+        guint8 extended[4];
+        if (fread(extended, 1, 4, file) != 4) return end;
+        pos += version >= 4 ? read_syncsafe32(extended) : read_be32(extended) + 4;
+    }
+
+    guint frame_header_size = version == 2 ? 6 : 10;
+    while (pos + frame_header_size <= end) {
+        guint8 frame[10];
+        if (fseeko(file, pos, SEEK_SET) != 0 || fread(frame, 1, frame_header_size, file) != frame_header_size) break;
+        if (frame[0] == 0) break;
+
+        guint32 size;
+        const char *title_id = "TIT2", *artist_id = "TPE1", *album_id = "TALB", *length_id = "TLEN";
+        guint id_length = 4;
+        if (version == 2) {
+            size = ((guint32)frame[3] << 16) | ((guint32)frame[4] << 8) | frame[5];
+            title_id = "TT2"; artist_id = "TP1"; album_id = "TAL"; length_id = "TLE";
+            id_length = 3;
+        } else {
+            size = version >= 4 ? read_syncsafe32(frame + 4) : read_be32(frame + 4);
+        }
+        pos += frame_header_size;
+        if (size == 0 || pos + size > end) break;
+
+        char **field = NULL;
+        gboolean is_length = FALSE;
+        if (memcmp(frame, title_id, id_length) == 0) field = &tags->title;
+        else if (memcmp(frame, artist_id, id_length) == 0) field = &tags->artist;
+        else if (memcmp(frame, album_id, id_length) == 0) field = &tags->album;
+        else if (memcmp(frame, length_id, id_length) == 0) is_length = TRUE;
+
+        if ((field || is_length) && size <= 4096) {
+            guint8 data[4096];
+            if (fread(data, 1, size, file) != size) break;
+            if (field) {
+                set_id3_text(field, data, size);
+            } else if (tags->duration_ms == 0) {
+                char *length_text = NULL;
+                set_id3_text(&length_text, data, size);
+                if (length_text) tags->duration_ms = (guint32)g_ascii_strtoull(length_text, NULL, 10);
+                g_free(length_text);
+            }
+        }
+        pos += size;
+    }
+    return end;
+}
+
+static void read_id3v1(FILE *file, goffset file_size, TrackTags *tags) {
+    guint8 tag[128];
+    if (file_size < 128 || fseeko(file, file_size - 128, SEEK_SET) != 0 ||
+        fread(tag, 1, 128, file) != 128 || memcmp(tag, "TAG", 3) != 0) {
+        return;
+    }
+
+    gchar *title = g_convert((const gchar *)tag + 3, strnlen((const char *)tag + 3, 30), "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+    gchar *artist = g_convert((const gchar *)tag + 33, strnlen((const char *)tag + 33, 30), "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+    gchar *album = g_convert((const gchar *)tag + 63, strnlen((const char *)tag + 63, 30), "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+    if (title) set_tag_text(&tags->title, title, -1);
+    if (artist) set_tag_text(&tags->artist, artist, -1);
+    if (album) set_tag_text(&tags->album, album, -1);
+    g_free(title);
+    g_free(artist);
+    g_free(album);
+}
+
+/* Estimates MP3 duration from the Xing/Info or VBRI frame count, or from the bitrate of
+ * the first frame for CBR files. */
+static guint32 read_mp3_duration(FILE *file, goffset audio_start, goffset file_size) {
+    static const guint16 bitrates_v1[16] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+    static const guint16 bitrates_v2[16] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+    static const guint32 sample_rates[4] = { 44100, 48000, 32000, 0 };
+    guint8 buffer[16384];
+
+    if (fseeko(file, audio_start, SEEK_SET) != 0) return 0;
+    gsize length = fread(buffer, 1, sizeof(buffer), file);
+
+    for (gsize i = 0; i + 4 <= length; i++) {
+        if (buffer[i] != 0xff || (buffer[i + 1] & 0xe0) != 0xe0) continue;
+
+        guint version = (buffer[i + 1] >> 3) & 3;       /* 3 = MPEG1, 2 = MPEG2, 0 = MPEG2.5 */
+        guint layer = (buffer[i + 1] >> 1) & 3;         /* 1 = Layer III */
+        guint bitrate_index = buffer[i + 2] >> 4;
+        guint rate_index = (buffer[i + 2] >> 2) & 3;
+        gboolean mono = (buffer[i + 3] >> 6) == 3;
+        if (version == 1 || layer != 1 || bitrate_index == 0 || bitrate_index == 15 || rate_index == 3) continue;
+
+        guint32 sample_rate = sample_rates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+        guint32 samples_per_frame = version == 3 ? 1152 : 576;
+        guint32 bitrate = (version == 3 ? bitrates_v1 : bitrates_v2)[bitrate_index] * 1000;
+        gsize side_info = version == 3 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+
+        const guint8 *xing = buffer + i + 4 + side_info;
+        const guint8 *vbri = buffer + i + 36;
+        guint32 frames = 0;
+        if (xing + 12 <= buffer + length && (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0) &&
+            (read_be32(xing + 4) & 1)) {
+            frames = read_be32(xing + 8);
+        } else if (vbri + 18 <= buffer + length && memcmp(vbri, "VBRI", 4) == 0) {
+            frames = read_be32(vbri + 14);
+        }
+
+        if (frames > 0) {
+            return (guint32)((guint64)frames * samples_per_frame * 1000 / sample_rate);
+        }
+        return (guint32)((guint64)(file_size - audio_start - (goffset)i) * 8 * 1000 / bitrate);
+    }
+    return 0;
+}
+
+static void read_flac_tags(FILE *file, TrackTags *tags) {
+    guint8 header[4];
+    gboolean last = FALSE;
+
+    if (fseeko(file, 4, SEEK_SET) != 0) return;
+    while (!last && fread(header, 1, 4, file) == 4) {
+        last = (header[0] & 0x80) != 0;
+        guint type = header[0] & 0x7f;
+        guint32 size = ((guint32)header[1] << 16) | ((guint32)header[2] << 8) | header[3];
+
+        if (type == 0 && size >= 18) {
+            guint8 info[18];
+            if (fread(info, 1, 18, file) != 18) return;
+            guint32 sample_rate = ((guint32)info[10] << 12) | ((guint32)info[11] << 4) | (info[12] >> 4);
+            guint64 samples = ((guint64)(info[13] & 0x0f) << 32) | read_be32(info + 14);
+            if (sample_rate > 0) tags->duration_ms = (guint32)(samples * 1000 / sample_rate);
+            if (fseeko(file, size - 18, SEEK_CUR) != 0) return;
+        } else if (type == 4 && size <= 16 * 1024 * 1024) {
+            guint8 *comment = g_malloc(size);
+            if (fread(comment, 1, size, file) == size) parse_vorbis_comment(comment, size, tags);
+            g_free(comment);
+        } else if (fseeko(file, size, SEEK_CUR) != 0) {
+            return;
+        }
+    }
+}
+
+/* Reassembles the first two Ogg packets (identification and comment headers) and takes
+ * the duration from the granule position of the last page. */
+static void read_ogg_tags(FILE *file, goffset file_size, TrackTags *tags) {
+    GByteArray *packets[2] = { g_byte_array_new(), g_byte_array_new() };
+    guint packet = 0;
+    guint8 header[27], lacing[255], segment[255];
+
+    if (fseeko(file, 0, SEEK_SET) != 0) goto out;
+    while (packet < 2 && fread(header, 1, 27, file) == 27 && memcmp(header, "OggS", 4) == 0) {
+        guint segments = header[26];
+        if (fread(lacing, 1, segments, file) != segments) goto out;
+        for (guint s = 0; s < segments && packet < 2; s++) {
+            if (fread(segment, 1, lacing[s], file) != lacing[s]) goto out;
+            g_byte_array_append(packets[packet], segment, lacing[s]);
+            if (lacing[s] < 255) packet++;
+            if (packets[packet < 2 ? packet : 1]->len > 16 * 1024 * 1024) goto out;
+        }
+    }
+    if (packet < 2) goto out;
+
+    guint32 sample_rate = 0;
+    guint32 pre_skip = 0;
+    const guint8 *ident = packets[0]->data;
+    const guint8 *comment = packets[1]->data;
+    if (packets[0]->len >= 16 && memcmp(ident, "\x01vorbis", 7) == 0 && packets[1]->len > 7 &&
+        memcmp(comment, "\x03vorbis", 7) == 0) {
+        sample_rate = read_le32(ident + 12);
+        parse_vorbis_comment(comment + 7, packets[1]->len - 7, tags);
+    } else if (packets[0]->len >= 19 && memcmp(ident, "OpusHead", 8) == 0 && packets[1]->len > 8 &&
+               memcmp(comment, "OpusTags", 8) == 0) {
+        sample_rate = 48000;
+        pre_skip = ident[10] | ((guint32)ident[11] << 8);
+        parse_vorbis_comment(comment + 8, packets[1]->len - 8, tags);
+    }
+
+    guint8 tail[65536];
+    goffset tail_start = MAX(file_size - (goffset)sizeof(tail), 0);
+    if (sample_rate == 0 || fseeko(file, tail_start, SEEK_SET) != 0) goto out;
+    gsize tail_length = fread(tail, 1, sizeof(tail), file);
+    for (gsize i = tail_length >= 14 ? tail_length - 13 : 0; i-- > 0; ) {
+        if (memcmp(tail + i, "OggS", 4) == 0) {
+            guint64 granule = read_le64(tail + i + 6);
+            if (granule > pre_skip) tags->duration_ms = (guint32)((granule - pre_skip) * 1000 / sample_rate);
+            break;
+        }
+    }
+
+out:
+    g_byte_array_unref(packets[0]);
+    g_byte_array_unref(packets[1]);
+}
+
+/* Walks MP4 atoms between start and end, recursing into the containers that lead to
+ * mvhd (duration) and the iTunes-style ilst metadata items. */
+static void parse_mp4_atoms(const guint8 *data, gsize start, gsize end, TrackTags *tags) {
+    gsize pos = start;
+    while (pos + 8 <= end) {
+        guint64 size = read_be32(data + pos);
+        gsize header = 8;
+        if (size == 1 && pos + 16 <= end) {
+            size = ((guint64)read_be32(data + pos + 8) << 32) | read_be32(data + pos + 12);
+            header = 16;
+        } else if (size == 0) {
+            size = end - pos;
+        }
+        if (size < header || size > end - pos) return;
+
+        const guint8 *type = data + pos + 4;
+        gsize body = pos + header;
+        gsize atom_end = pos + size;
+
+        if (memcmp(type, "moov", 4) == 0 || memcmp(type, "udta", 4) == 0 || memcmp(type, "ilst", 4) == 0) {
+            parse_mp4_atoms(data, body, atom_end, tags);
+        } else if (memcmp(type, "meta", 4) == 0) {
+            parse_mp4_atoms(data, body + 4, atom_end, tags);
+        } else if (memcmp(type, "mvhd", 4) == 0 && atom_end - body >= 32) {
+            const guint8 *mvhd = data + body;
+            guint64 timescale, duration;
+            if (mvhd[0] == 1) {
+                timescale = read_be32(mvhd + 20);
+                duration = ((guint64)read_be32(mvhd + 24) << 32) | read_be32(mvhd + 28);
+            } else {
+                timescale = read_be32(mvhd + 12);
+                duration = read_be32(mvhd + 16);
+            }
+            if (timescale > 0) tags->duration_ms = (guint32)(duration * 1000 / timescale);
+        } else if (atom_end - body > 16 && memcmp(data + body + 4, "data", 4) == 0 && read_be32(data + body) >= 16) {
+            const char *text = (const char *)data + body + 16;
+            gsize text_length = MIN((gsize)read_be32(data + body), atom_end - body) - 16;
+            if (memcmp(type, "\xa9nam", 4) == 0) set_tag_text(&tags->title, text, text_length);
+            else if (memcmp(type, "\xa9" "ART", 4) == 0) set_tag_text(&tags->artist, text, text_length);
+            else if (memcmp(type, "\xa9" "alb", 4) == 0) set_tag_text(&tags->album, text, text_length);
+        }
+        pos = atom_end;
+    }
+}
+
+static void read_mp4_tags(FILE *file, goffset file_size, TrackTags *tags) {
+    goffset pos = 0;
+    guint8 header[16];
+
+    while (pos + 8 <= file_size && fseeko(file, pos, SEEK_SET) == 0 && fread(header, 1, 8, file) == 8) {
+        guint64 size = read_be32(header);
+        if (size == 1) {
+            if (fread(header + 8, 1, 8, file) != 8) return;
+            size = ((guint64)read_be32(header + 8) << 32) | read_be32(header + 12);
+        } else if (size == 0) {
+            size = file_size - pos;
+        }
+        if (size < 8) return;
+
+        if (memcmp(header + 4, "moov", 4) == 0 && size <= 64 * 1024 * 1024) {
+            guint8 *moov = g_malloc(size);
+            if (fseeko(file, pos, SEEK_SET) == 0 && fread(moov, 1, size, file) == size) {
+                parse_mp4_atoms(moov, 0, size, tags);
+            }
+            g_free(moov);
+            return;
+        }
+        pos += size;
+    }
+}
+
+/* Reads title, artist, album and duration from ID3 (MP3), Vorbis comments (FLAC, Ogg
+ * Vorbis, Opus) or iTunes metadata (MP4/M4A), whichever the file starts with. */
+void read_track_tags(const char *path, goffset file_size, TrackTags *tags) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return;
+
+    guint8 magic[12] = { 0 };
+    if (fread(magic, 1, sizeof(magic), file) >= 8) {
+        if (memcmp(magic, "fLaC", 4) == 0) {
+            read_flac_tags(file, tags);
+        } else if (memcmp(magic, "OggS", 4) == 0) {
+            read_ogg_tags(file, file_size, tags);
+        } else if (memcmp(magic + 4, "ftyp", 4) == 0) {
+            read_mp4_tags(file, file_size, tags);
+        } else {
+            rewind(file);
+            goffset audio_start = read_id3v2(file, tags);
+            read_id3v1(file, file_size, tags);
+            if (tags->duration_ms == 0) {
+                tags->duration_ms = read_mp3_duration(file, audio_start, file_size);
+            }
+        }
+    }
+    fclose(file);
+}
+
+void track_tags_free(TrackTags *tags) {
+    g_free(tags->title);
+    g_free(tags->artist);
+    g_free(tags->album);
+    g_free(tags);
+}
+
+static gchar *song_path(const char *song_name) {
+    return g_path_is_absolute(song_name) ? g_strdup(song_name) : g_build_filename(music_dir, song_name, NULL);
+}
+
+const TrackTags *track_tags_get(TrackId id) {
+    return track_tags && id < track_tags->len ? g_ptr_array_index(track_tags, id) : NULL;
+}
+
+/* Worker: answers from the cache when path, size and mtime still match, otherwise
+ * parses the file. Results are published by tag_scan_drain through the UI channel. */
+static void tag_scan_worker(gpointer data, gpointer user_data) {
+    TagScanJob *job = data;
+    struct stat st;
+
+    if (stat(job->path, &st) != 0) {
+        job->missing = TRUE;
+    } else {
+        g_mutex_lock(&tag_cache_mutex);
+        TrackTags *cached = g_hash_table_lookup(tag_cache, job->path);
+        gboolean hit = cached && cached->size == st.st_size && cached->mtime == st.st_mtim.tv_sec;
+        g_mutex_unlock(&tag_cache_mutex);
+
+        if (!hit) {
+            job->tags = g_new0(TrackTags, 1);
+            job->tags->size = st.st_size;
+            job->tags->mtime = st.st_mtim.tv_sec;
+            read_track_tags(job->path, st.st_size, job->tags);
+        }
+    }
+
+    g_mutex_lock(&tag_cache_mutex);
+    g_ptr_array_add(tag_scan_results, job);
+    g_mutex_unlock(&tag_cache_mutex);
+    ui_post(UI_EVENT_TAG_SCAN, 0, 0, NULL);
+}
+
+void tag_scan_track(TrackId id) {
+    if (!tag_pool || !music_dir || id == TRACK_ID_NONE) return;
+
+    TagScanJob *job = g_new0(TagScanJob, 1);
+    job->id = id;
+    job->path = song_path(track_name(id));
+
+    if (tag_scan_done == tag_scan_total) {
+        tag_scan_started = g_get_monotonic_time();
+        tag_scan_parsed = 0;
+    }
+    tag_scan_total++;
+    g_thread_pool_push(tag_pool, job, NULL);
+}
+
+/* Moves finished worker results into the cache and track_tags. */
+static guint tag_scan_publish() {
+    g_mutex_lock(&tag_cache_mutex);
+    GPtrArray *results = tag_scan_results;
+    tag_scan_results = g_ptr_array_new();
+
+    for (guint i = 0; i < results->len; i++) {
+        TagScanJob *job = g_ptr_array_index(results, i);
+        TrackTags *tags = job->tags;
+
+        if (tags) {
+            g_hash_table_replace(tag_cache, job->path, tags);
+            job->path = NULL;
+            tag_cache_dirty = TRUE;
+            tag_scan_parsed++;
+        } else if (!job->missing) {
+            tags = g_hash_table_lookup(tag_cache, job->path);
+        }
+
+        if (job->id >= track_tags->len) {
+            g_ptr_array_set_size(track_tags, job->id + 1);
+        }
+        g_ptr_array_index(track_tags, job->id) = tags;
+        if (job->tags) {
+            search_index_track(job->id);
+        }
+        smart_playlists_update(job->id, !job->missing);
+        g_free(job->path);
+        g_free(job);
+    }
+    g_mutex_unlock(&tag_cache_mutex);
+
+    guint count = results->len;
+    g_ptr_array_unref(results);
+    return count;
+}
+
+/* Reports progress while the pool works, then writes the cache and logs throughput. */
+static void tag_scan_drain() {
+    guint published = tag_scan_publish();
+    if (published == 0) return;
+
+    tag_scan_done += published;
+    if (tag_scan_done < tag_scan_total) {
+        gchar *text = g_strdup_printf("Scanning tags %u/%u", tag_scan_done, tag_scan_total);
+        set_status_text(text);
+        g_free(text);
+        return;
+    }
+
+    trace_span(TRACE_TAG_SCAN, tag_scan_started, g_get_monotonic_time(), tag_scan_total);
+    gdouble seconds = (g_get_monotonic_time() - tag_scan_started) / (gdouble)G_USEC_PER_SEC;
+    g_debug("Tag scan: %u files (%u parsed) in %.2f s, %.0f files/sec", tag_scan_total, tag_scan_parsed,
+            seconds, seconds > 0 ? tag_scan_total / seconds : 0.0);
+    if (tag_cache_dirty) {
+        save_tag_cache();
+    }
+}
+
+/* One line per file: size, mtime, duration in ms, title, artist, album, path. */
+void load_tag_cache() {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(TAG_CACHE_FILE, &contents, NULL, NULL)) return;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_mutex_lock(&tag_cache_mutex);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        gchar **fields = g_strsplit(lines[i], "\t", 7);
+        if (g_strv_length(fields) == 7 && fields[6][0] != '\0') {
+            TrackTags *tags = g_new0(TrackTags, 1);
+            tags->size = g_ascii_strtoll(fields[0], NULL, 10);
+            tags->mtime = g_ascii_strtoll(fields[1], NULL, 10);
+            tags->duration_ms = (guint32)g_ascii_strtoull(fields[2], NULL, 10);
+            tags->title = fields[3][0] ? g_strdup(fields[3]) : NULL;
+            tags->artist = fields[4][0] ? g_strdup(fields[4]) : NULL;
+            tags->album = fields[5][0] ? g_strdup(fields[5]) : NULL;
+            g_hash_table_replace(tag_cache, g_strdup(fields[6]), tags);
+        }
+        g_strfreev(fields);
+    }
+    g_mutex_unlock(&tag_cache_mutex);
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+void save_tag_cache() {
+    GString *contents = g_string_new(NULL);
+    GHashTableIter iter;
+    gpointer path, value;
+
+    g_mutex_lock(&tag_cache_mutex);
+    g_hash_table_iter_init(&iter, tag_cache);
+    while (g_hash_table_iter_next(&iter, &path, &value)) {
+        const TrackTags *tags = value;
+        g_string_append_printf(contents, "%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%u\t%s\t%s\t%s\t%s\n",
+                               tags->size, tags->mtime, tags->duration_ms, tags->title ? tags->title : "",
+                               tags->artist ? tags->artist : "", tags->album ? tags->album : "", (const char *)path);
+    }
+    tag_cache_dirty = FALSE;
+    g_mutex_unlock(&tag_cache_mutex);
+
+    g_file_set_contents(TAG_CACHE_FILE, contents->str, contents->len, NULL);
+    g_string_free(contents, TRUE);
+}
+
+void tag_scanner_start() {
+    tag_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)track_tags_free);
+    tag_scan_results = g_ptr_array_new();
+    track_tags = g_ptr_array_new();
+    tag_pool = g_thread_pool_new(tag_scan_worker, NULL, g_get_num_processors(), FALSE, NULL);
+}
+
+void tag_scanner_stop() {
+    if (!tag_pool) return;
+
+    g_thread_pool_free(tag_pool, TRUE, TRUE);
+    tag_pool = NULL;
+    tag_scan_publish();
+    if (tag_cache_dirty) {
+        save_tag_cache();
+    }
+}
+
+static guint64 content_hash_round(guint64 acc, guint64 input) {
+    acc += input * CONTENT_HASH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * CONTENT_HASH_PRIME1;
+}
+
+static guint64 content_hash_merge(guint64 hash, guint64 lane) {
+    hash ^= content_hash_round(0, lane);
+    return hash * CONTENT_HASH_PRIME1 + CONTENT_HASH_PRIME4;
+}
+
+static guint64 content_hash_read64(const guint8 *data) {
+    guint64 value;
+    memcpy(&value, data, sizeof(value));
+    return GUINT64_FROM_LE(value);
+}
+
+/* XXH64 with seed 0, so hashes can be checked with xxhsum. */
+void content_hash_init(ContentHash *state) {
+    memset(state, 0, sizeof(*state));
+    state->lanes[0] = CONTENT_HASH_PRIME1 + CONTENT_HASH_PRIME2;
+    state->lanes[1] = CONTENT_HASH_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -CONTENT_HASH_PRIME1;
+}
+
+/* Four independent lanes per 32-byte stripe keep the multipliers busy, so the hash runs
+ * at several GB/s per core, well above what a disk delivers. */
+void content_hash_update(ContentHash *state, const guint8 *data, gsize length) {
+    state->total += length;
+
+    if (state->buffered) {
+        gsize take = MIN(length, sizeof(state->buffer) - state->buffered);
+        memcpy(state->buffer + state->buffered, data, take);
+        state->buffered += take;
+        data += take;
+        length -= take;
+        if (state->buffered < sizeof(state->buffer)) return;
+        for (int lane = 0; lane < 4; lane++) {
+            state->lanes[lane] = content_hash_round(state->lanes[lane], content_hash_read64(state->buffer + lane * 8));
+        }
+        state->buffered = 0;
+    }
+
+    guint64 v0 = state->lanes[0], v1 = state->lanes[1], v2 = state->lanes[2], v3 = state->lanes[3];
+    for (; length >= 32; data += 32, length -= 32) {
+        v0 = content_hash_round(v0, content_hash_read64(data));
+        v1 = content_hash_round(v1, content_hash_read64(data + 8));
+        v2 = content_hash_round(v2, content_hash_read64(data + 16));
+        v3 = content_hash_round(v3, content_hash_read64(data + 24));
+    }
+    state->lanes[0] = v0;
+    state->lanes[1] = v1;
+    state->lanes[2] = v2;
+    state->lanes[3] = v3;
+
+    memcpy(state->buffer, data, length);
+    state->buffered = length;
+}
+
+guint64 content_hash_finish(const ContentHash *state) {
+    guint64 hash;
+    if (state->total >= 32) {
+        const guint64 *v = state->lanes;
+        hash = ((v[0] << 1) | (v[0] >> 63)) + ((v[1] << 7) | (v[1] >> 57)) +
+               ((v[2] << 12) | (v[2] >> 52)) + ((v[3] << 18) | (v[3] >> 46));
+        for (int lane = 0; lane < 4; lane++) {
+            hash = content_hash_merge(hash, v[lane]);
+        }
+    } else {
+        hash = CONTENT_HASH_PRIME5;
+    }
+    hash += state->total;
+
+    const guint8 *data = state->buffer;
+    gsize length = state->buffered;
+    for (; length >= 8; data += 8, length -= 8) {
+        hash ^= content_hash_round(0, content_hash_read64(data));
+        hash = ((hash << 27) | (hash >> 37)) * CONTENT_HASH_PRIME1 + CONTENT_HASH_PRIME4;
+    }
+    if (length >= 4) {
+        guint32 word;
+        memcpy(&word, data, sizeof(word));
+        hash ^= (guint64)GUINT32_FROM_LE(word) * CONTENT_HASH_PRIME1;
+        hash = ((hash << 23) | (hash >> 41)) * CONTENT_HASH_PRIME2 + CONTENT_HASH_PRIME3;
+        data += 4;
+        length -= 4;
+    }
+    for (; length > 0; data++, length--) {
+        hash ^= *data * CONTENT_HASH_PRIME5;
+        hash = ((hash << 11) | (hash >> 53)) * CONTENT_HASH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= CONTENT_HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= CONTENT_HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* The audio of an MP3 without its tags: an ID3v2 block (and footer) at the start and an
+ * ID3v1 trailer at the end are left out, so retagging a copy does not make it unique.
+ * Other formats are hashed whole. */
+static goffset content_payload_bounds(int fd, goffset size, goffset *end) {
+    guint8 header[10];
+    goffset start = 0;
+    *end = size;
+
+    if (pread(fd, header, sizeof(header), 0) == sizeof(header) && memcmp(header, "ID3", 3) == 0 &&
+        header[3] != 0xff && header[4] != 0xff && !((header[6] | header[7] | header[8] | header[9]) & 0x80)) {
+        start = 10 + ((goffset)header[6] << 21 | header[7] << 14 | header[8] << 7 | header[9]);
+        if (header[5] & 0x10) start += 10;
+    }
+
+    char trailer[3];
+    if (size >= 128 && pread(fd, trailer, sizeof(trailer), size - 128) == sizeof(trailer) &&
+        memcmp(trailer, "TAG", 3) == 0) {
+        *end = size - 128;
+    }
+    if (start > *end) start = *end;
+    return start;
+}
+
+/* Hashes the payload of a file with plain sequential reads into buffer, then drops the
+ * file from the page cache so a pass over the whole library does not evict what is
+ * playing. */
+gboolean content_hash_file(const char *path, guint8 *buffer, guint64 *hash, guint64 *hashed_bytes) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return FALSE;
+    }
+
+    goffset end;
+    goffset offset = content_payload_bounds(fd, st.st_size, &end);
+    posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+
+    ContentHash state;
+    content_hash_init(&state);
+    gboolean ok = TRUE;
+    while (offset < end) {
+        ssize_t length = pread(fd, buffer, MIN((goffset)DEDUPE_READ_CHUNK, end - offset), offset);
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) continue;
+            ok = FALSE;
+            break;
+        }
+        content_hash_update(&state, buffer, length);
+        offset += length;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (!ok) return FALSE;
+
+    /* 0 marks "not hashed" in track_hashes. */
+    *hash = MAX(content_hash_finish(&state), 1);
+    *hashed_bytes = state.total;
+    return TRUE;
+}
+
+/* One read buffer per worker thread, freed with the thread. */
+static guint8 *dedupe_thread_buffer() {
+    guint8 *buffer = g_private_get(&dedupe_buffer);
+    if (!buffer) {
+        buffer = g_malloc(DEDUPE_READ_CHUNK);
+        g_private_set(&dedupe_buffer, buffer);
+    }
+    return buffer;
+}
+
+/* Worker: answers from the cache when path, size and mtime still match, otherwise
+ * reads and hashes the file. Results are published by dedupe_drain through the UI
+ * channel. */
+static void dedupe_worker(gpointer data, gpointer user_data) {
+    DedupeJob *job = data;
+    struct stat st;
+
+    if (stat(job->path, &st) != 0) {
+        job->missing = TRUE;
+    } else {
+        g_mutex_lock(&dedupe_mutex);
+        ContentHashInfo *cached = g_hash_table_lookup(dedupe_cache, job->path);
+        if (cached && cached->size == st.st_size && cached->mtime == st.st_mtim.tv_sec) {
+            job->hash = cached->hash;
+        }
+        g_mutex_unlock(&dedupe_mutex);
+
+        if (job->hash == 0 && content_hash_file(job->path, dedupe_thread_buffer(), &job->hash, &job->hashed_bytes)) {
+            job->info = g_new0(ContentHashInfo, 1);
+            job->info->size = st.st_size;
+            job->info->mtime = st.st_mtim.tv_sec;
+            job->info->hash = job->hash;
+        }
+    }
+
+    g_mutex_lock(&dedupe_mutex);
+    g_ptr_array_add(dedupe_results, job);
+    g_mutex_unlock(&dedupe_mutex);
+    ui_post(UI_EVENT_DEDUPE, 0, 0, NULL);
+}
+
+void dedupe_track(TrackId id) {
+    if (!dedupe_pool || !music_dir || id == TRACK_ID_NONE) return;
+
+    DedupeJob *job = g_new0(DedupeJob, 1);
+    job->id = id;
+    job->path = song_path(track_name(id));
+    job->generation = dedupe_generation;
+
+    if (dedupe_done == dedupe_total) {
+        dedupe_started = g_get_monotonic_time();
+        dedupe_hashed = 0;
+        dedupe_hashed_bytes = 0;
+    }
+    dedupe_total++;
+    g_thread_pool_push(dedupe_pool, job, NULL);
+}
+
+/* Called before a finished download is added: if its audio turns out to be in the
+ * library already, the new file is deleted instead of being listed twice. */
+void dedupe_note_download(const char *path) {
+    if (!dedupe_pool) return;
+
+    gchar *name = library_name_for_path(path);
+    if (name) g_hash_table_add(dedupe_downloads, GUINT_TO_POINTER(track_intern(name) + 1));
+    g_free(name);
+}
+
+gboolean dedupe_is_hidden(TrackId id) {
+    return dedupe_hidden && g_hash_table_contains(dedupe_hidden, GUINT_TO_POINTER(id + 1));
+}
+
+/* Takes the finished worker results and moves fresh hashes into the cache. */
+static GPtrArray *dedupe_publish() {
+    g_mutex_lock(&dedupe_mutex);
+    GPtrArray *results = dedupe_results;
+    dedupe_results = g_ptr_array_new();
+    for (guint i = 0; i < results->len; i++) {
+        DedupeJob *job = g_ptr_array_index(results, i);
+        if (job->info) {
+            g_hash_table_replace(dedupe_cache, g_ref_string_new(job->path), job->info);
+            job->info = NULL;
+            dedupe_cache_dirty = TRUE;
+            dedupe_hashed++;
+            dedupe_hashed_bytes += job->hashed_bytes;
+        }
+    }
+    g_mutex_unlock(&dedupe_mutex);
+    return results;
+}
+
+static void dedupe_set_owner(guint64 hash, TrackId id) {
+    guint64 *key = g_new(guint64, 1);
+    *key = hash;
+    g_hash_table_replace(dedupe_owners, key, GUINT_TO_POINTER(id + 1));
+}
+
+/* Hidden copies are also listed by hash, so a removed kept track can hand over to one. */
+static void dedupe_hide(TrackId id, guint64 hash) {
+    g_hash_table_add(dedupe_hidden, GUINT_TO_POINTER(id + 1));
+    GArray *copies = g_hash_table_lookup(dedupe_copies, &hash);
+    if (!copies) {
+        guint64 *key = g_new(guint64, 1);
+        *key = hash;
+        copies = g_array_new(FALSE, FALSE, sizeof(TrackId));
+        g_hash_table_insert(dedupe_copies, key, copies);
+    }
+    g_array_append_val(copies, id);
+}
+
+static void dedupe_unhide(TrackId id, guint64 hash) {
+    if (!g_hash_table_remove(dedupe_hidden, GUINT_TO_POINTER(id + 1))) return;
+
+    GArray *copies = g_hash_table_lookup(dedupe_copies, &hash);
+    for (guint i = 0; copies && i < copies->len; i++) {
+        if (g_array_index(copies, TrackId, i) == id) {
+            g_array_remove_index_fast(copies, i);
+            break;
+        }
+    }
+    if (copies && copies->len == 0) g_hash_table_remove(dedupe_copies, &hash);
+}
+
+/* Whether a kept track can still stand for its group. One whose file went away before
+ * the library watcher noticed must not get a new copy hidden, let alone deleted. */
+static gboolean dedupe_owner_present(TrackId id) {
+    if (!library_has_track(id)) return FALSE;
+
+    gchar *path = song_path(track_name(id));
+    gboolean present = g_file_test(path, G_FILE_TEST_EXISTS);
+    g_free(path);
+    return present;
+}
+
+/* The kept track of hash left the library: the earliest hidden copy still in it takes
+ * its place and goes back into the queue, search and smart playlists. */
+static void dedupe_promote(guint64 hash) {
+    GArray *copies = g_hash_table_lookup(dedupe_copies, &hash);
+    TrackId promoted = TRACK_ID_NONE;
+    for (guint i = 0; copies && i < copies->len; i++) {
+        TrackId id = g_array_index(copies, TrackId, i);
+        if (id < promoted && library_has_track(id)) promoted = id;
+    }
+    if (promoted == TRACK_ID_NONE) return;
+
+    dedupe_set_owner(hash, promoted);
+    dedupe_restore(promoted, hash);
+}
+
+/* Brings a hidden copy that is now kept back into the queue, search and smart playlists. */
+static void dedupe_restore(TrackId id, guint64 hash) {
+    if (!dedupe_is_hidden(id)) return;
+
+    dedupe_unhide(id, hash);
+    add_song(&play_queue, track_name(id));
+    search_index_track(id);
+    smart_playlists_update(id, TRUE);
+    g_debug("Duplicate: %s is kept now", track_name(id));
+}
+
+/* Files with the same content hash form a group. The track interned first is kept
+ * and the others are taken out of the queue and search, but stay on disk. A fresh
+ * download is never the one kept: it is deleted and reported instead. */
+static void dedupe_drain() {
+    GPtrArray *results = dedupe_publish();
+    if (results->len == 0) {
+        g_ptr_array_unref(results);
+        return;
+    }
+
+    guint32 mask_size = track_count();
+    guint8 *mask = NULL;
+    for (guint i = 0; i < results->len; i++) {
+        DedupeJob *job = g_ptr_array_index(results, i);
+        gboolean current = job->generation == dedupe_generation;
+        gboolean downloaded = current && g_hash_table_remove(dedupe_downloads, GUINT_TO_POINTER(job->id + 1));
+
+        /* Results for a library that has since been replaced, or for a track that left
+         * it while being hashed, change nothing. */
+        if (current && !job->missing && job->hash != 0 && library_has_track(job->id)) {
+            if (job->id >= track_hashes->len) g_array_set_size(track_hashes, job->id + 1);
+            guint64 previous = g_array_index(track_hashes, guint64, job->id);
+            if (previous != 0 && previous != job->hash) dedupe_track_removed(job->id);
+            g_array_index(track_hashes, guint64, job->id) = job->hash;
+
+            gpointer owner = g_hash_table_lookup(dedupe_owners, &job->hash);
+            TrackId kept = owner ? GPOINTER_TO_UINT(owner) - 1 : job->id;
+            TrackId duplicate = TRACK_ID_NONE;
+            if (owner && kept != job->id && !dedupe_owner_present(kept)) {
+                g_debug("Duplicate: %s is gone, %s is kept instead", track_name(kept), track_name(job->id));
+                owner = NULL;
+                kept = job->id;
+            }
+            if (!owner) {
+                dedupe_set_owner(job->hash, job->id);
+                dedupe_restore(job->id, job->hash);
+            } else if (kept != job->id && job->id < kept && !downloaded) {
+                dedupe_set_owner(job->hash, job->id);
+                dedupe_restore(job->id, job->hash);
+                duplicate = kept;
+                kept = job->id;
+            } else if (kept != job->id) {
+                duplicate = job->id;
+            }
+
+            if (duplicate != TRACK_ID_NONE && duplicate < mask_size) {
+                if (!mask) mask = g_new0(guint8, mask_size);
+                mask[duplicate] = 1;
+                search_remove_track(duplicate);
+                smart_playlists_update(duplicate, FALSE);
+                if (downloaded && duplicate == job->id) {
+                    g_debug("Download %s duplicates %s, deleting it", job->path, track_name(kept));
+                    unlink(job->path);
+                    gchar *text = g_strdup_printf("Already in library as %s", track_name(kept));
+                    set_status_text(text);
+                    g_free(text);
+                } else {
+                    g_debug("Duplicate: %s has the same audio as %s", track_name(duplicate), track_name(kept));
+                    dedupe_hide(duplicate, job->hash);
+                }
+            }
+        }
+        g_free(job->path);
+        g_free(job);
+    }
+
+    if (mask) {
+        remove_songs(&play_queue, mask, mask_size);
+        g_free(mask);
+    }
+
+    dedupe_done += results->len;
+    g_ptr_array_unref(results);
+    if (dedupe_cache_dirty && !dedupe_save_source) {
+        dedupe_save_source = g_timeout_add(DEDUPE_SAVE_DELAY_MS, dedupe_save_due, NULL);
+    }
+    if (dedupe_done < dedupe_total) return;
+
+    gdouble seconds = (g_get_monotonic_time() - dedupe_started) / (gdouble)G_USEC_PER_SEC;
+    trace_span(TRACE_DEDUPE, dedupe_started, g_get_monotonic_time(), dedupe_total);
+    g_debug("Dedupe: %u files (%u hashed, %.1f MB) in %.2f s, %.0f MB/s, %u duplicates", dedupe_total,
+            dedupe_hashed, dedupe_hashed_bytes / 1e6, seconds, seconds > 0 ? dedupe_hashed_bytes / 1e6 / seconds : 0.0,
+            g_hash_table_size(dedupe_hidden));
+}
+
+/* A track that leaves the library, or whose content changed, drops out of its group.
+ * If it was the kept one, a hidden copy takes its place. */
+void dedupe_track_removed(TrackId id) {
+    if (!dedupe_owners || id >= track_hashes->len) return;
+
+    guint64 hash = g_array_index(track_hashes, guint64, id);
+    if (hash == 0) return;
+    g_array_index(track_hashes, guint64, id) = 0;
+    dedupe_unhide(id, hash);
+
+    gpointer owner = g_hash_table_lookup(dedupe_owners, &hash);
+    if (owner && GPOINTER_TO_UINT(owner) - 1 == id) {
+        g_hash_table_remove(dedupe_owners, &hash);
+        dedupe_promote(hash);
+    }
+}
+
+/* Forgets every group when another library replaces this one. Hashes still in flight
+ * belong to the old library and are dropped by dedupe_drain. */
+void dedupe_reset() {
+    if (!dedupe_pool) return;
+
+    dedupe_generation++;
+    g_hash_table_remove_all(dedupe_owners);
+    g_hash_table_remove_all(dedupe_hidden);
+    g_hash_table_remove_all(dedupe_copies);
+    g_hash_table_remove_all(dedupe_downloads);
+    g_array_set_size(track_hashes, 0);
+}
+
+/* Duplicate groups as "kept = copy, copy" lines, the first max_groups of them, after a
+ * summary line with the space the hidden copies take. */
+gchar *dedupe_report_text(guint max_groups) {
+    if (!dedupe_hidden || g_hash_table_size(dedupe_hidden) == 0) return g_strdup("");
+
+    GHashTable *groups = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_ptr_array_unref);
+    guint64 bytes = 0;
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, dedupe_hidden);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        TrackId id = GPOINTER_TO_UINT(key) - 1;
+        guint64 hash = id < track_hashes->len ? g_array_index(track_hashes, guint64, id) : 0;
+        gpointer owner = g_hash_table_lookup(dedupe_owners, &hash);
+        if (!owner) continue;
+
+        GPtrArray *copies = g_hash_table_lookup(groups, owner);
+        if (!copies) {
+            copies = g_ptr_array_new();
+            g_hash_table_insert(groups, owner, copies);
+        }
+        g_ptr_array_add(copies, (gpointer)track_name(id));
+
+        struct stat st;
+        gchar *path = song_path(track_name(id));
+        if (stat(path, &st) == 0) bytes += st.st_size;
+        g_free(path);
+    }
+
+    GString *text = g_string_new(NULL);
+    g_string_append_printf(text, "  duplicates: %u groups, %u hidden copies (%.1f MB)\n", g_hash_table_size(groups),
+                           g_hash_table_size(dedupe_hidden), bytes / 1e6);
+    guint shown = 0;
+    gpointer value;
+    g_hash_table_iter_init(&iter, groups);
+    while (shown++ < max_groups && g_hash_table_iter_next(&iter, &key, &value)) {
+        GPtrArray *copies = value;
+        g_string_append_printf(text, "    %s =", track_name(GPOINTER_TO_UINT(key) - 1));
+        for (guint i = 0; i < copies->len; i++) {
+            g_string_append_printf(text, "%s %s", i ? "," : "", (const char *)g_ptr_array_index(copies, i));
+        }
+        g_string_append_c(text, '\n');
+    }
+    g_hash_table_unref(groups);
+    return g_string_free(text, FALSE);
+}
+
+/* One line per file: size, mtime, content hash in hex, path. */
+void load_dedupe_cache() {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(DEDUPE_CACHE_FILE, &contents, NULL, NULL)) return;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_mutex_lock(&dedupe_mutex);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        gchar **fields = g_strsplit(lines[i], "\t", 4);
+        if (g_strv_length(fields) == 4 && fields[3][0] != '\0') {
+            ContentHashInfo *info = g_new0(ContentHashInfo, 1);
+            info->size = g_ascii_strtoll(fields[0], NULL, 10);
+            info->mtime = g_ascii_strtoll(fields[1], NULL, 10);
+            info->hash = g_ascii_strtoull(fields[2], NULL, 16);
+            g_hash_table_replace(dedupe_cache, g_ref_string_new(fields[3]), info);
+        }
+        g_strfreev(fields);
+    }
+    g_mutex_unlock(&dedupe_mutex);
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+/* Copies the cache for the writer: a reference to each path and the entry by value, so
+ * formatting and the write stay off the main thread. */
+static GArray *dedupe_cache_snapshot() {
+    GHashTableIter iter;
+    gpointer path, value;
+
+    g_mutex_lock(&dedupe_mutex);
+    GArray *entries = g_array_sized_new(FALSE, FALSE, sizeof(DedupeCacheEntry), g_hash_table_size(dedupe_cache));
+    g_hash_table_iter_init(&iter, dedupe_cache);
+    while (g_hash_table_iter_next(&iter, &path, &value)) {
+        DedupeCacheEntry entry = {g_ref_string_acquire(path), *(const ContentHashInfo *)value};
+        g_array_append_val(entries, entry);
+    }
+    dedupe_cache_dirty = FALSE;
+    g_mutex_unlock(&dedupe_mutex);
+    return entries;
+}
+
+/* The single hash-cache writer thread; with one thread, snapshots land in the order taken. */
+static void dedupe_cache_write(gpointer data, gpointer user_data) {
+    GArray *entries = data;
+    GString *contents = g_string_sized_new(entries->len * 96);
+    for (guint i = 0; i < entries->len; i++) {
+        DedupeCacheEntry *entry = &g_array_index(entries, DedupeCacheEntry, i);
+        g_string_append_printf(contents, "%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%016" G_GINT64_MODIFIER "x\t%s\n",
+                               entry->info.size, entry->info.mtime, entry->info.hash, entry->path);
+        g_ref_string_release(entry->path);
+    }
+    g_array_unref(entries);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(DEDUPE_CACHE_FILE, contents->str, contents->len, &error)) {
+        g_warning("Cannot save %s: %s", DEDUPE_CACHE_FILE, error->message);
+        g_error_free(error);
+    }
+    g_string_free(contents, TRUE);
+}
+
+/* Hashes arrive in batches while a library is scanned; they are written once things
+ * have been quiet for DEDUPE_SAVE_DELAY_MS. */
+static gboolean dedupe_save_due(gpointer data) {
+    dedupe_save_source = 0;
+    g_thread_pool_push(dedupe_save_pool, dedupe_cache_snapshot(), NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/* Hashing is bound by the disk, not the CPU, so only a few workers read at once; on a
+ * single spinning disk dedupe_workers=1 avoids seeking between files. The cache is
+ * read by the library loader at startup. */
+void dedupe_start() {
+    if (get_setting_int("dedupe", 1) == 0) return;
+
+    dedupe_cache = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_ref_string_release, g_free);
+    dedupe_results = g_ptr_array_new();
+    dedupe_owners = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    dedupe_hidden = g_hash_table_new(g_direct_hash, g_direct_equal);
+    dedupe_copies = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)g_array_unref);
+    dedupe_downloads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    track_hashes = g_array_new(FALSE, TRUE, sizeof(guint64));
+    dedupe_pool = g_thread_pool_new(dedupe_worker, NULL, MAX(get_setting_int("dedupe_workers", 2), 1), FALSE, NULL);
+    dedupe_save_pool = g_thread_pool_new(dedupe_cache_write, NULL, 1, FALSE, NULL);
+}
+
+void dedupe_stop() {
+    if (!dedupe_pool) return;
+
+    g_thread_pool_free(dedupe_pool, TRUE, TRUE);
+    dedupe_pool = NULL;
+    GPtrArray *results = dedupe_publish();
+    for (guint i = 0; i < results->len; i++) {
+        DedupeJob *job = g_ptr_array_index(results, i);
+        g_free(job->path);
+        g_free(job);
+    }
+    g_ptr_array_unref(results);
+
+    /* Writes what is still pending and waits for the writer. */
+    if (dedupe_save_source) {
+        g_source_remove(dedupe_save_source);
+        dedupe_save_source = 0;
+    }
+    if (dedupe_cache_dirty) {
+        g_thread_pool_push(dedupe_save_pool, dedupe_cache_snapshot(), NULL);
+    }
+    g_thread_pool_free(dedupe_save_pool, FALSE, TRUE);
+    dedupe_save_pool = NULL;
+}
+
+/* Copies what the snapshot needs on the main thread: the header and the queue's ids, a
+ * memcpy however long the queue. Names are resolved by the writer, which may read any
+ * interned id. */
+SessionSnapshot *session_snapshot_take(const char *path) {
+    SessionSnapshot *snapshot = g_new0(SessionSnapshot, 1);
+    SessionHeader *header = &snapshot->header;
+    memcpy(header->magic, SESSION_MAGIC, sizeof(header->magic));
+
+    gint64 position = current_position;
+    if (session_resume_at >= 0) {
+        position = session_resume_at;
+    } else if (pipeline && pipeline_is_playing) {
+        gst_element_query_position(pipeline, GST_FORMAT_TIME, &position);
+    }
+    header->position_ns = MAX(position, 0);
+    header->volume = volume_level;
+    header->flags = (is_loop_enabled ? SESSION_FLAG_LOOP : 0) |
+                    (pipeline_is_playing || session_resume_at >= 0 ? 0 : SESSION_FLAG_PAUSED);
+
+    g_mutex_lock(&queue_mutex);
+    header->track_count = play_queue.length;
+    header->position = play_queue.position;
+    header->shuffle_key = play_queue.shuffle_key;
+    if (play_queue.shuffled) header->flags |= SESSION_FLAG_SHUFFLE;
+    snapshot->tracks = g_new(TrackId, MAX(play_queue.length, 1));
+    memcpy(snapshot->tracks, play_queue.tracks, (gsize)play_queue.length * sizeof(TrackId));
+    header->segment_count = play_queue.shuffled ? play_queue.segment_count : 0;
+    snapshot->segments = g_new0(SessionSegment, MAX(header->segment_count, 1));
+    for (guint32 i = 0; i < header->segment_count; i++) {
+        const ShuffleSegment *segment = &play_queue.segments[i];
+        snapshot->segments[i] = (SessionSegment){segment->key, segment->start, segment->length, segment->head_length, 0};
+        header->head_count += segment->head_length;
+    }
+    snapshot->heads = g_new(guint32, MAX(header->head_count, 1));
+    for (guint32 i = 0, head = 0; i < header->segment_count; i++) {
+        const ShuffleSegment *segment = &play_queue.segments[i];
+        memcpy(snapshot->heads + head, segment->head, (gsize)segment->head_length * sizeof(guint32));
+        head += segment->head_length;
+    }
+    g_mutex_unlock(&queue_mutex);
+
+    if (session_resume_at >= 0 && session_resume_paused) header->flags |= SESSION_FLAG_PAUSED;
+    snapshot->path = g_strdup(path);
+    return snapshot;
+}
+
+void session_snapshot_free(SessionSnapshot *snapshot) {
+    g_free(snapshot->segments);
+    g_free(snapshot->heads);
+    g_free(snapshot->tracks);
+    g_free(snapshot->path);
+    g_free(snapshot);
+}
+
+/* Lays the snapshot out as SESSION_FILE and replaces the old file in one rename, so a
+ * crash mid-write leaves the previous session intact. */
+gboolean session_snapshot_write(SessionSnapshot *snapshot, gsize *size_out) {
+    SessionHeader *header = &snapshot->header;
+    guint32 *offsets = g_new(guint32, MAX(header->track_count, 1));
+    GByteArray *strings = g_byte_array_new();
+
+    for (guint32 i = 0; i < header->track_count; i++) {
+        const char *name = track_name(snapshot->tracks[i]);
+        if (!name) name = "";
+        offsets[i] = strings->len;
+        g_byte_array_append(strings, (const guint8 *)name, strlen(name) + 1);
+    }
+    header->strings_size = strings->len;
+
+    GByteArray *file = g_byte_array_sized_new(sizeof(SessionHeader) + header->segment_count * sizeof(SessionSegment) +
+                                              (header->head_count + header->track_count) * sizeof(guint32) + strings->len);
+    g_byte_array_append(file, (const guint8 *)header, sizeof(SessionHeader));
+    g_byte_array_append(file, (const guint8 *)snapshot->segments, header->segment_count * sizeof(SessionSegment));
+    g_byte_array_append(file, (const guint8 *)snapshot->heads, header->head_count * sizeof(guint32));
+    g_byte_array_append(file, (const guint8 *)offsets, header->track_count * sizeof(guint32));
+    g_byte_array_append(file, strings->data, strings->len);
+    g_free(offsets);
+    g_byte_array_unref(strings);
+
+    GError *error = NULL;
+    gboolean written = g_file_set_contents(snapshot->path, (const gchar *)file->data, file->len, &error);
+    if (!written) {
+        trace_error("Cannot save the session to %s: %s", snapshot->path, error->message);
+        g_error_free(error);
+    }
+    if (size_out) *size_out = file->len;
+    g_byte_array_unref(file);
+    return written;
+}
+
+/* The single session-writer thread; with one thread, snapshots land in the order taken. */
+static void session_write(gpointer data, gpointer user_data) {
+    SessionSnapshot *snapshot = data;
+    gint64 started = g_get_monotonic_time();
+    session_snapshot_write(snapshot, NULL);
+    trace_span(TRACE_SESSION_SAVE, started, g_get_monotonic_time(), snapshot->header.track_count);
+    session_snapshot_free(snapshot);
+}
+
+static gboolean session_save_due(gpointer data) {
+    session_save_source = 0;
+    g_thread_pool_push(session_pool, session_snapshot_take(SESSION_FILE), NULL);
+
+    /* The position moves on its own while playing; save it now and then so a crash
+     * resumes close to where playback was. */
+    if (pipeline_is_playing) {
+        session_save_source = g_timeout_add(SESSION_SAVE_INTERVAL_MS, session_save_due, NULL);
+        session_save_periodic = TRUE;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Called on every change worth keeping. Changes within SESSION_SAVE_DELAY_MS of each
+ * other are written once. */
+void session_mark_dirty() {
+    if (!session_pool) return;
+    if (session_save_source && !session_save_periodic) return;
+
+    if (session_save_source) g_source_remove(session_save_source);
+    session_save_source = g_timeout_add(SESSION_SAVE_DELAY_MS, session_save_due, NULL);
+    session_save_periodic = FALSE;
+}
+
+void session_start() {
+    if (get_setting_int("session", 1) == 0) return;
+    session_pool = g_thread_pool_new(session_write, NULL, 1, FALSE, NULL);
+}
+
+/* Writes the final state and waits for the writer. */
+void session_stop() {
+    if (!session_pool) return;
+
+    if (session_save_source) {
+        g_source_remove(session_save_source);
+        session_save_source = 0;
+    }
+    g_thread_pool_push(session_pool, session_snapshot_take(SESSION_FILE), NULL);
+    g_thread_pool_free(session_pool, FALSE, TRUE);
+    session_pool = NULL;
+    g_clear_pointer(&session_tracks, g_free);
+    session_tracks_size = 0;
+}
+
+/* Maps SESSION_FILE and rebuilds the queue from it before the library loader runs: the
+ * same tracks in the same order (shuffle_key and the segments reproduce the shuffled one), the same
+ * current track, loop, shuffle and volume. The current track then prerolls paused and
+ * session_resume_continue takes it to the saved position. Returns FALSE without a
+ * usable snapshot. */
+gboolean session_restore(const char *path) {
+    gint64 started = g_get_monotonic_time();
+    GMappedFile *map = g_mapped_file_new(path, FALSE, NULL);
+    if (!map) return FALSE;
+
+    const char *data = g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    const SessionHeader *header = (const SessionHeader *)data;
+    if (length < sizeof(SessionHeader) || memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) != 0 ||
+        length != sizeof(SessionHeader) + (gsize)header->segment_count * sizeof(SessionSegment) +
+                  ((gsize)header->head_count + header->track_count) * sizeof(guint32) + header->strings_size ||
+        header->track_count == 0 || data[length - 1] != '\0') {
+        g_mapped_file_unref(map);
+        return FALSE;
+    }
+    const SessionSegment *segments = (const SessionSegment *)(data + sizeof(SessionHeader));
+    const guint32 *heads = (const guint32 *)(segments + header->segment_count);
+    const guint32 *offsets = heads + header->head_count;
+    const char *strings = (const char *)(offsets + header->track_count);
+    for (guint32 i = 0; i < header->track_count; i++) {
+        if (offsets[i] >= header->strings_size) {
+            g_mapped_file_unref(map);
+            return FALSE;
+        }
+    }
+    guint64 next_start = 0, head_total = 0;
+    for (guint32 i = 0; i < header->segment_count; i++) {
+        if (segments[i].start != next_start || segments[i].head_length > segments[i].length) {
+            g_mapped_file_unref(map);
+            return FALSE;
+        }
+        for (guint32 j = 0; j < segments[i].head_length && head_total + j < header->head_count; j++) {
+            if (heads[head_total + j] >= segments[i].length) {
+                g_mapped_file_unref(map);
+                return FALSE;
+            }
+        }
+        next_start += segments[i].length;
+        head_total += segments[i].head_length;
+    }
+    if (header->segment_count > 0 && (next_start != header->track_count || head_total != header->head_count)) {
+        g_mapped_file_unref(map);
+        return FALSE;
+    }
+
+    g_mutex_lock(&queue_mutex);
+    g_free(play_queue.tracks);
+    play_queue.tracks = g_new(TrackId, header->track_count);
+    play_queue.capacity = play_queue.length = header->track_count;
+    for (guint32 i = 0; i < header->track_count; i++) {
+        play_queue.tracks[i] = track_intern(strings + offsets[i]);
+    }
+    play_queue.shuffled = (header->flags & SESSION_FLAG_SHUFFLE) != 0;
+    play_queue.shuffle_key = header->shuffle_key;
+    play_queue.position = header->position < header->track_count ? header->position : QUEUE_NO_POSITION;
+    queue_segments_free(&play_queue);
+    if (header->segment_count > 0) {
+        play_queue.segments = g_new0(ShuffleSegment, header->segment_count);
+        play_queue.segment_count = header->segment_count;
+        for (guint32 i = 0, head = 0; i < header->segment_count; i++) {
+            ShuffleSegment *segment = &play_queue.segments[i];
+            segment->start = segments[i].start;
+            segment->length = segments[i].length;
+            segment->key = segments[i].key;
+            segment->head_length = segments[i].head_length;
+            segment->head = g_new(guint32, MAX(segment->head_length, 1));
+            memcpy(segment->head, heads + head, (gsize)segment->head_length * sizeof(guint32));
+            head += segment->head_length;
+            shuffle_segment_rank(segment);
+        }
+    }
+    g_mutex_unlock(&queue_mutex);
+
+    /* Restored tracks the library loader does not deliver are dropped once it is done,
+     * if their files are gone. */
+    session_tracks_size = track_count();
+    session_tracks = g_new0(guint8, session_tracks_size);
+    for (guint32 i = 0; i < play_queue.length; i++) {
+        session_tracks[play_queue.tracks[i]] = 1;
+    }
+
+    is_loop_enabled = (header->flags & SESSION_FLAG_LOOP) != 0;
+    is_shuffle_enabled = play_queue.shuffled;
+    volume_level = CLAMP(header->volume, 0.0, 1.0);
+    if (volume_slider) {
+        gtk_range_set_value(GTK_RANGE(volume_slider), volume_level * 100.0);
+    }
+    apply_volume();
+
+    TrackId current = queue_current(&play_queue);
+    if (pipeline && current != TRACK_ID_NONE) {
+        session_resume_track(track_name(current), header->position_ns, (header->flags & SESSION_FLAG_PAUSED) != 0);
+    }
+    g_debug("Session restored: %u tracks in %.1f ms", header->track_count,
+            (g_get_monotonic_time() - started) / 1000.0);
+    g_mapped_file_unref(map);
+    return TRUE;
+}
+
+/* Loads the track paused rather than through play_song, so nothing is heard before the
+ * seek to the saved position. Any play_song in the meantime cancels the resume. */
+static void session_resume_track(const char *song_name, gint64 position, gboolean paused) {
+    gchar *local_path = song_path(song_name);
+    gboolean exists = g_file_test(local_path, G_FILE_TEST_EXISTS);
+    g_free(local_path);
+    if (!exists) return;
+
+    position_clock_reset_track();
+    reset_seek_scale();
+    seek_reset();
+    gchar *uri = song_uri(song_name);
+    g_object_set(G_OBJECT(pipeline), "uri", uri, NULL);
+    g_free(uri);
+    shuffle_note_played(track_lookup(song_name));
+    analysis_track_started(song_name);
+    update_window_title(track_lookup(song_name));
+
+    session_resume_at = position;
+    session_resume_paused = paused;
+    session_resume_seeked = FALSE;
+    current_position = position;
+    pipeline_is_playing = FALSE;
+    gst_element_set_state(pipeline, GST_STATE_PAUSED);
+    set_status_text("Restoring session...");
+}
+
+/* On ASYNC_DONE: after the preroll, seeks to the saved position; after the seek, starts
+ * playback unless the session was saved paused. */
+static void session_resume_continue() {
+    if (session_resume_at < 0 || seek_in_flight) return;
+
+    gint64 position = session_resume_at;
+    if (!session_resume_seeked) {
+        session_resume_seeked = TRUE;
+        if (position > 0 && seek_request(position, TRUE)) return;
+    }
+
+    session_resume_at = -1;
+    g_debug("Session resumed at %.1f s, %.1f ms after startup", (gdouble)position / GST_SECOND,
+            (g_get_monotonic_time() - startup_started_at) / 1000.0);
+    if (session_resume_paused) {
+        set_play_pause_icon(FALSE);
+        set_status_text("Session restored.");
+        position_clock_update();
+    } else {
+        resume_song();
+    }
+}
+
+/* Whether the library loader's name is already in the queue from the snapshot. */
+static gboolean session_claim(const char *song_name) {
+    if (!session_tracks) return FALSE;
+
+    TrackId id = track_lookup(song_name);
+    if (id == TRACK_ID_NONE || id >= session_tracks_size || !session_tracks[id]) return FALSE;
+    session_tracks[id] = 2;
+    return TRUE;
+}
+
+/* Once the library is loaded: drops restored tracks whose files are gone. */
+static void session_drop_missing() {
+    if (!session_tracks) return;
+
+    guint8 *removed = g_new0(guint8, session_tracks_size);
+    guint removed_count = 0;
+    for (TrackId id = 0; id < session_tracks_size; id++) {
+        if (session_tracks[id] != 1) continue;
+        gchar *path = song_path(track_name(id));
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            removed[id] = 1;
+            removed_count++;
+        }
+        g_free(path);
+    }
+    if (removed_count > 0) {
+        remove_songs(&play_queue, removed, session_tracks_size);
+        g_debug("Session: %u restored tracks no longer exist", removed_count);
+    }
+    g_free(removed);
+    g_clear_pointer(&session_tracks, g_free);
+    session_tracks_size = 0;
+}
+
+/* Every file that enters the library goes through here, whatever noticed it. */
+void library_track_added(TrackId id) {
+    if (id == TRACK_ID_NONE) return;
+    if (id >= library_tracks_size) {
+        guint32 size = MAX(id + 1, library_tracks_size * 2);
+        library_tracks = g_renew(guint8, library_tracks, size);
+        memset(library_tracks + library_tracks_size, 0, size - library_tracks_size);
+        library_tracks_size = size;
+    }
+    library_tracks[id] = 1;
+    search_index_track(id);
+    tag_scan_track(id);
+    dedupe_track(id);
+    smart_playlists_update(id, TRUE);
+    if (analysis_pool) {
+        analysis_request(song_path(track_name(id)), FALSE);
+    }
+}
+
+void library_track_removed(TrackId id) {
+    if (!library_has_track(id)) return;
+    library_tracks[id] = 0;
+    search_remove_track(id);
+    dedupe_track_removed(id);
+    smart_playlists_update(id, FALSE);
+}
+
+/* Whether the track is in the library, hidden duplicates included. */
+gboolean library_has_track(TrackId id) {
+    return id < library_tracks_size && library_tracks[id];
+}
+
+/* Forgets the whole library before another one replaces it: the queue and what search,
+ * duplicate detection and smart playlists know about the old tracks. */
+void library_clear() {
+    free_song_list();
+    dedupe_reset();
+    smart_playlists_clear();
+    for (TrackId id = 0; id < library_tracks_size; id++) {
+        if (library_tracks[id]) search_remove_track(id);
+    }
+    g_clear_pointer(&library_tracks, g_free);
+    library_tracks_size = 0;
+}
+
+/* Search compares NFKC-normalized, case-folded text, so fullwidth "｜" matches "|", "Ä"
+ * matches "ä", and a decomposed "A" plus combining diaeresis matches the composed form. */
+gchar *search_normalize(const char *text) {
+    gchar *normalized = g_utf8_normalize(text, -1, G_NORMALIZE_ALL_COMPOSE);
+    if (!normalized) return g_strdup("");
+    gchar *folded = g_utf8_casefold(normalized, -1);
+    g_free(normalized);
+    return folded;
+}
+
+/* Packs the three code points starting at text into one key, 21 bits each. */
+static guint64 search_trigram(const gchar *text) {
+    guint64 key = 0;
+    for (int i = 0; i < 3; i++) {
+        key = (key << 21) | g_utf8_get_char(text);
+        text = g_utf8_next_char(text);
+    }
+    return key;
+}
+
+static int search_compare_trigram(gconstpointer a, gconstpointer b) {
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The distinct trigrams of text, sorted; empty for NULL. */
+static GArray *search_trigram_set(const gchar *text) {
+    GArray *keys = g_array_new(FALSE, FALSE, sizeof(guint64));
+    if (!text) return keys;
+
+    glong length = g_utf8_strlen(text, -1);
+    const gchar *p = text;
+    for (glong i = 0; i + 3 <= length; i++, p = g_utf8_next_char(p)) {
+        guint64 key = search_trigram(p);
+        g_array_append_val(keys, key);
+    }
+    g_array_sort(keys, search_compare_trigram);
+
+    guint unique = 0;
+    for (guint i = 0; i < keys->len; i++) {
+        if (unique == 0 || g_array_index(keys, guint64, i) != g_array_index(keys, guint64, unique - 1)) {
+            g_array_index(keys, guint64, unique++) = g_array_index(keys, guint64, i);
+        }
+    }
+    g_array_set_size(keys, unique);
+    return keys;
+}
+
+static void search_posting_add(guint64 key, TrackId id) {
+    GArray *posting = g_hash_table_lookup(search_postings, &key);
+    if (!posting) {
+        gint64 *stored_key = g_new(gint64, 1);
+        *stored_key = (gint64)key;
+        posting = g_array_new(FALSE, FALSE, sizeof(TrackId));
+        g_hash_table_insert(search_postings, stored_key, posting);
+    }
+    if (posting->len == 0 || g_array_index(posting, TrackId, posting->len - 1) != id) {
+        g_array_append_val(posting, id);
+        search_entries++;
+    }
+}
+
+/* Rebuilds every posting list from the stored texts once more than half of the entries
+ * are dead, so removals and re-indexing cost amortized constant time per trigram. */
+static void search_compact() {
+    if (search_dead < SEARCH_COMPACT_MIN || search_dead * 2 <= search_entries) return;
+
+    gint64 started = g_get_monotonic_time();
+    guint64 dead = search_dead;
+    g_hash_table_remove_all(search_postings);
+    search_entries = 0;
+    search_dead = 0;
+    for (TrackId id = 0; id < search_texts->len; id++) {
+        GArray *keys = search_trigram_set(g_ptr_array_index(search_texts, id));
+        for (guint i = 0; i < keys->len; i++) {
+            search_posting_add(g_array_index(keys, guint64, i), id);
+        }
+        g_array_unref(keys);
+    }
+    g_debug("Search: dropped %" G_GUINT64_FORMAT " dead postings, %" G_GUINT64_FORMAT " left, in %.1f ms", dead,
+            search_entries, (g_get_monotonic_time() - started) / 1000.0);
+}
+
+/* (Re)indexes the file name and any known tags of a track. Re-indexing adds only the
+ * trigrams the old text lacked; entries for trigrams it no longer has, and for removed
+ * tracks, stay in the postings as dead entries, which verification against the stored
+ * text filters out, until search_compact drops them. */
+void search_index_track(TrackId id) {
+    if (!search_postings) return;
+    if (dedupe_is_hidden(id)) {
+        search_remove_track(id);
+        return;
+    }
+
+    const TrackTags *tags = track_tags_get(id);
+    gchar *raw = g_strjoin("\n", track_name(id), tags && tags->title ? tags->title : "",
+                           tags && tags->artist ? tags->artist : "", tags && tags->album ? tags->album : "", NULL);
+    gchar *text = search_normalize(raw);
+    g_free(raw);
+
+    if (id >= search_texts->len) {
+        g_ptr_array_set_size(search_texts, id + 1);
+    }
+    gchar *old_text = g_ptr_array_index(search_texts, id);
+    if (old_text && strcmp(old_text, text) == 0) {
+        g_free(text);
+        return;
+    }
+
+    GArray *old_keys = search_trigram_set(old_text);
+    GArray *new_keys = search_trigram_set(text);
+    guint i = 0, j = 0;
+    while (i < old_keys->len || j < new_keys->len) {
+        guint64 old_key = i < old_keys->len ? g_array_index(old_keys, guint64, i) : G_MAXUINT64;
+        guint64 new_key = j < new_keys->len ? g_array_index(new_keys, guint64, j) : G_MAXUINT64;
+        if (old_key == new_key) {
+            i++;
+            j++;
+        } else if (old_key < new_key) {
+            search_dead++;
+            i++;
+        } else {
+            search_posting_add(new_key, id);
+            j++;
+        }
+    }
+    g_array_unref(old_keys);
+    g_array_unref(new_keys);
+    g_free(old_text);
+    g_ptr_array_index(search_texts, id) = text;
+    search_compact();
+}
+
+void search_remove_track(TrackId id) {
+    if (search_texts && id < search_texts->len && g_ptr_array_index(search_texts, id)) {
+        GArray *keys = search_trigram_set(g_ptr_array_index(search_texts, id));
+        search_dead += keys->len;
+        g_array_unref(keys);
+        g_free(g_ptr_array_index(search_texts, id));
+        g_ptr_array_index(search_texts, id) = NULL;
+        search_compact();
+    }
+}
+
+static gboolean search_result_seen(const TrackId *results, guint count, TrackId id) {
+    for (guint i = 0; i < count; i++) {
+        if (results[i] == id) return TRUE;
+    }
+    return FALSE;
+}
+
+/* Takes the candidates from the shortest posting list among the query's trigrams and
+ * verifies each against the stored text. Queries under three characters scan the texts. */
+guint search_tracks(const char *query, TrackId *results, guint max_results) {
+    if (!search_postings) return 0;
+
+    gchar *needle = search_normalize(query);
+    glong length = g_utf8_strlen(needle, -1);
+    guint count = 0;
+
+    if (length == 0) {
+        g_free(needle);
+        return 0;
+    }
+
+    if (length < 3) {
+        for (TrackId id = 0; id < search_texts->len && count < max_results; id++) {
+            const gchar *text = g_ptr_array_index(search_texts, id);
+            if (text && strstr(text, needle)) results[count++] = id;
+        }
+        g_free(needle);
+        return count;
+    }
+
+    GArray *shortest = NULL;
+    const gchar *p = needle;
+    for (glong i = 0; i + 3 <= length; i++, p = g_utf8_next_char(p)) {
+        guint64 key = search_trigram(p);
+        GArray *posting = g_hash_table_lookup(search_postings, &key);
+        if (!posting) {
+            g_free(needle);
+            return 0;
+        }
+        if (!shortest || posting->len < shortest->len) shortest = posting;
+    }
+
+    for (guint i = 0; i < shortest->len && count < max_results; i++) {
+        TrackId id = g_array_index(shortest, TrackId, i);
+        const gchar *text = id < search_texts->len ? g_ptr_array_index(search_texts, id) : NULL;
+        if (text && strstr(text, needle) && !search_result_seen(results, count, id)) {
+            results[count++] = id;
+        }
+    }
+
+    g_free(needle);
+    return count;
+}
+
+static void on_search_changed(GtkEditable *editable, gpointer data) {
+    TrackId results[SEARCH_MAX_RESULTS];
+    const char *query = gtk_entry_get_text(GTK_ENTRY(search_entry));
+    gint64 start = g_get_monotonic_time();
+    guint count = search_tracks(query, results, G_N_ELEMENTS(results));
+
+    g_debug("Search \"%s\": %u results in %.2f ms", query, count, (g_get_monotonic_time() - start) / 1000.0);
+
+    gtk_list_store_clear(search_results_store);
+    for (guint i = 0; i < count; i++) {
+        const TrackTags *tags = track_tags_get(results[i]);
+        gchar *label = tags && tags->title
+            ? g_strdup_printf("%s - %s", tags->title, tags->artist ? tags->artist : track_name(results[i]))
+            : g_strdup(track_name(results[i]));
+        gtk_list_store_insert_with_values(search_results_store, NULL, -1, 0, label, 1, results[i], -1);
+        g_free(label);
+    }
+    gtk_entry_completion_complete(gtk_entry_get_completion(GTK_ENTRY(search_entry)));
+}
+
+/* The store already holds only matching tracks, so the completion shows every row. */
+static gboolean search_match_all(GtkEntryCompletion *completion, const gchar *key, GtkTreeIter *iter, gpointer data) {
+    return TRUE;
+}
+
+static gboolean on_search_match_selected(GtkEntryCompletion *completion, GtkTreeModel *model, GtkTreeIter *iter, gpointer data) {
+    guint id;
+    gtk_tree_model_get(model, iter, 1, &id, -1);
+
+    trace_switch_begin();
+    guint32 position = queue_find(&play_queue, id);
+    if (position == QUEUE_NO_POSITION) {
+        add_song(&play_queue, track_name(id));
+        position = queue_find(&play_queue, id);
+    }
+    queue_jump(&play_queue, position);
+    play_song(track_name(id));
+
+    gtk_entry_set_text(GTK_ENTRY(search_entry), "");
+    return TRUE;
+}
+
+/* Times a cold load (full scan, index rebuilt) against a warm load (index hit) on a
+ * synthetic library of empty .mp3 files, creating them as needed. */
+int run_library_benchmark(const char *dir, guint count) {
+    if (g_mkdir_with_parents(dir, 0755) != 0) {
+        g_printerr("Cannot create %s\n", dir);
+        return 1;
+    }
+
+    for (guint i = 0; i < count; i++) {
+        gchar *path = g_strdup_printf("%s/track-%07u.mp3", dir, i);
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            FILE *file = fopen(path, "w");
+            if (file) fclose(file);
+        }
+        g_free(path);
+    }
+
+    gchar *index_path = g_build_filename(g_get_tmp_dir(), "muzio-bench-" LIBRARY_INDEX_FILE, NULL);
+    const char *dirs[] = { dir };
+    g_unlink(index_path);
+
+    gint64 start = g_get_monotonic_time();
+    guint cold_tracks = load_library(index_path, dirs, 1, library_add_to_queue, &play_queue, NULL);
+    gint64 cold_us = g_get_monotonic_time() - start;
+    free_song_list();
+
+    start = g_get_monotonic_time();
+    guint warm_tracks = load_library(index_path, dirs, 1, library_add_to_queue, &play_queue, NULL);
+    gint64 warm_us = g_get_monotonic_time() - start;
+    free_song_list();
+
+    g_print("cold (scan + index write): %u tracks in %.1f ms\n", cold_tracks, cold_us / 1000.0);
+    g_print("warm (index hit):          %u tracks in %.1f ms\n", warm_tracks, warm_us / 1000.0);
+
+    g_unlink(index_path);
+    g_free(index_path);
+    return 0;
+}
+
+void ask_for_music_directory() {
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Select Music Directory", GTK_WINDOW(main_window),
+                                                    GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                                    "Cancel", GTK_RESPONSE_CANCEL,
+                                                    "Select", GTK_RESPONSE_ACCEPT, NULL);
+
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
         const char *selected_dir = gtk_file_chooser_get_filename(chooser);
         free_music_directory();
         music_dir = g_strdup(selected_dir);
         save_music_directory(music_dir); 
+        library_loader_start(music_dir, FALSE);
+    }
+
+    gtk_widget_destroy(dialog);
+}
+
+void change_music_directory_button(GtkWidget *widget, gpointer data) {
+    if (library_loader_busy()) {
+        set_status_text("Library is still loading.");
+        return;
+    }
+    ask_for_music_directory();
+}
+
+void update_directory_label() {
+    if (music_dir) {
+        gchar *label_text = g_strdup_printf("Directory: %s", music_dir);
+        gtk_label_set_text(GTK_LABEL(directory_label), label_text);
+        g_free(label_text);
+    }
+}
+
+void create_settings_ui() {
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    gtk_container_set_border_width(GTK_CONTAINER(vbox), 20);
+    gtk_container_add(GTK_CONTAINER(settings_window), vbox);
+
+    directory_label = gtk_label_new("Directory: ");
+    gtk_box_pack_start(GTK_BOX(vbox), directory_label, FALSE, FALSE, 0);
+    update_directory_label();
+
+    change_dir_button = gtk_button_new_with_label("Change Directory");
+    g_signal_connect(change_dir_button, "clicked", G_CALLBACK(change_music_directory_button), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), change_dir_button, FALSE, FALSE, 0);
+
+    url_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(url_entry), "Enter the song URL here");
+    gtk_box_pack_start(GTK_BOX(vbox), url_entry, FALSE, FALSE, 0);
+
+    GtkWidget *download_button = gtk_button_new_with_label("Download Song");
+    g_signal_connect(download_button, "clicked", G_CALLBACK(download_song_button), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), download_button, FALSE, FALSE, 0);
+
+    GtkWidget *cancel_downloads = gtk_button_new_with_label("Cancel Downloads");
+    g_signal_connect(cancel_downloads, "clicked", G_CALLBACK(cancel_downloads_button), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), cancel_downloads, FALSE, FALSE, 0);
+
+    GtkWidget *create_playlist_button = gtk_button_new_with_label("Create New Playlist");
+    g_signal_connect(create_playlist_button, "clicked", G_CALLBACK(on_create_playlist_button_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), create_playlist_button, FALSE, FALSE, 0);
+}
+
+void open_settings_window(GtkWidget *widget, gpointer data) {
+    if (!settings_window) {
+        settings_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+        gtk_window_set_title(GTK_WINDOW(settings_window), "Settings");
+        g_signal_connect(settings_window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+        create_settings_ui();
+    }
+
+    gtk_widget_show_all(settings_window);
+}
+
+void create_ui() {
+    gtk_window_set_default_size(GTK_WINDOW(main_window), 400, 300);
+
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    gtk_container_set_border_width(GTK_CONTAINER(vbox), 20);
+    gtk_container_add(GTK_CONTAINER(main_window), vbox);
+
+    GtkWidget *time_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    current_time_label = gtk_label_new("0:00");
+    total_time_label = gtk_label_new("0:00");
+    gtk_box_pack_start(GTK_BOX(time_box), current_time_label, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(time_box), total_time_label, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), time_box, FALSE, FALSE, 0);
+
+    seek_scale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0, 100, 1);
+    gtk_scale_set_draw_value(GTK_SCALE(seek_scale), FALSE);
+    g_signal_connect(seek_scale, "change-value", G_CALLBACK(on_seek_change_value), NULL);
+    g_signal_connect(seek_scale, "button-press-event", G_CALLBACK(on_seek_button_press), NULL);
+    g_signal_connect(seek_scale, "button-release-event", G_CALLBACK(on_seek_button_release), NULL);
+    if (waveform_cache) {
+        gtk_widget_set_size_request(seek_scale, -1, 48);
+        g_signal_connect(seek_scale, "draw", G_CALLBACK(on_seek_scale_draw), NULL);
+    }
+    gtk_box_pack_start(GTK_BOX(vbox), seek_scale, FALSE, FALSE, 0);
+
+    GtkWidget *controls_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(vbox), controls_hbox, FALSE, FALSE, 0);
+
+    GtkWidget *previous_button = gtk_button_new_from_icon_name("media-skip-backward", GTK_ICON_SIZE_BUTTON);
+    g_signal_connect(previous_button, "clicked", G_CALLBACK(previous_song_button), NULL);
+    gtk_box_pack_start(GTK_BOX(controls_hbox), previous_button, TRUE, TRUE, 0);
+
+    play_pause_button = gtk_button_new();
+    GtkWidget *play_icon = gtk_image_new_from_icon_name("media-playback-start", GTK_ICON_SIZE_BUTTON);
+    gtk_button_set_image(GTK_BUTTON(play_pause_button), play_icon);
+    g_signal_connect(play_pause_button, "clicked", G_CALLBACK(play_pause_button_toggled), NULL);
+    gtk_box_pack_start(GTK_BOX(controls_hbox), play_pause_button, TRUE, TRUE, 0);
+
+    GtkWidget *next_button = gtk_button_new_from_icon_name("media-skip-forward", GTK_ICON_SIZE_BUTTON);
+    g_signal_connect(next_button, "clicked", G_CALLBACK(next_song_button), NULL);
+    gtk_box_pack_start(GTK_BOX(controls_hbox), next_button, TRUE, TRUE, 0);
+
+    status_label = gtk_label_new("Playing Song...");
+    gtk_box_pack_start(GTK_BOX(vbox), status_label, FALSE, FALSE, 0);
+
+    GtkWidget *extra_controls_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(vbox), extra_controls_hbox, FALSE, FALSE, 0);
+
+    GtkWidget *loop_button = gtk_button_new();
+    GtkWidget *loop_icon = gtk_image_new_from_icon_name("media-playlist-repeat", GTK_ICON_SIZE_BUTTON); 
+    gtk_button_set_image(GTK_BUTTON(loop_button), loop_icon);
+    g_signal_connect(loop_button, "clicked", G_CALLBACK(toggle_loop), NULL);
+    gtk_box_pack_start(GTK_BOX(extra_controls_hbox), loop_button, TRUE, TRUE, 0);
+
+    GtkWidget *shuffle_button = gtk_button_new();
+    GtkWidget *shuffle_icon = gtk_image_new_from_icon_name("media-playlist-shuffle", GTK_ICON_SIZE_BUTTON);
+    gtk_button_set_image(GTK_BUTTON(shuffle_button), shuffle_icon);
+    g_signal_connect(shuffle_button, "clicked", G_CALLBACK(toggle_shuffle), NULL);
+    gtk_box_pack_start(GTK_BOX(extra_controls_hbox), shuffle_button, TRUE, TRUE, 0);
+
+    GtkWidget *volume_label = gtk_label_new("Volume:");
+    gtk_box_pack_start(GTK_BOX(vbox), volume_label, FALSE, FALSE, 0);
+
+    volume_slider = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0.0, 100.0, 1.0); 
+    gtk_range_set_value(GTK_RANGE(volume_slider), 100.0);
+    g_signal_connect(volume_slider, "value-changed", G_CALLBACK(on_volume_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), volume_slider, FALSE, FALSE, 0);
+
+    GtkWidget *playlist_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(vbox), playlist_hbox, FALSE, FALSE, 0);
+
+    playlist_combo_box = GTK_COMBO_BOX_TEXT(gtk_combo_box_text_new());
+    gtk_box_pack_start(GTK_BOX(playlist_hbox), GTK_WIDGET(playlist_combo_box), TRUE, TRUE, 0);
+
+    search_entry = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(search_entry), "Search songs");
+    search_results_store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_UINT);
+    GtkEntryCompletion *completion = gtk_entry_completion_new();
+    gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(search_results_store));
+    gtk_entry_completion_set_text_column(completion, 0);
+    gtk_entry_completion_set_match_func(completion, search_match_all, NULL, NULL);
+    g_signal_connect(completion, "match-selected", G_CALLBACK(on_search_match_selected), NULL);
+    gtk_entry_set_completion(GTK_ENTRY(search_entry), completion);
+    g_object_unref(completion);
+    g_signal_connect(search_entry, "changed", G_CALLBACK(on_search_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(playlist_hbox), search_entry, TRUE, TRUE, 0);
+
+    add_to_playlist_button = gtk_button_new_with_label("Add to Playlist");
+    g_signal_connect(add_to_playlist_button, "clicked", G_CALLBACK(on_add_to_playlist_button_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), add_to_playlist_button, FALSE, FALSE, 0);
+
+    remove_from_playlist_button = gtk_button_new_with_label("Remove from Playlist");
+    g_signal_connect(remove_from_playlist_button, "clicked", G_CALLBACK(on_remove_from_playlist_button_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), remove_from_playlist_button, FALSE, FALSE, 0);
+
+    GtkWidget *play_playlist_button = gtk_button_new_with_label("Play Playlist");
+    g_signal_connect(play_playlist_button, "clicked", G_CALLBACK(on_play_playlist_button_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), play_playlist_button, FALSE, FALSE, 5);
+
+    GtkWidget *settings_button = gtk_button_new_from_icon_name("preferences-system", GTK_ICON_SIZE_BUTTON);
+    g_signal_connect(settings_button, "clicked", G_CALLBACK(open_settings_window), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), settings_button, FALSE, FALSE, 0);
+
+}
+
+void add_css_style() {
+    GtkCssProvider *css_provider = gtk_css_provider_new();
+    gtk_css_provider_load_from_path(css_provider, "style.css", NULL);
+    gtk_style_context_add_provider_for_screen(gdk_screen_get_default(),
+        GTK_STYLE_PROVIDER(css_provider),
+        GTK_STYLE_PROVIDER_PRIORITY_USER);
+}
+
+/* Resident set size from /proc, or -1 when it cannot be read. */
+glong read_rss_kb() {
+    gchar *contents = NULL;
+    glong rss_kb = -1;
+
+    if (g_file_get_contents("/proc/self/status", &contents, NULL, NULL)) {
+        const char *line = strstr(contents, "VmRSS:");
+        if (line) rss_kb = strtol(line + strlen("VmRSS:"), NULL, 10);
+        g_free(contents);
+    }
+    return rss_kb;
+}
+
+gchar *control_default_socket_path() {
+    const char *configured = get_setting("control_socket", NULL);
+    if (configured && configured[0] != '\0') return g_strdup(configured);
+    return g_build_filename(g_get_user_runtime_dir(), CONTROL_SOCKET_NAME, NULL);
+}
+
+/* The song shown as current: the local queue's, or the daemon's in --remote mode. */
+const char *current_song_name() {
+    if (remote_fd >= 0) return remote_track;
+    return track_name(queue_current(&play_queue));
+}
+
+/* Sets the ring buffer size and segment length on an audio base sink (alsasink,
+ * pulsesink, ...), including one that autoaudiosink picks later. Other elements have no
+ * buffer-time property and are left alone. */
+static void output_configure_sink(GstElement *element) {
+    if (!g_object_class_find_property(G_OBJECT_GET_CLASS(element), "buffer-time")) return;
+
+    g_object_set(element, "buffer-time", (gint64)output_buffer_ms * 1000,
+                 "latency-time", (gint64)output_latency_ms * 1000, NULL);
+    g_debug("Audio output: %s with %u ms buffer, %u ms segments", GST_OBJECT_NAME(element),
+            output_buffer_ms, output_latency_ms);
+}
+
+static void output_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data) {
+    output_configure_sink(element);
+}
+
+/* queue ! audioconvert ! audioresample ! volume ! sink. playbin hands over decoded audio
+ * as it is (PLAY_FLAG_NATIVE_AUDIO, no soft volume), so this is the only conversion and
+ * volume stage. The queue's thread is the one that feeds the sink and the one raised to
+ * realtime priority; it holds up to one ring buffer of audio so decoding can stall that
+ * long without an underrun. */
+GstElement *output_bin_new(const char *sink_name, GstElement **volume, GstElement **sink) {
+    GstElement *bin = gst_bin_new("audio-output");
+    GstElement *queue = gst_element_factory_make("queue", "output-queue");
+    GstElement *convert = gst_element_factory_make("audioconvert", NULL);
+    GstElement *resample = gst_element_factory_make("audioresample", NULL);
+    *volume = gst_element_factory_make("volume", "output-volume");
+    *sink = gst_element_factory_make(sink_name, "output-sink");
+    if (!queue || !convert || !resample || !*volume || !*sink) {
+        trace_error("Cannot build the audio output with %s", sink_name);
+        if (queue) gst_object_unref(queue);
+        if (convert) gst_object_unref(convert);
+        if (resample) gst_object_unref(resample);
+        if (*volume) gst_object_unref(*volume);
+        if (*sink) gst_object_unref(*sink);
+        gst_object_unref(bin);
+        *volume = *sink = NULL;
+        return NULL;
+    }
+
+    g_object_set(queue, "max-size-buffers", 0, "max-size-bytes", 0,
+                 "max-size-time", (guint64)output_buffer_ms * GST_MSECOND, NULL);
+    output_configure_sink(*sink);
+    if (GST_IS_BIN(*sink)) {
+        g_signal_connect(*sink, "deep-element-added", G_CALLBACK(output_deep_element_added), NULL);
+    }
+
+    gst_bin_add_many(GST_BIN(bin), queue, convert, resample, *volume, *sink, NULL);
+    gst_element_link_many(queue, convert, resample, *volume, *sink, NULL);
+    GstPad *queue_pad = gst_element_get_static_pad(queue, "sink");
+    gst_element_add_pad(bin, gst_ghost_pad_new("sink", queue_pad));
+    gst_object_unref(queue_pad);
+    return bin;
+}
+
+/* Runs in the thread that posted the message. A thread of the output bin entering its
+ * loop switches itself to SCHED_FIFO; without CAP_SYS_NICE or an RLIMIT_RTPRIO this
+ * fails once, is logged and playback goes on at normal priority. */
+static GstBusSyncReply output_sync_handler(GstBus *bus, GstMessage *msg, gpointer data) {
+    GstElement *bin = data;
+    GstStreamStatusType type;
+    GstElement *owner;
+
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS) return GST_BUS_PASS;
+    gst_message_parse_stream_status(msg, &type, &owner);
+    if (type != GST_STREAM_STATUS_TYPE_ENTER || !owner || output_realtime_priority <= 0 ||
+        !gst_object_has_as_ancestor(GST_OBJECT(owner), GST_OBJECT(bin))) {
+        return GST_BUS_PASS;
+    }
+
+    struct sched_param param = { .sched_priority = output_realtime_priority };
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error == 0) {
+        g_atomic_int_inc(&output_realtime_threads);
+        g_debug("Audio output: %s thread running at SCHED_FIFO %d", GST_OBJECT_NAME(owner), output_realtime_priority);
+    } else if (!g_atomic_int_exchange(&output_realtime_failed, TRUE)) {
+        g_debug("Audio output: no realtime priority for %s: %s", GST_OBJECT_NAME(owner), g_strerror(error));
+    }
+    return GST_BUS_PASS;
+}
+
+/* On the sink's own pad, in the streaming thread. A buffer whose running time has
+ * already passed on the pipeline clock arrives after it should be heard: the ring
+ * buffer ran dry. Consecutive late buffers are one underrun. A timestamp that does not
+ * continue the previous buffer, or a DISCONT flag, inside one segment is a
+ * discontinuity. Segments, flushes and new streams start over. */
+static GstPadProbeReturn output_stats_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    OutputStats *stats = data;
+
+    if (!(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER)) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+            gst_event_copy_segment(event, &stats->segment);
+        }
+        if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT || GST_EVENT_TYPE(event) == GST_EVENT_FLUSH_STOP ||
+            GST_EVENT_TYPE(event) == GST_EVENT_STREAM_START) {
+            stats->expected = GST_CLOCK_TIME_NONE;
+            stats->late = FALSE;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if (!GST_CLOCK_TIME_IS_VALID(pts)) return GST_PAD_PROBE_OK;
+
+    if (GST_CLOCK_TIME_IS_VALID(stats->expected) &&
+        (GST_BUFFER_IS_DISCONT(buffer) || ABS(GST_CLOCK_DIFF(stats->expected, pts)) > (GstClockTimeDiff)GST_MSECOND)) {
+        g_atomic_int_inc(&stats->discontinuities);
+    }
+    stats->expected = GST_BUFFER_DURATION_IS_VALID(buffer) ? pts + GST_BUFFER_DURATION(buffer) : GST_CLOCK_TIME_NONE;
+
+    GstClock *clock = gst_element_get_clock(stats->sink);
+    if (clock) {
+        if (GST_STATE(stats->sink) == GST_STATE_PLAYING) {
+            GstClockTime running = gst_segment_to_running_time(&stats->segment, GST_FORMAT_TIME, pts);
+            GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(stats->sink);
+            gboolean late = GST_CLOCK_TIME_IS_VALID(running) && now > running + stats->slack;
+            if (late && !stats->late) {
+                g_atomic_int_inc(&stats->underruns);
+                g_debug("Audio underrun: buffer %.1f ms late", (now - running) / 1e6);
+            }
+            stats->late = late;
+        }
+        gst_object_unref(clock);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/* Counts underruns and discontinuities at sink, allowing one segment of lateness. */
+void output_stats_attach(OutputStats *stats, GstElement *sink, guint latency_ms) {
+    memset(stats, 0, sizeof(*stats));
+    stats->sink = sink;
+    stats->slack = MAX(latency_ms, 1) * GST_MSECOND;
+    stats->expected = GST_CLOCK_TIME_NONE;
+    gst_segment_init(&stats->segment, GST_FORMAT_TIME);
+
+    GstPad *pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+                      output_stats_probe, stats, NULL);
+    gst_object_unref(pad);
+}
+
+/* With audio_output=custom the decoded audio goes through output_bin_new instead of
+ * playbin's own converters, with the sink's buffer and latency from the settings;
+ * otherwise autoaudiosink as configured by the system. Either way output_stats counts
+ * underruns and discontinuities at the sink that plays. */
+void create_pipeline() {
+    pipeline = gst_element_factory_make("playbin", "player");
+
+    GstElement *audio_sink = NULL, *stats_sink = NULL;
+    if (g_strcmp0(get_setting("audio_output", "auto"), "custom") == 0) {
+        audio_sink = output_bin_new(get_setting("audio_sink", "autoaudiosink"), &output_volume, &stats_sink);
+    }
+    if (audio_sink) {
+        guint flags;
+        g_object_get(pipeline, "flags", &flags, NULL);
+        g_object_set(pipeline, "flags", (flags | PLAY_FLAG_NATIVE_AUDIO) & ~PLAY_FLAG_SOFT_VOLUME, NULL);
+    } else {
+        audio_sink = stats_sink = gst_element_factory_make("autoaudiosink", "audio-output");
+    }
+    output_stats_attach(&output_stats, stats_sink, output_latency_ms);
+
+    GstPad *audio_sink_pad = gst_element_get_static_pad(audio_sink, "sink");
+    gst_pad_add_probe(audio_sink_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      audio_sink_probe, NULL, NULL);
+    gst_object_unref(audio_sink_pad);
+    g_object_set(pipeline, "audio-sink", audio_sink, NULL);
+
+    if (gapless_enabled) {
+        g_signal_connect(pipeline, "about-to-finish", G_CALLBACK(on_about_to_finish), NULL);
+    }
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    if (output_volume) {
+        gst_bus_set_sync_handler(bus, output_sync_handler, audio_sink, NULL);
+    }
+    gst_bus_add_watch(bus, bus_call, NULL);  
+    gst_object_unref(bus);
+}
+
+void destroy_pipeline() {
+    if (pipeline) {
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+        pipeline = NULL;
+        output_volume = NULL;
+    }
+}
+
+static void control_client_free(ControlClient *client) {
+    control_clients = g_list_remove(control_clients, client);
+    if (client->read_watch) g_source_remove(client->read_watch);
+    if (client->write_watch) g_source_remove(client->write_watch);
+    g_io_channel_unref(client->channel);
+    close(client->fd);
+    g_string_free(client->input, TRUE);
+    g_string_free(client->output, TRUE);
+    g_free(client);
+}
+
+static gboolean control_client_writable(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    ControlClient *client = data;
+    client->write_watch = 0;
+    control_client_flush(client);
+    return G_SOURCE_REMOVE;
+}
+
+/* Writes as much pending output as the socket takes and waits for G_IO_OUT for the rest,
+ * so a slow reader never blocks the player. */
+static void control_client_flush(ControlClient *client) {
+    while (client->output->len > 0) {
+        ssize_t written = send(client->fd, client->output->str, client->output->len, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        g_string_erase(client->output, 0, written);
+    }
+
+    if (client->output->len > 0 && !client->write_watch && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        client->write_watch = g_io_add_watch(client->channel, G_IO_OUT, control_client_writable, client);
+    }
+}
+
+/* "play" resumes a paused song or starts the current one; "play N" jumps to position N
+ * of the play order. */
+static void control_play(ControlClient *client, const char *argument) {
+    if (argument) {
+        guint64 position = g_ascii_strtoull(argument, NULL, 10);
+        if (position >= play_queue.length) {
+            g_string_append(client->output, "ERR no such position\n");
+            return;
+        }
+        trace_switch_begin();
+        queue_jump(&play_queue, position);
+        play_song(track_name(queue_current(&play_queue)));
+    } else if (!pipeline_is_playing) {
+        GstState state = GST_STATE_NULL;
+        gst_element_get_state(pipeline, &state, NULL, 0);
+        if (state == GST_STATE_PAUSED) {
+            resume_song();
+        } else if (!is_empty(&play_queue)) {
+            if (queue_current(&play_queue) == TRACK_ID_NONE) queue_jump(&play_queue, 0);
+            play_song(track_name(queue_current(&play_queue)));
+        } else {
+            g_string_append(client->output, "ERR queue is empty\n");
+            return;
+        }
+    }
+    g_string_append(client->output, "OK\n");
+}
+
+static void control_execute(ControlClient *client, char *line) {
+    if (client->enqueue_remaining > 0) {
+        if (line[0] != '\0') {
+            add_song(&play_queue, line);
+            library_track_added(play_queue.tracks[play_queue.length - 1]);
+            client->enqueue_added++;
+        }
+        if (--client->enqueue_remaining == 0) {
+            g_string_append_printf(client->output, "OK %u\n", client->enqueue_added);
+        }
+        return;
+    }
+
+    gchar **words = g_strsplit(line, " ", 2);
+    const char *command = words[0];
+    const char *argument = words[1];
+
+    if (command == NULL || command[0] == '\0') {
+        /* Blank lines are ignored. */
+    } else if (strcmp(command, "play") == 0) {
+        control_play(client, argument);
+    } else if (strcmp(command, "pause") == 0) {
+        if (pipeline_is_playing) pause_song();
+        g_string_append(client->output, "OK\n");
+    } else if (strcmp(command, "toggle") == 0) {
+        if (pipeline_is_playing) {
+            pause_song();
+            g_string_append(client->output, "OK\n");
+        } else {
+            control_play(client, NULL);
+        }
+    } else if (strcmp(command, "next") == 0 || strcmp(command, "prev") == 0) {
+        if (is_empty(&play_queue)) {
+            g_string_append(client->output, "ERR queue is empty\n");
+        } else {
+            trace_switch_begin();
+            if (command[0] == 'n') play_next_song(); else play_previous_song();
+            g_string_append(client->output, "OK\n");
+        }
+    } else if (strcmp(command, "seek") == 0 && argument) {
+        if (seek_request((gint64)(g_ascii_strtod(argument, NULL) * GST_SECOND), TRUE)) {
+            g_string_append(client->output, "OK\n");
+        } else {
+            g_string_append(client->output, "ERR seek failed\n");
+        }
+    } else if (strcmp(command, "enqueue") == 0 && argument) {
+        client->enqueue_remaining = (guint)g_ascii_strtoull(argument, NULL, 10);
+        client->enqueue_added = 0;
+        if (client->enqueue_remaining == 0) {
+            g_string_append(client->output, "OK 0\n");
+        }
+    } else if (strcmp(command, "clear") == 0) {
+        stop_current_song();
+        pipeline_is_playing = FALSE;
+        position_clock_update();
+        free_song_list();
+        g_string_append(client->output, "OK\n");
+    } else if (strcmp(command, "status") == 0) {
+        gint64 position = current_position;
+        gint64 duration = 0;
+        if (pipeline_is_playing) gst_element_query_position(pipeline, GST_FORMAT_TIME, &position);
+        gst_element_query_duration(pipeline, GST_FORMAT_TIME, &duration);
+
+        TrackId current = queue_current(&play_queue);
+        const char *state = pipeline_is_playing ? "playing" : current != TRACK_ID_NONE ? "paused" : "stopped";
+        gchar position_text[G_ASCII_DTOSTR_BUF_SIZE], duration_text[G_ASCII_DTOSTR_BUF_SIZE];
+        g_ascii_formatd(position_text, sizeof(position_text), "%.3f", (gdouble)position / GST_SECOND);
+        g_ascii_formatd(duration_text, sizeof(duration_text), "%.3f", (gdouble)MAX(duration, 0) / GST_SECOND);
+        g_string_append_printf(client->output, "OK state=%s position=%s duration=%s index=%d length=%u track=%s\n",
+                               state, position_text, duration_text,
+                               current != TRACK_ID_NONE ? (gint)play_queue.position : -1, play_queue.length,
+                               current != TRACK_ID_NONE ? track_name(current) : "");
+    } else if (strcmp(command, "stats") == 0) {
+        g_string_append_printf(client->output,
+                               "OK rss_kb=%ld startup_ms=%.1f tracks=%u clients=%u prefetch_hits=%d prefetch_misses=%d "
+                               "seeks=%u seeks_coalesced=%u duplicates=%u underruns=%d discontinuities=%d\n",
+                               read_rss_kb(), (startup_ready_us - startup_started_at) / 1000.0,
+                               play_queue.length, g_list_length(control_clients),
+                               g_atomic_int_get(&prefetch_hits), g_atomic_int_get(&prefetch_misses),
+                               seek_issued, seek_coalesced, dedupe_hidden ? g_hash_table_size(dedupe_hidden) : 0,
+                               g_atomic_int_get(&output_stats.underruns),
+                               g_atomic_int_get(&output_stats.discontinuities));
+    } else if (strcmp(command, "trace") == 0) {
+        trace_dump();
+        g_string_append(client->output, "OK\n");
+    } else if (strcmp(command, "shutdown") == 0) {
+        g_string_append(client->output, "OK\n");
+        g_idle_add(daemon_quit, NULL);
+    } else {
+        g_string_append_printf(client->output, "ERR unknown command %s\n", command);
+    }
+
+    g_strfreev(words);
+}
+
+/* Runs every complete line received so far; all their replies go out in one write. */
+static gboolean control_client_readable(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    ControlClient *client = data;
+    char buffer[16 * 1024];
+    ssize_t length;
+
+    while ((length = read(client->fd, buffer, sizeof(buffer))) > 0) {
+        g_string_append_len(client->input, buffer, length);
+    }
+    gboolean closed = length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+
+    char *line = client->input->str;
+    char *end = client->input->str + client->input->len;
+    char *newline;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+        *newline = '\0';
+        if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+        control_execute(client, line);
+        line = newline + 1;
+    }
+    g_string_erase(client->input, 0, line - client->input->str);
+    if (client->input->len > CONTROL_MAX_LINE) closed = TRUE;
+
+    control_client_flush(client);
+    if (closed) {
+        client->read_watch = 0;
+        control_client_free(client);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean control_accept(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    int fd = accept(control_listen_fd, NULL, NULL);
+    if (fd < 0) return G_SOURCE_CONTINUE;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    ControlClient *client = g_new0(ControlClient, 1);
+    client->fd = fd;
+    client->channel = g_io_channel_unix_new(fd);
+    client->input = g_string_new(NULL);
+    client->output = g_string_new(NULL);
+    client->read_watch = g_io_add_watch(client->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, control_client_readable, client);
+    control_clients = g_list_prepend(control_clients, client);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Listens on a Unix socket only the current user can connect to. */
+gboolean control_server_start(const char *path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) return FALSE;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    control_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (control_listen_fd < 0) return FALSE;
+
+    g_unlink(path);
+    mode_t old_umask = umask(077);
+    int bound = bind(control_listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (bound != 0 || listen(control_listen_fd, 16) != 0) {
+        close(control_listen_fd);
+        control_listen_fd = -1;
+        return FALSE;
+    }
+
+    GIOChannel *channel = g_io_channel_unix_new(control_listen_fd);
+    control_listen_watch = g_io_add_watch(channel, G_IO_IN, control_accept, NULL);
+    g_io_channel_unref(channel);
+    control_socket_path = g_strdup(path);
+    return TRUE;
+}
+
+void control_server_stop() {
+    while (control_clients) {
+        control_client_free(control_clients->data);
+    }
+    if (control_listen_watch) {
+        g_source_remove(control_listen_watch);
+        control_listen_watch = 0;
+    }
+    if (control_listen_fd >= 0) {
+        close(control_listen_fd);
+        control_listen_fd = -1;
+        g_unlink(control_socket_path);
+    }
+    g_free(control_socket_path);
+    control_socket_path = NULL;
+}
+
+static gboolean daemon_quit(gpointer data) {
+    if (daemon_loop) g_main_loop_quit(daemon_loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* Headless mode: only the pipeline, queue, library and playlists, driven over the
+ * control socket. GTK is never initialized. */
+int run_daemon(const char *socket_path) {
+    gst_init(NULL, NULL);
+
+    music_dir = load_music_directory();
+    load_settings();
+    if (!music_dir) {
+        g_printerr("No music directory in %s. Choose one in the window first.\n", CONFIG_FILE);
+        return 1;
+    }
+    gapless_enabled = get_setting_int("gapless", 1) != 0;
+    g_mutex_init(&library_loader_mutex);
+    g_mutex_init(&gap_mutex);
+    create_pipeline();
+    prefetch_start();
+    analysis_start();
+    dedupe_start();
+
+    gchar *path = socket_path ? g_strdup(socket_path) : control_default_socket_path();
+    if (!control_server_start(path)) {
+        g_printerr("Cannot listen on %s: %s\n", path, g_strerror(errno));
+        g_free(path);
+        destroy_pipeline();
+        return 1;
+    }
+
+    daemon_loop = g_main_loop_new(NULL, FALSE);
+    g_unix_signal_add(SIGINT, daemon_quit, NULL);
+    g_unix_signal_add(SIGTERM, daemon_quit, NULL);
+    g_unix_signal_add(SIGUSR1, on_trace_signal, NULL);
+
+    session_start();
+    if (!session_pool || !session_restore(SESSION_FILE)) {
+        is_shuffle_enabled = TRUE;
+        shuffle_playlist(&play_queue);
+    }
+    library_loader_start(music_dir, TRUE);
+
+    startup_ready_us = g_get_monotonic_time();
+    g_debug("Daemon listening on %s after %.1f ms, RSS %ld kB", path,
+            (startup_ready_us - startup_started_at) / 1000.0, read_rss_kb());
+    g_main_loop_run(daemon_loop);
+
+    control_server_stop();
+    cleanup_resources();
+    destroy_pipeline();
+    g_main_loop_unref(daemon_loop);
+    daemon_loop = NULL;
+    g_free(path);
+    return 0;
+}
+
+void remote_send(const char *commands) {
+    if (remote_fd < 0) return;
+
+    gsize length = strlen(commands);
+    while (length > 0) {
+        ssize_t written = send(remote_fd, commands, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            set_status_text("Lost connection to daemon.");
+            remote_disconnect();
+            return;
+        }
+        commands += written;
+        length -= written;
+    }
+}
+
+/* Mirrors "status" replies into the window; other errors go to the status bar. */
+static void remote_handle_line(const char *line) {
+    char state[16];
+    gdouble position, duration;
+    gint index;
+    guint length;
+    gint track_offset = 0;
+
+    if (sscanf(line, "OK state=%15s position=%lf duration=%lf index=%d length=%u track=%n",
+               state, &position, &duration, &index, &length, &track_offset) == 5 && track_offset > 0) {
+        g_free(remote_track);
+        remote_track = line[track_offset] ? g_strdup(line + track_offset) : NULL;
+
+        set_play_pause_icon(strcmp(state, "playing") == 0);
+        gtk_window_set_title(GTK_WINDOW(main_window), remote_track ? remote_track : "Muzio");
+
+        if (duration > 0) {
+            gtk_range_set_range(GTK_RANGE(seek_scale), 0.0, duration);
+            set_time_label(total_time_label, (gint64)(duration * GST_SECOND));
+        }
+        if (!seek_dragging) {
+            gtk_range_set_value(GTK_RANGE(seek_scale), position);
+        }
+        set_time_label(current_time_label, (gint64)(position * GST_SECOND));
+    } else if (g_str_has_prefix(line, "ERR ")) {
+        set_status_text(line + strlen("ERR "));
+    }
+}
+
+static gboolean remote_readable(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    char buffer[4096];
+    ssize_t length = read(remote_fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+        remote_watch = 0;
+        set_status_text("Lost connection to daemon.");
+        remote_disconnect();
+        return G_SOURCE_REMOVE;
+    }
+
+    g_string_append_len(remote_input, buffer, length);
+    char *newline;
+    while ((newline = memchr(remote_input->str, '\n', remote_input->len)) != NULL) {
+        *newline = '\0';
+        remote_handle_line(remote_input->str);
+        g_string_erase(remote_input, 0, newline - remote_input->str + 1);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean remote_poll(gpointer data) {
+    remote_send("status\n");
+    return remote_fd >= 0 ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+/* --remote: the window drives a daemon instead of its own pipeline. */
+gboolean remote_connect(const char *path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) return FALSE;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    remote_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (remote_fd < 0) return FALSE;
+    if (connect(remote_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(remote_fd);
+        remote_fd = -1;
+        return FALSE;
+    }
+
+    remote_input = g_string_new(NULL);
+    GIOChannel *channel = g_io_channel_unix_new(remote_fd);
+    remote_watch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, remote_readable, NULL);
+    g_io_channel_unref(channel);
+    remote_poll_source = g_timeout_add_seconds(1, remote_poll, NULL);
+
+    set_status_text("Connected to daemon.");
+    remote_send("status\n");
+    return TRUE;
+}
+
+void remote_disconnect() {
+    if (remote_watch) {
+        g_source_remove(remote_watch);
+        remote_watch = 0;
+    }
+    if (remote_poll_source) {
+        g_source_remove(remote_poll_source);
+        remote_poll_source = 0;
+    }
+    if (remote_fd >= 0) {
+        close(remote_fd);
+        remote_fd = -1;
+    }
+    if (remote_input) {
+        g_string_free(remote_input, TRUE);
+        remote_input = NULL;
+    }
+    g_free(remote_track);
+    remote_track = NULL;
+}
+
+static gboolean on_first_frame(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    g_debug("Time to first frame: %.1f ms, RSS %ld kB", (g_get_monotonic_time() - startup_started_at) / 1000.0,
+            read_rss_kb());
+    g_signal_handlers_disconnect_by_func(widget, on_first_frame, data);
+    return FALSE;
+}
+
+/* Imports a synthetic .txt playlist into a journal, then times a fresh load of it. */
+int run_playlist_benchmark(guint count) {
+    gchar *dir = g_dir_make_tmp("muzio-bench-XXXXXX", NULL);
+    if (!dir) return 1;
+    playlists_dir = dir;
+
+    GString *txt = g_string_new(NULL);
+    for (guint i = 0; i < count; i++) {
+        g_string_append_printf(txt, "Artist %u/Some fairly long song title number %07u ｜ Live.mp3\n", i % 997, i);
+    }
+    gchar *txt_path = playlist_file_path("bench", ".txt");
+    g_file_set_contents(txt_path, txt->str, txt->len, NULL);
+    g_string_free(txt, TRUE);
+
+    gint64 start = g_get_monotonic_time();
+    Playlist *playlist = playlist_open("bench", FALSE);
+    gint64 import_us = g_get_monotonic_time() - start;
+    playlist_close_all();
+
+    start = g_get_monotonic_time();
+    playlist = playlist_open("bench", FALSE);
+    gint64 load_us = g_get_monotonic_time() - start;
+    guint loaded = playlist ? playlist->entries->len : 0;
+
+    start = g_get_monotonic_time();
+    for (guint i = 0; playlist && i < 1000; i++) {
+        gchar *name = g_strdup_printf("appended-%u.mp3", i);
+        playlist_append(playlist, name);
+        g_free(name);
+    }
+    gint64 append_us = g_get_monotonic_time() - start;
+    playlist_close_all();
+
+    g_print("import .txt:     %u entries in %.1f ms\n", loaded, import_us / 1000.0);
+    g_print("journal load:    %u entries in %.1f ms\n", loaded, load_us / 1000.0);
+    g_print("journal append:  1000 entries in %.1f ms (synced)\n", append_us / 1000.0);
+
+    gchar *journal_path = playlist_file_path("bench", ".journal");
+    g_unlink(journal_path);
+    g_unlink(txt_path);
+    g_rmdir(dir);
+    g_free(journal_path);
+    g_free(txt_path);
+    g_free(dir);
+    return loaded == count ? 0 : 1;
+}
+
+static guint64 bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (guint64)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Writing 5 to clear_refs resets VmHWM, so each result reports its own peak. */
+static void bench_reset_peak_rss() {
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file) {
+        fputs("5", file);
+        fclose(file);
+    }
+}
+
+static glong bench_peak_rss_kb() {
+    gchar *contents = NULL;
+    glong peak_kb = -1;
+
+    if (g_file_get_contents("/proc/self/status", &contents, NULL, NULL)) {
+        const char *line = strstr(contents, "VmHWM:");
+        if (line) peak_kb = strtol(line + strlen("VmHWM:"), NULL, 10);
+        g_free(contents);
+    }
+    return peak_kb;
+}
+
+static int bench_compare_u64(gconstpointer a, gconstpointer b) {
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints one JSON object per line: throughput, latency percentiles in microseconds
+ * and the peak RSS since the last bench_reset_peak_rss. */
+static void bench_report(const char *name, guint size, guint64 *samples_ns, guint count) {
+    if (count == 0) return;
+
+    guint64 total_ns = 0;
+    for (guint i = 0; i < count; i++) total_ns += samples_ns[i];
+    qsort(samples_ns, count, sizeof(guint64), bench_compare_u64);
+
+    gchar line[512];
+    gchar ops_per_sec[G_ASCII_DTOSTR_BUF_SIZE], p50[G_ASCII_DTOSTR_BUF_SIZE];
+    gchar p99[G_ASCII_DTOSTR_BUF_SIZE], max[G_ASCII_DTOSTR_BUF_SIZE];
+    g_ascii_formatd(ops_per_sec, sizeof(ops_per_sec), "%.1f", total_ns ? count * 1e9 / total_ns : 0.0);
+    g_ascii_formatd(p50, sizeof(p50), "%.3f", samples_ns[count / 2] / 1000.0);
+    g_ascii_formatd(p99, sizeof(p99), "%.3f", samples_ns[MIN(count - 1, (guint)(count * 0.99))] / 1000.0);
+    g_ascii_formatd(max, sizeof(max), "%.3f", samples_ns[count - 1] / 1000.0);
+    snprintf(line, sizeof(line),
+             "{\"bench\":\"%s\",\"size\":%u,\"ops\":%u,\"ops_per_sec\":%s,\"p50_us\":%s,\"p99_us\":%s,"
+             "\"max_us\":%s,\"peak_rss_kb\":%ld}\n",
+             name, size, count, ops_per_sec, p50, p99, max, bench_peak_rss_kb());
+    fputs(line, stdout);
+    fflush(stdout);
+}
+
+static gboolean bench_make_library(const char *dir, guint size) {
+    if (g_mkdir_with_parents(dir, 0755) != 0) return FALSE;
+
+    for (guint i = 0; i < size; i++) {
+        gchar *path = g_strdup_printf("%s/Artist %03u - Track %07u.mp3", dir, i % 997, i);
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if (fd >= 0) close(fd);
+        }
+        g_free(path);
+    }
+    return TRUE;
+}
+
+static void bench_fill_queue(guint size) {
+    for (guint i = 0; i < size; i++) {
+        gchar name[64];
+        snprintf(name, sizeof(name), "Artist %03u - Track %07u.mp3", i % 997, i);
+        add_song(&play_queue, name);
+    }
+}
+
+/* add_song, queue_step, shuffling and free_song_list on an in-memory queue. The shuffle
+ * timed here is switching to a new shuffled order and back, and shuffle_step is
+ * queue_step in that order, where every step evaluates the permutation. */
+static void bench_queue_paths(guint size) {
+    guint rounds = CLAMP(10000000 / size, 3, 100);
+    guint64 *samples = g_new(guint64, MAX(size, rounds));
+    gchar name[64];
+
+    free_song_list();
+    bench_reset_peak_rss();
+    for (guint i = 0; i < size; i++) {
+        snprintf(name, sizeof(name), "Artist %03u - Track %07u.mp3", i % 997, i);
+        guint64 start = bench_now_ns();
+        add_song(&play_queue, name);
+        samples[i] = bench_now_ns() - start;
+    }
+    bench_report("add_song", size, samples, size);
+
+    bench_reset_peak_rss();
+    for (guint i = 0; i < size; i++) {
+        guint64 start = bench_now_ns();
+        queue_step(&play_queue, 1);
+        samples[i] = bench_now_ns() - start;
+    }
+    bench_report("queue_step", size, samples, size);
+
+    bench_reset_peak_rss();
+    for (guint i = 0; i < rounds; i++) {
+        guint64 start = bench_now_ns();
+        queue_set_shuffle(&play_queue, TRUE, shuffle_new_key());
+        queue_set_shuffle(&play_queue, FALSE, 0);
+        samples[i] = bench_now_ns() - start;
+    }
+    bench_report("shuffle", size, samples, rounds);
+
+    bench_reset_peak_rss();
+    queue_set_shuffle(&play_queue, TRUE, shuffle_new_key());
+    for (guint i = 0; i < size; i++) {
+        guint64 start = bench_now_ns();
+        queue_step(&play_queue, 1);
+        samples[i] = bench_now_ns() - start;
+    }
+    queue_set_shuffle(&play_queue, FALSE, 0);
+    bench_report("shuffle_step", size, samples, size);
+
+    bench_reset_peak_rss();
+    for (guint i = 0; i < rounds; i++) {
+        if (is_empty(&play_queue)) bench_fill_queue(size);
+        guint64 start = bench_now_ns();
+        free_song_list();
+        samples[i] = bench_now_ns() - start;
+    }
+    bench_report("free_song_list", size, samples, rounds);
+
+    g_free(samples);
+}
+
+/* load_songs_from_directory with no index (full scan) and with a fresh index. */
+static void bench_library_paths(const char *dir, guint size) {
+    const guint rounds = 5;
+    guint64 samples[5];
+    gchar *index_path = g_strdup_printf("%s.idx", dir);
+    char *saved_music_dir = music_dir;
+
+    music_dir = (char *)dir;
+    library_index_path = index_path;
+
+    bench_reset_peak_rss();
+    for (guint i = 0; i < rounds; i++) {
+        g_unlink(index_path);
+        free_song_list();
+        guint64 start = bench_now_ns();
         load_songs_from_directory();
+        samples[i] = bench_now_ns() - start;
     }
+    bench_report("load_library_cold", size, samples, rounds);
 
-    gtk_widget_destroy(dialog);
+    bench_reset_peak_rss();
+    for (guint i = 0; i < rounds; i++) {
+        free_song_list();
+        guint64 start = bench_now_ns();
+        load_songs_from_directory();
+        samples[i] = bench_now_ns() - start;
+    }
+    bench_report("load_library_warm", size, samples, rounds);
+
+    free_song_list();
+    g_unlink(index_path);
+    library_index_path = LIBRARY_INDEX_FILE;
+    music_dir = saved_music_dir;
+    g_free(index_path);
 }
 
-void change_music_directory_button(GtkWidget *widget, gpointer data) {
-    ask_for_music_directory();
+/* Playlist import from .txt, journal replay and synced appends. */
+static void bench_playlist_paths(const char *dir, guint size) {
+    const guint rounds = 5;
+    const guint appends = 1000;
+    guint64 *samples = g_new(guint64, appends);
+    const char *saved_dir = playlists_dir;
+    gchar *bench_dir = g_strdup_printf("%s-playlists", dir);
+
+    g_mkdir_with_parents(bench_dir, 0755);
+    playlists_dir = bench_dir;
+    gchar *txt_path = playlist_file_path("bench", ".txt");
+    gchar *journal_path = playlist_file_path("bench", ".journal");
+
+    GString *txt = g_string_new(NULL);
+    for (guint i = 0; i < size; i++) {
+        g_string_append_printf(txt, "Artist %03u - Track %07u.mp3\n", i % 997, i);
+    }
+    g_file_set_contents(txt_path, txt->str, txt->len, NULL);
+    g_string_free(txt, TRUE);
+    g_unlink(journal_path);
+
+    bench_reset_peak_rss();
+    guint64 start = bench_now_ns();
+    playlist_open("bench", FALSE);
+    samples[0] = bench_now_ns() - start;
+    playlist_close_all();
+    bench_report("playlist_import", size, samples, 1);
+
+    bench_reset_peak_rss();
+    for (guint i = 0; i < rounds; i++) {
+        start = bench_now_ns();
+        playlist_open("bench", FALSE);
+        samples[i] = bench_now_ns() - start;
+        playlist_close_all();
+    }
+    bench_report("playlist_load", size, samples, rounds);
+
+    Playlist *playlist = playlist_open("bench", FALSE);
+    bench_reset_peak_rss();
+    for (guint i = 0; playlist && i < appends; i++) {
+        gchar name[64];
+        snprintf(name, sizeof(name), "Appended %07u.mp3", i);
+        start = bench_now_ns();
+        playlist_append(playlist, name);
+        samples[i] = bench_now_ns() - start;
+    }
+    if (playlist) bench_report("playlist_append", size, samples, appends);
+    playlist_close_all();
+
+    g_unlink(txt_path);
+    g_unlink(journal_path);
+    g_rmdir(bench_dir);
+    playlists_dir = saved_dir;
+    g_free(txt_path);
+    g_free(journal_path);
+    g_free(bench_dir);
+    g_free(samples);
 }
 
-void update_directory_label() {
-    if (music_dir) {
-        gchar *label_text = g_strdup_printf("Directory: %s", music_dir);
-        gtk_label_set_text(GTK_LABEL(directory_label), label_text);
-        g_free(label_text);
+/* Runs every path for each size in the comma-separated list, creating the synthetic
+ * libraries under base_dir (tmpfs by default) on first use and reusing them after. */
+int run_bench_suite(const char *base_dir, const char *sizes) {
+    gchar **size_list = g_strsplit(sizes, ",", -1);
+    int status = 0;
+
+    for (guint s = 0; size_list[s] != NULL && status == 0; s++) {
+        guint size = (guint)g_ascii_strtoull(size_list[s], NULL, 10);
+        if (size == 0) continue;
+
+        gchar *dir = g_strdup_printf("%s/muzio-bench-%u", base_dir, size);
+        if (!bench_make_library(dir, size)) {
+            g_printerr("Cannot create %s\n", dir);
+            status = 1;
+        } else {
+            bench_queue_paths(size);
+            bench_library_paths(dir, size);
+            bench_playlist_paths(dir, size);
+        }
+        g_free(dir);
     }
+
+    g_strfreev(size_list);
+    return status;
 }
 
-void create_settings_ui() {
-    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
-    gtk_container_set_border_width(GTK_CONTAINER(vbox), 20);
-    gtk_container_add(GTK_CONTAINER(settings_window), vbox);
+static gdouble bench_cpu_seconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-    directory_label = gtk_label_new("Directory: ");
-    gtk_box_pack_start(GTK_BOX(vbox), directory_label, FALSE, FALSE, 0);
-    update_directory_label();
+/* Stress test for the UI channel: every producer posts `events` increasing values to its
+ * own slot. The main loop must see every event, each slot's applied values must only
+ * grow, and the last value of each slot must survive coalescing. */
+void bench_ui_event(guint slot, gint64 value) {
+    if (slot >= bench_ui_producers) return;
 
-    change_dir_button = gtk_button_new_with_label("Change Directory");
-    g_signal_connect(change_dir_button, "clicked", G_CALLBACK(change_music_directory_button), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), change_dir_button, FALSE, FALSE, 0);
+    if (value <= bench_ui_last[slot]) bench_ui_ordered = FALSE;
+    bench_ui_last[slot] = value;
+    if (ui_channel_received >= bench_ui_expected && bench_ui_loop) {
+        g_main_loop_quit(bench_ui_loop);
+    }
+}
 
-    url_entry = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(url_entry), "Enter the song URL here");
-    gtk_box_pack_start(GTK_BOX(vbox), url_entry, FALSE, FALSE, 0);
+static gpointer bench_ui_producer(gpointer data) {
+    guint slot = GPOINTER_TO_UINT(data);
+    for (gint64 i = 0; i < bench_ui_events; i++) {
+        ui_post(UI_EVENT_BENCH, slot, i, NULL);
+    }
+    return NULL;
+}
 
-    GtkWidget *download_button = gtk_button_new_with_label("Download Song");
-    g_signal_connect(download_button, "clicked", G_CALLBACK(download_song_button), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), download_button, FALSE, FALSE, 0);
+int run_ui_channel_benchmark(guint producers, guint events) {
+    GThread **threads = g_new(GThread *, producers);
+    bench_ui_producers = producers;
+    bench_ui_events = events;
+    bench_ui_expected = (guint64)producers * events;
+    bench_ui_last = g_new(gint64, producers);
+    for (guint i = 0; i < producers; i++) bench_ui_last[i] = -1;
+    bench_ui_loop = g_main_loop_new(NULL, FALSE);
+
+    guint64 started = bench_now_ns();
+    for (guint i = 0; i < producers; i++) {
+        threads[i] = g_thread_new("ui-producer", bench_ui_producer, GUINT_TO_POINTER(i));
+    }
+    if (bench_ui_expected > 0) g_main_loop_run(bench_ui_loop);
+    guint64 elapsed = bench_now_ns() - started;
+    for (guint i = 0; i < producers; i++) g_thread_join(threads[i]);
 
-    GtkWidget *create_playlist_button = gtk_button_new_with_label("Create New Playlist");
-    g_signal_connect(create_playlist_button, "clicked", G_CALLBACK(on_create_playlist_button_clicked), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), create_playlist_button, FALSE, FALSE, 0);
+    gboolean ok = bench_ui_ordered && ui_channel_received == bench_ui_expected;
+    for (guint i = 0; i < producers; i++) {
+        if (bench_ui_last[i] != (gint64)events - 1) ok = FALSE;
+    }
+    printf("{\"bench\":\"ui_channel\",\"producers\":%u,\"events\":%" G_GUINT64_FORMAT ",\"events_per_sec\":%.0f,"
+           "\"drains\":%u,\"applied\":%" G_GUINT64_FORMAT ",\"max_drain_us\":%" G_GINT64_FORMAT ",\"ok\":%s}\n",
+           producers, ui_channel_received, elapsed ? ui_channel_received * 1e9 / elapsed : 0.0, ui_channel_drains,
+           ui_channel_applied, ui_channel_max_drain_us, ok ? "true" : "false");
+
+    ui_channel_stop();
+    g_main_loop_unref(bench_ui_loop);
+    bench_ui_loop = NULL;
+    g_free(bench_ui_last);
+    g_free(threads);
+    return ok ? 0 : 1;
 }
 
-void open_settings_window(GtkWidget *widget, gpointer data) {
-    if (!settings_window) {
-        settings_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-        gtk_window_set_title(GTK_WINDOW(settings_window), "Settings");
-        g_signal_connect(settings_window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
-        create_settings_ui();
+/* Analysis speed in times realtime per core: first the loudness and waveform kernels
+ * alone on a minute of generated noise, then the single decode and analysis of each
+ * FILE, whose decoder threads are included in the process CPU time. */
+int run_analysis_benchmark(int count, char *paths[]) {
+    const guint seconds = 60;
+    gsize frames = (gsize)seconds * LOUDNESS_RATE;
+    gfloat *samples = g_new(gfloat, frames * 2);
+    GRand *rand = g_rand_new_with_seed(1);
+    for (gsize i = 0; i < frames * 2; i++) {
+        samples[i] = (gfloat)g_rand_double_range(rand, -0.5, 0.5);
     }
+    g_rand_free(rand);
+
+    gdouble loudness_best = G_MAXDOUBLE, waveform_best = G_MAXDOUBLE;
+    for (guint round = 0; round < 5; round++) {
+        LoudnessAnalysis loudness;
+        WaveformAnalysis waveform;
+        gint8 peaks[WAVEFORM_BUCKETS * 2];
+
+        loudness_analysis_init(&loudness);
+        gdouble started = bench_cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+        for (gsize offset = 0; offset < frames; offset += 4096) {
+            loudness_feed(&loudness, samples + offset * 2, MIN(frames - offset, 4096));
+        }
+        loudness_integrated(&loudness);
+        loudness_best = MIN(loudness_best, bench_cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - started);
+        loudness_analysis_clear(&loudness);
+
+        waveform_analysis_init(&waveform);
+        started = bench_cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+        for (gsize offset = 0; offset < frames; offset += 4096) {
+            waveform_feed(&waveform, samples + offset * 2, MIN(frames - offset, 4096));
+        }
+        waveform_finish(&waveform, peaks);
+        waveform_best = MIN(waveform_best, bench_cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - started);
+        waveform_analysis_clear(&waveform);
+    }
+    g_free(samples);
+    printf("{\"bench\":\"loudness_kernel\",\"audio_s\":%u,\"cpu_s\":%.4f,\"x_realtime_per_core\":%.0f}\n",
+           seconds, loudness_best, loudness_best > 0 ? seconds / loudness_best : 0.0);
+    printf("{\"bench\":\"waveform_kernel\",\"audio_s\":%u,\"cpu_s\":%.4f,\"x_realtime_per_core\":%.0f}\n",
+           seconds, waveform_best, waveform_best > 0 ? seconds / waveform_best : 0.0);
+    fflush(stdout);
+
+    if (count > 0) gst_init(NULL, NULL);
+    gdouble total_audio = 0.0, total_cpu = 0.0;
+    for (int i = 0; i < count; i++) {
+        LoudnessAnalysis loudness;
+        WaveformAnalysis waveform;
+        gint8 peaks[WAVEFORM_BUCKETS * 2];
+
+        loudness_analysis_init(&loudness);
+        waveform_analysis_init(&waveform);
+        gdouble cpu_started = bench_cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+        guint64 wall_started = bench_now_ns();
+        gboolean decoded = analysis_decode_file(paths[i], &loudness, &waveform);
+        gdouble lufs = loudness_integrated(&loudness);
+        waveform_finish(&waveform, peaks);
+        gdouble wall = (bench_now_ns() - wall_started) / 1e9;
+        gdouble cpu = bench_cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_started;
+        gdouble audio = loudness.frames / (gdouble)LOUDNESS_RATE;
+        gfloat peak = loudness.peak;
+        loudness_analysis_clear(&loudness);
+        waveform_analysis_clear(&waveform);
+        if (!decoded) {
+            g_printerr("Cannot decode %s\n", paths[i]);
+            continue;
+        }
 
-    gtk_widget_show_all(settings_window);
+        gchar lufs_text[G_ASCII_DTOSTR_BUF_SIZE] = "null";
+        if (!isnan(lufs)) g_ascii_formatd(lufs_text, sizeof(lufs_text), "%.2f", lufs);
+        printf("{\"bench\":\"analysis_file\",\"file\":%d,\"audio_s\":%.2f,\"wall_s\":%.3f,\"cpu_s\":%.3f,"
+               "\"lufs\":%s,\"peak\":%.4f,\"x_realtime_per_core\":%.0f}\n",
+               i, audio, wall, cpu, lufs_text, peak, cpu > 0 ? audio / cpu : 0.0);
+        fflush(stdout);
+        total_audio += audio;
+        total_cpu += cpu;
+    }
+    if (total_cpu > 0) {
+        printf("{\"bench\":\"analysis_files\",\"files\":%d,\"audio_s\":%.2f,\"cpu_s\":%.3f,\"x_realtime_per_core\":%.0f}\n",
+               count, total_audio, total_cpu, total_audio / total_cpu);
+    }
+    return 0;
 }
 
-void create_ui() {
-    gtk_window_set_default_size(GTK_WINDOW(main_window), 400, 300);
+static void bench_dedupe_worker(gpointer data, gpointer user_data) {
+    DedupeJob *job = data;
+    job->missing = !content_hash_file(job->path, dedupe_thread_buffer(), &job->hash, &job->hashed_bytes);
+}
 
-    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
-    gtk_container_set_border_width(GTK_CONTAINER(vbox), 20);
-    gtk_container_add(GTK_CONTAINER(main_window), vbox);
+static void bench_collect_files(const char *dir_path, GPtrArray *jobs) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir) return;
+
+    const char *name;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar *path = g_build_filename(dir_path, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+            g_free(path);
+        } else if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            bench_collect_files(path, jobs);
+            g_free(path);
+        } else {
+            DedupeJob *job = g_new0(DedupeJob, 1);
+            job->path = path;
+            g_ptr_array_add(jobs, job);
+        }
+    }
+    g_dir_close(dir);
+}
 
-    GtkWidget *time_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
-    current_time_label = gtk_label_new("0:00");
-    total_time_label = gtk_label_new("0:00");
-    gtk_box_pack_start(GTK_BOX(time_box), current_time_label, FALSE, FALSE, 0);
-    gtk_box_pack_end(GTK_BOX(time_box), total_time_label, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), time_box, FALSE, FALSE, 0);
+/* Hash speed on 256 MB in memory, then one pass over every file under DIR with WORKERS
+ * threads. Each file is dropped from the page cache after hashing, so a rerun reads
+ * from disk again and files_mb_per_sec is what the disk delivers. Duplicate groups go
+ * to stderr. */
+int run_dedupe_benchmark(const char *dir_path, guint workers) {
+    gsize kernel_size = 256 * 1024 * 1024;
+    guint8 *data = g_malloc(kernel_size);
+    for (gsize i = 0; i < kernel_size; i++) {
+        data[i] = (guint8)((i * 2654435761u) >> 13);
+    }
+    ContentHash state;
+    guint64 start = bench_now_ns();
+    content_hash_init(&state);
+    content_hash_update(&state, data, kernel_size);
+    guint64 kernel_hash = content_hash_finish(&state);
+    gdouble kernel_gb_per_sec = kernel_size / (gdouble)(bench_now_ns() - start);
+    g_free(data);
+
+    GPtrArray *jobs = g_ptr_array_new();
+    if (dir_path) bench_collect_files(dir_path, jobs);
+
+    start = bench_now_ns();
+    GThreadPool *pool = g_thread_pool_new(bench_dedupe_worker, NULL, MAX(workers, 1), FALSE, NULL);
+    for (guint i = 0; i < jobs->len; i++) {
+        g_thread_pool_push(pool, g_ptr_array_index(jobs, i), NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+    gdouble seconds = (bench_now_ns() - start) / 1e9;
+
+    GHashTable *groups = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)g_ptr_array_unref);
+    guint64 bytes = 0, duplicate_bytes = 0;
+    guint files = 0, duplicates = 0;
+    for (guint i = 0; i < jobs->len; i++) {
+        DedupeJob *job = g_ptr_array_index(jobs, i);
+        if (job->missing) continue;
+
+        GPtrArray *group = g_hash_table_lookup(groups, &job->hash);
+        if (group) {
+            duplicates++;
+            duplicate_bytes += job->hashed_bytes;
+        } else {
+            group = g_ptr_array_new();
+            g_hash_table_insert(groups, &job->hash, group);
+        }
+        g_ptr_array_add(group, job->path);
+        files++;
+        bytes += job->hashed_bytes;
+    }
 
-    seek_scale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0, 100, 1);
-    gtk_scale_set_draw_value(GTK_SCALE(seek_scale), FALSE);
-    g_signal_connect(seek_scale, "value-changed", G_CALLBACK(on_seek_changed), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), seek_scale, FALSE, FALSE, 0);
+    guint group_count = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, groups);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GPtrArray *group = value;
+        if (group->len < 2) continue;
+        group_count++;
+        for (guint i = 0; i < group->len; i++) {
+            g_printerr("%s%s", i == 0 ? "" : i == 1 ? " = " : ", ", (const char *)g_ptr_array_index(group, i));
+        }
+        g_printerr("\n");
+    }
 
-    GtkWidget *controls_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-    gtk_box_pack_start(GTK_BOX(vbox), controls_hbox, FALSE, FALSE, 0);
+    printf("{\"bench\":\"dedupe\",\"kernel_gb_per_sec\":%.2f,\"kernel_hash\":\"%016" G_GINT64_MODIFIER "x\",\"workers\":%u,"
+           "\"files\":%u,\"mb\":%.1f,\"seconds\":%.3f,\"files_mb_per_sec\":%.1f,\"groups\":%u,\"duplicates\":%u,"
+           "\"duplicate_mb\":%.1f}\n",
+           kernel_gb_per_sec, kernel_hash, MAX(workers, 1), files, bytes / 1e6, seconds,
+           seconds > 0 ? bytes / 1e6 / seconds : 0.0, group_count, duplicates, duplicate_bytes / 1e6);
+
+    g_hash_table_unref(groups);
+    for (guint i = 0; i < jobs->len; i++) {
+        DedupeJob *job = g_ptr_array_index(jobs, i);
+        g_free(job->path);
+        g_free(job);
+    }
+    g_ptr_array_unref(jobs);
+    return 0;
+}
 
-    GtkWidget *previous_button = gtk_button_new_from_icon_name("media-skip-backward", GTK_ICON_SIZE_BUTTON);
-    g_signal_connect(previous_button, "clicked", G_CALLBACK(previous_song_button), NULL);
-    gtk_box_pack_start(GTK_BOX(controls_hbox), previous_button, TRUE, TRUE, 0);
+/* Resident memory per track for COUNT synthetic names two directories deep, as the
+ * recursive library scan names them, interned into the track name arena and then stored
+ * the way track names used to be: a g_strdup per name, a GPtrArray of them and a
+ * GHashTable from name to id. The arena goes first because its chunks, pages and table
+ * are large enough to be returned to the system on free. */
+int run_track_names_benchmark(guint count) {
+    gchar name[64];
+    guint64 name_bytes = 0;
+
+    glong before = read_rss_kb();
+    for (guint i = 0; i < count; i++) {
+        gsize length = snprintf(name, sizeof(name), "Artist %03u/Album %02u/%02u Track %07u.flac", i % 997,
+                                i / 997 % 13, i % 20, i);
+        track_intern_length(name, length);
+        name_bytes += length + 1;
+    }
+    glong arena_kb = read_rss_kb() - before;
+    free_tracks();
+
+    before = read_rss_kb();
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *ids = g_hash_table_new(g_str_hash, g_str_equal);
+    for (guint i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "Artist %03u/Album %02u/%02u Track %07u.flac", i % 997, i / 997 % 13, i % 20, i);
+        char *copy = g_strdup(name);
+        g_hash_table_insert(ids, copy, GUINT_TO_POINTER(names->len + 1));
+        g_ptr_array_add(names, copy);
+    }
+    glong strdup_kb = read_rss_kb() - before;
+    g_hash_table_unref(ids);
+    g_ptr_array_unref(names);
+
+    gdouble tracks = MAX(count, 1);
+    printf("{\"bench\":\"track_names\",\"tracks\":%u,\"name_bytes_per_track\":%.1f,"
+           "\"strdup_bytes_per_track\":%.1f,\"arena_bytes_per_track\":%.1f}\n",
+           count, name_bytes / tracks, strdup_kb * 1024.0 / tracks, arena_kb * 1024.0 / tracks);
+    return 0;
+}
 
-    play_pause_button = gtk_button_new();
-    GtkWidget *play_icon = gtk_image_new_from_icon_name("media-playback-start", GTK_ICON_SIZE_BUTTON);
-    gtk_button_set_image(GTK_BUTTON(play_pause_button), play_icon);
-    g_signal_connect(play_pause_button, "clicked", G_CALLBACK(play_pause_button_toggled), NULL);
-    gtk_box_pack_start(GTK_BOX(controls_hbox), play_pause_button, TRUE, TRUE, 0);
+/* Saves a shuffled queue of COUNT synthetic tracks as a session and restores it, timing
+ * the main thread's share of a save (copying the queue), the writer's share, and the
+ * restore from a cold start of the track name store. */
+int run_session_benchmark(guint count) {
+    gchar name[64];
+    for (guint i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "Artist %03u/Album %02u/Track %07u.flac", i % 997, i % 13, i);
+        add_song(&play_queue, name);
+    }
+    queue_set_shuffle(&play_queue, TRUE, shuffle_new_key());
+    queue_jump(&play_queue, count / 2);
+    TrackId current = queue_current(&play_queue);
+    current_position = 90 * GST_SECOND;
+
+    gchar *path = g_build_filename(g_get_tmp_dir(), "muzio-bench-session.bin", NULL);
+    gint64 started = g_get_monotonic_time();
+    SessionSnapshot *snapshot = session_snapshot_take(path);
+    gint64 taken = g_get_monotonic_time();
+    gsize bytes = 0;
+    gboolean written = session_snapshot_write(snapshot, &bytes);
+    gint64 finished = g_get_monotonic_time();
+    session_snapshot_free(snapshot);
+    if (!written) {
+        g_free(path);
+        return 1;
+    }
 
-    GtkWidget *next_button = gtk_button_new_from_icon_name("media-skip-forward", GTK_ICON_SIZE_BUTTON);
-    g_signal_connect(next_button, "clicked", G_CALLBACK(next_song_button), NULL);
-    gtk_box_pack_start(GTK_BOX(controls_hbox), next_button, TRUE, TRUE, 0);
+    gchar *current_name = g_strdup(track_name(current));
+    free_song_list();
+    free_tracks();
+    gint64 restore_started = g_get_monotonic_time();
+    gboolean restored = session_restore(path);
+    gint64 restore_finished = g_get_monotonic_time();
+    gboolean same = restored && g_strcmp0(track_name(queue_current(&play_queue)), current_name) == 0;
+
+    printf("{\"bench\":\"session\",\"tracks\":%u,\"bytes\":%" G_GSIZE_FORMAT ",\"snapshot_ms\":%.2f,\"write_ms\":%.2f,"
+           "\"restore_ms\":%.2f,\"same_current\":%s}\n",
+           count, bytes, (taken - started) / 1000.0, (finished - taken) / 1000.0,
+           (restore_finished - restore_started) / 1000.0, same ? "true" : "false");
+
+    g_clear_pointer(&session_tracks, g_free);
+    g_unlink(path);
+    g_free(path);
+    g_free(current_name);
+    return same ? 0 : 1;
+}
 
-    status_label = gtk_label_new("Playing Song...");
-    gtk_box_pack_start(GTK_BOX(vbox), status_label, FALSE, FALSE, 0);
+static void bench_count_names(const char *const *names, guint count, gpointer data) {
+    *(guint *)data += count;
+}
 
-    GtkWidget *extra_controls_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-    gtk_box_pack_start(GTK_BOX(vbox), extra_controls_hbox, FALSE, FALSE, 0);
+/* The scan load_songs_from_directory did before it went recursive: readdir, a stat to
+ * tell directories apart, and a substring match for ".mp3", here applied at every level
+ * so it covers the same tree. */
+static void bench_scan_readdir(const char *dir_path, guint *dirs, guint *files) {
+    DIR *handle = opendir(dir_path);
+    if (!handle) return;
 
-    GtkWidget *loop_button = gtk_button_new();
-    GtkWidget *loop_icon = gtk_image_new_from_icon_name("media-playlist-repeat", GTK_ICON_SIZE_BUTTON); 
-    gtk_button_set_image(GTK_BUTTON(loop_button), loop_icon);
-    g_signal_connect(loop_button, "clicked", G_CALLBACK(toggle_loop), NULL);
-    gtk_box_pack_start(GTK_BOX(extra_controls_hbox), loop_button, TRUE, TRUE, 0);
+    (*dirs)++;
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        gchar *path = g_build_filename(dir_path, entry->d_name, NULL);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            bench_scan_readdir(path, dirs, files);
+        } else if (strstr(entry->d_name, ".mp3") != NULL) {
+            (*files)++;
+        }
+        g_free(path);
+    }
+    closedir(handle);
+}
 
-    GtkWidget *shuffle_button = gtk_button_new();
-    GtkWidget *shuffle_icon = gtk_image_new_from_icon_name("media-playlist-shuffle", GTK_ICON_SIZE_BUTTON);
-    gtk_button_set_image(GTK_BUTTON(shuffle_button), shuffle_icon);
-    g_signal_connect(shuffle_button, "clicked", G_CALLBACK(toggle_shuffle), NULL);
-    gtk_box_pack_start(GTK_BOX(extra_controls_hbox), shuffle_button, TRUE, TRUE, 0);
+/* Drops the dentry and inode caches so each cold run reads directories from disk. Only
+ * works as root; the result says whether it did. */
+static gboolean bench_drop_dentries() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    gboolean dropped = write(fd, "2\n", 2) == 2;
+    close(fd);
+    return dropped;
+}
 
-    GtkWidget *volume_label = gtk_label_new("Volume:");
-    gtk_box_pack_start(GTK_BOX(vbox), volume_label, FALSE, FALSE, 0);
+/* Artists, albums and tracks in four formats, plus a cover and a partial download in
+ * every album that must not count. */
+static gboolean bench_make_tree(const char *dir, guint artists) {
+    static const char *const suffixes[] = { "mp3", "flac", "opus", "m4a" };
+
+    for (guint a = 0; a < artists; a++) {
+        for (guint b = 0; b < 10; b++) {
+            gchar *album = g_strdup_printf("%s/Artist %03u/Album %02u", dir, a, b);
+            if (g_mkdir_with_parents(album, 0755) != 0) {
+                g_free(album);
+                return FALSE;
+            }
+            for (guint t = 0; t < 14; t++) {
+                gchar *path = t == 12 ? g_strdup_printf("%s/cover.jpg", album)
+                            : t == 13 ? g_strdup_printf("%s/Track 99.mp3.part", album)
+                            : g_strdup_printf("%s/Track %02u.%s", album, t, suffixes[t % G_N_ELEMENTS(suffixes)]);
+                if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+                    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+                    if (fd >= 0) close(fd);
+                }
+                g_free(path);
+            }
+            g_free(album);
+        }
+    }
+    return TRUE;
+}
 
-    volume_slider = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0.0, 100.0, 1.0); 
-    gtk_range_set_value(GTK_RANGE(volume_slider), 100.0);
-    g_signal_connect(volume_slider, "value-changed", G_CALLBACK(on_volume_changed), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), volume_slider, FALSE, FALSE, 0);
+static void bench_scan_report(const char *mode, guint workers, gboolean cold, guint dirs, guint files, gint64 us) {
+    gdouble seconds = MAX(us, 1) / 1e6;
+    printf("{\"bench\":\"scan\",\"mode\":\"%s\",\"workers\":%u,\"dentries_dropped\":%s,\"dirs\":%u,\"files\":%u,"
+           "\"ms\":%.1f,\"dirs_per_sec\":%.0f,\"files_per_sec\":%.0f}\n",
+           mode, workers, cold ? "true" : "false", dirs, files, us / 1000.0, dirs / seconds, files / seconds);
+}
 
-    playlist_combo_box = GTK_COMBO_BOX_TEXT(gtk_combo_box_text_new());
-    gtk_box_pack_start(GTK_BOX(vbox), GTK_WIDGET(playlist_combo_box), FALSE, FALSE, 0);
+/* Walks DIR (by default a synthetic tree of 1000 albums) with the old single-threaded
+ * readdir scan, then with load_library on one worker and on WORKERS workers without an
+ * index, then once more with the index it wrote. */
+int run_scan_benchmark(const char *dir_path, guint workers) {
+    gchar *dir = dir_path ? g_strdup(dir_path) : g_build_filename(g_get_tmp_dir(), "muzio-scan-bench", NULL);
+    if (!dir_path && !bench_make_tree(dir, 100)) {
+        g_printerr("Cannot create %s\n", dir);
+        g_free(dir);
+        return 1;
+    }
 
-    add_to_playlist_button = gtk_button_new_with_label("Add to Playlist");
-    g_signal_connect(add_to_playlist_button, "clicked", G_CALLBACK(on_add_to_playlist_button_clicked), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), add_to_playlist_button, FALSE, FALSE, 0);
+    gchar *index_path = g_build_filename(g_get_tmp_dir(), "muzio-bench-scan.idx", NULL);
+    const char *roots[] = { dir };
+    guint saved_workers = library_scan_workers;
+    guint dirs = 0, files = 0;
+
+    gboolean cold = bench_drop_dentries();
+    gint64 start = g_get_monotonic_time();
+    bench_scan_readdir(dir, &dirs, &files);
+    bench_scan_report("readdir", 1, cold, dirs, files, g_get_monotonic_time() - start);
+
+    guint runs[] = { 1, MAX(workers, 1) };
+    for (guint r = 0; r < G_N_ELEMENTS(runs); r++) {
+        GPtrArray *dir_paths = g_ptr_array_new_with_free_func(g_free);
+        library_scan_workers = runs[r];
+        files = 0;
+        g_unlink(index_path);
+        cold = bench_drop_dentries();
+        start = g_get_monotonic_time();
+        load_library(index_path, roots, 1, bench_count_names, &files, dir_paths);
+        bench_scan_report("scan", runs[r], cold, dir_paths->len, files, g_get_monotonic_time() - start);
+        g_ptr_array_unref(dir_paths);
+    }
 
-    GtkWidget *play_playlist_button = gtk_button_new_with_label("Play Playlist");
-    g_signal_connect(play_playlist_button, "clicked", G_CALLBACK(on_play_playlist_button_clicked), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), play_playlist_button, FALSE, FALSE, 5);
+    GPtrArray *dir_paths = g_ptr_array_new_with_free_func(g_free);
+    files = 0;
+    cold = bench_drop_dentries();
+    start = g_get_monotonic_time();
+    load_library(index_path, roots, 1, bench_count_names, &files, dir_paths);
+    bench_scan_report("index", library_scan_workers, cold, dir_paths->len, files, g_get_monotonic_time() - start);
+    g_ptr_array_unref(dir_paths);
+
+    library_scan_workers = saved_workers;
+    g_unlink(index_path);
+    g_free(index_path);
+    g_free(dir);
+    return 0;
+}
 
-    load_playlists();
+/* A 440 Hz tone as a 16-bit stereo WAV file, for benchmarks that need something to
+ * decode. */
+static gboolean bench_write_tone(const char *path, guint seconds) {
+    const guint32 rate = 44100;
+    guint32 data_size = rate * seconds * 4;
+    guint8 header[44] = "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x02\0\0\0\0\0\0\0\0\0\x04\0\x10\0data";
+    guint32 fields[][2] = { { 4, 36 + data_size }, { 24, rate }, { 28, rate * 4 }, { 40, data_size } };
+    for (guint i = 0; i < G_N_ELEMENTS(fields); i++) {
+        guint32 value = GUINT32_TO_LE(fields[i][1]);
+        memcpy(header + fields[i][0], &value, 4);
+    }
 
-    GtkWidget *settings_button = gtk_button_new_from_icon_name("preferences-system", GTK_ICON_SIZE_BUTTON);
-    g_signal_connect(settings_button, "clicked", G_CALLBACK(open_settings_window), NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), settings_button, FALSE, FALSE, 0);
+    FILE *file = fopen(path, "wb");
+    if (!file) return FALSE;
+    fwrite(header, 1, sizeof(header), file);
+    gint16 *samples = g_new(gint16, rate * 2);
+    for (guint s = 0; s < seconds; s++) {
+        for (guint32 i = 0; i < rate; i++) {
+            gint16 value = (gint16)GINT16_TO_LE((gint16)(8192 * sin(2 * G_PI * 440 * i / rate)));
+            samples[2 * i] = samples[2 * i + 1] = value;
+        }
+        fwrite(samples, sizeof(gint16), rate * 2, file);
+    }
+    g_free(samples);
+    return fclose(file) == 0;
+}
+
+/* Plays STREAMS copies of FILE (by default a generated tone) at once for SECONDS, into
+ * fakesinks that keep to the clock: first through playbin's own conversion and volume,
+ * then through output_bin_new. Reports the process CPU time per stream and the
+ * underruns and discontinuities counted at the sinks. FILE should be longer than
+ * SECONDS. */
+int run_output_benchmark(guint streams, guint seconds, const char *file) {
+    gst_init(NULL, NULL);
+    streams = MAX(streams, 1);
+    seconds = MAX(seconds, 1);
+
+    gchar *tone_path = NULL;
+    if (!file) {
+        tone_path = g_build_filename(g_get_tmp_dir(), "muzio-bench-tone.wav", NULL);
+        if (!bench_write_tone(tone_path, seconds + 2)) {
+            g_printerr("Cannot write %s\n", tone_path);
+            g_free(tone_path);
+            return 1;
+        }
+        file = tone_path;
+    }
+    gchar *uri = g_filename_to_uri(file, NULL, NULL);
+
+    static const char *const modes[] = { "playbin", "custom" };
+    for (guint mode = 0; mode < G_N_ELEMENTS(modes); mode++) {
+        GstElement **players = g_new0(GstElement *, streams);
+        OutputStats *stats = g_new0(OutputStats, streams);
+
+        for (guint i = 0; i < streams; i++) {
+            GstElement *volume = NULL, *sink = NULL, *audio_sink = NULL;
+            players[i] = gst_element_factory_make("playbin", NULL);
+            if (mode == 1) {
+                audio_sink = output_bin_new("fakesink", &volume, &sink);
+                guint flags;
+                g_object_get(players[i], "flags", &flags, NULL);
+                g_object_set(players[i], "flags", (flags | PLAY_FLAG_NATIVE_AUDIO) & ~PLAY_FLAG_SOFT_VOLUME, NULL);
+            } else {
+                audio_sink = sink = gst_element_factory_make("fakesink", NULL);
+            }
+            g_object_set(sink, "sync", TRUE, NULL);
+            g_object_set(players[i], "uri", uri, "audio-sink", audio_sink, NULL);
+            output_stats_attach(&stats[i], sink, output_latency_ms);
+            gst_element_set_state(players[i], GST_STATE_PAUSED);
+        }
+        for (guint i = 0; i < streams; i++) {
+            gst_element_get_state(players[i], NULL, NULL, 10 * GST_SECOND);
+        }
+
+        gdouble cpu_start = bench_cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+        for (guint i = 0; i < streams; i++) {
+            gst_element_set_state(players[i], GST_STATE_PLAYING);
+        }
+        g_usleep((gulong)seconds * G_USEC_PER_SEC);
+        gdouble cpu = bench_cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+        gint underruns = 0, discontinuities = 0;
+        for (guint i = 0; i < streams; i++) {
+            gst_element_set_state(players[i], GST_STATE_NULL);
+            underruns += g_atomic_int_get(&stats[i].underruns);
+            discontinuities += g_atomic_int_get(&stats[i].discontinuities);
+            gst_object_unref(players[i]);
+        }
+        printf("{\"bench\":\"output\",\"mode\":\"%s\",\"streams\":%u,\"seconds\":%u,\"cpu_percent_per_stream\":%.2f,"
+               "\"underruns\":%d,\"discontinuities\":%d}\n",
+               modes[mode], streams, seconds, 100.0 * cpu / seconds / streams, underruns, discontinuities);
+        g_free(players);
+        g_free(stats);
+    }
 
+    g_free(uri);
+    if (tone_path) {
+        g_unlink(tone_path);
+        g_free(tone_path);
+    }
+    return 0;
 }
 
-void add_css_style() {
-    GtkCssProvider *css_provider = gtk_css_provider_new();
-    gtk_css_provider_load_from_path(css_provider, "style.css", NULL);
-    gtk_style_context_add_provider_for_screen(gdk_screen_get_default(),
-        GTK_STYLE_PROVIDER(css_provider),
-        GTK_STYLE_PROVIDER_PRIORITY_USER);
+/* Runs one ffmpeg post-processing step and adds its wall and CPU time (the child's user
+ * and system time) to the totals. */
+static gboolean bench_run_ffmpeg(const char *const *argv, gdouble *wall_ms, gdouble *cpu_ms) {
+    struct rusage before, after;
+    gint status = 0;
+    GError *error = NULL;
+
+    getrusage(RUSAGE_CHILDREN, &before);
+    gint64 started = g_get_monotonic_time();
+    if (!g_spawn_sync(NULL, (gchar **)argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL,
+                      NULL, NULL, &status, &error)) {
+        g_printerr("Cannot run %s: %s\n", argv[0], error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    *wall_ms += (g_get_monotonic_time() - started) / 1000.0;
+    getrusage(RUSAGE_CHILDREN, &after);
+    *cpu_ms += (after.ru_utime.tv_sec - before.ru_utime.tv_sec + after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e3 +
+               (after.ru_utime.tv_usec - before.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e3;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* The downloader's post-processing, run RUNS times on FILE: remuxing the native stream
+ * as download_profile=native does, and the MP3 transcode of download_profile=mp3 at the
+ * downloader's default quality. Without FILE the fixture is three minutes of tone in
+ * WebM/Opus, the usual best audio format of a video site. Needs ffmpeg. */
+int run_postprocess_benchmark(const char *file, guint runs) {
+    runs = MAX(runs, 1);
+    gchar *fixture = NULL;
+    if (!file) {
+        gchar *tone = g_build_filename(g_get_tmp_dir(), "muzio-bench-tone.wav", NULL);
+        fixture = g_build_filename(g_get_tmp_dir(), "muzio-bench-fixture.webm", NULL);
+        const char *const encode[] = { "ffmpeg", "-y", "-loglevel", "error", "-i", tone, "-c:a", "libopus",
+                                       "-b:a", "128k", fixture, NULL };
+        gdouble wall_ms = 0, cpu_ms = 0;
+        gboolean made = bench_write_tone(tone, 180) && bench_run_ffmpeg(encode, &wall_ms, &cpu_ms);
+        g_unlink(tone);
+        g_free(tone);
+        if (!made) {
+            g_printerr("Cannot create the fixture %s\n", fixture);
+            g_free(fixture);
+            return 1;
+        }
+        file = fixture;
+    }
+
+    /* Opus keeps its Ogg container and AAC goes into MP4, as the downloader does when it
+     * extracts without converting. */
+    const char *native_suffix = g_str_has_suffix(file, ".m4a") || g_str_has_suffix(file, ".mp4") ||
+                                g_str_has_suffix(file, ".aac") ? "m4a" : "opus";
+    static const char *const modes[] = { "native", "mp3" };
+    int result = 0;
+    struct stat st;
+    gint64 input_size = stat(file, &st) == 0 ? st.st_size : 0;
+
+    for (guint mode = 0; mode < G_N_ELEMENTS(modes) && result == 0; mode++) {
+        gchar *name = g_strdup_printf("muzio-bench-postprocess.%s", mode == 0 ? native_suffix : "mp3");
+        gchar *output = g_build_filename(g_get_tmp_dir(), name, NULL);
+        const char *const remux[] = { "ffmpeg", "-y", "-loglevel", "error", "-i", file, "-vn", "-acodec", "copy",
+                                      output, NULL };
+        const char *const transcode[] = { "ffmpeg", "-y", "-loglevel", "error", "-i", file, "-vn", "-acodec",
+                                          "libmp3lame", "-q:a", "5", output, NULL };
+        gdouble wall_ms = 0, cpu_ms = 0;
+
+        for (guint run = 0; run < runs && result == 0; run++) {
+            if (!bench_run_ffmpeg(mode == 0 ? remux : transcode, &wall_ms, &cpu_ms)) result = 1;
+        }
+        if (result == 0) {
+            gint64 output_size = stat(output, &st) == 0 ? st.st_size : 0;
+            printf("{\"bench\":\"postprocess\",\"mode\":\"%s\",\"runs\":%u,\"input_mb\":%.2f,\"output_mb\":%.2f,"
+                   "\"wall_ms\":%.1f,\"cpu_ms\":%.1f}\n",
+                   modes[mode], runs, input_size / 1e6, output_size / 1e6, wall_ms / runs, cpu_ms / runs);
+        }
+        g_unlink(output);
+        g_free(output);
+        g_free(name);
+    }
+
+    if (fixture) {
+        g_unlink(fixture);
+        g_free(fixture);
+    }
+    return result;
+}
+
+/* Materializes three smart playlists over a synthetic library of COUNT tracks, then
+ * times adding and removing 1000 more one by one, as the library watcher does, and
+ * opening a playlist. The per-track and open times should not grow with COUNT. */
+int run_smart_playlist_benchmark(guint count) {
+    const guint changes = 1000;
+    track_tags = g_ptr_array_new();
+    play_counts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    play_counts_loaded = TRUE;
+
+    SmartRule *artist = g_new0(SmartRule, 1);
+    artist->directory = g_strdup("Artist 001");
+    artist->max_duration_ms = artist->max_plays = G_MAXUINT32;
+    SmartRule *long_tracks = g_new0(SmartRule, 1);
+    long_tracks->min_duration_ms = 300000;
+    long_tracks->max_duration_ms = long_tracks->max_plays = G_MAXUINT32;
+    SmartRule *live = g_new0(SmartRule, 1);
+    live->name_pattern = g_strdup("*live*");
+    live->added_after = 1600000000;
+    live->max_duration_ms = live->max_plays = G_MAXUINT32;
+    smart_playlist_new("artist", "artist.smart", artist);
+    smart_playlist_new("long", "long.smart", long_tracks);
+    smart_playlist_new("live", "live.smart", live);
+
+    gchar name[80];
+    TrackId *ids = g_new(TrackId, count + changes);
+    for (guint i = 0; i < count + changes; i++) {
+        snprintf(name, sizeof(name), "Artist %03u/Album %02u/Track %07u%s.flac", i % 997, i % 13, i,
+                 i % 10 == 0 ? " (Live)" : "");
+        ids[i] = track_intern(name);
+        TrackTags *tags = g_new0(TrackTags, 1);
+        tags->duration_ms = 60000 + i % 420 * 1000;
+        tags->mtime = 1500000000 + (gint64)i * 997 % 200000000;
+        if (ids[i] >= track_tags->len) g_ptr_array_set_size(track_tags, ids[i] + 1);
+        g_ptr_array_index(track_tags, ids[i]) = tags;
+    }
+
+    gint64 started = g_get_monotonic_time();
+    for (guint i = 0; i < count; i++) {
+        smart_playlists_update(ids[i], TRUE);
+    }
+    gint64 materialized = g_get_monotonic_time();
+    for (guint i = count; i < count + changes; i++) {
+        smart_playlists_update(ids[i], TRUE);
+    }
+    gint64 added = g_get_monotonic_time();
+    for (guint i = 0; i < changes; i++) {
+        smart_playlists_update(ids[i * (count / changes + 1) % (count + changes)], FALSE);
+    }
+    gint64 removed = g_get_monotonic_time();
+    Playlist *playlist = playlist_open("long", FALSE);
+    gint64 opened = g_get_monotonic_time();
+
+    guint members = 0;
+    for (guint i = 0; i < smart_playlists->len; i++) {
+        members += ((Playlist *)g_ptr_array_index(smart_playlists, i))->entries->len;
+    }
+    printf("{\"bench\":\"smart_playlists\",\"tracks\":%u,\"playlists\":%u,\"members\":%u,\"materialize_ms\":%.2f,"
+           "\"add_us_per_track\":%.3f,\"remove_us_per_track\":%.3f,\"open_us\":%.3f}\n",
+           count, smart_playlists->len, members, (materialized - started) / 1000.0,
+           (gdouble)(added - materialized) / changes, (gdouble)(removed - added) / changes, (gdouble)(opened - removed));
+
+    playlist_close_all();
+    g_clear_pointer(&smart_playlists, g_ptr_array_unref);
+    g_clear_pointer(&play_counts, g_hash_table_unref);
+    for (guint i = 0; i < track_tags->len; i++) {
+        if (g_ptr_array_index(track_tags, i)) track_tags_free(g_ptr_array_index(track_tags, i));
+    }
+    g_clear_pointer(&track_tags, g_ptr_array_unref);
+    g_free(ids);
+    return playlist ? 0 : 1;
+}
+
+/* Headless benchmarks, selected by the first argument:
+ *   --bench-library DIR [COUNT]      cold vs. warm library load
+ *   --bench-playlist [COUNT]         playlist import, journal load and append
+ *   --bench-suite [DIR] [SIZES]      every non-GUI path as JSON lines, default sizes
+ *                                    1000,100000,1000000 under /dev/shm
+ *   --bench-analysis [FILE...]       loudness and waveform analysis speed, times realtime
+ *                                    per core
+ *   --bench-ui-channel [PRODUCERS] [EVENTS]
+ *                                    UI channel stress test, default 16 threads posting
+ *                                    100000 events each
+ *   --bench-dedupe [DIR] [WORKERS]   content hash speed in memory and over the files
+ *                                    under DIR, with the duplicate groups found
+ *   --bench-track-names [COUNT]      bytes per track of the track name store, default
+ *                                    500000 names
+ *   --bench-scan [DIR] [WORKERS]     dirs/sec and files/sec of the library scanner
+ *                                    against the old readdir scan, default 8 workers
+ *   --bench-session [COUNT]          save and restore time of a session with COUNT
+ *                                    tracks, default 100000
+ *   --bench-output [STREAMS] [SECONDS] [FILE]
+ *                                    CPU per stream, underruns and discontinuities of
+ *                                    playbin's audio path against the custom output,
+ *                                    default 8 streams for 10 seconds
+ *   --bench-postprocess [FILE] [RUNS]
+ *                                    ffmpeg time of the native remux against the MP3
+ *                                    transcode of a download, default 3 runs
+ *   --bench-smart-playlists [COUNT]  smart playlist materialization over COUNT tracks,
+ *                                    incremental update and open time, default 100000 */
+int run_benchmark(int argc, char *argv[]) {
+    if (strcmp(argv[1], "--bench-library") == 0 && argc >= 3) {
+        return run_library_benchmark(argv[2], argc >= 4 ? (guint)atoi(argv[3]) : 100000);
+    }
+    if (strcmp(argv[1], "--bench-playlist") == 0) {
+        return run_playlist_benchmark(argc >= 3 ? (guint)atoi(argv[2]) : 200000);
+    }
+    if (strcmp(argv[1], "--bench-suite") == 0) {
+        const char *base_dir = argc >= 3 ? argv[2] : g_file_test("/dev/shm", G_FILE_TEST_IS_DIR) ? "/dev/shm" : g_get_tmp_dir();
+        return run_bench_suite(base_dir, argc >= 4 ? argv[3] : "1000,100000,1000000");
+    }
+    if (strcmp(argv[1], "--bench-ui-channel") == 0) {
+        return run_ui_channel_benchmark(argc >= 3 ? (guint)atoi(argv[2]) : 16, argc >= 4 ? (guint)atoi(argv[3]) : 100000);
+    }
+    if (strcmp(argv[1], "--bench-session") == 0) {
+        return run_session_benchmark(argc >= 3 ? (guint)atoi(argv[2]) : 100000);
+    }
+    if (strcmp(argv[1], "--bench-smart-playlists") == 0) {
+        return run_smart_playlist_benchmark(argc >= 3 ? (guint)atoi(argv[2]) : 100000);
+    }
+    if (strcmp(argv[1], "--bench-postprocess") == 0) {
+        return run_postprocess_benchmark(argc >= 3 ? argv[2] : NULL, argc >= 4 ? (guint)atoi(argv[3]) : 3);
+    }
+    if (strcmp(argv[1], "--bench-output") == 0) {
+        return run_output_benchmark(argc >= 3 ? (guint)atoi(argv[2]) : 8, argc >= 4 ? (guint)atoi(argv[3]) : 10,
+                                    argc >= 5 ? argv[4] : NULL);
+    }
+    if (strcmp(argv[1], "--bench-scan") == 0) {
+        return run_scan_benchmark(argc >= 3 ? argv[2] : NULL, argc >= 4 ? (guint)atoi(argv[3]) : 8);
+    }
+    if (strcmp(argv[1], "--bench-dedupe") == 0) {
+        return run_dedupe_benchmark(argc >= 3 ? argv[2] : NULL, argc >= 4 ? (guint)atoi(argv[3]) : 2);
+    }
+    if (strcmp(argv[1], "--bench-track-names") == 0) {
+        return run_track_names_benchmark(argc >= 3 ? (guint)atoi(argv[2]) : 500000);
+    }
+    if (strcmp(argv[1], "--bench-analysis") == 0) {
+        return run_analysis_benchmark(argc - 2, argv + 2);
+    }
+
+    g_printerr("Unknown benchmark %s\n", argv[1]);
+    return 2;
 }
 
 int main(int argc, char *argv[]) {
+    startup_started_at = g_get_monotonic_time();
+
+    shuffle_rand = g_rand_new();
+    init_queue(&play_queue);
+    g_mutex_init(&queue_mutex);
+
+    if (argc >= 2 && g_str_has_prefix(argv[1], "--bench-")) {
+        return run_benchmark(argc, argv);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+        return run_daemon(argc >= 3 ? argv[2] : NULL);
+    }
+
     gtk_init(&argc, &argv);
     gst_init(&argc, &argv);
-    init_list(&song_list);
-    g_mutex_init(&list_mutex);
 
     main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(main_window), "Muzio");
     gtk_window_set_default_size(GTK_WINDOW(main_window), 300, 200);
     g_signal_connect(main_window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
+    g_signal_connect(main_window, "map", G_CALLBACK(on_main_window_visibility), NULL);
+    g_signal_connect(main_window, "unmap", G_CALLBACK(on_main_window_visibility), NULL);
+    g_signal_connect(main_window, "window-state-event", G_CALLBACK(on_main_window_state), NULL);
+    g_signal_connect(main_window, "draw", G_CALLBACK(on_first_frame), NULL);
 
     music_dir = load_music_directory();
-
-    if (!music_dir) {
-        ask_for_music_directory();
-    } else {
-        load_songs_from_directory();
+    load_settings();
+    search_postings = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)g_array_unref);
+    search_texts = g_ptr_array_new_with_free_func(g_free);
+    tag_scanner_start();
+    prefetch_start();
+    gapless_enabled = get_setting_int("gapless", 1) != 0;
+    g_mutex_init(&library_loader_mutex);
+
+    gchar *remote_socket = NULL;
+    if (argc >= 2 && strcmp(argv[1], "--remote") == 0) {
+        remote_socket = argc >= 3 ? g_strdup(argv[2]) : control_default_socket_path();
     }
 
-    pipeline = gst_element_factory_make("playbin", "player");
-
-    GstBus *bus = gst_element_get_bus(pipeline);
-    gst_bus_add_watch(bus, bus_call, NULL);  
-    gst_object_unref(bus);
+    g_mutex_init(&gap_mutex);
+    if (!remote_socket) {
+        create_pipeline();
+        analysis_start();
+        dedupe_start();
+        session_start();
+        smart_playlists_start();
+    }
 
     create_ui();
     add_css_style();
 
-    toggle_shuffle(NULL, NULL);
-
-    if (!is_empty(&song_list)) {
-        current_song = song_list.head;
-        play_song(current_song->song_name);
+    if (!session_pool || !session_restore(SESSION_FILE)) {
+        toggle_shuffle(NULL, NULL);
     }
 
+    g_unix_signal_add(SIGUSR1, on_trace_signal, NULL);
     gtk_widget_show_all(main_window);
+    if (remote_socket) {
+        load_playlists();
+        if (!remote_connect(remote_socket)) {
+            gchar *text = g_strdup_printf("Cannot connect to daemon at %s", remote_socket);
+            set_status_text(text);
+            g_free(text);
+        }
+    } else {
+        library_loader_start(music_dir, TRUE);
+    }
     gtk_main();
 
+    remote_disconnect();
     cleanup_resources();
-    if (pipeline) {
-        gst_element_set_state(pipeline, GST_STATE_NULL);
-        gst_object_unref(pipeline);
-        pipeline = NULL;
-    }
+    destroy_pipeline();
+    g_free(remote_socket);
    
     return 0;
 }